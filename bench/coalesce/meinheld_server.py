@@ -0,0 +1,20 @@
+import sys
+
+from meinheld import server
+
+# a template streaming its output in small pieces
+PARTS = [b"<li>item %d</li>\n" % i for i in range(300)]
+
+def app(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/html')])
+    for part in PARTS:
+        yield part
+    yield b"Hello world!"
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+if len(sys.argv) > 1:
+    server.set_write_coalesce_size(int(sys.argv[1]))
+server.run(app)
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Streaming responses of 300 small items, one writev per item
+# (write_coalesce_size 0) and coalesced (default).
+#
+#   $ sh bench/coalesce/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for size in 0 65536; do
+    echo "write_coalesce_size: $size"
+    python bench/coalesce/meinheld_server.py $size &
+    PID=$!
+    sleep 1
+    python bench/pipeline/client.py 127.0.0.1 8000 $CONNS $SECS 1
+    kill $PID
+    wait $PID 2> /dev/null
+done
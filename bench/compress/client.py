@@ -0,0 +1,61 @@
+"""
+keep-alive load generator sending Accept-Encoding: gzip, responses are
+counted by their status line as the bodies are compressed.
+
+usage: python client.py [host] [port] [connections] [seconds]
+"""
+import select
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+REQUEST = (
+    b"GET / HTTP/1.1\r\n"
+    b"Host: localhost\r\n"
+    b"Accept-Encoding: gzip, deflate\r\n"
+    b"\r\n"
+)
+END = b"HTTP/1.1 200 OK\r\n"
+
+
+def run(args):
+    host, port, conns, seconds = args
+    socks = []
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        s.sendall(REQUEST)
+        socks.append(s)
+    done = 0
+    received = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        r, _, _ = select.select(socks, [], [], 1)
+        for s in r:
+            data = s.recv(65536)
+            if not data:
+                raise RuntimeError("connection closed")
+            received += len(data)
+            if END in data:
+                done += 1
+                s.sendall(REQUEST)
+    return done, received
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    procs = 4
+    pool = Pool(procs)
+    results = pool.map(run, [(host, port, conns // procs, seconds)] * procs)
+    total = sum(r[0] for r in results)
+    received = sum(r[1] for r in results)
+    print("%d requests in %ds, %.1f req/s, %d bytes per response"
+          % (total, seconds, total / float(seconds), received // max(total, 1)))
+
+
+if __name__ == "__main__":
+    main()
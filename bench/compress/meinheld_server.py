@@ -0,0 +1,29 @@
+import gzip
+import sys
+
+from meinheld import server
+
+# a 20KB html page, compressed by the app with gzip.compress or by the
+# server with server.set_compress_level
+row = b"<tr><td class=\"name\">item</td><td class=\"price\">42</td></tr>\n"
+page = b"<html><body><table>\n" + row * 340 + b"</table>Hello world!</body></html>"
+
+mode = sys.argv[1] if len(sys.argv) > 1 else "server"
+
+def hello_world(environ, start_response):
+    headers = [('Content-Type', 'text/html')]
+    body = page
+    if mode == "python" and 'gzip' in environ.get('HTTP_ACCEPT_ENCODING', ''):
+        body = gzip.compress(page, 6)
+        headers.append(('Content-Encoding', 'gzip'))
+        headers.append(('Vary', 'Accept-Encoding'))
+    start_response('200 OK', headers)
+    return [body]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+if mode == "server":
+    server.set_compress_level(6)
+server.run(hello_world)
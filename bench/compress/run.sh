@@ -0,0 +1,20 @@
+#!/bin/sh
+# A 20KB html page sent as is, gzip compressed by the app and by
+# server.set_compress_level(6).
+#
+#   $ sh bench/compress/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in identity python server; do
+    echo "$mode:"
+    python bench/compress/meinheld_server.py $mode 2> /dev/null &
+    PID=$!
+    sleep 1
+    python bench/compress/client.py 127.0.0.1 8000 $CONNS $SECS
+    kill $PID
+    wait $PID 2> /dev/null
+done
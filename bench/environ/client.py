@@ -0,0 +1,114 @@
+"""
+keep-alive load generator sending a browser like request (20 headers),
+for each environ mode. Allocations are sampled afterwards on a single
+connection, so the only environ alive at app entry is the current one.
+
+usage: python client.py [host] [port] [connections] [seconds]
+"""
+import select
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+REQUEST = (
+    b"GET /index.html?page=1 HTTP/1.1\r\n"
+    b"Host: localhost:8000\r\n"
+    b"Connection: keep-alive\r\n"
+    b"Cache-Control: max-age=0\r\n"
+    b"sec-ch-ua: \"Chromium\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    b"sec-ch-ua-mobile: ?0\r\n"
+    b"sec-ch-ua-platform: \"Linux\"\r\n"
+    b"Upgrade-Insecure-Requests: 1\r\n"
+    b"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    b"(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    b"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    b"image/avif,image/webp,*/*;q=0.8\r\n"
+    b"Sec-Fetch-Site: same-origin\r\n"
+    b"Sec-Fetch-Mode: navigate\r\n"
+    b"Sec-Fetch-User: ?1\r\n"
+    b"Sec-Fetch-Dest: document\r\n"
+    b"Referer: http://localhost:8000/\r\n"
+    b"Accept-Encoding: gzip, deflate, br\r\n"
+    b"Accept-Language: en-US,en;q=0.9\r\n"
+    b"Cookie: session=0123456789abcdef; csrftoken=abcdefghijklmnop; _ga=GA1.1.1\r\n"
+    b"If-None-Match: \"5f3a-1234\"\r\n"
+    b"If-Modified-Since: Mon, 02 Oct 2023 10:00:00 GMT\r\n"
+    b"DNT: 1\r\n"
+    b"\r\n"
+)
+END = b"Hello world!"
+
+
+def run(args):
+    host, port, conns, seconds = args
+    socks = []
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        s.sendall(REQUEST)
+        socks.append(s)
+    done = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        r, _, _ = select.select(socks, [], [], 1)
+        for s in r:
+            data = s.recv(4096)
+            if not data:
+                raise RuntimeError("connection closed")
+            done += data.count(END)
+            s.sendall(REQUEST)
+    return done
+
+
+def get(host, port, path):
+    s = socket.create_connection((host, port))
+    s.sendall(b"GET " + path + b" HTTP/1.0\r\n\r\n")
+    data = b""
+    while True:
+        d = s.recv(4096)
+        if not d:
+            break
+        data += d
+    s.close()
+    return data.split(b"\r\n\r\n", 1)[1]
+
+
+def sample(host, port, n=2000):
+    s = socket.create_connection((host, port))
+    for i in range(n):
+        s.sendall(REQUEST)
+        data = b""
+        while END not in data:
+            data += s.recv(4096)
+    s.close()
+    return int(get(host, port, b"/stats"))
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    procs = 4
+    pool = Pool(procs)
+    rps = {}
+    for mode in ("eager", "lazy"):
+        get(host, port, b"/" + mode.encode())
+        total = sum(pool.map(run, [(host, port, conns // procs, seconds)] * procs))
+        rps[mode] = total / float(seconds)
+    # after the load runs, so both modes see the same header key cache
+    # and free lists
+    blocks = {}
+    for mode in ("eager", "lazy"):
+        get(host, port, b"/" + mode.encode())
+        sample(host, port, 500)
+        blocks[mode] = sample(host, port)
+    for mode in ("eager", "lazy"):
+        print("%-6s %.1f req/s, %d blocks allocated at app entry"
+              % (mode, rps[mode], blocks[mode]))
+    print("lazy environ saves %d allocations per request"
+          % (blocks["eager"] - blocks["lazy"]))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+"""
+usage: python meinheld_server.py
+
+The app reads three headers, like a typical handler.
+
+  GET /eager, GET /lazy   switch environ mode (from the next request)
+  GET /stats              median sys.getallocatedblocks() at app entry
+                          since the last switch
+"""
+import array
+import sys
+
+from meinheld import server
+
+# preallocated, recording a sample must not allocate
+blocks = array.array("q", [0] * 4096)
+count = [0]
+
+
+def app(environ, start_response):
+    path = environ["PATH_INFO"]
+    if path in ("/eager", "/lazy", "/stats"):
+        body = b"ok"
+        if path == "/stats":
+            samples = sorted(blocks[:min(count[0], len(blocks))])
+            body = ("%d" % samples[len(samples) // 2]).encode()
+        else:
+            server.set_lazy_environ(path == "/lazy")
+        count[0] = 0
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [body]
+    blocks[count[0] % len(blocks)] = sys.getallocatedblocks()
+    count[0] += 1
+    environ.get("HTTP_HOST")
+    environ.get("HTTP_COOKIE")
+    environ.get("HTTP_ACCEPT_ENCODING")
+    start_response("200 OK", [("Content-Type", "text/plain")])
+    return [b"Hello world!"]
+
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.run(app)
@@ -0,0 +1,17 @@
+#!/bin/sh
+# compare the eager environ dict with server.set_lazy_environ(True),
+# req/s and allocated blocks at app entry for a 20 header request.
+#
+#   $ sh bench/environ/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+python bench/environ/meinheld_server.py 2> /dev/null &
+PID=$!
+sleep 1
+python bench/environ/client.py 127.0.0.1 8000 $CONNS $SECS
+kill $PID
+wait $PID 2> /dev/null
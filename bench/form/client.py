@@ -0,0 +1,63 @@
+"""
+keep-alive load generator posting a multipart/form-data body of two
+fields and a `size` KB file.
+
+usage: python client.py [host] [port] [connections] [seconds] [size]
+"""
+import os
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+END = b"}"
+BOUNDARY = b"----meinheldBenchBoundary7MA4YWxkTrZu0gW"
+
+
+def make_request(size):
+    body = b""
+    for name, value in ((b"title", b"bench upload"), (b"tags", b"a,b,c")):
+        body += (b"--" + BOUNDARY + b"\r\n"
+                 b'Content-Disposition: form-data; name="' + name + b'"\r\n\r\n' + value + b"\r\n")
+    body += (b"--" + BOUNDARY + b"\r\n"
+             b'Content-Disposition: form-data; name="file"; filename="data.bin"\r\n'
+             b"Content-Type: application/octet-stream\r\n\r\n" + os.urandom(size * 1024) + b"\r\n"
+             b"--" + BOUNDARY + b"--\r\n")
+    return (b"POST /upload HTTP/1.1\r\nHost: localhost\r\n"
+            b"Content-Type: multipart/form-data; boundary=" + BOUNDARY + b"\r\n"
+            b"Content-Length: %d\r\n\r\n" % len(body)) + body
+
+
+def run(args):
+    host, port, seconds, size = args
+    request = make_request(size)
+    s = socket.create_connection((host, port))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    done = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        s.sendall(request)
+        data = b""
+        while not data.endswith(END):
+            d = s.recv(4096)
+            if not d:
+                raise RuntimeError("connection closed")
+            data += d
+        done += 1
+    return done
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    size = int(sys.argv[5]) if len(sys.argv) > 5 else 256
+    pool = Pool(conns)
+    total = sum(pool.map(run, [(host, port, seconds, size)] * conns))
+    print("%dKB: %d requests in %ds, %.1f req/s"
+          % (size, total, seconds, total / float(seconds)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+import sys
+
+from meinheld import server
+
+mode = sys.argv[1] if len(sys.argv) > 1 else "server"
+
+# sizes of the uploaded files and fields
+def cgi_app(environ, start_response):
+    import cgi
+    fs = cgi.FieldStorage(fp=environ['wsgi.input'], environ=environ, keep_blank_values=True)
+    sizes = []
+    for item in fs.list:
+        if item.filename is not None:
+            sizes.append(len(item.file.read()))
+        else:
+            sizes.append(len(item.value))
+    return respond(start_response, sizes)
+
+def form_app(environ, start_response):
+    sizes = []
+    for values in environ['meinheld.form'].values():
+        for v in values:
+            if isinstance(v, tuple):
+                sizes.append(len(v[2].read()))
+            else:
+                sizes.append(len(v))
+    return respond(start_response, sizes)
+
+def respond(start_response, sizes):
+    body = b'{"sizes": %d}' % sum(sizes)
+    start_response('200 OK', [('Content-Type', 'application/json'),
+                              ('Content-Length', str(len(body)))])
+    return [body]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+server.set_max_content_length(1024 * 1024 * 64)
+if mode == "server":
+    server.set_form_parser(True)
+    server.run(form_app)
+else:
+    server.run(cgi_app)
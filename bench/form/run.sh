@@ -0,0 +1,22 @@
+#!/bin/sh
+# multipart/form-data uploads of a 64KB to 4MB file parsed by
+# cgi.FieldStorage and by server.set_form_parser(True).
+#
+#   $ sh bench/form/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-8}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in cgi server; do
+    echo "$mode:"
+    python bench/form/meinheld_server.py $mode 2> /dev/null &
+    PID=$!
+    sleep 1
+    for size in 64 1024 4096; do
+        python bench/form/client.py 127.0.0.1 8000 $CONNS $SECS $size
+    done
+    kill $PID
+    wait $PID 2> /dev/null
+done
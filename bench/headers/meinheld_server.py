@@ -0,0 +1,29 @@
+import sys
+
+from meinheld import server
+
+# a typical application response, a dozen headers
+HEADERS = [
+    ('Content-Type', 'text/html; charset=utf-8'),
+    ('Cache-Control', 'private, max-age=0, no-cache'),
+    ('Vary', 'Accept-Encoding, Cookie'),
+    ('X-Frame-Options', 'SAMEORIGIN'),
+    ('X-Content-Type-Options', 'nosniff'),
+    ('X-XSS-Protection', '1; mode=block'),
+    ('Strict-Transport-Security', 'max-age=31536000; includeSubDomains'),
+    ('Referrer-Policy', 'same-origin'),
+    ('Set-Cookie', 'sessionid=0123456789abcdef0123456789abcdef; HttpOnly; Path=/'),
+    ('X-Request-Id', '6f1c2a9e-5b7d-4e2a-9c1b-3d8e7f6a5b4c'),
+    ('Content-Length', '12'),
+]
+
+def app(environ, start_response):
+    start_response('200 OK', list(HEADERS))
+    return [b"Hello world!"]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+server.set_header_cache('cache' in sys.argv[1:])
+server.run(app)
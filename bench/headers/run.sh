@@ -0,0 +1,22 @@
+#!/bin/sh
+# Responses with a dozen headers, plain and pipelined, without and
+# with server.set_header_cache(True).
+#
+#   $ sh bench/headers/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for opt in "" cache; do
+    echo "header cache: ${opt:-off}"
+    python bench/headers/meinheld_server.py $opt &
+    PID=$!
+    sleep 1
+    for depth in 1 16; do
+        python bench/pipeline/client.py 127.0.0.1 8000 $CONNS $SECS $depth
+    done
+    kill $PID
+    wait $PID 2> /dev/null
+done
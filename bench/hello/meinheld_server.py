@@ -1,3 +1,5 @@
+import sys
+
 from meinheld import server
 
 def hello_world(environ, start_response):
@@ -10,5 +12,6 @@ def hello_world(environ, start_response):
 server.listen(("0.0.0.0", 8000))
 server.set_access_logger(None)
 server.set_error_logger(None)
-server.run(hello_world)
+# python meinheld_server.py lazy calls the app without a greenlet
+server.run(hello_world, greenlet=sys.argv[1] if len(sys.argv) > 1 else 'always')
 
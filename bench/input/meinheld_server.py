@@ -0,0 +1,36 @@
+import sys
+import zlib
+
+from meinheld import server
+
+mode = sys.argv[1] if len(sys.argv) > 1 else "read"
+
+# crc32 of the request body, read with the method of mode
+def crc_app(environ, start_response):
+    inp = environ['wsgi.input']
+    if mode == "getbuffer":
+        crc = zlib.crc32(inp.getbuffer())
+    elif mode == "readinto":
+        crc = 0
+        view = memoryview(bytearray(65536))
+        while True:
+            n = inp.readinto(view)
+            if not n:
+                break
+            crc = zlib.crc32(view[:n], crc)
+    elif mode == "readline":
+        crc = 0
+        for line in inp:
+            crc = zlib.crc32(line, crc)
+    else:
+        crc = zlib.crc32(inp.read())
+    body = b'{"crc": %d}' % crc
+    start_response('200 OK', [('Content-Type', 'application/json'),
+                              ('Content-Length', str(len(body)))])
+    return [body]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+server.run(crc_app)
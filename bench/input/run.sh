@@ -0,0 +1,21 @@
+#!/bin/sh
+# 256KB text bodies read with wsgi.input read(), readinto() into one
+# bytearray, getbuffer() and line iteration.
+#
+#   $ sh bench/input/run.sh [connections] [seconds] [size KB]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-8}
+SECS=${2:-10}
+SIZE=${3:-256}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in read readinto getbuffer readline; do
+    echo "$mode:"
+    python bench/input/meinheld_server.py $mode &
+    PID=$!
+    sleep 1
+    python bench/input/client.py 127.0.0.1 8000 $CONNS $SECS $SIZE
+    kill $PID
+    wait $PID 2> /dev/null
+done
@@ -0,0 +1,55 @@
+"""
+idle connection recycling: `conns` clients send one request and go
+idle, as many more stop half way through their request head. Reports
+how long the server keeps each kind of socket open.
+
+usage: python client.py [host] [port] [connections]
+"""
+import select
+import socket
+import sys
+import time
+
+REQUEST = b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+PARTIAL = b"GET / HTTP/1.1\r\nHost: localhost\r\n"
+
+
+def open_all(host, port, conns, data):
+    socks = {}
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.sendall(data)
+        socks[s] = time.time()
+    return socks
+
+
+def wait_closed(socks):
+    closed = []
+    while socks:
+        r, _, _ = select.select(list(socks), [], [], 60)
+        if not r:
+            raise RuntimeError("connections not closed")
+        for s in r:
+            if not s.recv(65536):
+                closed.append(time.time() - socks.pop(s))
+                s.close()
+    closed.sort()
+    return closed
+
+
+def report(label, closed):
+    print("%s: %d closed after p50 %.0fms p99 %.0fms max %.0fms" % (
+        label, len(closed), closed[len(closed) // 2] * 1000,
+        closed[len(closed) * 99 // 100] * 1000, closed[-1] * 1000))
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 500
+    report("idle keep-alive", wait_closed(open_all(host, port, conns, REQUEST)))
+    report("partial head", wait_closed(open_all(host, port, conns, PARTIAL)))
+
+
+if __name__ == '__main__':
+    main()
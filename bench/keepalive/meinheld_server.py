@@ -0,0 +1,17 @@
+import sys
+
+from meinheld import server
+
+# usage: python meinheld_server.py [keepalive secs] [read timeout secs]
+keepalive = float(sys.argv[1]) if len(sys.argv) > 1 else 5
+read_timeout = float(sys.argv[2]) if len(sys.argv) > 2 else 30
+
+def app(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/plain')])
+    return [b"Hello world!"]
+
+server.listen(("0.0.0.0", 8000))
+server.set_access_logger(None)
+server.set_keepalive(keepalive)
+server.set_read_timeout(read_timeout)
+server.run(app)
@@ -0,0 +1,19 @@
+#!/bin/sh
+# how fast idle keep-alive sockets and clients stalled in the middle of
+# a request head are closed, with second and with sub-second timeouts.
+#
+#   $ sh bench/keepalive/run.sh [connections]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-500}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for timeouts in "5 30" "0.5 0.25"; do
+    echo "keepalive, read timeout: $timeouts"
+    python bench/keepalive/meinheld_server.py $timeouts &
+    PID=$!
+    sleep 1
+    python bench/keepalive/client.py 127.0.0.1 8000 $CONNS
+    kill $PID
+    wait $PID 2> /dev/null
+done
@@ -0,0 +1,58 @@
+"""
+pipelining load generator, each connection keeps `depth` requests
+in flight and sends the next batch in one write.
+
+usage: python client.py [host] [port] [connections] [seconds] [depth] [path]
+"""
+import select
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+REQUEST = b"GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n"
+END = b"Hello world!"
+
+
+def run(args):
+    host, port, conns, seconds, depth, path = args
+    request = REQUEST % path.encode()
+    socks = {}
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        s.sendall(request * depth)
+        socks[s] = 0
+    done = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        r, _, _ = select.select(list(socks), [], [], 1)
+        for s in r:
+            data = s.recv(65536)
+            if not data:
+                raise RuntimeError("connection closed")
+            n = data.count(END)
+            done += n
+            socks[s] += n
+            if socks[s] >= depth:
+                socks[s] -= depth
+                s.sendall(request * depth)
+    return done
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    depth = int(sys.argv[5]) if len(sys.argv) > 5 else 16
+    path = sys.argv[6] if len(sys.argv) > 6 else "/"
+    procs = 4
+    pool = Pool(procs)
+    total = sum(pool.map(run, [(host, port, conns // procs, seconds, depth, path)] * procs))
+    print("depth %d: %d requests in %ds, %.1f req/s"
+          % (depth, total, seconds, total / float(seconds)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,18 @@
+#!/bin/sh
+# HTTP/1.1 pipelining throughput at increasing depth.
+#
+#   $ sh bench/pipeline/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+python bench/poller/meinheld_server.py &
+PID=$!
+sleep 1
+for depth in 1 4 16 64; do
+    python bench/pipeline/client.py 127.0.0.1 8000 $CONNS $SECS $depth
+done
+kill $PID
+wait $PID 2> /dev/null
@@ -0,0 +1,49 @@
+"""
+keep-alive load generator.
+
+usage: python client.py [host] [port] [connections] [seconds]
+"""
+import select
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+REQUEST = b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+END = b"Hello world!"
+
+
+def run(args):
+    host, port, conns, seconds = args
+    socks = []
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        s.sendall(REQUEST)
+        socks.append(s)
+    done = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        r, _, _ = select.select(socks, [], [], 1)
+        for s in r:
+            data = s.recv(4096)
+            if not data:
+                raise RuntimeError("connection closed")
+            done += data.count(END)
+            s.sendall(REQUEST)
+    return done
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    procs = 4
+    pool = Pool(procs)
+    total = sum(pool.map(run, [(host, port, conns // procs, seconds)] * procs))
+    print("%d requests in %ds, %.1f req/s" % (total, seconds, total / float(seconds)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,20 @@
+#!/bin/sh
+# compare picoev backends: builds meinheld with each poller and runs
+# the keep-alive client against it.
+#
+#   $ sh bench/poller/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+for poller in epoll uring; do
+    MEINHELD_POLLER=$poller python setup.py build_ext --inplace --force > /dev/null || exit 1
+    python bench/poller/meinheld_server.py &
+    PID=$!
+    sleep 1
+    printf "%-6s " $poller
+    python bench/poller/client.py 127.0.0.1 8000 $CONNS $SECS
+    kill $PID
+    wait $PID 2> /dev/null
+done
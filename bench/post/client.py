@@ -0,0 +1,56 @@
+"""
+keep-alive load generator posting a JSON body of about `size` KB.
+
+usage: python client.py [host] [port] [connections] [seconds] [size]
+"""
+import json
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+END = b"}"
+
+
+def make_request(size):
+    item = {"id": 12345, "name": "item name", "tags": ["a", "b", "c"], "price": 42.5}
+    n = size * 1024 // len(json.dumps(item)) + 1
+    body = json.dumps({"items": [item] * n}).encode()
+    return (b"POST /api HTTP/1.1\r\nHost: localhost\r\n"
+            b"Content-Type: application/json\r\n"
+            b"Content-Length: %d\r\n\r\n" % len(body)) + body
+
+
+def run(args):
+    host, port, seconds, size = args
+    request = make_request(size)
+    s = socket.create_connection((host, port))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    done = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        s.sendall(request)
+        data = b""
+        while not data.endswith(END):
+            d = s.recv(4096)
+            if not d:
+                raise RuntimeError("connection closed")
+            data += d
+        done += 1
+    return done
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    size = int(sys.argv[5]) if len(sys.argv) > 5 else 256
+    pool = Pool(conns)
+    total = sum(pool.map(run, [(host, port, seconds, size)] * conns))
+    print("%dKB: %d requests in %ds, %.1f req/s"
+          % (size, total, seconds, total / float(seconds)))
+
+
+if __name__ == "__main__":
+    main()
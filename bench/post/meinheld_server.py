@@ -0,0 +1,17 @@
+import json
+
+from meinheld import server
+
+# a JSON API reading the whole request body
+def json_app(environ, start_response):
+    doc = json.loads(environ['wsgi.input'].read())
+    body = b'{"items": %d}' % len(doc["items"])
+    start_response('200 OK', [('Content-Type', 'application/json'),
+                              ('Content-Length', str(len(body)))])
+    return [body]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+server.run(json_app)
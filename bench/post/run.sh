@@ -0,0 +1,18 @@
+#!/bin/sh
+# JSON POST bodies of 4KB to 400KB read with wsgi.input.read().
+#
+#   $ sh bench/post/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-8}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+python bench/post/meinheld_server.py &
+PID=$!
+sleep 1
+for size in 4 64 256 400; do
+    python bench/post/client.py 127.0.0.1 8000 $CONNS $SECS $size
+done
+kill $PID
+wait $PID 2> /dev/null
@@ -0,0 +1,21 @@
+import sys
+
+from meinheld import server
+
+# a page that takes some Python work to render, with and without the
+# response cache
+def render_page():
+    rows = "".join("<tr><td>%d</td><td>%s</td></tr>" % (i, str(i * i)) for i in range(100))
+    return ("<html><body><table>%s</table>Hello world!</body></html>" % rows).encode()
+
+def app(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/html'), ('X-Meinheld-Cache', 'ttl=5, stale=30')])
+    return [render_page()]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+if len(sys.argv) > 1 and sys.argv[1] == "cache":
+    server.set_response_cache_size(1024 * 1024 * 16)
+server.run(app)
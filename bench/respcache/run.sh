@@ -0,0 +1,20 @@
+#!/bin/sh
+# A page rendered by the app on every request and answered from the
+# response cache.
+#
+#   $ sh bench/respcache/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in app cache; do
+    echo "$mode:"
+    python bench/respcache/meinheld_server.py $mode &
+    PID=$!
+    sleep 1
+    python bench/pipeline/client.py 127.0.0.1 8000 $CONNS $SECS 1 /page
+    kill $PID
+    wait $PID 2> /dev/null
+done
@@ -0,0 +1,36 @@
+"""
+request latency while the server runs bursts of spawned calls.
+
+usage: python client.py [host] [port] [requests]
+"""
+import socket
+import sys
+import time
+
+REQUEST = b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+END = b"Hello world!"
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    count = int(sys.argv[3]) if len(sys.argv) > 3 else 500
+    s = socket.create_connection((host, port))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    latency = []
+    for i in range(count):
+        start = time.time()
+        s.sendall(REQUEST)
+        data = b""
+        while not data.endswith(END):
+            data += s.recv(65536)
+        latency.append(time.time() - start)
+        time.sleep(0.005)
+    latency.sort()
+    print("%d requests: p50 %.1fms p99 %.1fms max %.1fms" % (
+        count, latency[count // 2] * 1000, latency[count * 99 // 100] * 1000,
+        latency[-1] * 1000))
+
+
+if __name__ == '__main__':
+    main()
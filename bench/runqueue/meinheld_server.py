@@ -0,0 +1,31 @@
+import sys
+
+from meinheld import server
+
+# every 100ms a burst of `burst` spawned calls, each a little work, while
+# requests come in. Prints the run queue stats of get_loop_stats() on exit.
+burst = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+
+def app(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/plain')])
+    return [b"Hello world!"]
+
+def work():
+    sum(range(50))
+
+def fan_out():
+    for i in range(burst):
+        server.spawn(work)
+    server.schedule_call(0.1, fan_out)
+
+server.listen(("0.0.0.0", 8000))
+server.set_access_logger(None)
+server.schedule_call(0, fan_out)
+try:
+    server.run(app)
+finally:
+    stats = server.get_loop_stats()
+    print("runs %d, max depth %d, wait %.2fms on average, %dms max, %d turns left calls for after the poll" % (
+        stats["runs"], stats["run_queue_max"],
+        stats["run_wait_msec"] / float(max(stats["runs"], 1)),
+        stats["run_wait_max_msec"], stats["run_deferred"]))
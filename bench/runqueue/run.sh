@@ -0,0 +1,17 @@
+#!/bin/sh
+# request latency while bursts of spawned calls run, and the run queue
+# depth and wait from get_loop_stats().
+#
+#   $ sh bench/runqueue/run.sh [burst] [requests]
+
+cd "$(dirname "$0")/../.."
+BURST=${1:-20000}
+COUNT=${2:-500}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+python bench/runqueue/meinheld_server.py $BURST &
+PID=$!
+sleep 1
+python bench/runqueue/client.py 127.0.0.1 8000 $COUNT
+kill -INT $PID
+wait $PID 2> /dev/null
@@ -0,0 +1,18 @@
+import sys
+
+from meinheld import server
+
+# every request waits 50ms for a slow backend, with single flight the
+# concurrent ones share one call
+def app(environ, start_response):
+    server.sleep(0.05)
+    start_response('200 OK', [('Content-Type', 'text/plain')])
+    return [b"Hello world!"]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+if len(sys.argv) > 1 and sys.argv[1] == "flight":
+    server.set_single_flight(True)
+server.run(app)
@@ -0,0 +1,30 @@
+import mimetypes
+import os
+import sys
+import tempfile
+
+from meinheld import server
+
+# a small asset, served by add_static or by a Python static app
+root = tempfile.mkdtemp()
+with open(os.path.join(root, "app.css"), "wb") as f:
+    f.write(b"body { margin: 0 }\n" * 200 + b"Hello world!")
+
+def static_app(environ, start_response):
+    path = environ['PATH_INFO']
+    if path.startswith('/assets/'):
+        fn = os.path.join(root, path[len('/assets/'):])
+        if os.path.isfile(fn):
+            ctype = mimetypes.guess_type(fn)[0] or 'application/octet-stream'
+            start_response('200 OK', [('Content-Type', ctype)])
+            return environ['wsgi.file_wrapper'](open(fn, 'rb'))
+    start_response('404 Not Found', [('Content-Type', 'text/plain')])
+    return [b"Not Found"]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_error_logger(None)
+if len(sys.argv) > 1 and sys.argv[1] == "static":
+    server.add_static("/assets", root)
+server.run(static_app)
@@ -0,0 +1,20 @@
+#!/bin/sh
+# A 4KB asset served by a Python static app over wsgi.file_wrapper and
+# by server.add_static.
+#
+#   $ sh bench/static/run.sh [connections] [seconds]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-64}
+SECS=${2:-10}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in app static; do
+    echo "$mode:"
+    python bench/static/meinheld_server.py $mode &
+    PID=$!
+    sleep 1
+    python bench/pipeline/client.py 127.0.0.1 8000 $CONNS $SECS 1 /assets/app.css
+    kill $PID
+    wait $PID 2> /dev/null
+done
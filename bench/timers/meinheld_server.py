@@ -0,0 +1,74 @@
+import random
+import sys
+import time
+
+from meinheld import server
+
+# schedule timers the way request deadlines are used: most are cancelled
+# before they fire, the rest fire spread over a few seconds. Then loop
+# wakeups and timer lateness from get_loop_stats() with a 3ms periodic
+# timer and with an idle loop.
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+late = []
+ticking = [False]
+
+def fired(due):
+    late.append(time.time() - due)
+
+def app(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/plain')])
+    return [b"Hello world!"]
+
+def schedule():
+    timers = []
+    start = time.time()
+    for i in range(count):
+        timers.append(server.schedule_call(30, fired, 0))
+    for timer in timers:
+        timer.cancel()
+    elapsed = time.time() - start
+    print("schedule+cancel %d: %.1f ns/timer" % (count, elapsed * 1e9 / count))
+    # after the next poll, so the loop time is fresh
+    server.schedule_call(0.001, spread)
+
+def spread():
+    now = time.time()
+    for i in range(count):
+        delay = random.uniform(0.001, 2)
+        server.schedule_call(delay, fired, now + delay)
+    server.schedule_call(2.5, ticks)
+
+def tick():
+    if ticking[0]:
+        server.schedule_call(0.003, tick)
+
+def measure(label, secs, then):
+    start = (time.time(), server.get_loop_stats())
+    server.schedule_call(secs, report, label, start, then)
+
+def report(label, start, then):
+    elapsed = time.time() - start[0]
+    stats = server.get_loop_stats()
+    timers = stats["timers"] - start[1]["timers"]
+    print("%s: %.1f wakeups/s, %d timers %.2fms late on average" % (
+        label, (stats["wakeups"] - start[1]["wakeups"]) / elapsed, timers,
+        (stats["timer_late_msec"] - start[1]["timer_late_msec"]) / max(timers, 1)))
+    then()
+
+def ticks():
+    ticking[0] = True
+    tick()
+    measure("3ms timer", 2, idle)
+
+def idle():
+    ticking[0] = False
+    measure("idle", 5, server.shutdown)
+
+server.listen(("0.0.0.0", 8000))
+server.set_access_logger(None)
+server.schedule_call(0, schedule)
+server.run(app)
+
+late.sort()
+print("fired %d: lateness p50 %.1fms p99 %.1fms max %.1fms" % (
+    len(late), late[len(late) // 2] * 1000, late[len(late) * 99 // 100] * 1000, late[-1] * 1000))
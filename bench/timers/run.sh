@@ -0,0 +1,12 @@
+#!/bin/sh
+# schedule_call throughput and lateness with many timers: a batch
+# scheduled and cancelled, then a batch fired over two seconds. Then
+# loop wakeups per second with a 3ms timer and with nothing to do.
+#
+#   $ sh bench/timers/run.sh [timers]
+
+cd "$(dirname "$0")/../.."
+COUNT=${1:-100000}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+python bench/timers/meinheld_server.py $COUNT
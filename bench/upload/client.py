@@ -0,0 +1,70 @@
+"""
+upload load generator, each connection posts `size` MB bodies in 64KB
+writes. Prints uploads per second, the mean time to the response and
+the server's peak RSS.
+
+usage: python client.py [host] [port] [connections] [seconds] [size]
+"""
+import socket
+import sys
+import time
+from multiprocessing import Pool
+
+BLOCK = b"x" * 65536
+
+
+def upload(s, size):
+    s.sendall(b"POST /upload HTTP/1.1\r\nHost: localhost\r\n"
+              b"Content-Length: %d\r\n\r\n" % (size * len(BLOCK)))
+    for i in range(size):
+        s.sendall(BLOCK)
+    data = b""
+    while b"\r\n\r\n" not in data:
+        d = s.recv(4096)
+        if not d:
+            raise RuntimeError("connection closed")
+        data += d
+
+
+def run(args):
+    host, port, conns, seconds, size = args
+    s = socket.create_connection((host, port))
+    done = 0
+    elapsed = 0.0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        start = time.time()
+        upload(s, size)
+        elapsed += time.time() - start
+        done += 1
+    return done, elapsed
+
+
+def rss(host, port):
+    s = socket.create_connection((host, port))
+    s.sendall(b"GET /rss HTTP/1.0\r\n\r\n")
+    data = b""
+    while True:
+        d = s.recv(4096)
+        if not d:
+            break
+        data += d
+    return int(data.split(b"\r\n\r\n", 1)[1])
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+    conns = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+    seconds = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+    size = int(sys.argv[5]) * 16 if len(sys.argv) > 5 else 100 * 16
+    pool = Pool(conns)
+    results = pool.map(run, [(host, port, conns, seconds, size)] * conns)
+    done = sum(r[0] for r in results)
+    elapsed = sum(r[1] for r in results)
+    print("%d uploads in %ds, %.1f uploads/s, %.1f ms per upload, server peak RSS %d KB"
+          % (done, seconds, done / float(seconds), elapsed * 1000 / max(done, 1), rss(host, port)))
+
+
+if __name__ == "__main__":
+    main()
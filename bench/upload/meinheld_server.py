@@ -0,0 +1,28 @@
+import resource
+import sys
+
+from meinheld import server
+
+# reads the upload in 64KB blocks like a proxy passing it on
+def upload_app(environ, start_response):
+    if environ['PATH_INFO'] == '/rss':
+        body = b"%d" % resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    else:
+        inp = environ['wsgi.input']
+        n = 0
+        while True:
+            data = inp.read(65536)
+            if not data:
+                break
+            n += len(data)
+        body = b"%d" % n
+    start_response('200 OK', [('Content-Type', 'text/plain')])
+    return [body]
+
+server.listen(("0.0.0.0", 8000))
+server.set_keepalive(10)
+server.set_access_logger(None)
+server.set_max_content_length(1024 * 1024 * 1024)
+if len(sys.argv) > 1 and sys.argv[1] == "stream":
+    server.set_streaming_input(True)
+server.run(upload_app)
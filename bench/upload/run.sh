@@ -0,0 +1,21 @@
+#!/bin/sh
+# 100MB uploads read by the app in 64KB blocks, the buffered body
+# (spooled to a file over client_body_buffer_size) and server.set_streaming_input(True).
+#
+#   $ sh bench/upload/run.sh [connections] [seconds] [MB]
+
+cd "$(dirname "$0")/../.."
+CONNS=${1:-8}
+SECS=${2:-10}
+SIZE=${3:-100}
+
+python setup.py build_ext --inplace > /dev/null || exit 1
+for mode in buffer stream; do
+    echo "$mode:"
+    python bench/upload/meinheld_server.py $mode 2> /dev/null &
+    PID=$!
+    sleep 1
+    python bench/upload/client.py 127.0.0.1 8000 $CONNS $SECS $SIZE
+    kill $PID
+    wait $PID 2> /dev/null
+done
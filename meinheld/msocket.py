@@ -151,17 +151,17 @@ from meinheld import server, cancel_wait
 def wait_read(fileno, timeout=None):
     if not timeout:
         timeout = 0
-    server.trampoline(fileno, read=True, timeout=int(timeout))
+    server.trampoline(fileno, read=True, timeout=timeout)
 
 def wait_write(fileno, timeout=None):
     if not timeout:
         timeout = 0
-    server.trampoline(fileno, write=True, timeout=int(timeout))
+    server.trampoline(fileno, write=True, timeout=timeout)
 
 def wait_readwrite(fileno, timeout=None):
     if not timeout:
         timeout = 0
-    server.trampoline(fileno, read=True, write=True, timeout=int(timeout))
+    server.trampoline(fileno, read=True, write=True, timeout=timeout)
 
 
 
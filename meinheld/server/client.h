@@ -4,6 +4,29 @@
 #include "meinheld.h"
 #include "request.h"
 
+typedef struct iovec iovec_t;
+
+#define WRITE_BUCKET_IOV 4
+#define CLIENT_HEADER_BUF 1024
+
+typedef struct {
+    int fd;
+    iovec_t *iov;
+    uint32_t iov_cnt;
+    uint32_t iov_size;
+    uint32_t total;
+    uint32_t total_size;
+    uint8_t sended;
+    uint8_t in_client;    // client->write_arena
+    PyObject *temp1; //keep origin pointer
+    char *header;         // serialized headers (client->header_buf or heap)
+    size_t header_len;
+    size_t header_size;
+    char chunk_len[20];   // chunk size line
+    void *coalesce;       // coalesce_buf of process_write
+    iovec_t inline_iov[WRITE_BUCKET_IOV];
+} write_bucket;
+
 typedef struct _client {
     int fd;
     char *remote_addr;
@@ -29,9 +52,22 @@ typedef struct _client {
     uint8_t content_length_set;     // content_length_set flag
     uint64_t content_length;         // content_length
     uint64_t write_bytes;            // send body length
+    uint64_t file_offset;       // next sendfile offset
+    uint64_t file_end;          // end of the current file range
+    void *file_ranges;          // parts of a multipart/byteranges response
+    void *static_file;          // static_file of a static response
+    void *cache_entry;          // response_cache_entry being sent
+    void *cache_capture;        // response_cache_entry being stored
+    void *cache_wait;           // response_cache_entry the request waits for
+    struct _client *cache_wait_next;
+    void *compress;             // compress_stream of the response body
     void *bucket;               //write_data
     uint8_t response_closed;    //response closed flag
     uint8_t use_cork;     // use TCP_CORK
+    uint8_t body_done;    // response iterator ended
+    uint8_t write_arena_used;
+    write_bucket write_arena;   // bucket of the common response path
+    char header_buf[CLIENT_HEADER_BUF]; // response header block
 } client_t;
 
 typedef struct {
@@ -0,0 +1,351 @@
+#include "compress.h"
+#include "environ.h"
+#include "log.h"
+
+/*
+ * Response compression
+ *
+ * With server.set_compress_level(n) (1-9) a response is gzip or deflate
+ * compressed when the request's Accept-Encoding allows it, the app did
+ * not set Content-Encoding, the Content-Type is not an already
+ * compressed format and the body is not shorter than
+ * server.set_compress_min_length(). A one item body is compressed at
+ * once and sent with Content-Length, others are compressed item by item
+ * as a chunked HTTP/1.1 response. The zlib streams (about 256KB each)
+ * are reset and reused instead of allocated per response.
+ *
+ * A wsgi.file_wrapper or static response to a client accepting gzip is
+ * sent from path.gz instead when it exists and is not older.
+ */
+
+#define COMPRESS_MAXFREELIST 16
+#define COMPRESS_WINDOW_BITS 15
+#define COMPRESS_MEM_LEVEL 8
+
+static compress_stream *gzip_free_list[COMPRESS_MAXFREELIST];
+static int gzip_numfree = 0;
+static compress_stream *deflate_free_list[COMPRESS_MAXFREELIST];
+static int deflate_numfree = 0;
+
+static int compress_level = 0;
+static size_t compress_min_length = 256;
+static unsigned long long compress_responses = 0;
+static unsigned long long compress_precompressed = 0;
+static unsigned long long compress_bytes_in = 0;
+static unsigned long long compress_bytes_out = 0;
+
+/* already compressed formats */
+static const char *incompressible_types[] = {
+    "image/",
+    "audio/",
+    "video/",
+    "font/woff",
+    "application/zip",
+    "application/gzip",
+    "application/x-gzip",
+    "application/x-bzip2",
+    "application/x-xz",
+    "application/zstd",
+    "application/x-7z-compressed",
+    "application/x-rar-compressed",
+    "application/pdf",
+    "application/octet-stream",
+    NULL
+};
+
+int
+has_compress(void)
+{
+    return compress_level > 0;
+}
+
+/* q=0 refuses the coding */
+static int
+nonzero_quality(const char *p, const char *end)
+{
+    if(p < end && *p == '0'){
+        p++;
+        if(p < end && *p == '.'){
+            p++;
+            while(p < end && *p >= '0' && *p <= '9'){
+                if(*p++ != '0'){
+                    return 1;
+                }
+            }
+        }
+        return 0;
+    }
+    return 1;
+}
+
+#define TOKEN_IS(p, len, s) \
+    ((len) == sizeof(s) - 1 && !strncasecmp((p), (s), sizeof(s) - 1))
+
+/* encoding of the response, 0 is identity */
+int
+accept_compress(PyObject *env)
+{
+    char *value, *p, *end, *token;
+    Py_ssize_t len;
+    size_t token_len;
+    int gzip = 0, deflate = 0, any = 0, q;
+
+    if(!environ_get_string(env, "HTTP_ACCEPT_ENCODING", &value, &len)){
+        return 0;
+    }
+    p = value;
+    end = value + len;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')){
+            p++;
+        }
+        token = p;
+        while(p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'){
+            p++;
+        }
+        token_len = p - token;
+        q = 1;
+        while(p < end && *p != ','){
+            if(*p++ != ';'){
+                continue;
+            }
+            while(p < end && (*p == ' ' || *p == '\t')){
+                p++;
+            }
+            if(end - p > 2 && (*p == 'q' || *p == 'Q') && p[1] == '='){
+                q = nonzero_quality(p + 2, end);
+            }
+        }
+        if(TOKEN_IS(token, token_len, "gzip") || TOKEN_IS(token, token_len, "x-gzip")){
+            gzip = q ? 1 : -1;
+        }else if(TOKEN_IS(token, token_len, "deflate")){
+            deflate = q ? 1 : -1;
+        }else if(TOKEN_IS(token, token_len, "*")){
+            any = q ? 1 : -1;
+        }
+    }
+    if(gzip == 1 || (gzip == 0 && any == 1)){
+        return COMPRESS_GZIP;
+    }
+    if(deflate == 1 || (deflate == 0 && any == 1)){
+        return COMPRESS_DEFLATE;
+    }
+    return 0;
+}
+
+int
+compressible_type(const char *type, size_t len)
+{
+    const char **t;
+    size_t n;
+
+    if(len >= 9 && !strncasecmp(type, "image/svg", 9)){
+        return 1;
+    }
+    for(t = incompressible_types; *t; t++){
+        n = strlen(*t);
+        if(len >= n && !strncasecmp(type, *t, n)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+const char *
+compress_encoding(int encoding, size_t *len)
+{
+    if(encoding == COMPRESS_GZIP){
+        *len = 4;
+        return "gzip";
+    }
+    *len = 7;
+    return "deflate";
+}
+
+compress_stream *
+new_compress_stream(int encoding)
+{
+    compress_stream *s = NULL;
+    int bits;
+
+    if(encoding == COMPRESS_GZIP && gzip_numfree){
+        s = gzip_free_list[--gzip_numfree];
+    }else if(encoding == COMPRESS_DEFLATE && deflate_numfree){
+        s = deflate_free_list[--deflate_numfree];
+    }
+    if(s){
+        GDEBUG("use pooled %p", s);
+        if(deflateReset(&s->zs) != Z_OK ||
+                (s->level != compress_level &&
+                 deflateParams(&s->zs, compress_level, Z_DEFAULT_STRATEGY) != Z_OK)){
+            deflateEnd(&s->zs);
+            PyMem_Free(s);
+            s = NULL;
+        }
+    }
+    if(s == NULL){
+        s = PyMem_Malloc(sizeof(compress_stream));
+        if(s == NULL){
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(s, 0, sizeof(compress_stream));
+        // +16 writes the gzip header and trailer
+        bits = encoding == COMPRESS_GZIP ? COMPRESS_WINDOW_BITS + 16 : COMPRESS_WINDOW_BITS;
+        if(deflateInit2(&s->zs, compress_level, Z_DEFLATED, bits, COMPRESS_MEM_LEVEL,
+                    Z_DEFAULT_STRATEGY) != Z_OK){
+            PyMem_Free(s);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        GDEBUG("alloc %p", s);
+    }
+    s->encoding = encoding;
+    s->level = compress_level;
+    s->pending = 0;
+    compress_responses++;
+    return s;
+}
+
+void
+release_compress_stream(compress_stream *s)
+{
+    if(s->encoding == COMPRESS_GZIP && gzip_numfree < COMPRESS_MAXFREELIST){
+        gzip_free_list[gzip_numfree++] = s;
+    }else if(s->encoding == COMPRESS_DEFLATE && deflate_numfree < COMPRESS_MAXFREELIST){
+        deflate_free_list[deflate_numfree++] = s;
+    }else{
+        deflateEnd(&s->zs);
+        PyMem_Free(s);
+        return;
+    }
+    GDEBUG("back to pool %p", s);
+}
+
+/*
+ * Compressed bytes of data, maybe empty. flush is Z_NO_FLUSH,
+ * Z_SYNC_FLUSH or Z_FINISH.
+ */
+PyObject *
+compress_data(compress_stream *s, const char *data, size_t len, int flush)
+{
+    PyObject *out;
+    size_t size, used = 0;
+
+    size = flush == Z_FINISH ? deflateBound(&s->zs, len) : len / 2 + 64;
+    out = PyBytes_FromStringAndSize(NULL, size);
+    if(out == NULL){
+        return NULL;
+    }
+    s->zs.next_in = (Bytef *)data;
+    s->zs.avail_in = len;
+    for(;;){
+        s->zs.next_out = (Bytef *)PyBytes_AS_STRING(out) + used;
+        s->zs.avail_out = size - used;
+        if(deflate(&s->zs, flush) == Z_STREAM_ERROR){
+            Py_DECREF(out);
+            PyErr_SetString(PyExc_IOError, "deflate error");
+            return NULL;
+        }
+        used = size - s->zs.avail_out;
+        if(s->zs.avail_out != 0){
+            // all input taken and flushed as asked
+            break;
+        }
+        size *= 2;
+        if(_PyBytes_Resize(&out, size) == -1){
+            return NULL;
+        }
+    }
+    if(_PyBytes_Resize(&out, used) == -1){
+        return NULL;
+    }
+    s->pending = flush == Z_NO_FLUSH && (len > 0 || s->pending);
+    compress_bytes_in += len;
+    compress_bytes_out += used;
+    return out;
+}
+
+/*
+ * path.gz when it is a regular file not older than the file of info,
+ * info is replaced by its stat.
+ */
+int
+open_precompressed(const char *path, size_t len, struct stat *info)
+{
+    char gz[PATH_MAX];
+    struct stat gz_info;
+    int fd;
+
+    if(len + 4 > sizeof(gz) || memchr(path, '\0', len)){
+        return -1;
+    }
+    memcpy(gz, path, len);
+    memcpy(gz + len, ".gz", 4);
+    fd = open(gz, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    if(fstat(fd, &gz_info) == -1 || !S_ISREG(gz_info.st_mode) || gz_info.st_mtime < info->st_mtime){
+        close(fd);
+        return -1;
+    }
+    DEBUG("precompressed %s fd:%d", gz, fd);
+    *info = gz_info;
+    compress_precompressed++;
+    return fd;
+}
+
+void
+clear_compress_streams(void)
+{
+    while(gzip_numfree){
+        deflateEnd(&gzip_free_list[--gzip_numfree]->zs);
+        PyMem_Free(gzip_free_list[gzip_numfree]);
+    }
+    while(deflate_numfree){
+        deflateEnd(&deflate_free_list[--deflate_numfree]->zs);
+        PyMem_Free(deflate_free_list[deflate_numfree]);
+    }
+}
+
+void
+set_compress_level(int level)
+{
+    compress_level = level;
+}
+
+int
+get_compress_level(void)
+{
+    return compress_level;
+}
+
+void
+set_compress_min_length(size_t length)
+{
+    compress_min_length = length;
+}
+
+size_t
+get_compress_min_length(void)
+{
+    return compress_min_length;
+}
+
+PyObject*
+get_compress_stats(void)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K}",
+            "responses", compress_responses,
+            "precompressed", compress_precompressed,
+            "bytes_in", compress_bytes_in,
+            "bytes_out", compress_bytes_out);
+}
+
+/* static mounts use it for path.gz */
+void
+count_precompressed(void)
+{
+    compress_precompressed++;
+}
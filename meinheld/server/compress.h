@@ -0,0 +1,50 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "meinheld.h"
+#include <zlib.h>
+
+#define COMPRESS_GZIP 1
+#define COMPRESS_DEFLATE 2
+
+/**
+ * zlib stream of a response being compressed, pooled per encoding.
+ */
+typedef struct {
+    z_stream zs;
+    int encoding;
+    int level;
+    uint8_t pending;        // data written since the last flush
+} compress_stream;
+
+int has_compress(void);
+
+int accept_compress(PyObject *env);
+
+int compressible_type(const char *type, size_t len);
+
+const char* compress_encoding(int encoding, size_t *len);
+
+compress_stream* new_compress_stream(int encoding);
+
+void release_compress_stream(compress_stream *s);
+
+PyObject* compress_data(compress_stream *s, const char *data, size_t len, int flush);
+
+int open_precompressed(const char *path, size_t len, struct stat *info);
+
+void count_precompressed(void);
+
+void clear_compress_streams(void);
+
+void set_compress_level(int level);
+
+int get_compress_level(void);
+
+void set_compress_min_length(size_t length);
+
+size_t get_compress_min_length(void);
+
+PyObject* get_compress_stats(void);
+
+#endif
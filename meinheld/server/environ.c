@@ -0,0 +1,747 @@
+#include "environ.h"
+#include "http_request_parser.h"
+
+/**
+ * Lazy environ.
+ *
+ * The parser callbacks append raw header names and values to one
+ * buffer instead of creating key/value objects for every header.
+ * Item lookups (env[key], env.get, `in`) set only the requested
+ * HTTP_* item. Everything that looks at the whole mapping (iteration,
+ * len, keys/items/values, copy, repr, ==, update ...) sets all of them
+ * first, then runs the dict implementation.
+ *
+ * C code calling PyDict_GetItem/PyDict_Next on the environ only sees
+ * items already set, so this is opt-in (server.set_lazy_environ).
+ */
+
+static PyObject *remote_addr_key;
+static PyObject *remote_port_key;
+static PyObject *empty_args;
+
+static PyObject*
+latin1(const char *buf, size_t len)
+{
+#ifdef PY3
+    return PyUnicode_DecodeLatin1(buf, len, NULL);
+#else
+    return PyBytes_FromStringAndSize(buf, len);
+#endif
+}
+
+static const char*
+key_string(PyObject *key, Py_ssize_t *len)
+{
+#ifdef PY3
+    if(!PyUnicode_Check(key)){
+        return NULL;
+    }
+    return PyUnicode_AsUTF8AndSize(key, len);
+#else
+    if(!PyBytes_Check(key)){
+        return NULL;
+    }
+    *len = PyBytes_GET_SIZE(key);
+    return PyBytes_AS_STRING(key);
+#endif
+}
+
+PyObject*
+EnvironObject_New(const char *remote_addr, int remote_port)
+{
+    EnvironObject *self;
+
+    self = (EnvironObject *)PyDict_Type.tp_new(&EnvironObjectType, empty_args, NULL);
+    if(self == NULL){
+        return NULL;
+    }
+    self->buf = self->inline_buf;
+    self->buf_size = ENVIRON_INLINE_BUF;
+    self->headers = self->inline_headers;
+    self->headers_size = ENVIRON_INLINE_HEADERS;
+    strncpy(self->remote_addr, remote_addr, sizeof(self->remote_addr) - 1);
+    self->remote_port = remote_port;
+    self->remote_pending = 1;
+    return (PyObject *)self;
+}
+
+static void
+EnvironObject_dealloc(EnvironObject *self)
+{
+    if(self->buf != self->inline_buf){
+        PyMem_Free(self->buf);
+    }
+    if(self->headers != self->inline_headers){
+        PyMem_Free(self->headers);
+    }
+    PyDict_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+append_buf(EnvironObject *self, const char *buf, size_t len)
+{
+    char *new_buf;
+    size_t size = self->buf_size;
+
+    if(self->buf_len + len > size){
+        while(self->buf_len + len > size){
+            size *= 2;
+        }
+        if(self->buf == self->inline_buf){
+            new_buf = PyMem_Malloc(size);
+            if(new_buf != NULL){
+                memcpy(new_buf, self->buf, self->buf_len);
+            }
+        }else{
+            new_buf = PyMem_Realloc(self->buf, size);
+        }
+        if(new_buf == NULL){
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->buf = new_buf;
+        self->buf_size = size;
+    }
+    memcpy(self->buf + self->buf_len, buf, len);
+    self->buf_len += len;
+    return 0;
+}
+
+static environ_header*
+new_header(EnvironObject *self)
+{
+    environ_header *headers, *h;
+    size_t size;
+
+    if(self->num_headers == self->headers_size){
+        size = self->headers_size * 2;
+        if(self->headers == self->inline_headers){
+            headers = PyMem_Malloc(sizeof(environ_header) * size);
+            if(headers != NULL){
+                memcpy(headers, self->headers, sizeof(environ_header) * self->num_headers);
+            }
+        }else{
+            headers = PyMem_Realloc(self->headers, sizeof(environ_header) * size);
+        }
+        if(headers == NULL){
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->headers = headers;
+        self->headers_size = size;
+    }
+    h = &self->headers[self->num_headers++];
+    h->name_off = self->buf_len;
+    h->name_len = 0;
+    h->value_off = self->buf_len;
+    h->value_len = 0;
+    h->done = 0;
+    self->pending++;
+    return h;
+}
+
+/* returns the length of the current name, -1 on error */
+int
+environ_add_name(PyObject *env, const char *buf, size_t len)
+{
+    EnvironObject *self = (EnvironObject *)env;
+    environ_header *h;
+
+    if(self->last_is_name && self->num_headers){
+        // name split across reads
+        h = &self->headers[self->num_headers - 1];
+    }else{
+        h = new_header(self);
+        if(h == NULL){
+            return -1;
+        }
+    }
+    if(append_buf(self, buf, len) == -1){
+        return -1;
+    }
+    h->name_len += len;
+    h->value_off = self->buf_len;
+    self->last_is_name = 1;
+    return h->name_len;
+}
+
+/* returns the length of the current value, -1 on error */
+int
+environ_add_value(PyObject *env, const char *buf, size_t len)
+{
+    EnvironObject *self = (EnvironObject *)env;
+    environ_header *h;
+
+    if(self->num_headers == 0){
+        return 0;
+    }
+    h = &self->headers[self->num_headers - 1];
+    if(append_buf(self, buf, len) == -1){
+        return -1;
+    }
+    h->value_len += len;
+    self->last_is_name = 0;
+    return h->value_len;
+}
+
+static int
+set_header_item(EnvironObject *self, PyObject *key, environ_header *h)
+{
+    PyObject *value;
+    int ret;
+
+    value = latin1(self->buf + h->value_off, h->value_len);
+    if(value == NULL){
+        return -1;
+    }
+    ret = PyDict_SetItem((PyObject *)self, key, value);
+    Py_DECREF(value);
+    return ret;
+}
+
+static int
+set_remote_items(EnvironObject *self)
+{
+    PyObject *object;
+    int ret;
+
+    self->remote_pending = 0;
+    object = NATIVE_FROMSTRING(self->remote_addr);
+    if(object == NULL){
+        return -1;
+    }
+    ret = PyDict_SetItem((PyObject *)self, remote_addr_key, object);
+    Py_DECREF(object);
+    if(ret == -1){
+        return -1;
+    }
+    object = NATIVE_FROMFORMAT("%d", self->remote_port);
+    if(object == NULL){
+        return -1;
+    }
+    ret = PyDict_SetItem((PyObject *)self, remote_port_key, object);
+    Py_DECREF(object);
+    return ret;
+}
+
+static int
+name_matches(const char *name, size_t len, const char *key, size_t key_len)
+{
+    size_t i;
+    char c;
+
+    if(len != key_len){
+        return 0;
+    }
+    for(i = 0; i < len; i++){
+        c = name[i];
+        if(c == '-'){
+            c = '_';
+        }else if(c >= 'a' && c <= 'z'){
+            c -= 'a' - 'A';
+        }
+        if(c != key[i]){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* set the item for key if it is still pending */
+static int
+materialize_key(EnvironObject *self, PyObject *key)
+{
+    const char *s;
+    Py_ssize_t len;
+    environ_header *h, *found = NULL;
+    uint32_t i;
+
+    if(self->pending == 0 && !self->remote_pending){
+        return 0;
+    }
+    s = key_string(key, &len);
+    if(s == NULL){
+        PyErr_Clear();
+        return 0;
+    }
+    if(len > 5 && !memcmp(s, "HTTP_", 5)){
+        for(i = 0; i < self->num_headers; i++){
+            h = &self->headers[i];
+            if(!h->done && name_matches(self->buf + h->name_off, h->name_len, s + 5, len - 5)){
+                // last one wins, like PyDict_SetItem in order
+                h->done = 1;
+                self->pending--;
+                found = h;
+            }
+        }
+        if(found){
+            return set_header_item(self, key, found);
+        }
+    }else if(self->remote_pending && (!strcmp(s, "REMOTE_ADDR") || !strcmp(s, "REMOTE_PORT"))){
+        return set_remote_items(self);
+    }
+    return 0;
+}
+
+static int
+materialize_all(EnvironObject *self)
+{
+    environ_header *h;
+    PyObject *key;
+    int i, ret;
+
+    if(self->remote_pending){
+        if(set_remote_items(self) == -1){
+            return -1;
+        }
+    }
+    if(self->pending == 0){
+        return 0;
+    }
+    // backwards with setdefault: the last header wins, items the app already set win
+    for(i = self->num_headers - 1; i >= 0; i--){
+        h = &self->headers[i];
+        if(h->done){
+            continue;
+        }
+        h->done = 1;
+        self->pending--;
+        key = get_http_header_key(self->buf + h->name_off, h->name_len);
+        if(key == NULL){
+            return -1;
+        }
+        ret = 0;
+        if(PyDict_GetItem((PyObject *)self, key) == NULL){
+            ret = set_header_item(self, key, h);
+        }
+        Py_DECREF(key);
+        if(ret == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+environ_set_content_keys(PyObject *env, PyObject *content_type_key, PyObject *content_length_key)
+{
+    EnvironObject *self = (EnvironObject *)env;
+    environ_header *h;
+    PyObject *key;
+    uint32_t i;
+
+    for(i = 0; i < self->num_headers; i++){
+        h = &self->headers[i];
+        if(h->name_len == 12 && !strncasecmp(self->buf + h->name_off, "content-type", 12)){
+            key = content_type_key;
+        }else if(h->name_len == 14 && !strncasecmp(self->buf + h->name_off, "content-length", 14)){
+            key = content_length_key;
+        }else{
+            continue;
+        }
+        h->done = 1;
+        self->pending--;
+        if(set_header_item(self, key, h) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* borrowed reference, like PyDict_GetItemString */
+PyObject*
+environ_get_item_string(PyObject *env, const char *key)
+{
+    PyObject *k, *v;
+
+    if(!CheckEnvironObject(env)){
+        return PyDict_GetItemString(env, key);
+    }
+    k = NATIVE_FROMSTRING(key);
+    if(k == NULL){
+        PyErr_Clear();
+        return NULL;
+    }
+    v = PyDict_GetItem(env, k);
+    if(v == NULL && materialize_key((EnvironObject *)env, k) == 0){
+        v = PyDict_GetItem(env, k);
+    }
+    PyErr_Clear();
+    Py_DECREF(k);
+    return v;
+}
+
+/* latin-1 data of a native str item, 0 when missing or not native */
+int
+environ_get_string(PyObject *env, const char *key, char **buf, Py_ssize_t *len)
+{
+    PyObject *obj = environ_get_item_string(env, key);
+
+    if(obj == NULL){
+        return 0;
+    }
+#ifdef PY3
+    if(!PyUnicode_Check(obj)){
+        return 0;
+    }
+#if PY_VERSION_HEX < 0x030C0000
+    if(PyUnicode_READY(obj) == -1){
+        PyErr_Clear();
+        return 0;
+    }
+#endif
+    if(PyUnicode_KIND(obj) != PyUnicode_1BYTE_KIND){
+        return 0;
+    }
+    *buf = (char *)PyUnicode_1BYTE_DATA(obj);
+    *len = PyUnicode_GET_LENGTH(obj);
+#else
+    if(!PyBytes_Check(obj)){
+        return 0;
+    }
+    *buf = PyBytes_AS_STRING(obj);
+    *len = PyBytes_GET_SIZE(obj);
+#endif
+    return 1;
+}
+
+/* borrowed reference, NULL without exception when missing */
+static PyObject*
+lookup(EnvironObject *self, PyObject *key)
+{
+    PyObject *v;
+
+#ifdef PY3
+    v = PyDict_GetItemWithError((PyObject *)self, key);
+    if(v != NULL || PyErr_Occurred()){
+        return v;
+    }
+#else
+    v = PyDict_GetItem((PyObject *)self, key);
+    if(v != NULL){
+        return v;
+    }
+#endif
+    if(materialize_key(self, key) == -1){
+        return NULL;
+    }
+#ifdef PY3
+    return PyDict_GetItemWithError((PyObject *)self, key);
+#else
+    return PyDict_GetItem((PyObject *)self, key);
+#endif
+}
+
+static PyObject*
+EnvironObject_subscript(EnvironObject *self, PyObject *key)
+{
+    PyObject *v;
+
+    v = lookup(self, key);
+    if(v == NULL){
+        if(!PyErr_Occurred()){
+            PyErr_SetObject(PyExc_KeyError, key);
+        }
+        return NULL;
+    }
+    Py_INCREF(v);
+    return v;
+}
+
+static int
+EnvironObject_ass_subscript(EnvironObject *self, PyObject *key, PyObject *value)
+{
+    // the pending item must not come back later
+    if(materialize_key(self, key) == -1){
+        return -1;
+    }
+    return PyDict_Type.tp_as_mapping->mp_ass_subscript((PyObject *)self, key, value);
+}
+
+static Py_ssize_t
+EnvironObject_length(EnvironObject *self)
+{
+    if(materialize_all(self) == -1){
+        return -1;
+    }
+    return PyDict_Type.tp_as_mapping->mp_length((PyObject *)self);
+}
+
+static int
+EnvironObject_contains(EnvironObject *self, PyObject *key)
+{
+    if(lookup(self, key) != NULL){
+        return 1;
+    }
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject*
+EnvironObject_iter(EnvironObject *self)
+{
+    if(materialize_all(self) == -1){
+        return NULL;
+    }
+    return PyDict_Type.tp_iter((PyObject *)self);
+}
+
+static PyObject*
+EnvironObject_repr(EnvironObject *self)
+{
+    if(materialize_all(self) == -1){
+        return NULL;
+    }
+    return PyDict_Type.tp_repr((PyObject *)self);
+}
+
+static PyObject*
+EnvironObject_richcompare(PyObject *self, PyObject *other, int op)
+{
+    if(CheckEnvironObject(self) && materialize_all((EnvironObject *)self) == -1){
+        return NULL;
+    }
+    if(CheckEnvironObject(other) && materialize_all((EnvironObject *)other) == -1){
+        return NULL;
+    }
+    return PyDict_Type.tp_richcompare(self, other, op);
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+static PyObject*
+EnvironObject_or(PyObject *self, PyObject *other)
+{
+    if(CheckEnvironObject(self) && materialize_all((EnvironObject *)self) == -1){
+        return NULL;
+    }
+    if(CheckEnvironObject(other) && materialize_all((EnvironObject *)other) == -1){
+        return NULL;
+    }
+    return PyDict_Type.tp_as_number->nb_or(self, other);
+}
+
+static PyObject*
+EnvironObject_inplace_or(PyObject *self, PyObject *other)
+{
+    if(CheckEnvironObject(other) && materialize_all((EnvironObject *)other) == -1){
+        return NULL;
+    }
+    // materialize self too, updated keys must not be overwritten later
+    if(CheckEnvironObject(self) && materialize_all((EnvironObject *)self) == -1){
+        return NULL;
+    }
+    return PyDict_Type.tp_as_number->nb_inplace_or(self, other);
+}
+#endif
+
+static PyObject*
+EnvironObject_get(EnvironObject *self, PyObject *args)
+{
+    PyObject *key, *def = Py_None, *v;
+
+    if(!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def)){
+        return NULL;
+    }
+    v = lookup(self, key);
+    if(v == NULL){
+        if(PyErr_Occurred()){
+            return NULL;
+        }
+        v = def;
+    }
+    Py_INCREF(v);
+    return v;
+}
+
+#ifndef PY3
+static PyObject*
+EnvironObject_has_key(EnvironObject *self, PyObject *key)
+{
+    int ret = EnvironObject_contains(self, key);
+    if(ret == -1){
+        return NULL;
+    }
+    return PyBool_FromLong(ret);
+}
+#endif
+
+static PyObject*
+EnvironObject_reduce(EnvironObject *self, PyObject *unused)
+{
+    // pickle and copy as a plain dict
+    if(materialize_all(self) == -1){
+        return NULL;
+    }
+    return Py_BuildValue("O(N)", &PyDict_Type, PyDict_Copy((PyObject *)self));
+}
+
+static PyObject*
+call_dict_method(const char *name, PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *descr, *bound, *ret;
+
+    descr = PyObject_GetAttrString((PyObject *)&PyDict_Type, name);
+    if(descr == NULL){
+        return NULL;
+    }
+    bound = Py_TYPE(descr)->tp_descr_get(descr, self, (PyObject *)Py_TYPE(self));
+    Py_DECREF(descr);
+    if(bound == NULL){
+        return NULL;
+    }
+    ret = PyObject_Call(bound, args, kwargs);
+    Py_DECREF(bound);
+    return ret;
+}
+
+#define ENVIRON_DICT_METHOD(name) \
+static PyObject* \
+EnvironObject_##name(EnvironObject *self, PyObject *args, PyObject *kwargs) \
+{ \
+    if(materialize_all(self) == -1){ \
+        return NULL; \
+    } \
+    return call_dict_method(#name, (PyObject *)self, args, kwargs); \
+}
+
+ENVIRON_DICT_METHOD(keys)
+ENVIRON_DICT_METHOD(items)
+ENVIRON_DICT_METHOD(values)
+ENVIRON_DICT_METHOD(copy)
+ENVIRON_DICT_METHOD(pop)
+ENVIRON_DICT_METHOD(popitem)
+ENVIRON_DICT_METHOD(setdefault)
+ENVIRON_DICT_METHOD(update)
+ENVIRON_DICT_METHOD(clear)
+#if PY_VERSION_HEX >= 0x03080000
+ENVIRON_DICT_METHOD(__reversed__)
+#endif
+#ifndef PY3
+ENVIRON_DICT_METHOD(iterkeys)
+ENVIRON_DICT_METHOD(iteritems)
+ENVIRON_DICT_METHOD(itervalues)
+ENVIRON_DICT_METHOD(viewkeys)
+ENVIRON_DICT_METHOD(viewitems)
+ENVIRON_DICT_METHOD(viewvalues)
+#endif
+
+#define ENVIRON_DICT_METHOD_DEF(name) \
+    {#name, (PyCFunction)EnvironObject_##name, METH_VARARGS | METH_KEYWORDS, 0}
+
+static PyMethodDef EnvironObject_methods[] = {
+    {"get", (PyCFunction)EnvironObject_get, METH_VARARGS, 0},
+#ifndef PY3
+    {"has_key", (PyCFunction)EnvironObject_has_key, METH_O, 0},
+#endif
+    {"__reduce__", (PyCFunction)EnvironObject_reduce, METH_NOARGS, 0},
+    ENVIRON_DICT_METHOD_DEF(keys),
+    ENVIRON_DICT_METHOD_DEF(items),
+    ENVIRON_DICT_METHOD_DEF(values),
+    ENVIRON_DICT_METHOD_DEF(copy),
+    ENVIRON_DICT_METHOD_DEF(pop),
+    ENVIRON_DICT_METHOD_DEF(popitem),
+    ENVIRON_DICT_METHOD_DEF(setdefault),
+    ENVIRON_DICT_METHOD_DEF(update),
+    ENVIRON_DICT_METHOD_DEF(clear),
+#if PY_VERSION_HEX >= 0x03080000
+    ENVIRON_DICT_METHOD_DEF(__reversed__),
+#endif
+#ifndef PY3
+    ENVIRON_DICT_METHOD_DEF(iterkeys),
+    ENVIRON_DICT_METHOD_DEF(iteritems),
+    ENVIRON_DICT_METHOD_DEF(itervalues),
+    ENVIRON_DICT_METHOD_DEF(viewkeys),
+    ENVIRON_DICT_METHOD_DEF(viewitems),
+    ENVIRON_DICT_METHOD_DEF(viewvalues),
+#endif
+    {NULL, NULL}
+};
+
+static PyMappingMethods EnvironObject_as_mapping = {
+    (lenfunc)EnvironObject_length,             /*mp_length*/
+    (binaryfunc)EnvironObject_subscript,       /*mp_subscript*/
+    (objobjargproc)EnvironObject_ass_subscript,/*mp_ass_subscript*/
+};
+
+static PySequenceMethods EnvironObject_as_sequence = {
+    0,                                  /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)EnvironObject_contains, /* sq_contains */
+};
+
+#if PY_VERSION_HEX >= 0x03090000
+static PyNumberMethods EnvironObject_as_number = {
+    .nb_or = EnvironObject_or,
+    .nb_inplace_or = EnvironObject_inplace_or,
+};
+#endif
+
+PyTypeObject EnvironObjectType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                    /* ob_size */
+#endif
+    "meinheld.environ",             /*tp_name*/
+    sizeof(EnvironObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)EnvironObject_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    (reprfunc)EnvironObject_repr, /*tp_repr*/
+#if PY_VERSION_HEX >= 0x03090000
+    &EnvironObject_as_number,  /*tp_as_number*/
+#else
+    0,                         /*tp_as_number*/
+#endif
+    &EnvironObject_as_sequence, /*tp_as_sequence*/
+    &EnvironObject_as_mapping, /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Environ",                 /* tp_doc */
+    0,                       /* tp_traverse */
+    0,                       /* tp_clear */
+    EnvironObject_richcompare, /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    (getiterfunc)EnvironObject_iter, /*tp_iter */
+    0,                         /* tp_iternext */
+    EnvironObject_methods,     /* tp_methods */
+    0,                         /* tp_members */
+    0,                          /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                      /* tp_init */
+    0,                         /* tp_alloc */
+    0,                           /* tp_new */
+};
+
+int
+EnvironObject_Ready(void)
+{
+    EnvironObjectType.tp_base = &PyDict_Type;
+    if(PyType_Ready(&EnvironObjectType) < 0){
+        return -1;
+    }
+    remote_addr_key = NATIVE_FROMSTRING("REMOTE_ADDR");
+    remote_port_key = NATIVE_FROMSTRING("REMOTE_PORT");
+    empty_args = PyTuple_New(0);
+    if(remote_addr_key == NULL || remote_port_key == NULL || empty_args == NULL){
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef ENVIRON_H
+#define ENVIRON_H
+
+#include "meinheld.h"
+
+#define ENVIRON_INLINE_HEADERS 24
+#define ENVIRON_INLINE_BUF 1024
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t value_off;
+    uint32_t value_len;
+    uint8_t done;
+} environ_header;
+
+/**
+ * dict subclass, keeps the raw request headers in C and sets
+ * HTTP_* (and REMOTE_ADDR/REMOTE_PORT) items on first access.
+ */
+typedef struct {
+    PyDictObject dict;
+    char *buf;
+    uint32_t buf_len;
+    uint32_t buf_size;
+    environ_header *headers;
+    uint32_t num_headers;
+    uint32_t headers_size;
+    uint32_t pending;
+    uint8_t last_is_name;
+    uint8_t remote_pending;
+    int remote_port;
+    char remote_addr[48];
+    environ_header inline_headers[ENVIRON_INLINE_HEADERS];
+    char inline_buf[ENVIRON_INLINE_BUF];
+} EnvironObject;
+
+extern PyTypeObject EnvironObjectType;
+
+#define CheckEnvironObject(o) (Py_TYPE(o) == &EnvironObjectType)
+
+int EnvironObject_Ready(void);
+
+PyObject* EnvironObject_New(const char *remote_addr, int remote_port);
+
+int environ_add_name(PyObject *env, const char *buf, size_t len);
+
+int environ_add_value(PyObject *env, const char *buf, size_t len);
+
+int environ_set_content_keys(PyObject *env, PyObject *content_type_key, PyObject *content_length_key);
+
+PyObject* environ_get_item_string(PyObject *env, const char *key);
+
+int environ_get_string(PyObject *env, const char *key, char **buf, Py_ssize_t *len);
+
+#endif
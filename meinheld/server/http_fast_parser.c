@@ -0,0 +1,323 @@
+/**
+ * Request head parser modeled on picohttpparser
+ *
+ * https://github.com/h2o/picohttpparser
+ *
+ * It parses a complete request head into a fast_request in one pass,
+ * scanning URLs, header names and header values with SSE4.2/AVX2 when
+ * the CPU supports them. Anything unusual (obs-fold, absolute URI,
+ * unknown version, CTL in values ...) returns FAST_PARSE_FALLBACK and
+ * is left to http_parser, so both parsers accept the same requests.
+ */
+
+#include "http_fast_parser.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAST_PARSER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char* (*scan_func)(const char *buf, const char *buf_end);
+
+/* return the first byte in ranges, or where less than a block remains */
+static scan_func scan_url_fast = NULL;
+static scan_func scan_token_fast = NULL;
+static scan_func scan_value_fast = NULL;
+static const char *impl_name = "scalar";
+
+/* SP, CTL, DEL and non ASCII end the request target (same as strict http_parser) */
+static const char url_ranges[16] = "\x00\x20\x7f\xff";
+#define URL_RANGES_SIZE 4
+
+/* non tchar, '|' and '~' are rechecked by token_char_map */
+static const char token_ranges[16] = "\x00\x20\"\"(),,//:@[]{\xff";
+#define TOKEN_RANGES_SIZE 16
+
+/* CTL except HT, DEL */
+static const char value_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+#define VALUE_RANGES_SIZE 6
+
+static const char token_char_map[256] =
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\1\0\1\1\1\1\1\0\0\1\1\0\1\1\0"
+    "\1\1\1\1\1\1\1\1\1\1\0\0\0\0\0\0"
+    "\0\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1"
+    "\1\1\1\1\1\1\1\1\1\1\1\0\0\0\1\1"
+    "\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1"
+    "\1\1\1\1\1\1\1\1\1\1\1\0\1\0\1\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+#define IS_URL_CHAR(c) ((unsigned char)((c) - 0x21) < 0x5e)
+#define IS_VALUE_CHAR(c) ((unsigned char)(c) >= 0x20 ? (c) != 0x7f : (c) == '\t')
+
+#ifdef FAST_PARSER_X86
+
+__attribute__((target("sse4.2")))
+static inline const char *
+findchar_sse42(const char *buf, const char *buf_end, const char *ranges, int ranges_size)
+{
+    __m128i ranges16, b16;
+    int r;
+
+    ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+    while (buf_end - buf >= 16) {
+        b16 = _mm_loadu_si128((const __m128i *)buf);
+        r = _mm_cmpestri(ranges16, ranges_size, b16, 16,
+                _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+        if (r != 16) {
+            return buf + r;
+        }
+        buf += 16;
+    }
+    return buf;
+}
+
+__attribute__((target("sse4.2")))
+static const char *
+scan_url_sse42(const char *buf, const char *buf_end)
+{
+    return findchar_sse42(buf, buf_end, url_ranges, URL_RANGES_SIZE);
+}
+
+__attribute__((target("sse4.2")))
+static const char *
+scan_token_sse42(const char *buf, const char *buf_end)
+{
+    return findchar_sse42(buf, buf_end, token_ranges, TOKEN_RANGES_SIZE);
+}
+
+__attribute__((target("sse4.2")))
+static const char *
+scan_value_sse42(const char *buf, const char *buf_end)
+{
+    return findchar_sse42(buf, buf_end, value_ranges, VALUE_RANGES_SIZE);
+}
+
+/*
+ * AVX2 has no range compare, so the URL and value classes are written
+ * out with unsigned min compares. 32 byte blocks first, the rest goes
+ * through SSE4.2 (every AVX2 CPU has it). Header names are short and
+ * their class is irregular, they always use SSE4.2.
+ */
+__attribute__((target("avx2,sse4.2")))
+static const char *
+scan_url_avx2(const char *buf, const char *buf_end)
+{
+    const __m256i lo = _mm256_set1_epi8(0x21);
+    const __m256i span = _mm256_set1_epi8(0x7e - 0x21);
+    __m256i b32, d;
+    unsigned int mask;
+
+    while (buf_end - buf >= 32) {
+        b32 = _mm256_loadu_si256((const __m256i *)buf);
+        // 0x21 <= c <= 0x7e
+        d = _mm256_sub_epi8(b32, lo);
+        mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d));
+        if (mask != 0) {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+    return findchar_sse42(buf, buf_end, url_ranges, URL_RANGES_SIZE);
+}
+
+__attribute__((target("avx2,sse4.2")))
+static const char *
+scan_value_avx2(const char *buf, const char *buf_end)
+{
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i ht = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    __m256i b32, m;
+    unsigned int mask;
+
+    while (buf_end - buf >= 32) {
+        b32 = _mm256_loadu_si256((const __m256i *)buf);
+        // (c <= 0x1f && c != HT) || c == DEL
+        m = _mm256_cmpeq_epi8(_mm256_min_epu8(b32, ctl), b32);
+        m = _mm256_andnot_si256(_mm256_cmpeq_epi8(b32, ht), m);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b32, del));
+        mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+    return findchar_sse42(buf, buf_end, value_ranges, VALUE_RANGES_SIZE);
+}
+
+#endif
+
+void
+fast_parser_init(void)
+{
+#ifdef FAST_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_url_fast = scan_url_avx2;
+        scan_token_fast = scan_token_sse42;
+        scan_value_fast = scan_value_avx2;
+        impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_url_fast = scan_url_sse42;
+        scan_token_fast = scan_token_sse42;
+        scan_value_fast = scan_value_sse42;
+        impl_name = "sse4.2";
+    }
+#endif
+    DEBUG("fast parser %s", impl_name);
+}
+
+const char*
+fast_parser_impl(void)
+{
+    return impl_name;
+}
+
+static inline const char *
+scan_url(const char *p, const char *end)
+{
+    if (scan_url_fast) {
+        p = scan_url_fast(p, end);
+    }
+    while (p < end && IS_URL_CHAR(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static inline const char *
+scan_token(const char *p, const char *end)
+{
+    if (scan_token_fast) {
+        p = scan_token_fast(p, end);
+    }
+    while (p < end && token_char_map[(unsigned char)*p]) {
+        p++;
+    }
+    return p;
+}
+
+static inline const char *
+scan_value(const char *p, const char *end)
+{
+    if (scan_value_fast) {
+        p = scan_value_fast(p, end);
+    }
+    while (p < end && IS_VALUE_CHAR(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Parse "METHOD /path HTTP/1.x\r\n" + headers + "\r\n".
+ *
+ * Returns the length of the request head, FAST_PARSE_INCOMPLETE when
+ * the head is not in buf yet, or FAST_PARSE_FALLBACK.
+ * Leading and trailing whitespace handling of header values follows
+ * http_parser (leading SP/HT stripped, trailing kept).
+ */
+int
+fast_parse_request(const char *buf, size_t len, fast_request *r)
+{
+    const char *p = buf, *end = buf + len, *s;
+    fast_header *h;
+
+    r->num_headers = 0;
+
+    // http_parser skips CRLF between requests
+    while (p < end && (*p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    s = p;
+    while (p < end && *p >= 'A' && *p <= 'Z') {
+        p++;
+    }
+    if (p == end) {
+        return FAST_PARSE_INCOMPLETE;
+    }
+    if (*p != ' ' || p == s) {
+        return FAST_PARSE_FALLBACK;
+    }
+    r->method = s;
+    r->method_len = p - s;
+    p++;
+
+    s = p;
+    p = scan_url(p, end);
+    if (p == end) {
+        return FAST_PARSE_INCOMPLETE;
+    }
+    if (*p != ' ' || *s != '/') {
+        return FAST_PARSE_FALLBACK;
+    }
+    r->path = s;
+    r->path_len = p - s;
+    p++;
+
+    if (end - p < 10) {
+        return FAST_PARSE_INCOMPLETE;
+    }
+    if (memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1')
+            || p[8] != '\r' || p[9] != '\n') {
+        return FAST_PARSE_FALLBACK;
+    }
+    r->minor_version = p[7] - '0';
+    p += 10;
+
+    for (;;) {
+        if (end - p < 2) {
+            return FAST_PARSE_INCOMPLETE;
+        }
+        if (*p == '\r') {
+            if (p[1] != '\n') {
+                return FAST_PARSE_FALLBACK;
+            }
+            return (int)(p + 2 - buf);
+        }
+        if (unlikely(r->num_headers == LIMIT_REQUEST_FIELDS)) {
+            // let http_parser reply 400
+            return FAST_PARSE_FALLBACK;
+        }
+        h = &r->headers[r->num_headers];
+
+        // obs-fold lines start with SP/HT and stop here too
+        s = p;
+        p = scan_token(p, end);
+        if (p == end) {
+            return FAST_PARSE_INCOMPLETE;
+        }
+        if (*p != ':' || p == s) {
+            return FAST_PARSE_FALLBACK;
+        }
+        h->name = s;
+        h->name_len = p - s;
+        p++;
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        s = p;
+        p = scan_value(p, end);
+        if (end - p < 2) {
+            return FAST_PARSE_INCOMPLETE;
+        }
+        if (p[0] != '\r' || p[1] != '\n') {
+            return FAST_PARSE_FALLBACK;
+        }
+        h->value = s;
+        h->value_len = p - s;
+        p += 2;
+        r->num_headers++;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef HTTP_FAST_PARSER_H
+#define HTTP_FAST_PARSER_H
+
+#include "meinheld.h"
+#include "request.h"
+
+#define FAST_PARSE_INCOMPLETE -2
+#define FAST_PARSE_FALLBACK -1
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} fast_header;
+
+typedef struct {
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    int minor_version;
+    fast_header headers[LIMIT_REQUEST_FIELDS];
+    size_t num_headers;
+} fast_request;
+
+void fast_parser_init(void);
+
+const char* fast_parser_impl(void);
+
+int fast_parse_request(const char *buf, size_t len, fast_request *r);
+
+#endif
@@ -3,8 +3,13 @@
 #include "response.h"
 #include "input.h"
 #include "util.h"
+#include "http_fast_parser.h"
+#include "environ.h"
 
 #define MAXFREELIST 1024
+#define STREAM_BODY_BUF_SIZE 1024 * 8
+#define STREAM_BODY_READ_SIZE 1024 * 64
+#define SPLICE_BODY_SIZE 1024 * 1024
 
 /**
  * environ spec.
@@ -84,6 +89,7 @@ static PyObject *path_info_key;
 static PyObject *query_string_key;
 static PyObject *request_method_key;
 static PyObject *client_key;
+static PyObject *form_key;
 
 static PyObject *content_type_key;
 static PyObject *content_length_key;
@@ -117,6 +123,88 @@ static PyObject *http_method_merge;
 static http_parser *http_parser_free_list[MAXFREELIST];
 static int numfree = 0;
 
+// stands for body bytes spliced to the spool file, the parser only counts them
+static char spliced_body[SPLICE_BODY_SIZE];
+
+/**
+ * static environ items (wsgi.*, SCRIPT_NAME, SERVER_NAME ...).
+ * Every environ starts as a PyDict_Copy of it. The template is presized
+ * for a whole request, the copy keeps that size so adding the request
+ * items does not resize.
+ */
+#define ENVIRON_PRESIZE 40
+
+static PyObject *environ_template = NULL;
+
+// http_parser state between messages
+static unsigned char start_req_state = 0;
+
+#ifdef PY3
+# define NATIVE_LENGTH PyUnicode_GET_LENGTH
+#else
+# define NATIVE_LENGTH PyBytes_GET_SIZE
+#endif
+
+/**
+ * environ keys of common request headers.
+ *
+ * common_header_hash() is collision free for this list (checked at
+ * setup), so a lookup is one hash and one strncasecmp.
+ * Content-Type and Content-Length map to CONTENT_TYPE/CONTENT_LENGTH.
+ */
+typedef struct {
+    const char *name;
+    size_t len;
+    PyObject *key;
+} header_key;
+
+static header_key common_headers[] = {
+    {"host"}, {"user-agent"}, {"accept"}, {"accept-language"},
+    {"accept-encoding"}, {"accept-charset"}, {"connection"}, {"cookie"},
+    {"content-type"}, {"content-length"}, {"cache-control"}, {"pragma"},
+    {"referer"}, {"origin"}, {"upgrade-insecure-requests"},
+    {"if-modified-since"}, {"if-none-match"}, {"if-match"},
+    {"if-unmodified-since"}, {"if-range"}, {"range"}, {"authorization"},
+    {"x-forwarded-for"}, {"x-forwarded-proto"}, {"x-forwarded-host"},
+    {"x-forwarded-port"}, {"x-real-ip"}, {"x-requested-with"},
+    {"x-request-id"}, {"dnt"}, {"te"}, {"via"}, {"forwarded"}, {"expect"},
+    {"keep-alive"}, {"sec-fetch-site"}, {"sec-fetch-mode"},
+    {"sec-fetch-dest"}, {"sec-fetch-user"}, {"sec-ch-ua"},
+    {"sec-ch-ua-mobile"}, {"sec-ch-ua-platform"}, {"sec-websocket-key"},
+    {"sec-websocket-version"}, {"sec-websocket-extensions"},
+    {"sec-websocket-protocol"}, {"upgrade"}, {"transfer-encoding"},
+    {"content-encoding"}, {"x-csrf-token"}, {"priority"}, {"purpose"},
+    {"x-amzn-trace-id"},
+    {NULL}
+};
+
+#define COMMON_HEADER_SLOTS 128
+
+static header_key *common_header_slots[COMMON_HEADER_SLOTS];
+
+/**
+ * LRU of keys for the other headers, keyed by the HTTP_* name.
+ */
+#define HEADER_KEY_LRU_SIZE 64
+#define HEADER_KEY_LRU_BUCKETS 128
+#define HEADER_KEY_MAX 64
+
+typedef struct {
+    uint32_t hash;
+    size_t len;
+    char name[HEADER_KEY_MAX];
+    PyObject *key;
+    int prev;
+    int next;
+    int chain;
+} header_key_entry;
+
+static header_key_entry header_key_lru[HEADER_KEY_LRU_SIZE];
+static int header_key_buckets[HEADER_KEY_LRU_BUCKETS];
+static int header_key_head = -1;
+static int header_key_tail = -1;
+static int header_key_used = 0;
+
 void
 parser_list_fill(void)
 {
@@ -170,17 +258,24 @@ new_environ(client_t *client)
 {
     PyObject *object, *environ;
 
-    environ = PyDict_New();
-    PyDict_SetItem(environ, version_key, version_val);
-    PyDict_SetItem(environ, scheme_key, scheme_val);
-    PyDict_SetItem(environ, errors_key, errors_val);
-    PyDict_SetItem(environ, multithread_key, multithread_val);
-    PyDict_SetItem(environ, multiprocess_key, multiprocess_val);
-    PyDict_SetItem(environ, run_once_key, run_once_val);
-    PyDict_SetItem(environ, script_key, empty_string);
-    PyDict_SetItem(environ, server_name_key, server_name_val);
-    PyDict_SetItem(environ, server_port_key, server_port_val);
-    PyDict_SetItem(environ, file_wrapper_key, file_wrapper_val);
+    if(use_lazy_environ){
+        environ = EnvironObject_New(client->remote_addr, client->remote_port);
+        if(environ == NULL){
+            return NULL;
+        }
+        if(PyDict_Update(environ, environ_template) == -1){
+            Py_DECREF(environ);
+            return NULL;
+        }
+        // REMOTE_ADDR, REMOTE_PORT on access
+        return environ;
+    }
+
+    // clones the presized keys table, no resize while parsing
+    environ = PyDict_Copy(environ_template);
+    if(environ == NULL){
+        return NULL;
+    }
 
     object = NATIVE_FROMSTRING(client->remote_addr);
     PyDict_SetItem(environ, remote_addr_key, object);
@@ -225,6 +320,7 @@ urldecode(char *buf, int len)
     return t - s0;
 }
 
+#ifndef PY3
 static PyObject*
 concat_string(PyObject *o, const char *buf, size_t len)
 {
@@ -245,6 +341,39 @@ concat_string(PyObject *o, const char *buf, size_t len)
     Py_DECREF(o);
     return ret;
 }
+#endif
+
+static PyObject*
+concat_native(PyObject *o, const char *buf, size_t len)
+{
+#ifdef PY3
+    PyObject *s, *ret;
+
+    s = PyUnicode_DecodeLatin1(buf, len, NULL);
+    if(s == NULL){
+        return NULL;
+    }
+    ret = PyUnicode_Concat(o, s);
+    Py_DECREF(s);
+    if(ret != NULL){
+        Py_DECREF(o);
+    }
+    return ret;
+#else
+    return concat_string(o, buf, len);
+#endif
+}
+
+static int
+set_header(request *req)
+{
+    int ret;
+
+    ret = PyDict_SetItem(req->environ, req->field, req->value);
+    Py_CLEAR(req->field);
+    Py_CLEAR(req->value);
+    return ret;
+}
 
 static int
 replace_env_key(PyObject* dict, PyObject* old_key, PyObject* new_key)
@@ -362,15 +491,18 @@ set_path(PyObject *env, char *buf, int len)
     }
 }
 
-static PyObject*
-get_http_header_key(const char *s, int len)
+static inline unsigned int
+common_header_hash(const char *s, size_t len)
 {
-    PyObject *obj;
-    char *dest;
-    char c;
+    const unsigned char *u = (const unsigned char *)s;
+    return (len * 30 + (u[0] | 0x20) * 6 + (u[len - 1] | 0x20) * 28
+            + (u[len - 2] | 0x20) * 11) & (COMMON_HEADER_SLOTS - 1);
+}
 
-    obj = PyBytes_FromStringAndSize(NULL, len + prefix_len);
-    dest = (char*)PyBytes_AS_STRING(obj);
+static void
+make_http_header_key(char *dest, const char *s, size_t len)
+{
+    char c;
 
     *dest++ = 'H';
     *dest++ = 'T';
@@ -388,10 +520,138 @@ get_http_header_key(const char *s, int len)
             *dest++ = c;
         }
     }
+}
+
+static PyObject*
+new_key(const char *s, size_t len)
+{
+    PyObject *obj;
 
+    obj = NATIVE_FROMSTRINGANDSIZE(s, len);
+    if(obj == NULL){
+        return NULL;
+    }
+#ifdef PY3
+    PyUnicode_InternInPlace(&obj);
+#else
+    PyString_InternInPlace(&obj);
+#endif
     return obj;
 }
 
+static void
+lru_unlink(int i)
+{
+    header_key_entry *e = &header_key_lru[i];
+
+    if(e->prev != -1){
+        header_key_lru[e->prev].next = e->next;
+    }else{
+        header_key_head = e->next;
+    }
+    if(e->next != -1){
+        header_key_lru[e->next].prev = e->prev;
+    }else{
+        header_key_tail = e->prev;
+    }
+}
+
+static void
+lru_push_front(int i)
+{
+    header_key_entry *e = &header_key_lru[i];
+
+    e->prev = -1;
+    e->next = header_key_head;
+    if(header_key_head != -1){
+        header_key_lru[header_key_head].prev = i;
+    }
+    header_key_head = i;
+    if(header_key_tail == -1){
+        header_key_tail = i;
+    }
+}
+
+static int
+lru_evict(void)
+{
+    int i = header_key_tail, *p;
+    header_key_entry *e = &header_key_lru[i];
+
+    p = &header_key_buckets[e->hash & (HEADER_KEY_LRU_BUCKETS - 1)];
+    while(*p != i){
+        p = &header_key_lru[*p].chain;
+    }
+    *p = e->chain;
+    lru_unlink(i);
+    Py_CLEAR(e->key);
+    return i;
+}
+
+PyObject*
+get_http_header_key(const char *s, size_t len)
+{
+    header_key *k;
+    header_key_entry *e;
+    PyObject *key;
+    char name[HEADER_KEY_MAX];
+    size_t j, n = len + prefix_len;
+    uint32_t hash = 2166136261U;
+    int i, *bucket;
+
+    if(likely(len >= 2)){
+        k = common_header_slots[common_header_hash(s, len)];
+        if(k && k->len == len && !strncasecmp(k->name, s, len)){
+            Py_INCREF(k->key);
+            return k->key;
+        }
+    }
+
+    if(unlikely(n > HEADER_KEY_MAX)){
+        char temp[n];
+        make_http_header_key(temp, s, len);
+        return NATIVE_FROMSTRINGANDSIZE(temp, n);
+    }
+
+    make_http_header_key(name, s, len);
+    for(j = 0; j < n; j++){
+        hash = (hash ^ (unsigned char)name[j]) * 16777619U;
+    }
+    bucket = &header_key_buckets[hash & (HEADER_KEY_LRU_BUCKETS - 1)];
+    for(i = *bucket; i != -1; i = e->chain){
+        e = &header_key_lru[i];
+        if(e->hash == hash && e->len == n && !memcmp(e->name, name, n)){
+            if(i != header_key_head){
+                lru_unlink(i);
+                lru_push_front(i);
+            }
+            Py_INCREF(e->key);
+            return e->key;
+        }
+    }
+
+    key = new_key(name, n);
+    if(key == NULL){
+        return NULL;
+    }
+    if(header_key_used < HEADER_KEY_LRU_SIZE){
+        i = header_key_used++;
+    }else{
+        i = lru_evict();
+    }
+    e = &header_key_lru[i];
+    e->key = key;
+    e->hash = hash;
+    e->len = n;
+    memcpy(e->name, name, n);
+    e->chain = *bucket;
+    *bucket = i;
+    lru_push_front(i);
+
+    Py_INCREF(e->key);
+    return e->key;
+}
+
 static void
 key_upper(char *s, const char *key, size_t len)
 {
@@ -414,24 +674,43 @@ key_upper(char *s, const char *key, size_t len)
 static int
 write_body2file(request *req, const char *buffer, size_t buffer_len)
 {
-
-    FILE *tmp = (FILE *)req->body;
-    fwrite(buffer, 1, buffer_len, tmp);
+    const char *p = buffer;
+    size_t left = buffer_len;
+    ssize_t w;
+
+    // spliced data is already in the file, see body_spool_space
+    while(buffer != spliced_body && left > 0){
+        w = write(req->body_fd, p, left);
+        if(w == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            DEBUG("write_body2file error %d", errno);
+            return -1;
+        }
+        p += w;
+        left -= w;
+    }
     req->body_readed += buffer_len;
     DEBUG("write_body2file %d bytes", (int)buffer_len);
-    return req->body_readed;
-
+    return 0;
 }
 
 static int
 write_body2mem(request *req, const char *buf, size_t buf_len)
 {
     buffer_t *body = (buffer_t*)req->body;
-    write2buf(body, buf, buf_len);
+
+    if(buf == body->buf + body->len){
+        // read into the buffer, see body_read_space
+        body->len += buf_len;
+    }else{
+        write2buf(body, buf, buf_len);
+    }
 
     req->body_readed += buf_len;
     DEBUG("write_body2mem %d bytes", (int)buf_len);
-    return req->body_readed;
+    return 0;
 }
 
 static int
@@ -451,11 +730,20 @@ get_client(http_parser *p)
     return (client_t *)p->data;
 }
 
+/*
+ * the request being parsed, client->current_req is the one being handled
+ * and still parsed while its body is streamed
+ */
 static request *
 get_current_request(http_parser *p)
 {
     client_t *client =  (client_t *)p->data;
-    return client->current_req;
+    request *req = client->current_req;
+
+    if(req && req->body_type == BODY_TYPE_STREAM && !req->complete){
+        return req;
+    }
+    return client->request_queue->tail;
 }
 
 static int
@@ -472,71 +760,118 @@ message_begin_cb(http_parser *p)
         return -1;
     }
     req->start_msec = current_msec;
-    client->current_req = req;
     environ = new_environ(client);
+    if(environ == NULL){
+        free_request(req);
+        return -1;
+    }
     client->complete = 0;
     /* client->bad_request_code = 0; */
     /* client->body_type = BODY_TYPE_NONE; */
     /* client->body_readed = 0; */
     /* client->body_length = 0; */
     req->environ = environ;
-    push_request(client->request_queue, client->current_req);
+    push_request(client->request_queue, req);
     return 0;
 }
 
 
+static int
+lazy_header_field(request *req, const char *buf, size_t len)
+{
+    int ret;
+
+    if(req->last_header_element != FIELD){
+        if(LIMIT_REQUEST_FIELDS <= req->num_headers){
+            req->bad_request_code = 400;
+            return -1;
+        }
+        req->num_headers++;
+    }
+    ret = environ_add_name(req->environ, buf, len);
+    if(unlikely(ret == -1)){
+        req->bad_request_code = 500;
+        return -1;
+    }
+    if(unlikely(ret + prefix_len > LIMIT_REQUEST_FIELD_SIZE)){
+        req->bad_request_code = 400;
+        return -1;
+    }
+    req->last_header_element = FIELD;
+    return 0;
+}
+
+static int
+lazy_header_value(request *req, const char *buf, size_t len)
+{
+    int ret;
+
+    ret = environ_add_value(req->environ, buf, len);
+    if(unlikely(ret == -1)){
+        req->bad_request_code = 500;
+        return -1;
+    }
+    if(unlikely(ret > LIMIT_REQUEST_FIELD_SIZE)){
+        req->bad_request_code = 400;
+        return -1;
+    }
+    req->last_header_element = VALUE;
+    return 0;
+}
+
 static int
 header_field_cb(http_parser *p, const char *buf, size_t len)
 {
     request *req = get_current_request(p);
-    PyObject *env = NULL, *obj = NULL;
-#ifdef PY3
-    char *c1, *c2;
-    PyObject *f, *v;
-#endif
+    PyObject *obj = NULL;
     /* DEBUG("field key:%.*s", (int)len, buf); */
 
+    if(CheckEnvironObject(req->environ)){
+        return lazy_header_field(req, buf, len);
+    }
+
     if(req->last_header_element != FIELD){
-        env = req->environ;
         if(LIMIT_REQUEST_FIELDS <= req->num_headers){
             req->bad_request_code = 400;
             return -1;
         }
-#ifdef PY3
-        //TODO CHECK ERROR 
-        c1 = PyBytes_AS_STRING(req->field);
-        f = PyUnicode_DecodeLatin1(c1, strlen(c1), NULL);
-        c2 = PyBytes_AS_STRING(req->value);
-        v = PyUnicode_DecodeLatin1(c2, strlen(c2), NULL);
-        PyDict_SetItem(env, f, v);
-        Py_DECREF(f);
-        Py_DECREF(v);
-#else
-        PyDict_SetItem(env, req->field, req->value);
-#endif
-        Py_DECREF(req->field);
-        Py_DECREF(req->value);
-        req->field = NULL;
-        req->value = NULL;
+        if(unlikely(set_header(req) == -1)){
+            req->bad_request_code = 500;
+            return -1;
+        }
         req->num_headers++;
     }
 
     if(likely(req->field == NULL)){
+        if(unlikely(len + prefix_len > LIMIT_REQUEST_FIELD_SIZE)){
+            req->bad_request_code = 400;
+            return -1;
+        }
         obj = get_http_header_key(buf, len);
     }else{
+        // name split across reads
         char temp[len];
+        if(unlikely(NATIVE_LENGTH(req->field) + len > LIMIT_REQUEST_FIELD_SIZE)){
+            req->bad_request_code = 400;
+            return -1;
+        }
+        if(req->field == content_type_key){
+            Py_DECREF(req->field);
+            req->field = h_content_type_key;
+            Py_INCREF(req->field);
+        }else if(req->field == content_length_key){
+            Py_DECREF(req->field);
+            req->field = h_content_length_key;
+            Py_INCREF(req->field);
+        }
         key_upper(temp, buf, len);
-        obj = concat_string(req->field, temp, len);
+        obj = concat_native(req->field, temp, len);
     }
 
     if(unlikely(obj == NULL)){
         req->bad_request_code = 500;
         return -1;
     }
-    if(unlikely(PyBytes_GET_SIZE(obj) > LIMIT_REQUEST_FIELD_SIZE)){
-        req->bad_request_code = 400;
-        return -1;
-    }
 
     req->field = obj;
     req->last_header_element = FIELD;
@@ -550,20 +885,32 @@ header_value_cb(http_parser *p, const char *buf, size_t len)
     PyObject *obj;
 
     /* DEBUG("field value:%.*s", (int)len, buf); */
+    if(CheckEnvironObject(req->environ)){
+        return lazy_header_value(req, buf, len);
+    }
+
     if(likely(req->value== NULL)){
+        if(unlikely(len > LIMIT_REQUEST_FIELD_SIZE)){
+            req->bad_request_code = 400;
+            return -1;
+        }
+#ifdef PY3
+        obj = PyUnicode_DecodeLatin1(buf, len, NULL);
+#else
         obj = PyBytes_FromStringAndSize(buf, len);
+#endif
     }else{
-        obj = concat_string(req->value, buf, len);
+        if(unlikely(NATIVE_LENGTH(req->value) + len > LIMIT_REQUEST_FIELD_SIZE)){
+            req->bad_request_code = 400;
+            return -1;
+        }
+        obj = concat_native(req->value, buf, len);
     }
 
     if(unlikely(obj == NULL)){
         req->bad_request_code = 500;
         return -1; 
     }
-    if(unlikely(PyBytes_GET_SIZE(obj) > LIMIT_REQUEST_FIELD_SIZE)){
-        req->bad_request_code = 400;
-        return -1;
-    }
 
     req->value = obj;
     req->last_header_element = VALUE;
@@ -602,6 +949,7 @@ static int
 body_cb(http_parser *p, const char *buf, size_t len)
 {
     request *req = get_current_request(p);
+    int ret;
     DEBUG("body_cb");
 
     if(max_content_length < req->body_readed + len){
@@ -610,6 +958,15 @@ body_cb(http_parser *p, const char *buf, size_t len)
         req->bad_request_code = 413;
         return -1;
     }
+    if(req->form){
+        req->body_readed += len;
+        ret = multipart_execute(req->form, buf, len);
+        if(ret != 0){
+            req->bad_request_code = ret;
+            return -1;
+        }
+        return 0;
+    }
     if(req->body_type == BODY_TYPE_NONE){
         if(req->body_length == 0){
             //Length Required
@@ -618,24 +975,26 @@ body_cb(http_parser *p, const char *buf, size_t len)
         }
         if(req->body_length > client_body_buffer_size){
             //large size request
-            FILE *tmp = tmpfile();
-            if(tmp < 0){
+            req->body_fd = open_spool_file();
+            if(req->body_fd == -1){
                 req->bad_request_code = 500;
                 return -1;
             }
-
-            req->body = tmp;
             req->body_type = BODY_TYPE_TMPFILE;
             DEBUG("BODY_TYPE_TMPFILE");
         }else{
             //default memory stream
             DEBUG("client->body_length %d", req->body_length);
-            req->body = new_buffer(req->body_length, 0);
+            // +1, a full buffer is grown by write2buf
+            req->body = new_buffer(req->body_length + 1, 0);
             req->body_type = BODY_TYPE_BUFFER;
             DEBUG("BODY_TYPE_BUFFER");
         }
     }
-    write_body(req, buf, len);
+    if(write_body(req, buf, len) == -1){
+        req->bad_request_code = 500;
+        return -1;
+    }
     return 0;
 }
 
@@ -645,13 +1004,17 @@ headers_complete_cb(http_parser *p)
     PyObject *obj;
     int ret;
     uint64_t content_length = 0;
+    char *type;
+    Py_ssize_t type_len;
+    const char *boundary;
+    size_t boundary_len;
 
     client_t *client = get_client(p);
-    request *req = client->current_req;
+    request *req = get_current_request(p);
     PyObject *env = req->environ;
     
     DEBUG("should keep alive %d", http_should_keep_alive(p));
-    client->keep_alive = http_should_keep_alive(p);
+    req->keep_alive = http_should_keep_alive(p);
 
     if(p->content_length != ULLONG_MAX){
         content_length = p->content_length;
@@ -689,25 +1052,16 @@ headers_complete_cb(http_parser *p)
     }
     req->path = NULL;
 
+    if(CheckEnvironObject(env)){
+        ret = environ_set_content_keys(env, content_type_key, content_length_key);
+        if(unlikely(ret == -1)){
+            return -1;
+        }
+    }
+
     //Last header
     if(likely(req->field && req->value)){
-
-#ifdef PY3
-        //TODO CHECK ERROR 
-        char *c1 = PyBytes_AS_STRING(req->field);
-        PyObject *f = PyUnicode_DecodeLatin1(c1, strlen(c1), NULL);
-        char *c2 = PyBytes_AS_STRING(req->value);
-        PyObject *v = PyUnicode_DecodeLatin1(c2, strlen(c2), NULL);
-        PyDict_SetItem(env, f, v);
-        Py_DECREF(f);
-        Py_DECREF(v);
-#else
-        PyDict_SetItem(env, req->field, req->value);
-#endif
-        Py_DECREF(req->field);
-        Py_DECREF(req->value);
-        req->field = NULL;
-        req->value = NULL;
+        ret = set_header(req);
         if(unlikely(ret == -1)){
             return -1;
         }
@@ -794,6 +1148,23 @@ headers_complete_cb(http_parser *p)
     req->body_length = content_length;
     /* client->current_req = NULL; */
 
+    if(use_form_parser && !p->upgrade && (content_length > 0 || (p->flags & F_CHUNKED)) &&
+            environ_get_string(env, "CONTENT_TYPE", &type, &type_len) &&
+            multipart_boundary(type, type_len, &boundary, &boundary_len)){
+        // parsed as it arrives, the app gets meinheld.form
+        req->form = new_multipart_parser(boundary, boundary_len);
+        if(req->form == NULL){
+            req->bad_request_code = 500;
+            return -1;
+        }
+        DEBUG("multipart/form-data");
+    }else if(use_streaming_input && !p->upgrade && (content_length > 0 || (p->flags & F_CHUNKED))){
+        // the app runs now, wsgi.input reads the body from the socket
+        req->body = new_buffer(STREAM_BODY_BUF_SIZE, 0);
+        req->body_type = BODY_TYPE_STREAM;
+        DEBUG("BODY_TYPE_STREAM");
+    }
+
     //keep client data
     obj = ClientObject_New(client);
     if(unlikely(obj == NULL)){
@@ -813,9 +1184,31 @@ int
 message_complete_cb(http_parser *p)
 {
     client_t *client = get_client(p);
+    request *req = get_current_request(p);
+    PyObject *form;
+    int ret;
+
     DEBUG("message_complete_cb");
     client->complete = 1;
     client->upgrade = p->upgrade;
+    req->complete = 1;
+
+    if(req->form){
+        form = multipart_finish(req->form);
+        free_multipart_parser(req->form);
+        req->form = NULL;
+        if(form == NULL){
+            DEBUG("set request code %d", 400);
+            req->bad_request_code = 400;
+            return -1;
+        }
+        ret = PyDict_SetItem(req->environ, form_key, form);
+        Py_DECREF(form);
+        if(ret == -1){
+            req->bad_request_code = 500;
+            return -1;
+        }
+    }
 
     /* request *req = client->request_queue->tail; */
     /* req->body = client->body; */
@@ -835,6 +1228,145 @@ static http_parser_settings settings =
   };
 
 
+static int
+fast_method(const char *m, size_t len)
+{
+    switch (len) {
+        case 3:
+            if (!memcmp(m, "GET", 3)) {
+                return HTTP_GET;
+            } else if (!memcmp(m, "PUT", 3)) {
+                return HTTP_PUT;
+            }
+            break;
+        case 4:
+            if (!memcmp(m, "POST", 4)) {
+                return HTTP_POST;
+            } else if (!memcmp(m, "HEAD", 4)) {
+                return HTTP_HEAD;
+            }
+            break;
+        case 5:
+            if (!memcmp(m, "PATCH", 5)) {
+                return HTTP_PATCH;
+            }
+            break;
+        case 6:
+            if (!memcmp(m, "DELETE", 6)) {
+                return HTTP_DELETE;
+            }
+            break;
+        case 7:
+            if (!memcmp(m, "OPTIONS", 7)) {
+                return HTTP_OPTIONS;
+            }
+            break;
+        default:
+            break;
+    }
+    return -1;
+}
+
+#define HEADER_IS(h, s) \
+    ((h)->name_len == sizeof(s) - 1 && !strncasecmp((h)->name, s, sizeof(s) - 1))
+
+#define VALUE_IS(h, s) \
+    ((h)->value_len == sizeof(s) - 1 && !strncasecmp((h)->value, s, sizeof(s) - 1))
+
+/**
+ * Parse one whole request (head and Content-Length body) with the fast
+ * parser and feed the http_parser callbacks.
+ * Returns consumed bytes, 0 when http_parser should take over
+ * (incomplete data, chunked, upgrade ...) or -1 on callback error.
+ */
+static int
+fast_execute(http_parser *p, const char *data, size_t len)
+{
+    fast_request r;
+    fast_header *h;
+    int head_len, method;
+    size_t i;
+    unsigned char flags = 0;
+    uint64_t content_length = ULLONG_MAX;
+    const char *c, *cend;
+
+    head_len = fast_parse_request(data, len, &r);
+    if (head_len <= 0) {
+        return 0;
+    }
+    method = fast_method(r.method, r.method_len);
+    if (method < 0) {
+        return 0;
+    }
+
+    for (i = 0; i < r.num_headers; i++) {
+        h = &r.headers[i];
+        if (HEADER_IS(h, "content-length")) {
+            if (h->value_len == 0 || h->value_len > 18) {
+                return 0;
+            }
+            content_length = 0;
+            for (c = h->value, cend = h->value + h->value_len; c < cend; c++) {
+                if (*c < '0' || *c > '9') {
+                    return 0;
+                }
+                content_length = content_length * 10 + (*c - '0');
+            }
+        } else if (HEADER_IS(h, "connection")) {
+            if (h->value_len > 0 && (h->value[h->value_len - 1] == ' ' ||
+                        h->value[h->value_len - 1] == '\t')) {
+                // trailing OWS, let http_parser decide keep-alive
+                return 0;
+            }
+            if (VALUE_IS(h, "keep-alive")) {
+                flags |= F_CONNECTION_KEEP_ALIVE;
+            } else if (VALUE_IS(h, "close")) {
+                flags |= F_CONNECTION_CLOSE;
+            }
+        } else if (HEADER_IS(h, "transfer-encoding") || HEADER_IS(h, "upgrade")) {
+            return 0;
+        }
+    }
+    if (content_length != ULLONG_MAX && content_length > len - head_len) {
+        // stream the body with http_parser
+        return 0;
+    }
+
+    p->method = method;
+    p->http_major = 1;
+    p->http_minor = r.minor_version;
+    p->flags = flags;
+    p->content_length = content_length;
+    p->upgrade = 0;
+
+    if (message_begin_cb(p) != 0) {
+        return -1;
+    }
+    if (url_cb(p, r.path, r.path_len) != 0) {
+        return -1;
+    }
+    for (i = 0; i < r.num_headers; i++) {
+        h = &r.headers[i];
+        if (header_field_cb(p, h->name, h->name_len) != 0) {
+            return -1;
+        }
+        if (header_value_cb(p, h->value, h->value_len) != 0) {
+            return -1;
+        }
+    }
+    if (headers_complete_cb(p) != 0) {
+        return -1;
+    }
+    if (content_length != ULLONG_MAX && content_length > 0) {
+        if (body_cb(p, data + head_len, content_length) != 0) {
+            return -1;
+        }
+        head_len += content_length;
+    }
+    message_complete_cb(p);
+    return head_len;
+}
+
 static PyMethodDef method = {"file_wrapper", (PyCFunction)file_wrapper, METH_VARARGS, 0};
 
 int
@@ -849,6 +1381,7 @@ init_parser(client_t *cli, const char *name, const short port)
     /* memset(cli->http_parser, 0, sizeof(http_parser)); */
     http_parser_init(cli->http_parser, HTTP_REQUEST);
     cli->http_parser->data = cli;
+    start_req_state = cli->http_parser->state;
 
     return 0;
 }
@@ -856,15 +1389,183 @@ init_parser(client_t *cli, const char *name, const short port)
 size_t
 execute_parse(client_t *cli, const char *data, size_t len)
 {
+    size_t nread = 0;
+    int ret;
+
     cli->complete = 0;
-    return http_parser_execute(cli->http_parser, &settings, data, len);
+    if (use_fast_parser) {
+        // only between messages, http_parser owns partial ones
+        while (nread < len && cli->http_parser->state == start_req_state) {
+            ret = fast_execute(cli->http_parser, data + nread, len - nread);
+            if (ret < 0) {
+                return nread;
+            }
+            if (ret == 0) {
+                break;
+            }
+            nread += ret;
+            if (!http_should_keep_alive(cli->http_parser)) {
+                // connection will be closed, ignore the rest
+                return len;
+            }
+        }
+        if (nread == len) {
+            return nread;
+        }
+    }
+    nread += http_parser_execute(cli->http_parser, &settings, data + nread, len - nread);
+    if (nread != len && HTTP_PARSER_ERRNO(cli->http_parser) == HPE_CLOSED_CONNECTION) {
+        // data after "Connection: close", the connection will be closed
+        return len;
+    }
+    return nread;
 }
 
 
+/*
+ * Room for the rest of the Content-Length body being parsed when it is
+ * kept in memory, the client is read straight into it and body_cb finds
+ * the data in place. 0 when there is none.
+ */
+size_t
+body_read_space(client_t *cli, char **space)
+{
+    http_parser *p = cli->http_parser;
+    request *req = get_current_request(p);
+    buffer_t *body;
+    size_t rest, room;
+    char *newbuf;
+
+    if(req == NULL || req->body == NULL || req->complete || req->bad_request_code > 0 ||
+            (p->flags & F_CHUNKED)){
+        return 0;
+    }
+    if(req->body_type != BODY_TYPE_BUFFER && req->body_type != BODY_TYPE_STREAM){
+        return 0;
+    }
+    body = (buffer_t *)req->body;
+    rest = req->body_length - req->body_readed;
+    room = body->buf_size - body->len - 1;
+    if(room < rest && room < STREAM_BODY_READ_SIZE){
+        // a streamed body, its buffer is emptied by the app
+        room = rest < STREAM_BODY_READ_SIZE ? rest : STREAM_BODY_READ_SIZE;
+        newbuf = PyMem_Realloc(body->buf, body->len + room + 1);
+        if(newbuf == NULL){
+            return 0;
+        }
+        body->buf = newbuf;
+        body->buf_size = body->len + room + 1;
+    }
+    *space = body->buf + body->len;
+    return rest < room ? rest : room;
+}
+
+/*
+ * The fd and size of the next part of the Content-Length body being
+ * spooled to a file, the client is spliced straight into it and space is
+ * given to the parser for the spliced bytes. 0 when there is none.
+ */
+size_t
+body_spool_space(client_t *cli, int *fd, char **space)
+{
+    http_parser *p = cli->http_parser;
+    request *req = get_current_request(p);
+    size_t rest;
+
+    if(req == NULL || req->body_type != BODY_TYPE_TMPFILE || req->complete ||
+            req->bad_request_code > 0 || (p->flags & F_CHUNKED)){
+        return 0;
+    }
+    rest = req->body_length - req->body_readed;
+    *fd = req->body_fd;
+    *space = spliced_body;
+    return rest < sizeof(spliced_body) ? rest : sizeof(spliced_body);
+}
+
+/*
+ * the oldest request can run, the ones behind it may still be reading.
+ * A streamed body is read by the app.
+ */
 int
 parser_finish(client_t *cli)
 {
-    return cli->complete;
+    request *req = cli->request_queue->head;
+    return req != NULL && (req->complete || req->body_type == BODY_TYPE_STREAM);
+}
+
+static void
+setup_header_keys(void)
+{
+    header_key *k;
+    unsigned int h;
+    int i;
+
+    memset(common_header_slots, 0, sizeof(common_header_slots));
+    for(k = common_headers; k->name != NULL; k++){
+        k->len = strlen(k->name);
+        if(!strcmp(k->name, "content-type")){
+            Py_INCREF(content_type_key);
+            k->key = content_type_key;
+        }else if(!strcmp(k->name, "content-length")){
+            Py_INCREF(content_length_key);
+            k->key = content_length_key;
+        }else{
+            char temp[k->len + prefix_len];
+            make_http_header_key(temp, k->name, k->len);
+            k->key = new_key(temp, k->len + prefix_len);
+        }
+        h = common_header_hash(k->name, k->len);
+        if(common_header_slots[h] != NULL){
+            RDEBUG("header key hash collision %s %s", k->name, common_header_slots[h]->name);
+            continue;
+        }
+        common_header_slots[h] = k;
+    }
+
+    for(i = 0; i < HEADER_KEY_LRU_BUCKETS; i++){
+        header_key_buckets[i] = -1;
+    }
+    header_key_head = header_key_tail = -1;
+    header_key_used = 0;
+}
+
+static void
+clear_header_keys(void)
+{
+    header_key *k;
+    int i;
+
+    for(k = common_headers; k->name != NULL; k++){
+        Py_CLEAR(k->key);
+    }
+    memset(common_header_slots, 0, sizeof(common_header_slots));
+    for(i = 0; i < header_key_used; i++){
+        Py_CLEAR(header_key_lru[i].key);
+    }
+    header_key_used = 0;
+}
+
+static void
+setup_environ_template(void)
+{
+#if PY_VERSION_HEX < 0x030D0000
+    environ_template = _PyDict_NewPresized(ENVIRON_PRESIZE);
+#else
+    environ_template = PyDict_New();
+#endif
+    if(environ_template == NULL){
+        return;
+    }
+    PyDict_SetItem(environ_template, version_key, version_val);
+    PyDict_SetItem(environ_template, scheme_key, scheme_val);
+    PyDict_SetItem(environ_template, errors_key, errors_val);
+    PyDict_SetItem(environ_template, multithread_key, multithread_val);
+    PyDict_SetItem(environ_template, multiprocess_key, multiprocess_val);
+    PyDict_SetItem(environ_template, run_once_key, run_once_val);
+    PyDict_SetItem(environ_template, script_key, empty_string);
+    PyDict_SetItem(environ_template, server_name_key, server_name_val);
+    PyDict_SetItem(environ_template, server_port_key, server_port_val);
+    PyDict_SetItem(environ_template, file_wrapper_key, file_wrapper_val);
 }
 
 void
@@ -913,6 +1614,7 @@ setup_static_env(char *name, int port)
     query_string_key = NATIVE_FROMSTRING("QUERY_STRING");
     request_method_key = NATIVE_FROMSTRING("REQUEST_METHOD");
     client_key = NATIVE_FROMSTRING("meinheld.client");
+    form_key = NATIVE_FROMSTRING("meinheld.form");
 
     content_type_key = NATIVE_FROMSTRING("CONTENT_TYPE");
     content_length_key = NATIVE_FROMSTRING("CONTENT_LENGTH");
@@ -920,6 +1622,8 @@ setup_static_env(char *name, int port)
     h_content_type_key = NATIVE_FROMSTRING("HTTP_CONTENT_TYPE");
     h_content_length_key = NATIVE_FROMSTRING("HTTP_CONTENT_LENGTH");
 
+    setup_header_keys();
+
     server_protocol_val10 = NATIVE_FROMSTRING("HTTP/1.0");
     server_protocol_val11 = NATIVE_FROMSTRING("HTTP/1.1");
 
@@ -944,6 +1648,8 @@ setup_static_env(char *name, int port)
     http_method_checkout = NATIVE_FROMSTRING("CHECKOUT");
     http_method_merge = NATIVE_FROMSTRING("MERGE");
 
+    setup_environ_template();
+
     //PycString_IMPORT;
 }
 
@@ -951,6 +1657,7 @@ void
 clear_static_env(void)
 {
     DEBUG("clear_static_env");
+    Py_CLEAR(environ_template);
     Py_DECREF(empty_string);
 
     Py_DECREF(version_key);
@@ -982,6 +1689,9 @@ clear_static_env(void)
     Py_DECREF(query_string_key);
     Py_DECREF(request_method_key);
     Py_DECREF(client_key);
+    Py_DECREF(form_key);
+
+    clear_header_keys();
 
     Py_DECREF(content_type_key);
     Py_DECREF(content_length_key);
@@ -9,6 +9,10 @@ int init_parser(client_t *cli, const char *name, const short port);
 
 size_t execute_parse(client_t *cli, const char *data, size_t len);
 
+size_t body_read_space(client_t *cli, char **space);
+
+size_t body_spool_space(client_t *cli, int *fd, char **space);
+
 int parser_finish(client_t *cli);
 
 void setup_static_env(char *name, int port);
@@ -23,4 +27,6 @@ void dealloc_parser(http_parser *p);
 
 PyObject* new_environ(client_t *client);
 
+PyObject* get_http_header_key(const char *s, size_t len);
+
 #endif
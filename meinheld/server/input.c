@@ -1,4 +1,5 @@
 #include "input.h"
+#include "server.h"
 
 #define IO_MAXFREELIST 1024
 
@@ -75,9 +76,31 @@ InputObject_New(buffer_t *buf)
     }
     io->buffer = buf;
     io->pos = 0;
+    io->client = NULL;
     return (PyObject *)io;
 }
 
+/* buf is filled by the parser while the app reads it */
+PyObject*
+StreamInputObject_New(buffer_t *buf, client_t *client)
+{
+    InputObject *io;
+
+    io = (InputObject *)InputObject_New(buf);
+    if(io == NULL){
+        return NULL;
+    }
+    io->client = client;
+    return (PyObject *)io;
+}
+
+/* the request ended, only the data read so far is left */
+void
+end_input_stream(PyObject *obj)
+{
+    ((InputObject *)obj)->client = NULL;
+}
+
 void
 InputObject_dealloc(InputObject *self)
 {
@@ -98,6 +121,44 @@ is_close(InputObject *self)
     return 0;
 }
 
+/*
+ * Read the streamed body until the buffer holds n unread bytes (all of
+ * it when n < 0), or a line when line is set.
+ */
+static int
+fill_stream(InputObject *self, Py_ssize_t n, int line)
+{
+#ifdef WITH_GREENLET
+    buffer_t *buf = self->buffer;
+    Py_ssize_t l;
+    int ret;
+
+    while(self->client){
+        l = buf->len - self->pos;
+        if(n >= 0 && l >= n){
+            break;
+        }
+        if(line && memchr(buf->buf + self->pos, '\n', l)){
+            break;
+        }
+        if(self->pos > 0){
+            // drop the data read by the app
+            memmove(buf->buf, buf->buf + self->pos, l);
+            buf->len = l;
+            self->pos = 0;
+        }
+        ret = read_input_stream(self->client);
+        if(ret == -1){
+            return -1;
+        }
+        if(ret == 0){
+            self->client = NULL;
+        }
+    }
+#endif
+    return 0;
+}
+
 static PyObject*
 InputObject_read(InputObject *self, PyObject *args)
 {
@@ -111,6 +172,9 @@ InputObject_read(InputObject *self, PyObject *args)
     if(is_close(self)){
         return NULL;
     }
+    if(fill_stream(self, n, 0) == -1){
+        return NULL;
+    }
     l = self->buffer->len - self->pos;
     if (n < 0 || n > l) {
         n = l;
@@ -126,29 +190,68 @@ InputObject_read(InputObject *self, PyObject *args)
     return s;
 }
 
-static int
-inner_readline(InputObject *self, char **output)
+static PyObject*
+InputObject_readinto(InputObject *self, PyObject *args)
 {
-    char *start, *end;
-    Py_ssize_t l = 0;
+    Py_buffer view;
+    Py_ssize_t n;
 
-    start = self->buffer->buf + self->pos;
-    end = self->buffer->buf + self->buffer->len;
+    if (!PyArg_ParseTuple(args, "w*:readinto", &view)){
+        return NULL;
+    }
+    if(is_close(self) || fill_stream(self, view.len, 0) == -1){
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    n = self->buffer->len - self->pos;
+    if (n > view.len) {
+        n = view.len;
+    }
+    memcpy(view.buf, self->buffer->buf + self->pos, n);
+    self->pos += n;
+    PyBuffer_Release(&view);
+    return PyLong_FromSsize_t(n);
+}
 
-    while(start < end){
-        if(*start == '\n'){
-            break;
-        }
-        start++;
-        l++;
+/* the unread body, read to its end first when it is streamed */
+static int
+InputObject_bf_getbuffer(InputObject *self, Py_buffer *view, int flags)
+{
+    if(is_close(self) || fill_stream(self, -1, 0) == -1){
+        view->obj = NULL;
+        return -1;
     }
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->buffer->buf + self->pos,
+            self->buffer->len - self->pos, 1, flags);
+}
+
+static PyObject*
+InputObject_getbuffer(InputObject *self, PyObject *args)
+{
+    return PyMemoryView_FromObject((PyObject *)self);
+}
+
+/* a line of at most size bytes (no limit when size < 0) */
+static int
+inner_readline(InputObject *self, char **output, int size)
+{
+    char *start, *nl;
+    Py_ssize_t l;
 
-    if (start < end){
-        start++;
-        l++;
+    if(fill_stream(self, size, 1) == -1){
+        return -1;
+    }
+    start = self->buffer->buf + self->pos;
+    l = self->buffer->len - self->pos;
+    if(size >= 0 && size < l){
+        l = size;
+    }
+    nl = memchr(start, '\n', l);
+    if(nl){
+        l = nl - start + 1;
     }
     //seek current pos
-    *output = self->buffer->buf + self->pos;
+    *output = start;
     self->pos += l;
     return (int)l;
 }
@@ -156,7 +259,7 @@ inner_readline(InputObject *self, char **output)
 static PyObject* 
 InputObject_readline(InputObject *self, PyObject *args)
 {
-    int len, size = -1, delta;
+    int len, size = -1;
     char *output;
 
     if(args){
@@ -168,15 +271,9 @@ InputObject_readline(InputObject *self, PyObject *args)
         return NULL;
     }
 
-    if((len = inner_readline(self, &output)) < 0){
+    if((len = inner_readline(self, &output, size)) < 0){
         return NULL;
     }
-    if (size >= 0 && size < len) {
-        delta = len - size;
-        len -= delta;
-        //back
-        self->pos -= delta;
-    }
     return PyBytes_FromStringAndSize(output, len);
 }
 
@@ -201,7 +298,7 @@ InputObject_readlines(InputObject *self, PyObject *args)
     }
 
     while (1){
-        if((len = inner_readline(self, &output)) < 0){
+        if((len = inner_readline(self, &output, -1)) < 0){
             goto err;
         }
         if (len == 0){
@@ -250,9 +347,22 @@ static struct PyMethodDef InputObject_methods[] = {
   {"read",    (PyCFunction)InputObject_read,     METH_VARARGS, ""},
   {"readline",    (PyCFunction)InputObject_readline, METH_VARARGS, ""},
   {"readlines",    (PyCFunction)InputObject_readlines,METH_VARARGS, ""},
+  {"readinto",    (PyCFunction)InputObject_readinto, METH_VARARGS, ""},
+  {"getbuffer",    (PyCFunction)InputObject_getbuffer, METH_NOARGS, ""},
   {NULL,    NULL}
 };
 
+static PyBufferProcs InputObject_as_buffer = {
+#ifndef PY3
+    0,                         /* bf_getreadbuffer */
+    0,                         /* bf_getwritebuffer */
+    0,                         /* bf_getsegcount */
+    0,                         /* bf_getcharbuffer */
+#endif
+    (getbufferproc)InputObject_bf_getbuffer, /* bf_getbuffer */
+    0,                         /* bf_releasebuffer */
+};
+
 static PyGetSetDef file_getsetlist[] = {
     {0},
 };
@@ -282,8 +392,12 @@ PyTypeObject InputObjectType = {
     0,                         /*tp_str*/
     0,                         /*tp_getattro*/
     0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
+    &InputObject_as_buffer,    /*tp_as_buffer*/
+#ifdef PY3
     Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+#endif
     "Input",                 /* tp_doc */
     0,                       /* tp_traverse */
     0,                       /* tp_clear */
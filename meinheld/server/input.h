@@ -10,6 +10,7 @@ typedef struct {
     PyObject_HEAD
     buffer_t *buffer;
     Py_ssize_t pos;
+    client_t *client;     // reads more of a streamed body, NULL at its end
 } InputObject;
 
 extern PyTypeObject InputObjectType;
@@ -20,4 +21,8 @@ void InputObject_list_clear(void);
 
 PyObject* InputObject_New(buffer_t *buf);
 
+PyObject* StreamInputObject_New(buffer_t *buf, client_t *client);
+
+void end_input_stream(PyObject *obj);
+
 #endif
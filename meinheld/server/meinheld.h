@@ -16,10 +16,10 @@
 
 #ifdef linux
 #include <sys/sendfile.h>
-#elif defined(__APPLE__) || defined(__FreeBSD__)
-#include <sys/uio.h>
 #endif
 
+#include <sys/uio.h>
+
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -112,12 +112,14 @@ as_str(PyObject* obj)
 # define NATIVE_FROMSTRING  PyUnicode_FromString
 # define NATIVE_FROMSTRINGANDSIZE  PyUnicode_FromStringAndSize
 # define NATIVE_FROMFORMAT  PyUnicode_FromFormat
+# define NATIVE_CHECK_EXACT  PyUnicode_CheckExact
 #else
 # define NATIVE_GET_STRING_SIZE  PyBytes_GET_SIZE
 # define NATIVE_ASSTRING  PyBytes_AsString
 # define NATIVE_FROMSTRING  PyBytes_FromString
 # define NATIVE_FROMSTRINGANDSIZE  PyBytes_FromStringAndSize
 # define NATIVE_FROMFORMAT  PyBytes_FromFormat
+# define NATIVE_CHECK_EXACT  PyBytes_CheckExact
 #endif
 
 #if PY_MAJOR_VERSION < 3
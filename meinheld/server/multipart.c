@@ -0,0 +1,524 @@
+#include "multipart.h"
+#include "server.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * multipart/form-data parser
+ *
+ * With server.set_form_parser(True) a multipart/form-data body is parsed
+ * by body_cb as it arrives instead of being buffered. Parts with a
+ * filename are written to unnamed spool files, the others are kept in
+ * memory. environ['meinheld.form'] is {name: [value, ...]}, a value is
+ * bytes for a field and (filename, content_type, file) for a file part
+ * with the file at its start. wsgi.input is empty. Every file part holds
+ * its spool fd until the form is collected, a request with more than
+ * form_file_parts_max of them gets a 413.
+ *
+ * Delimiters are found with memmem(), a delimiter start at the end of
+ * the data is carried to the next call. Quoted parameters end at the
+ * next quote, browsers percent-encode quotes in names and filenames.
+ */
+
+#define MULTIPART_HEAD_MAX 1024 * 8
+#define MULTIPART_PARTS_MAX 1024
+#define MULTIPART_VALUE_SIZE 256
+
+enum {
+    MP_PREAMBLE,
+    MP_DELIM,           // "--" or CRLF follows the delimiter
+    MP_DELIM_DASH,
+    MP_DELIM_CR,
+    MP_HEAD,
+    MP_BODY,
+    MP_DONE,            // epilogue, ignored
+};
+
+#define NAME_IS(p, len, s) \
+    ((len) == sizeof(s) - 1 && !strncasecmp((p), (s), sizeof(s) - 1))
+
+/*
+ * The next "; name=value" of a header value, a quoted value keeps its
+ * quotes.
+ */
+static int
+next_param(const char **pp, const char *end, const char **name, size_t *name_len,
+        const char **value, size_t *value_len)
+{
+    const char *p = *pp;
+
+    for(;;){
+        while(p < end && *p != ';'){
+            p++;
+        }
+        if(p == end){
+            return 0;
+        }
+        p++;
+        while(p < end && (*p == ' ' || *p == '\t')){
+            p++;
+        }
+        *name = p;
+        while(p < end && *p != '=' && *p != ';' && *p != ' ' && *p != '\t'){
+            p++;
+        }
+        *name_len = p - *name;
+        while(p < end && (*p == ' ' || *p == '\t')){
+            p++;
+        }
+        if(p == end || *p != '='){
+            continue;
+        }
+        p++;
+        while(p < end && (*p == ' ' || *p == '\t')){
+            p++;
+        }
+        *value = p;
+        if(p < end && *p == '"'){
+            p = memchr(p + 1, '"', end - p - 1);
+            if(p == NULL){
+                return 0;
+            }
+            p++;
+        }else{
+            while(p < end && *p != ';' && *p != ' ' && *p != '\t'){
+                p++;
+            }
+        }
+        *value_len = p - *value;
+        *pp = p;
+        return 1;
+    }
+}
+
+static void
+unquote(const char **value, size_t *len)
+{
+    if(*len >= 2 && **value == '"'){
+        (*value)++;
+        *len -= 2;
+    }
+}
+
+/* the boundary of a multipart/form-data Content-Type, 0 when there is none */
+int
+multipart_boundary(const char *type, size_t len, const char **boundary, size_t *boundary_len)
+{
+    const char *p = type, *end = type + len, *name, *value;
+    size_t name_len, value_len;
+
+    if(len < 19 || strncasecmp(type, "multipart/form-data", 19)){
+        return 0;
+    }
+    p += 19;
+    while(next_param(&p, end, &name, &name_len, &value, &value_len)){
+        if(NAME_IS(name, name_len, "boundary")){
+            unquote(&value, &value_len);
+            if(value_len == 0 || value_len + 4 > MULTIPART_DELIM_MAX - 6){
+                return 0;
+            }
+            *boundary = value;
+            *boundary_len = value_len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+multipart_parser *
+new_multipart_parser(const char *boundary, size_t len)
+{
+    multipart_parser *mp;
+
+    mp = PyMem_Malloc(sizeof(multipart_parser));
+    if(mp == NULL){
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(mp, 0, sizeof(multipart_parser));
+    mp->form = PyDict_New();
+    if(mp->form == NULL){
+        PyMem_Free(mp);
+        return NULL;
+    }
+    mp->fd = -1;
+    mp->state = MP_PREAMBLE;
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, len);
+    mp->delim_len = len + 4;
+    // the first delimiter has no CRLF before it
+    memcpy(mp->carry, "\r\n", 2);
+    mp->carry_len = 2;
+    GDEBUG("alloc %p", mp);
+    return mp;
+}
+
+void
+free_multipart_parser(multipart_parser *mp)
+{
+    if(mp->fd != -1){
+        close(mp->fd);
+    }
+    if(mp->head){
+        free_buffer(mp->head);
+    }
+    if(mp->value){
+        free_buffer(mp->value);
+    }
+    Py_XDECREF(mp->name);
+    Py_XDECREF(mp->filename);
+    Py_XDECREF(mp->content_type);
+    Py_XDECREF(mp->form);
+    GDEBUG("dealloc %p", mp);
+    PyMem_Free(mp);
+}
+
+static PyObject *
+form_string(const char *s, size_t len)
+{
+#ifdef PY3
+    return PyUnicode_DecodeUTF8(s, len, "surrogateescape");
+#else
+    return PyBytes_FromStringAndSize(s, len);
+#endif
+}
+
+/* the part head is read, start its value */
+static int
+begin_part(multipart_parser *mp)
+{
+    const char *p, *end, *eol, *colon, *v, *v_end, *name, *value;
+    const char *field = NULL, *filename = NULL;
+    size_t name_len, value_len, field_len = 0, filename_len = 0;
+
+    if(++mp->parts > MULTIPART_PARTS_MAX){
+        return 400;
+    }
+    // CRLF, the header lines, CRLF
+    p = mp->head->buf + 2;
+    end = mp->head->buf + mp->head->len - 2;
+    while(p < end){
+        eol = memchr(p, '\r', end - p);
+        if(eol == NULL){
+            eol = end;
+        }
+        colon = memchr(p, ':', eol - p);
+        if(colon){
+            v = colon + 1;
+            while(v < eol && (*v == ' ' || *v == '\t')){
+                v++;
+            }
+            v_end = eol;
+            while(v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')){
+                v_end--;
+            }
+            if(NAME_IS(p, (size_t)(colon - p), "content-disposition")){
+                while(next_param(&v, v_end, &name, &name_len, &value, &value_len)){
+                    unquote(&value, &value_len);
+                    if(NAME_IS(name, name_len, "name")){
+                        field = value;
+                        field_len = value_len;
+                    }else if(NAME_IS(name, name_len, "filename")){
+                        filename = value;
+                        filename_len = value_len;
+                    }
+                }
+            }else if(NAME_IS(p, (size_t)(colon - p), "content-type") && mp->content_type == NULL){
+                mp->content_type = form_string(v, v_end - v);
+                if(mp->content_type == NULL){
+                    goto error;
+                }
+            }
+        }
+        p = eol + 2;
+    }
+    if(field == NULL){
+        return 400;
+    }
+    mp->name = form_string(field, field_len);
+    if(mp->name == NULL){
+        goto error;
+    }
+    if(filename){
+        if(++mp->files > form_file_parts_max){
+            DEBUG("too many file parts %d", mp->files);
+            return 413;
+        }
+        mp->filename = form_string(filename, filename_len);
+        if(mp->filename == NULL){
+            goto error;
+        }
+        mp->fd = open_spool_file();
+        if(mp->fd == -1){
+            PyErr_SetFromErrno(PyExc_IOError);
+            goto error;
+        }
+        mp->file = 1;
+    }else{
+        mp->value = new_buffer(MULTIPART_VALUE_SIZE, 0);
+        mp->file = 0;
+    }
+    DEBUG("part %d file:%d", mp->parts, mp->file);
+    return 0;
+error:
+    call_error_logger();
+    return 500;
+}
+
+static int
+part_data(multipart_parser *mp, const char *data, size_t len)
+{
+    ssize_t w;
+
+    if(mp->state != MP_BODY || len == 0){
+        return 0;
+    }
+    if(!mp->file){
+        if(write2buf(mp->value, data, len) != WRITE_OK){
+            call_error_logger();
+            return 500;
+        }
+        return 0;
+    }
+    while(len > 0){
+        w = write(mp->fd, data, len);
+        if(w == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            PyErr_SetFromErrno(PyExc_IOError);
+            call_error_logger();
+            return 500;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static PyObject *
+part_file(multipart_parser *mp)
+{
+    PyObject *file;
+#ifndef PY3
+    FILE *fp;
+#endif
+
+    if(lseek(mp->fd, 0, SEEK_SET) == -1){
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+#ifdef PY3
+    file = PyFile_FromFd(mp->fd, "<form>", "rb", -1, NULL, NULL, NULL, 1);
+    if(file == NULL){
+        return NULL;
+    }
+#else
+    fp = fdopen(mp->fd, "rb");
+    if(fp == NULL){
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    file = PyFile_FromFile(fp, "<form>", "rb", fclose);
+    if(file == NULL){
+        mp->fd = -1;
+        fclose(fp);
+        return NULL;
+    }
+#endif
+    // the file object closes it
+    mp->fd = -1;
+    return file;
+}
+
+/* a delimiter, the part before it is complete */
+static int
+end_part(multipart_parser *mp)
+{
+    PyObject *value, *file, *list;
+
+    if(mp->state != MP_BODY){
+        mp->state = MP_DELIM;
+        return 0;
+    }
+    if(mp->file){
+        file = part_file(mp);
+        if(file == NULL){
+            goto error;
+        }
+        value = Py_BuildValue("(OOO)", mp->filename,
+                mp->content_type ? mp->content_type : Py_None, file);
+        Py_DECREF(file);
+    }else{
+        value = getPyString(mp->value);
+        mp->value = NULL;
+    }
+    if(value == NULL){
+        goto error;
+    }
+    list = PyDict_GetItem(mp->form, mp->name);
+    if(list == NULL){
+        list = PyList_New(0);
+        if(list == NULL || PyDict_SetItem(mp->form, mp->name, list) == -1){
+            Py_XDECREF(list);
+            Py_DECREF(value);
+            goto error;
+        }
+        Py_DECREF(list);
+    }
+    if(PyList_Append(list, value) == -1){
+        Py_DECREF(value);
+        goto error;
+    }
+    Py_DECREF(value);
+    Py_CLEAR(mp->name);
+    Py_CLEAR(mp->filename);
+    Py_CLEAR(mp->content_type);
+    mp->state = MP_DELIM;
+    return 0;
+error:
+    call_error_logger();
+    return 500;
+}
+
+/*
+ * Parse the next data of the body. Returns 0, or the status code of a
+ * bad body or a server error.
+ */
+int
+multipart_execute(multipart_parser *mp, const char *data, size_t len)
+{
+    const char *p = data, *end = data + len, *found;
+    size_t n, need, start;
+    int ret;
+
+    while(p < end){
+        switch(mp->state){
+            case MP_PREAMBLE:
+            case MP_BODY:
+                if(mp->carry_len){
+                    need = mp->delim_len - mp->carry_len;
+                    n = (size_t)(end - p) < need ? (size_t)(end - p) : need;
+                    if(!memcmp(p, mp->delim + mp->carry_len, n)){
+                        if(n < need){
+                            memcpy(mp->carry + mp->carry_len, p, n);
+                            mp->carry_len += n;
+                            return 0;
+                        }
+                        p += n;
+                        mp->carry_len = 0;
+                        if((ret = end_part(mp)) != 0){
+                            return ret;
+                        }
+                        break;
+                    }
+                    // data, a delimiter starts only with its CR
+                    if((ret = part_data(mp, mp->carry, mp->carry_len)) != 0){
+                        return ret;
+                    }
+                    mp->carry_len = 0;
+                }
+                found = memmem(p, end - p, mp->delim, mp->delim_len);
+                if(found){
+                    if((ret = part_data(mp, p, found - p)) != 0){
+                        return ret;
+                    }
+                    p = found + mp->delim_len;
+                    if((ret = end_part(mp)) != 0){
+                        return ret;
+                    }
+                    break;
+                }
+                // keep a delimiter start at the end
+                n = (size_t)(end - p) < mp->delim_len ? (size_t)(end - p) : mp->delim_len - 1;
+                found = end - n;
+                while((found = memchr(found, '\r', end - found)) != NULL){
+                    if(!memcmp(found, mp->delim, end - found)){
+                        break;
+                    }
+                    found++;
+                }
+                if(found == NULL){
+                    found = end;
+                }
+                if((ret = part_data(mp, p, found - p)) != 0){
+                    return ret;
+                }
+                memcpy(mp->carry, found, end - found);
+                mp->carry_len = end - found;
+                return 0;
+            case MP_DELIM:
+                if(*p == '-'){
+                    mp->state = MP_DELIM_DASH;
+                }else if(*p == '\r'){
+                    mp->state = MP_DELIM_CR;
+                }else if(*p != ' ' && *p != '\t'){
+                    return 400;
+                }
+                p++;
+                break;
+            case MP_DELIM_DASH:
+                if(*p++ != '-'){
+                    return 400;
+                }
+                DEBUG("parts %d", mp->parts);
+                mp->state = MP_DONE;
+                break;
+            case MP_DELIM_CR:
+                if(*p++ != '\n'){
+                    return 400;
+                }
+                if(mp->head == NULL){
+                    mp->head = new_buffer(MULTIPART_VALUE_SIZE, 0);
+                }
+                mp->head->len = 0;
+                if(write2buf(mp->head, "\r\n", 2) != WRITE_OK){
+                    call_error_logger();
+                    return 500;
+                }
+                mp->state = MP_HEAD;
+                break;
+            case MP_HEAD:
+                start = mp->head->len;
+                n = end - p;
+                if(n > MULTIPART_HEAD_MAX - start){
+                    n = MULTIPART_HEAD_MAX - start;
+                }
+                if(write2buf(mp->head, p, n) != WRITE_OK){
+                    call_error_logger();
+                    return 500;
+                }
+                // the CRLF CRLF may start in the last data
+                found = memmem(mp->head->buf + (start > 3 ? start - 3 : 0),
+                        mp->head->len - (start > 3 ? start - 3 : 0), "\r\n\r\n", 4);
+                if(found == NULL){
+                    if(mp->head->len >= MULTIPART_HEAD_MAX){
+                        return 400;
+                    }
+                    p += n;
+                    break;
+                }
+                mp->head->len = found - mp->head->buf + 4;
+                p += mp->head->len - start;
+                if((ret = begin_part(mp)) != 0){
+                    return ret;
+                }
+                mp->state = MP_BODY;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/* {name: [value, ...]} of a complete body, NULL when it is not */
+PyObject *
+multipart_finish(multipart_parser *mp)
+{
+    if(mp->state != MP_DONE){
+        return NULL;
+    }
+    Py_INCREF(mp->form);
+    return mp->form;
+}
@@ -0,0 +1,40 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include "meinheld.h"
+#include "buffer.h"
+
+#define MULTIPART_DELIM_MAX 80      // "\r\n--" and a boundary of up to 70 chars
+
+/**
+ * multipart/form-data body being parsed, fed by body_cb.
+ */
+typedef struct {
+    uint8_t state;
+    uint8_t file;               // the part has a filename
+    size_t delim_len;
+    size_t carry_len;
+    int parts;
+    int files;                  // file parts, each holds a spool fd
+    int fd;                     // spool file of a file part
+    buffer_t *head;             // part head being read
+    buffer_t *value;            // field part
+    PyObject *name;
+    PyObject *filename;
+    PyObject *content_type;
+    PyObject *form;             // {name: [value, ...]}
+    char delim[MULTIPART_DELIM_MAX];
+    char carry[MULTIPART_DELIM_MAX];    // delimiter start at the end of the last data
+} multipart_parser;
+
+int multipart_boundary(const char *type, size_t len, const char **boundary, size_t *boundary_len);
+
+multipart_parser* new_multipart_parser(const char *boundary, size_t len);
+
+int multipart_execute(multipart_parser *mp, const char *data, size_t len);
+
+PyObject* multipart_finish(multipart_parser *mp);
+
+void free_multipart_parser(multipart_parser *mp);
+
+#endif
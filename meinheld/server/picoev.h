@@ -84,6 +84,7 @@ extern "C" {
     /* TODO adjust the size to match that of a cache line */
     picoev_handler* callback;
     void* cb_arg;
+    uintptr_t timeout_at; /* msec, when timeout_idx is used */
     picoev_loop_id_t loop_id;
     char events;
     unsigned char timeout_idx; /* PICOEV_TIMEOUT_IDX_UNUSED if not used */
@@ -97,11 +98,14 @@ extern "C" {
       short* vec;
       short* vec_of_vec;
       size_t base_idx;
-      time_t base_time;
-      int resolution;
+      uintptr_t base_time; /* msec */
+      int resolution; /* msec */
       void* _free_addr;
+      unsigned count[PICOEV_TIMEOUT_VEC_SIZE]; /* fds in each slot */
+      uintptr_t min_at[PICOEV_TIMEOUT_VEC_SIZE]; /* no fd in the slot is due
+						    before this */
     } timeout;
-    time_t now;
+    uintptr_t now; /* msec */
   };
   
   typedef struct picoev_globals_st {
@@ -116,7 +120,8 @@ extern "C" {
   
   extern picoev_globals picoev;
   
-  /* creates a new event loop (defined by each backend) */
+  /* creates a new event loop (defined by each backend), timeouts up to
+     max_timeout msec are kept in one turn of the wheel, longer ones wrap */
   picoev_loop* picoev_create_loop(int max_timeout);
   
   /* destroys a loop (defined by each backend) */
@@ -125,7 +130,8 @@ extern "C" {
   /* internal: updates events to be watched (defined by each backend) */
   int picoev_update_events_internal(picoev_loop* loop, int fd, int events);
   
-  /* internal: poll once and call the handlers (defined by each backend) */
+  /* internal: poll once and call the handlers, max_wait in msec (defined by
+     each backend) */
   int picoev_poll_once_internal(picoev_loop* loop, int max_wait);
   
   /* internal, aligned allocator with address scrambling to avoid cache
@@ -177,9 +183,9 @@ extern "C" {
     return 0;
   }
   
-  /* updates timeout */
+  /* updates timeout, msec from now (0 clears it) */
   PICOEV_INLINE
-  void picoev_set_timeout(picoev_loop* loop, int fd, int secs) {
+  void picoev_set_timeout(picoev_loop* loop, int fd, int msec) {
     picoev_fd* target;
     short* vec, * vec_of_vec;
     size_t vi = fd / PICOEV_SHORT_BITS, delta;
@@ -195,14 +201,19 @@ extern "C" {
 	vec_of_vec[vi / PICOEV_SHORT_BITS]
 	  &= ~((unsigned short)SHRT_MIN >> (vi % PICOEV_SHORT_BITS));
       }
+      if (--loop->timeout.count[target->timeout_idx] == 0) {
+	loop->timeout.min_at[target->timeout_idx] = UINTPTR_MAX;
+      }
       target->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
     }
-    if (secs != 0) {
-      delta = (loop->now + secs - loop->timeout.base_time)
-	/ loop->timeout.resolution;
-      if (delta >= PICOEV_TIMEOUT_VEC_SIZE) {
-	delta = PICOEV_TIMEOUT_VEC_SIZE - 1;
-      }
+    if (msec != 0) {
+      /* past the end of the wheel the slot is reused, the fd waits there for
+	 more turns */
+      target->timeout_at = current_msec + msec;
+      delta = target->timeout_at > loop->timeout.base_time
+	? (target->timeout_at - loop->timeout.base_time)
+	  / loop->timeout.resolution
+	: 0;
       target->timeout_idx =
 	(loop->timeout.base_idx + delta) % PICOEV_TIMEOUT_VEC_SIZE;
       vec = PICOEV_TIMEOUT_VEC_OF(loop, target->timeout_idx);
@@ -210,12 +221,16 @@ extern "C" {
       vec_of_vec = PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, target->timeout_idx);
       vec_of_vec[vi / PICOEV_SHORT_BITS]
 	|= (unsigned short)SHRT_MIN >> (vi % PICOEV_SHORT_BITS);
+      loop->timeout.count[target->timeout_idx]++;
+      if (target->timeout_at < loop->timeout.min_at[target->timeout_idx]) {
+	loop->timeout.min_at[target->timeout_idx] = target->timeout_at;
+      }
     }
   }
   
   /* registers a file descriptor and callback argument to a event loop */
   PICOEV_INLINE
-  int picoev_add(picoev_loop* loop, int fd, int events, int timeout_in_secs,
+  int picoev_add(picoev_loop* loop, int fd, int events, int timeout_in_msec,
 		 picoev_handler* callback, void* cb_arg) {
     picoev_fd* target;
     if (unlikely(!PICOEV_IS_INITED_AND_FD_IN_RANGE(fd))) {
@@ -232,7 +247,7 @@ extern "C" {
       target->loop_id = 0;
       return -1;
     }
-    picoev_set_timeout(loop, fd, timeout_in_secs);
+    picoev_set_timeout(loop, fd, timeout_in_msec);
     return 0;
   }
   
@@ -331,7 +346,9 @@ extern "C" {
     loop->timeout.vec = loop->timeout.vec_of_vec
       + picoev.timeout_vec_of_vec_size * PICOEV_TIMEOUT_VEC_SIZE;
     loop->timeout.base_idx = 0;
-    loop->timeout.base_time = current_msec/1000;
+    loop->timeout.base_time = current_msec;
+    memset(loop->timeout.count, 0, sizeof(loop->timeout.count));
+    memset(loop->timeout.min_at, 0xff, sizeof(loop->timeout.min_at));
     loop->timeout.resolution
       = PICOEV_RND_UP(max_timeout, PICOEV_TIMEOUT_VEC_SIZE)
       / PICOEV_TIMEOUT_VEC_SIZE;
@@ -347,50 +364,97 @@ extern "C" {
   /* internal function */
   PICOEV_INLINE
   void picoev_handle_timeout_internal(picoev_loop* loop) {
-    size_t i, j, k;
+    size_t i, j, k, idx;
+    short* vec, * vec_of_vec;
+    uintptr_t span
+      = (uintptr_t)loop->timeout.resolution * PICOEV_TIMEOUT_VEC_SIZE;
+    if (loop->now > loop->timeout.base_time
+	&& loop->now - loop->timeout.base_time >= 2 * span) {
+      /* slept for turns, the last one still visits every slot */
+      loop->timeout.base_time
+	+= ((loop->now - loop->timeout.base_time) / span - 1) * span;
+    }
     for (;
-	 loop->timeout.base_time <= loop->now - loop->timeout.resolution; 
+	 loop->timeout.base_time + loop->timeout.resolution <= loop->now;
 	 loop->timeout.base_idx
 	   = (loop->timeout.base_idx + 1) % PICOEV_TIMEOUT_VEC_SIZE,
 	   loop->timeout.base_time += loop->timeout.resolution) {
+      idx = loop->timeout.base_idx;
+      /* skip empty slots and those that only hold fds of later turns */
+      if (loop->timeout.count[idx] == 0
+	  || loop->timeout.min_at[idx] > loop->now) {
+	continue;
+      }
+      loop->timeout.min_at[idx] = UINTPTR_MAX;
       /* TODO use SIMD instructions */
-      short* vec = PICOEV_TIMEOUT_VEC_OF(loop, loop->timeout.base_idx);
-      short* vec_of_vec
-	= PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, loop->timeout.base_idx);
+      vec = PICOEV_TIMEOUT_VEC_OF(loop, idx);
+      vec_of_vec = PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, idx);
       for (i = 0; i < picoev.timeout_vec_of_vec_size; ++i) {
 	short vv = vec_of_vec[i];
 	if (vv != 0) {
 	  for (j = i * PICOEV_SHORT_BITS; vv != 0; j++, vv <<= 1) {
 	    if (vv < 0) {
 	      short v = vec[j];
-	      assert(v != 0);
 	      for (k = j * PICOEV_SHORT_BITS; v != 0; k++, v <<= 1) {
 		if (v < 0) {
 		  picoev_fd* fd = picoev.fds + k;
-		  assert(fd->loop_id == loop->loop_id);
-		  fd->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
-		  (*fd->callback)(loop, k, PICOEV_TIMEOUT, fd->cb_arg);
+		  /* a callback may have moved or removed it */
+		  if (fd->loop_id != loop->loop_id || fd->timeout_idx != idx) {
+		    continue;
+		  }
+		  if (fd->timeout_at <= loop->now) {
+		    picoev_set_timeout(loop, k, 0);
+		    (*fd->callback)(loop, k, PICOEV_TIMEOUT, fd->cb_arg);
+		  } else if (fd->timeout_at < loop->timeout.min_at[idx]) {
+		    loop->timeout.min_at[idx] = fd->timeout_at;
+		  }
 		}
 	      }
-	      vec[j] = 0;
 	    }
 	  }
-	  vec_of_vec[i] = 0;
 	}
       }
     }
   }
   
-  /* loop once */
+  /* msec until the next fd timeout is handled, -1 if none is set */
   PICOEV_INLINE
-  int picoev_loop_once(picoev_loop* loop, int max_wait) {
-    if (max_wait > loop->timeout.resolution) {
-      max_wait = loop->timeout.resolution;
+  intptr_t picoev_next_timeout(picoev_loop* loop) {
+    size_t i, idx;
+    uintptr_t end, at, due = UINTPTR_MAX;
+    uintptr_t span
+      = (uintptr_t)loop->timeout.resolution * PICOEV_TIMEOUT_VEC_SIZE;
+    for (i = 0; i < PICOEV_TIMEOUT_VEC_SIZE; i++) {
+      idx = (loop->timeout.base_idx + i) % PICOEV_TIMEOUT_VEC_SIZE;
+      if (loop->timeout.count[idx] == 0) {
+	continue;
+      }
+      end = loop->timeout.base_time + (i + 1) * loop->timeout.resolution;
+      if (end >= due) {
+	break;
+      }
+      /* the turn that handles the first fd due in this slot */
+      at = loop->timeout.min_at[idx];
+      if (at > end) {
+	end += (at - end + span - 1) / span * span;
+      }
+      if (end < due) {
+	due = end;
+      }
+    }
+    if (due == UINTPTR_MAX) {
+      return -1;
     }
+    return due > current_msec ? (intptr_t)(due - current_msec) : 0;
+  }
+  
+  /* loop once, max_wait in msec */
+  PICOEV_INLINE
+  int picoev_loop_once(picoev_loop* loop, int max_wait) {
     if ( unlikely(picoev_poll_once_internal(loop, max_wait) != 0) ) {
       return -1;
     }
-    loop->now = current_msec / 1000;
+    loop->now = current_msec;
     picoev_handle_timeout_internal(loop);
     return 0;
   }
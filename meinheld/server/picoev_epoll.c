@@ -75,7 +75,7 @@ picoev_loop* picoev_create_loop(int max_timeout)
     return NULL;
   }
   
-  loop->loop.now = current_msec / 1000;
+  loop->loop.now = current_msec;
   return &loop->loop;
 }
 
@@ -122,8 +122,14 @@ int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
   } else {
     SET(EPOLL_CTL_MOD, 0);
     if (epoll_ret != 0) {
-      assert(errno == ENOENT);
-      ev.events |= EPOLLEXCLUSIVE;
+      assert(errno == ENOENT || errno == EINVAL);
+      if (errno == EINVAL) {
+        /* an EPOLLEXCLUSIVE watch can not be modified, add it again
+           without the flag so that the next change is a MOD */
+        SET(EPOLL_CTL_DEL, 1);
+      } else {
+        ev.events |= EPOLLEXCLUSIVE;
+      }
       SET(EPOLL_CTL_ADD, 1);
     }
   }
@@ -137,7 +143,14 @@ int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
       ev.events |= EPOLLEXCLUSIVE;
       SET(EPOLL_CTL_ADD, 1);
     } else {
-      SET(EPOLL_CTL_MOD, 1);
+      SET(EPOLL_CTL_MOD, 0);
+      if (epoll_ret != 0) {
+        /* an EPOLLEXCLUSIVE watch can not be modified, add it again
+           without the flag so that the next change is a MOD */
+        assert(errno == EINVAL);
+        SET(EPOLL_CTL_DEL, 1);
+        SET(EPOLL_CTL_ADD, 1);
+      }
     }
   }
   
@@ -158,7 +171,7 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
   Py_BEGIN_ALLOW_THREADS
   nevents = epoll_wait(loop->epfd, loop->events,
 		       sizeof(loop->events) / sizeof(loop->events[0]),
-		       max_wait * 1000);
+		       max_wait);
   Py_END_ALLOW_THREADS
   cache_time_update();
 
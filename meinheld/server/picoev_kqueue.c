@@ -118,7 +118,7 @@ picoev_loop* picoev_create_loop(int max_timeout)
   }
   loop->changed_fds = -1;
   
-  loop->loop.now = current_msec / 1000;
+  loop->loop.now = current_msec;
   return &loop->loop;
 }
 
@@ -175,8 +175,8 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
   /* apply pending changes, with last changes stored to loop->changelist */
   cl_off = apply_pending_changes(loop, 0);
   
-  ts.tv_sec = max_wait;
-  ts.tv_nsec = 0;
+  ts.tv_sec = max_wait / 1000;
+  ts.tv_nsec = (max_wait % 1000) * 1000000;
 
   Py_BEGIN_ALLOW_THREADS
   nevents = kevent(loop->kq, loop->changelist, cl_off, loop->events,
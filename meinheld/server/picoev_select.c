@@ -102,7 +102,7 @@ picoev_loop* picoev_create_loop(int max_timeout)
     return NULL;
   }
   
-  loop->loop.now = current_msec / 1000;
+  loop->loop.now = current_msec;
   return loop;
 }
 
@@ -148,8 +148,8 @@ int picoev_poll_once_internal(picoev_loop* loop, int max_wait)
   }
   
   /* select and handle if any */
-  tv.tv_sec = max_wait;
-  tv.tv_usec = 0;
+  tv.tv_sec = max_wait / 1000;
+  tv.tv_usec = (max_wait % 1000) * 1000;
 
   Py_BEGIN_ALLOW_THREADS
   r = select(maxfd + 1, &readfds, &writefds, &errorfds, &tv);
@@ -0,0 +1,404 @@
+/*
+ * io_uring backend for picoev.
+ *
+ * picoev handlers do their own read()/writev() once a descriptor is ready,
+ * so this backend keeps picoev's readiness contract and implements it with
+ * one-shot IORING_OP_POLL_ADD requests.  Registrations are only recorded by
+ * picoev_update_events_internal(); the poll requests are queued on the
+ * submission ring and submitted together with the wait in a single
+ * io_uring_enter() per loop iteration, so adding, re-arming and removing
+ * descriptors costs no extra system calls (unlike epoll_ctl).
+ *
+ * Requires Linux >= 5.11 (IORING_FEAT_EXT_ARG).
+ */
+
+#include <Python.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "picoev.h"
+#include "time_cache.h"
+
+#ifndef PICOEV_URING_ENTRIES
+# define PICOEV_URING_ENTRIES 4096
+#endif
+
+/* user_data of requests whose completion is ignored (poll remove) */
+#define PICOEV_URING_IGNORE UINT64_MAX
+
+#define URING_POLL_IN (POLLIN | POLLHUP | POLLERR)
+#define URING_POLL_OUT (POLLOUT | POLLHUP | POLLERR)
+
+typedef struct picoev_uring_fd_st {
+  uint32_t gen;   /* generation of the armed poll request */
+  char armed;     /* events of the armed poll request, 0 if none */
+  char dirty;     /* queued in the dirty list */
+} picoev_uring_fd;
+
+typedef struct picoev_loop_uring_st {
+  picoev_loop loop;
+  int ring_fd;
+  struct {
+    unsigned* head;
+    unsigned* tail;
+    unsigned* ring_mask;
+    unsigned* array;
+    struct io_uring_sqe* sqes;
+    unsigned entries;
+    unsigned local_tail;
+    unsigned to_submit;
+    void* ring_ptr;
+    size_t ring_sz;
+    size_t sqes_sz;
+  } sq;
+  struct {
+    unsigned* head;
+    unsigned* tail;
+    unsigned* ring_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_ptr;
+    size_t ring_sz;
+  } cq;
+  picoev_uring_fd* fds;
+  int* dirty;
+  int num_dirty;
+} picoev_loop_uring;
+
+picoev_globals picoev;
+
+static int uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags, void* arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		      flags, arg, argsz);
+}
+
+static int uring_submit(picoev_loop_uring* loop)
+{
+  int r;
+  while (loop->sq.to_submit != 0) {
+    r = uring_enter(loop->ring_fd, loop->sq.to_submit, 0, 0, NULL, 0);
+    if (r < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    loop->sq.to_submit -= r;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe* uring_get_sqe(picoev_loop_uring* loop)
+{
+  struct io_uring_sqe* sqe;
+  unsigned head = __atomic_load_n(loop->sq.head, __ATOMIC_ACQUIRE);
+  unsigned idx;
+
+  if (loop->sq.local_tail - head >= loop->sq.entries) {
+    /* ring is full, flush it to the kernel */
+    if (uring_submit(loop) != 0) {
+      return NULL;
+    }
+  }
+  idx = loop->sq.local_tail & *loop->sq.ring_mask;
+  sqe = loop->sq.sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  loop->sq.array[idx] = idx;
+  loop->sq.local_tail++;
+  loop->sq.to_submit++;
+  __atomic_store_n(loop->sq.tail, loop->sq.local_tail, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static inline uint64_t uring_user_data(int fd, uint32_t gen)
+{
+  return ((uint64_t)gen << 32) | (uint32_t)fd;
+}
+
+static int uring_poll_add(picoev_loop_uring* loop, int fd, int events)
+{
+  struct io_uring_sqe* sqe;
+  picoev_uring_fd* st = loop->fds + fd;
+
+  if ((sqe = uring_get_sqe(loop)) == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = ((events & PICOEV_READ) != 0 ? POLLIN : 0)
+    | ((events & PICOEV_WRITE) != 0 ? POLLOUT : 0);
+  st->gen++;
+  st->armed = events;
+  sqe->user_data = uring_user_data(fd, st->gen);
+  return 0;
+}
+
+static int uring_poll_remove(picoev_loop_uring* loop, int fd)
+{
+  struct io_uring_sqe* sqe;
+  picoev_uring_fd* st = loop->fds + fd;
+
+  if ((sqe = uring_get_sqe(loop)) == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = uring_user_data(fd, st->gen);
+  sqe->user_data = PICOEV_URING_IGNORE;
+  /* completions of the removed request are stale from now on */
+  st->gen++;
+  st->armed = 0;
+  return 0;
+}
+
+static void uring_mark_dirty(picoev_loop_uring* loop, int fd)
+{
+  picoev_uring_fd* st = loop->fds + fd;
+  if (!st->dirty) {
+    st->dirty = 1;
+    loop->dirty[loop->num_dirty++] = fd;
+  }
+}
+
+/* queues poll requests for descriptors changed since the last iteration */
+static int uring_flush_dirty(picoev_loop_uring* loop)
+{
+  int i, fd, events;
+  picoev_uring_fd* st;
+
+  for (i = 0; i < loop->num_dirty; ++i) {
+    fd = loop->dirty[i];
+    st = loop->fds + fd;
+    st->dirty = 0;
+    if (picoev.fds[fd].loop_id == loop->loop.loop_id) {
+      events = picoev.fds[fd].events & PICOEV_READWRITE;
+    } else {
+      events = 0;
+    }
+    if (st->armed == events) {
+      continue;
+    }
+    if (st->armed != 0 && uring_poll_remove(loop, fd) != 0) {
+      return -1;
+    }
+    if (events != 0 && uring_poll_add(loop, fd, events) != 0) {
+      return -1;
+    }
+  }
+  loop->num_dirty = 0;
+  return 0;
+}
+
+static void uring_unmap(picoev_loop_uring* loop)
+{
+  if (loop->sq.sqes != NULL && loop->sq.sqes != MAP_FAILED) {
+    munmap(loop->sq.sqes, loop->sq.sqes_sz);
+  }
+  if (loop->cq.ring_ptr != NULL && loop->cq.ring_ptr != MAP_FAILED) {
+    munmap(loop->cq.ring_ptr, loop->cq.ring_sz);
+  }
+  if (loop->sq.ring_ptr != NULL && loop->sq.ring_ptr != MAP_FAILED) {
+    munmap(loop->sq.ring_ptr, loop->sq.ring_sz);
+  }
+}
+
+static int uring_init(picoev_loop_uring* loop)
+{
+  struct io_uring_params p;
+  char* sq_ptr, * cq_ptr;
+
+  memset(&p, 0, sizeof(p));
+  if ((loop->ring_fd = uring_setup(PICOEV_URING_ENTRIES, &p)) == -1) {
+    return -1;
+  }
+  if ((p.features & IORING_FEAT_EXT_ARG) == 0) {
+    close(loop->ring_fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  loop->sq.ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  loop->cq.ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  loop->sq.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  loop->sq.ring_ptr = mmap(NULL, loop->sq.ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+			   IORING_OFF_SQ_RING);
+  loop->cq.ring_ptr = mmap(NULL, loop->cq.ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+			   IORING_OFF_CQ_RING);
+  loop->sq.sqes = mmap(NULL, loop->sq.sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+		       IORING_OFF_SQES);
+  if (loop->sq.ring_ptr == MAP_FAILED || loop->cq.ring_ptr == MAP_FAILED
+      || loop->sq.sqes == MAP_FAILED) {
+    uring_unmap(loop);
+    close(loop->ring_fd);
+    return -1;
+  }
+
+  sq_ptr = loop->sq.ring_ptr;
+  loop->sq.head = (unsigned*)(sq_ptr + p.sq_off.head);
+  loop->sq.tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+  loop->sq.ring_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+  loop->sq.array = (unsigned*)(sq_ptr + p.sq_off.array);
+  loop->sq.entries = p.sq_entries;
+  loop->sq.local_tail = *loop->sq.tail;
+  loop->sq.to_submit = 0;
+
+  cq_ptr = loop->cq.ring_ptr;
+  loop->cq.head = (unsigned*)(cq_ptr + p.cq_off.head);
+  loop->cq.tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+  loop->cq.ring_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+  loop->cq.cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+  return 0;
+}
+
+picoev_loop* picoev_create_loop(int max_timeout)
+{
+  picoev_loop_uring* loop;
+
+  /* init parent */
+  assert(PICOEV_IS_INITED);
+  if ((loop = (picoev_loop_uring*)malloc(sizeof(picoev_loop_uring))) == NULL) {
+    return NULL;
+  }
+  memset(loop, 0, sizeof(picoev_loop_uring));
+  if (picoev_init_loop_internal(&loop->loop, max_timeout) != 0) {
+    free(loop);
+    return NULL;
+  }
+
+  /* init myself */
+  loop->fds = (picoev_uring_fd*)calloc(picoev.max_fd, sizeof(picoev_uring_fd));
+  loop->dirty = (int*)malloc(sizeof(int) * picoev.max_fd);
+  if (loop->fds == NULL || loop->dirty == NULL || uring_init(loop) != 0) {
+    free(loop->fds);
+    free(loop->dirty);
+    picoev_deinit_loop_internal(&loop->loop);
+    free(loop);
+    return NULL;
+  }
+
+  loop->loop.now = current_msec;
+  return &loop->loop;
+}
+
+int picoev_destroy_loop(picoev_loop* _loop)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+
+  uring_unmap(loop);
+  if (close(loop->ring_fd) != 0) {
+    return -1;
+  }
+  free(loop->fds);
+  free(loop->dirty);
+  picoev_deinit_loop_internal(&loop->loop);
+  free(loop);
+  return 0;
+}
+
+int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  picoev_fd* target = picoev.fds + fd;
+
+  assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+
+  if ((events & PICOEV_DEL) != 0) {
+    /* the descriptor may be closed right after, drop the armed request now
+       so that it is never applied to a reused descriptor */
+    if (loop->fds[fd].armed != 0 && uring_poll_remove(loop, fd) != 0) {
+      return -1;
+    }
+    target->events = 0;
+    return 0;
+  }
+
+  if (unlikely((events & PICOEV_READWRITE) == target->events)) {
+    return 0;
+  }
+  target->events = events & PICOEV_READWRITE;
+  uring_mark_dirty(loop, fd);
+  return 0;
+}
+
+int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct io_uring_cqe* cqe;
+  unsigned head, tail;
+  int r, fd, revents;
+  uint32_t gen;
+  picoev_fd* target;
+  picoev_uring_fd* st;
+
+  if (uring_flush_dirty(loop) != 0) {
+    return -1;
+  }
+
+  ts.tv_sec = max_wait / 1000;
+  ts.tv_nsec = (max_wait % 1000) * 1000000;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = uring_enter(loop->ring_fd, loop->sq.to_submit, 1,
+		  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		  &arg, sizeof(arg));
+  Py_END_ALLOW_THREADS
+  cache_time_update();
+
+  if (r >= 0) {
+    loop->sq.to_submit -= r;
+  } else if (errno != ETIME && errno != EINTR) {
+    return -1;
+  }
+
+  head = *loop->cq.head;
+  tail = __atomic_load_n(loop->cq.tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    cqe = loop->cq.cqes + (head & *loop->cq.ring_mask);
+    if (cqe->user_data == PICOEV_URING_IGNORE) {
+      continue;
+    }
+    fd = (int)(uint32_t)cqe->user_data;
+    gen = (uint32_t)(cqe->user_data >> 32);
+    st = loop->fds + fd;
+    if (st->gen != gen || st->armed == 0) {
+      /* removed or re-armed meanwhile */
+      continue;
+    }
+    /* one-shot request is done, re-arm on the next iteration */
+    st->armed = 0;
+    uring_mark_dirty(loop, fd);
+    target = picoev.fds + fd;
+    if (cqe->res < 0) {
+      continue;
+    }
+    if (loop->loop.loop_id == target->loop_id
+	&& likely((target->events & PICOEV_READWRITE) != 0)) {
+      revents = ((cqe->res & URING_POLL_IN) != 0 ? PICOEV_READ : 0)
+	| ((cqe->res & URING_POLL_OUT) != 0 ? PICOEV_WRITE : 0);
+      revents &= target->events;
+      if (likely(revents != 0)) {
+	__atomic_store_n(loop->cq.head, head + 1, __ATOMIC_RELEASE);
+	(*target->callback)(&loop->loop, fd, revents, target->cb_arg);
+      }
+    }
+  }
+  __atomic_store_n(loop->cq.head, head, __ATOMIC_RELEASE);
+  return 0;
+}
@@ -109,7 +109,11 @@ shift_request(request_queue *q)
     temp_req = req;
     req = req->next;
     q->head = req;
+    if(req == NULL){
+        q->tail = NULL;
+    }
     q->size--;
+    temp_req->next = NULL;
     return temp_req;
 }
 
@@ -120,6 +124,7 @@ new_request(void)
     request *req = alloc_request();
     //request *req = (request *)PyMem_Malloc(sizeof(request));
     memset(req, 0, sizeof(request));
+    req->body_fd = -1;
     return req;
 }
 
@@ -130,6 +135,9 @@ free_request(request *req)
     Py_XDECREF(req->path);
     Py_XDECREF(req->field);
     Py_XDECREF(req->value);
+    if (req->form) {
+        free_multipart_parser(req->form);
+    }
     dealloc_request(req);
     //PyMem_Free(req);
 }
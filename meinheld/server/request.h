@@ -3,6 +3,7 @@
 
 #include "meinheld.h"
 #include "buffer.h"
+#include "multipart.h"
 
 #define LIMIT_PATH 1024 * 8
 #define LIMIT_FRAGMENT 1024
@@ -15,8 +16,9 @@
 
 typedef enum {
     BODY_TYPE_NONE,
-    BODY_TYPE_TMPFILE,
-    BODY_TYPE_BUFFER
+    BODY_TYPE_TMPFILE,    // unnamed file, body_fd
+    BODY_TYPE_BUFFER,
+    BODY_TYPE_STREAM      // buffer read by wsgi.input while the app runs
 } request_body_type;
 
 typedef enum {
@@ -36,10 +38,15 @@ typedef struct {
     int bad_request_code;
     void *body;
     request_body_type body_type;
+    int body_fd;          // spool file of a BODY_TYPE_TMPFILE body
+    PyObject *input;      // wsgi.input of a streamed body
+    multipart_parser *form; // body parsed to meinheld.form
     
     PyObject *field;
     PyObject *value;
     uintptr_t start_msec;
+    uint8_t keep_alive;   // http_should_keep_alive() of this request
+    uint8_t complete;     // message complete, ready to run
 
 } request;
 
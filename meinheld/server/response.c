@@ -1,4 +1,9 @@
 #include "response.h"
+#include "environ.h"
+#include "server.h"
+#include "static_file.h"
+#include "response_cache.h"
+#include "compress.h"
 #include "log.h"
 #include "util.h"
 #include "meinheld.h"
@@ -37,6 +42,95 @@
 
 ResponseObject *start_response = NULL;
 
+#define HEADER_CACHE_SIZE 16
+#define HEADER_CACHE_MAX_HEADERS 32
+#define STATUS_CACHE_SIZE 8
+
+typedef struct {
+    PyObject *status;       // status str given to start_response
+    int status_code;
+    PyObject *lines[2];     // HTTP/1.0 and HTTP/1.1 status lines
+} status_cache_entry;
+
+typedef struct {
+    PyObject *status_line;  // client->http_status
+    PyObject *headers;      // tuple of the app's header tuples
+    int cl_index;           // Content-Length, not in block
+    uint8_t ref;
+    char *block;            // status line, Server and app headers
+    size_t prefix_len;      // Date goes after the prefix
+    size_t block_len;
+} header_cache_entry;
+
+static header_cache_entry header_cache[HEADER_CACHE_SIZE];
+static int header_cache_used = 0;
+static int header_cache_hand = 0;
+static unsigned long long header_cache_hits = 0;
+static unsigned long long header_cache_misses = 0;
+
+static status_cache_entry status_cache[STATUS_CACHE_SIZE];
+static int status_cache_used = 0;
+static int status_cache_hand = 0;
+static unsigned long long status_cache_hits = 0;
+static unsigned long long status_cache_misses = 0;
+
+static PyObject* create_status(PyObject *bytes, int bytelen, int http_minor);
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define COALESCE_IOV IOV_MAX
+#else
+#define COALESCE_IOV 1024
+#endif
+#define CHUNK_LEN_SIZE 20
+#define COALESCE_BUF_MAXFREELIST 64
+
+typedef struct {
+    iovec_t iov[COALESCE_IOV];
+    PyObject *items[COALESCE_IOV];      // keep items until written
+    uint32_t items_cnt;
+    size_t scratch_len;
+    char scratch[COALESCE_IOV / 3 * CHUNK_LEN_SIZE]; // chunk size lines
+} coalesce_buf;
+
+static coalesce_buf *coalesce_buf_free_list[COALESCE_BUF_MAXFREELIST];
+static int coalesce_buf_numfree = 0;
+
+static void dealloc_coalesce_buf(coalesce_buf *buf);
+
+#define MAX_BYTE_RANGES 16
+#define SENDFILE_MAX 0x7ffff000
+
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} byte_range;
+
+typedef struct {
+    int cnt;
+    int next;                   // next part header, cnt is the closing one
+    uint64_t size;
+    char boundary[24];
+    byte_range ranges[MAX_BYTE_RANGES];
+    size_t content_type_len;
+    char content_type[];        // app Content-Type, sent in each part
+} file_ranges;
+
+typedef struct {
+    int status;                 // 200, 206, 304 or 416
+    uint64_t size;              // file size after the start offset
+    uint64_t length;            // response body length
+    uint64_t app_length;        // app Content-Length
+    uint8_t app_length_set;
+    uint8_t accept_ranges;
+    int encoding;               // the file is the precompressed .gz
+    byte_range range;           // single range response
+    file_ranges *ranges;        // multipart/byteranges response
+    char etag[48];              // generated, the app did not send one
+    size_t etag_len;
+    char last_modified[32];     // generated, the app did not send one
+    size_t last_modified_len;
+} file_response;
+
 static PyObject*
 wsgi_to_bytes(PyObject *value)
 {
@@ -169,40 +263,74 @@ send_error_page(client_t *client)
 
 
 
+/*
+ * A client writes one bucket at a time, the common case uses
+ * client->write_arena and its inline iovec. Headers are serialized into
+ * one block (client->header_buf, heap only when they do not fit), so a
+ * response is one or two iovec entries instead of four per header.
+ */
 static write_bucket *
-new_write_bucket(int fd, int cnt)
+new_write_bucket(client_t *client, int cnt)
 {
 
     write_bucket *bucket;
     iovec_t *iov;
 
-    bucket = PyMem_Malloc(sizeof(write_bucket));
-    if(bucket == NULL){
-        return NULL;
+    if(likely(!client->write_arena_used && cnt <= WRITE_BUCKET_IOV)){
+        bucket = &client->write_arena;
+        memset(bucket, 0, offsetof(write_bucket, inline_iov));
+        bucket->in_client = 1;
+        client->write_arena_used = 1;
+    }else{
+        bucket = PyMem_Malloc(sizeof(write_bucket));
+        if(bucket == NULL){
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(bucket, 0, offsetof(write_bucket, inline_iov));
+        GDEBUG("allocate %p", bucket);
     }
-    memset(bucket, 0, sizeof(write_bucket));
 
-    bucket->fd = fd;
-    iov = (iovec_t *)PyMem_Malloc(sizeof(iovec_t) * cnt);
-    if(iov == NULL){
-        PyMem_Free(bucket);
-        return NULL;
+    bucket->fd = client->fd;
+    if(cnt <= WRITE_BUCKET_IOV){
+        bucket->iov = bucket->inline_iov;
+    }else{
+        iov = (iovec_t *)PyMem_Malloc(sizeof(iovec_t) * cnt);
+        if(iov == NULL){
+            PyErr_NoMemory();
+            if(bucket->in_client){
+                client->write_arena_used = 0;
+            }else{
+                PyMem_Free(bucket);
+            }
+            return NULL;
+        }
+        bucket->iov = iov;
     }
-    memset(iov, 0, sizeof(iovec_t));
-    bucket->iov = iov;
     bucket->iov_size = cnt;
-    GDEBUG("allocate %p", bucket);
+    bucket->header = client->header_buf;
+    bucket->header_size = CLIENT_HEADER_BUF;
     return bucket;
 }
 
 static void
-free_write_bucket(write_bucket *bucket)
+free_write_bucket(client_t *client, write_bucket *bucket)
 {
     GDEBUG("free %p", bucket);
     Py_CLEAR(bucket->temp1);
-    Py_CLEAR(bucket->chunk_data);
-    PyMem_Free(bucket->iov);
-    PyMem_Free(bucket);
+    if(bucket->header != client->header_buf){
+        PyMem_Free(bucket->header);
+    }
+    if(bucket->coalesce){
+        dealloc_coalesce_buf((coalesce_buf *)bucket->coalesce);
+    }else if(bucket->iov != bucket->inline_iov){
+        PyMem_Free(bucket->iov);
+    }
+    if(bucket->in_client){
+        client->write_arena_used = 0;
+    }else{
+        PyMem_Free(bucket);
+    }
 }
 
 
@@ -216,31 +344,73 @@ set2bucket(write_bucket *bucket, char *buf, size_t len)
     bucket->total_size += len;
 }
 
-static void
-set_chunked_data(write_bucket *bucket, char *lendata, size_t lenlen, char *data, size_t datalen)
+static size_t
+set_chunk_len(write_bucket *bucket, size_t datalen)
 {
-    set2bucket(bucket, lendata, lenlen);
-    set2bucket(bucket, CRLF, 2);
-    set2bucket(bucket, data, datalen);
-    set2bucket(bucket, CRLF, 2);
+    int i;
+    i = snprintf(bucket->chunk_len, sizeof(bucket->chunk_len), "%zx" CRLF, datalen);
+    DEBUG("Transfer-Encoding chunk_size %.*s", i - 2, bucket->chunk_len);
+    return (size_t)i;
 }
 
 static void
 set_last_chunked_data(write_bucket *bucket)
 {
-    set2bucket(bucket, "0", 1);
-    set2bucket(bucket, CRLF, 2);
-    set2bucket(bucket, CRLF, 2);
+    set2bucket(bucket, "0" CRLF CRLF, 5);
 }
 
+static int
+put_header_data(write_bucket *bucket, const char *data, size_t len)
+{
+    char *header;
+    size_t size;
 
-static void
-add_header(write_bucket *bucket, char *key, size_t keylen, char *val, size_t vallen)
+    if(unlikely(bucket->header_len + len > bucket->header_size)){
+        size = bucket->header_size * 2;
+        while(size < bucket->header_len + len){
+            size *= 2;
+        }
+        if(bucket->header_size == CLIENT_HEADER_BUF){
+            // still in client->header_buf
+            header = PyMem_Malloc(size);
+            if(header != NULL){
+                memcpy(header, bucket->header, bucket->header_len);
+            }
+        }else{
+            header = PyMem_Realloc(bucket->header, size);
+        }
+        if(header == NULL){
+            PyErr_NoMemory();
+            return -1;
+        }
+        bucket->header = header;
+        bucket->header_size = size;
+    }
+    memcpy(bucket->header + bucket->header_len, data, len);
+    bucket->header_len += len;
+    return 1;
+}
+
+static int
+add_header(write_bucket *bucket, const char *key, size_t keylen, const char *val, size_t vallen)
 {
-    set2bucket(bucket, key, keylen);
-    set2bucket(bucket, DELIM, 2);
-    set2bucket(bucket, val, vallen);
-    set2bucket(bucket, CRLF, 2);
+    if(unlikely(bucket->header_len + keylen + vallen + 4 > bucket->header_size)){
+        if(put_header_data(bucket, key, keylen) == -1 ||
+                put_header_data(bucket, DELIM, 2) == -1 ||
+                put_header_data(bucket, val, vallen) == -1){
+            return -1;
+        }
+        return put_header_data(bucket, CRLF, 2);
+    }
+    memcpy(bucket->header + bucket->header_len, key, keylen);
+    bucket->header_len += keylen;
+    memcpy(bucket->header + bucket->header_len, DELIM, 2);
+    bucket->header_len += 2;
+    memcpy(bucket->header + bucket->header_len, val, vallen);
+    bucket->header_len += vallen;
+    memcpy(bucket->header + bucket->header_len, CRLF, 2);
+    bucket->header_len += 2;
+    return 1;
 }
 
 #ifdef DEVELOP
@@ -290,6 +460,8 @@ writev_bucket(write_bucket *data)
         return STATUS_OK;
     }else{
         if(data->total > w){
+            data->total = data->total - w;
+            BDEBUG("writev_bucket write %d progress %d/%d", (int)w, data->total, data->total_size);
             for(; i < data->iov_cnt;i++){
                 if(w > data->iov[i].iov_len){
                     //already write
@@ -301,8 +473,6 @@ writev_bucket(write_bucket *data)
                     break;
                 }
             }
-            data->total = data->total - w;
-            BDEBUG("writev_bucket write %d progress %d/%d", (int)w, data->total, data->total_size);
             //resume
             // again later
             return writev_bucket(data);
@@ -313,50 +483,6 @@ writev_bucket(write_bucket *data)
     return STATUS_OK;
 }
 
-static int
-set_file_content_length(client_t *client, write_bucket *bucket)
-{
-    struct stat info;
-    int in_fd, ret = 0;
-    size_t size = 0;
-    Py_ssize_t valuelen = 0;
-    FileWrapperObject *filewrap = NULL;
-    PyObject *filelike = NULL, *length = NULL;
-    char *value = NULL; 
-
-    filewrap = (FileWrapperObject *)client->response;
-    filelike = filewrap->filelike;
-
-    in_fd = PyObject_AsFileDescriptor(filelike);
-    if (in_fd == -1) {
-        call_error_logger();
-        return -1;
-    }
-    if (fstat(in_fd, &info) == -1){
-        PyErr_SetFromErrno(PyExc_IOError);
-        return -1;
-    }
-
-    size = info.st_size;
-    client->content_length_set = 1;
-    client->content_length = size;
-    DEBUG("set content length:%" PRIu64 , size);
-    length = PyBytes_FromFormat("%zu", size);
-    if (length == NULL) {
-        return -1;
-    }
-
-    PyBytes_AsStringAndSize(length, &value, &valuelen);
-    
-    add_header(bucket, "Content-Length", 14, value, valuelen);
-    ret = PyList_Append(bucket->temp1, length);
-    if (ret == -1) {
-        return -1;
-    }
-    Py_DECREF(length);
-    return 1;
-}
-
 /*
 static int
 get_len(PyObject *v)
@@ -395,18 +521,54 @@ set_content_length(client_t *client, write_bucket *bucket, char *data, size_t da
 }
 */
 
+/*
+ * Same checks as wsgi_to_bytes, but points into the str itself instead
+ * of building a bytes copy. A 1 byte kind str only has latin-1 chars.
+ */
+static int
+wsgi_header_data(PyObject *value, char **buf, Py_ssize_t *len)
+{
+#ifdef PY3
+    if (unlikely(!PyUnicode_Check(value))) {
+        PyErr_Format(PyExc_TypeError, "expected unicode object, value "
+                     "of type %.200s found", value->ob_type->tp_name);
+        return -1;
+    }
+#if PY_VERSION_HEX < 0x030C0000
+    if (unlikely(PyUnicode_READY(value) == -1)) {
+        return -1;
+    }
+#endif
+    if (unlikely(PyUnicode_KIND(value) != PyUnicode_1BYTE_KIND)) {
+        PyErr_SetString(PyExc_ValueError, "unicode object contains non "
+                        "latin-1 characters");
+        return -1;
+    }
+    *buf = (char *)PyUnicode_1BYTE_DATA(value);
+    *len = PyUnicode_GET_LENGTH(value);
+#else
+    if (unlikely(!PyBytes_Check(value))) {
+        PyErr_Format(PyExc_TypeError, "expected byte string object, "
+                     "value of type %.200s found", value->ob_type->tp_name);
+        return -1;
+    }
+    *buf = PyBytes_AS_STRING(value);
+    *len = PyBytes_GET_SIZE(value);
+#endif
+    return 1;
+}
+
+#define HEADER_IS(name, namelen, s) \
+    ((namelen) == sizeof(s) - 1 && !strncasecmp((name), (s), sizeof(s) - 1))
+
 static int
-add_all_headers(write_bucket *bucket, PyObject *fast_headers, int hlen, client_t *client)
+add_all_headers(write_bucket *bucket, PyObject *fast_headers, int hlen, int *cl_index, uint8_t skip_type)
 {
     int i;
     PyObject *tuple = NULL;
     PyObject *obj1 = NULL, *obj2 = NULL;
-    PyObject *bytes1 = NULL, *bytes2 = NULL;
     char *name = NULL, *value = NULL;
     Py_ssize_t namelen, valuelen;
-#ifdef PY3
-    int o;
-#endif
 
     if(likely(fast_headers != NULL)){
         for (i = 0; i < hlen; i++) {
@@ -436,66 +598,48 @@ add_all_headers(write_bucket *bucket, PyObject *fast_headers, int hlen, client_t
             if(unlikely(!obj2)){
                 goto error;
             }
-            bytes1 = wsgi_to_bytes(obj1);
-            if(unlikely(PyBytes_AsStringAndSize(bytes1, &name, &namelen) == -1)){
+            if(unlikely(wsgi_header_data(obj1, &name, &namelen) == -1)){
                 goto error;
             }
 
             //value
-            bytes2 = wsgi_to_bytes(obj2);
-            if(unlikely(PyBytes_AsStringAndSize(bytes2, &value, &valuelen) == -1)){
+            if(unlikely(wsgi_header_data(obj2, &value, &valuelen) == -1)){
                 goto error;
             }
 
-            if (unlikely(strchr(name, ':') != 0)) {
+            if (unlikely(memchr(name, ':', namelen) != NULL)) {
                 PyErr_Format(PyExc_ValueError, "header name may not contains ':'"
                              "response header with name '%s' and value '%s'",
                              name, value);
                 goto error;
             }
 
-            if (unlikely(strchr(name, '\n') != 0 || strchr(value, '\n') != 0)) {
+            if (unlikely(memchr(name, '\n', namelen) != NULL || memchr(value, '\n', valuelen) != NULL)) {
                 PyErr_Format(PyExc_ValueError, "embedded newline in "
                              "response header with name '%s' and value '%s'",
                              name, value);
                 goto error;
             }
 
-            if (!strcasecmp(name, "Server") || !strcasecmp(name, "Date")) {
+            if (HEADER_IS(name, namelen, "Server") || HEADER_IS(name, namelen, "Date") ||
+                    HEADER_IS(name, namelen, "X-Meinheld-Cache")) {
                 continue;
             }
 
-            if (client->content_length_set != 1 && !strcasecmp(name, "Content-Length")) {
-                char *v = value;
-                long l = 0;
-
-                errno = 0;
-                l = strtol(v, &v, 10);
-                if (*v || errno == ERANGE || l < 0) {
-                    PyErr_SetString(PyExc_ValueError,
-                                    "invalid content length");
-                    goto error;
-                }
+            if (skip_type && HEADER_IS(name, namelen, "Content-Type")) {
+                // multipart/byteranges, each part has it
+                continue;
+            }
 
-                client->content_length_set = 1;
-                client->content_length = l;
+            if (*cl_index < 0 && HEADER_IS(name, namelen, "Content-Length")) {
+                // per request value, add_content_length writes it
+                *cl_index = i;
+                continue;
             }
-            DEBUG("response header %s:%d : %s:%d",name, (int)namelen, value, (int)valuelen);
-            add_header(bucket, name, namelen, value, valuelen);
-#ifdef PY3
-            //keep bytes string 
-            o = PyList_Append(bucket->temp1, bytes1);
-            if(o != -1){
-                o = PyList_Append(bucket->temp1, bytes2);
-                if(o == -1){
-                    goto error;
-                }
-            }else{
+            DEBUG("response header %.*s:%d : %.*s:%d", (int)namelen, name, (int)namelen, (int)valuelen, value, (int)valuelen);
+            if(unlikely(add_header(bucket, name, namelen, value, valuelen) == -1)){
                 goto error;
             }
-#endif
-            Py_XDECREF(bytes1);
-            Py_XDECREF(bytes2);
         }
 
     }else{
@@ -508,351 +652,1660 @@ error:
         /* write_error_log(__FILE__, __LINE__); */
         call_error_logger();
     }
-    Py_XDECREF(bytes1);
-    Py_XDECREF(bytes2);
     return -1;
 }
 
+static int
+add_content_length(write_bucket *bucket, client_t *client, PyObject *fast_headers, int cl_index)
+{
+    PyObject *tuple;
+    char *value = NULL, *v;
+    Py_ssize_t valuelen;
+    long l = 0;
+
+    tuple = PySequence_Fast_GET_ITEM(fast_headers, cl_index);
+    if(wsgi_header_data(PyTuple_GET_ITEM(tuple, 1), &value, &valuelen) == -1){
+        return -1;
+    }
+    v = value;
+    errno = 0;
+    l = strtol(v, &v, 10);
+    if (v != value + valuelen || valuelen == 0 || errno == ERANGE || l < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "invalid content length");
+        return -1;
+    }
+
+    client->content_length_set = 1;
+    client->content_length = l;
+    return add_header(bucket, "Content-Length", 14, value, valuelen);
+}
+
 static int
 add_status_line(write_bucket *bucket, client_t *client)
 {
     PyObject *object;
-    char *value = NULL;
-    Py_ssize_t valuelen;
 
     object = client->http_status;
     //TODO ERROR CHECK
     if(object){
         DEBUG("add_status_line client %p", client);
-        PyBytes_AsStringAndSize(object, &value, &valuelen);
 
         //write status code
-        set2bucket(bucket, value, valuelen);
-
-        add_header(bucket, "Server", 6,  SERVER, sizeof(SERVER) -1);
-        //cache_time_update();
-        add_header(bucket, "Date", 4, (char *)http_time, 29);
+        if(put_header_data(bucket, PyBytes_AS_STRING(object), PyBytes_GET_SIZE(object)) == -1){
+            return -1;
+        }
+        return add_header(bucket, "Server", 6,  SERVER, sizeof(SERVER) -1);
     }else{
         DEBUG("missing status_line %p", client);
     }
     return 1;
 }
 
-static PyObject*
-get_chunk_data(size_t datalen)
+static int
+add_date_header(write_bucket *bucket)
 {
-    char lendata[32];
-    int i = 0;
-    i = snprintf(lendata, 32, "%zx", datalen);
-    DEBUG("Transfer-Encoding chunk_size %s", lendata);
-    return PyBytes_FromStringAndSize(lendata, (Py_ssize_t)i);
+    //cache_time_update();
+    return add_header(bucket, "Date", 4, (char *)http_time, 29);
+}
+
+/*
+ * Header cache
+ *
+ * Most handlers return the same status and header list every time.
+ * The validated status line, Server and app headers are kept as one
+ * block, keyed on the status line object and the app's header tuples.
+ * Date, Content-Length, Transfer-Encoding and Connection change per
+ * request and are added outside the block.
+ */
+static int
+same_str(PyObject *a, PyObject *b)
+{
+    if(a == b){
+        return 1;
+    }
+#ifdef PY3
+    if(!PyUnicode_CheckExact(a) || !PyUnicode_CheckExact(b)){
+        return 0;
+    }
+#if PY_VERSION_HEX < 0x030C0000
+    if(PyUnicode_READY(a) == -1 || PyUnicode_READY(b) == -1){
+        PyErr_Clear();
+        return 0;
+    }
+#endif
+    return PyUnicode_KIND(a) == PyUnicode_1BYTE_KIND &&
+        PyUnicode_KIND(b) == PyUnicode_1BYTE_KIND &&
+        PyUnicode_GET_LENGTH(a) == PyUnicode_GET_LENGTH(b) &&
+        !memcmp(PyUnicode_1BYTE_DATA(a), PyUnicode_1BYTE_DATA(b), PyUnicode_GET_LENGTH(a));
+#else
+    return PyBytes_CheckExact(a) && PyBytes_CheckExact(b) &&
+        PyBytes_GET_SIZE(a) == PyBytes_GET_SIZE(b) &&
+        !memcmp(PyBytes_AS_STRING(a), PyBytes_AS_STRING(b), PyBytes_GET_SIZE(a));
+#endif
 }
 
+static int
+same_status_line(PyObject *a, PyObject *b)
+{
+    return a == b || (PyBytes_GET_SIZE(a) == PyBytes_GET_SIZE(b) &&
+        !memcmp(PyBytes_AS_STRING(a), PyBytes_AS_STRING(b), PyBytes_GET_SIZE(a)));
+}
 
-static void
-set_first_body_data(client_t *client, char *data, size_t datalen)
+static int
+same_headers(header_cache_entry *e, PyObject *fast_headers, int hlen)
 {
-    write_bucket *bucket = client->bucket;
-    if(data){
-        if(client->chunked_response){
-            char *lendata  = NULL;
-            Py_ssize_t len = 0;
-
-            PyObject *chunk_data = get_chunk_data(datalen);
-            //TODO CHECK ERROR
-            PyBytes_AsStringAndSize(chunk_data, &lendata, &len);
-            set_chunked_data(bucket, lendata, len, data, datalen);
-            bucket->chunk_data = chunk_data;
-        }else{
-            set2bucket(bucket, data, datalen);
+    int i;
+    PyObject *a, *b;
+
+    if(PyTuple_GET_SIZE(e->headers) != hlen){
+        return 0;
+    }
+    for(i = 0; i < hlen; i++){
+        a = PyTuple_GET_ITEM(e->headers, i);
+        b = PySequence_Fast_GET_ITEM(fast_headers, i);
+        if(a == b){
+            continue;
+        }
+        if(!PyTuple_CheckExact(b) || PyTuple_GET_SIZE(b) != 2){
+            return 0;
+        }
+        if(!same_str(PyTuple_GET_ITEM(a, 0), PyTuple_GET_ITEM(b, 0))){
+            return 0;
+        }
+        // Content-Length value is checked by add_content_length
+        if(i != e->cl_index && !same_str(PyTuple_GET_ITEM(a, 1), PyTuple_GET_ITEM(b, 1))){
+            return 0;
         }
     }
+    return 1;
 }
 
-static response_status
-write_headers(client_t *client, char *data, size_t datalen, char is_file)
+static header_cache_entry *
+lookup_header_cache(PyObject *status_line, PyObject *fast_headers, int hlen)
 {
-    write_bucket *bucket = 0; 
-    uint32_t hlen = 0;
-    PyObject *headers = NULL, *templist = NULL;
-    response_status ret;
-    
-    DEBUG("header write? %d", client->header_done);
-    if(client->header_done){
-        return STATUS_OK;
+    int i;
+    header_cache_entry *e;
+
+    for(i = 0; i < header_cache_used; i++){
+        e = &header_cache[i];
+        if(same_status_line(e->status_line, status_line) && same_headers(e, fast_headers, hlen)){
+            e->ref = 1;
+            header_cache_hits++;
+            return e;
+        }
     }
+    header_cache_misses++;
+    return NULL;
+}
 
-    //TODO ERROR CHECK
-    if (!client->headers){
-        goto error;
-    }
-    headers = PySequence_Fast(client->headers, "header must be list");
-    if (!headers){
-        goto error;
-    }
-    hlen = PySequence_Fast_GET_SIZE(headers);
+static void
+free_header_cache_entry(header_cache_entry *e)
+{
+    Py_CLEAR(e->status_line);
+    Py_CLEAR(e->headers);
+    PyMem_Free(e->block);
+    e->block = NULL;
+}
 
-    bucket = new_write_bucket(client->fd, (hlen * 4) + 42 );
+static void
+store_header_cache(PyObject *status_line, PyObject *fast_headers, int hlen, int cl_index,
+        write_bucket *bucket, size_t prefix_len, size_t app_start)
+{
+    int i;
+    PyObject *tuple, *headers;
+    header_cache_entry *e;
+    size_t app_len = bucket->header_len - app_start;
+    char *block;
 
-    if(bucket == NULL){
-        goto error;
+    if(hlen > HEADER_CACHE_MAX_HEADERS){
+        return;
     }
-    templist = PyList_New(hlen * 4);
-    bucket->temp1 = templist;
-
-    if(add_status_line(bucket, client) == -1){
-        goto error;
+    // only str items, so the key can not change under us
+    for(i = 0; i < hlen; i++){
+        tuple = PySequence_Fast_GET_ITEM(fast_headers, i);
+        if(!PyTuple_CheckExact(tuple) ||
+                !NATIVE_CHECK_EXACT(PyTuple_GET_ITEM(tuple, 0)) ||
+                !NATIVE_CHECK_EXACT(PyTuple_GET_ITEM(tuple, 1))){
+            return;
+        }
     }
-    //write header
-    if(add_all_headers(bucket, headers, hlen, client) == -1){
-        //Error
-        goto error;
+    block = PyMem_Malloc(prefix_len + app_len);
+    if(block == NULL){
+        return;
     }
-    
-    // check content_length_set
-    if(data && !client->content_length_set && client->http_parser->http_minor == 1){
-        //Transfer-Encoding chunked
-        add_header(bucket, "Transfer-Encoding", 17, "chunked", 7);
-        client->chunked_response = 1;
+    headers = PySequence_Tuple(fast_headers);
+    if(headers == NULL){
+        PyErr_Clear();
+        PyMem_Free(block);
+        return;
     }
 
-    if (is_file && !client->content_length_set){
-        if (set_file_content_length(client, bucket) == -1) {
-            goto error;
+    if(header_cache_used < HEADER_CACHE_SIZE){
+        e = &header_cache[header_cache_used++];
+    }else{
+        // clock, entries hit since the last pass stay
+        while(header_cache[header_cache_hand].ref){
+            header_cache[header_cache_hand].ref = 0;
+            header_cache_hand = (header_cache_hand + 1) % HEADER_CACHE_SIZE;
         }
-    }
+        e = &header_cache[header_cache_hand];
+        header_cache_hand = (header_cache_hand + 1) % HEADER_CACHE_SIZE;
+        free_header_cache_entry(e);
+    }
+    memcpy(block, bucket->header, prefix_len);
+    memcpy(block + prefix_len, bucket->header + app_start, app_len);
+    Py_INCREF(status_line);
+    e->status_line = status_line;
+    e->headers = headers;
+    e->cl_index = cl_index;
+    e->ref = 0;
+    e->block = block;
+    e->prefix_len = prefix_len;
+    e->block_len = prefix_len + app_len;
+    DEBUG("header cache store %p headers:%d size:%d", e, hlen, (int)e->block_len);
+}
 
-    if(client->status_code == 101){
-        add_header(bucket, "Connection", 10, "upgrade", 7);
-    }else if(client->keep_alive == 1){
-        //Keep-Alive
-        add_header(bucket, "Connection", 10, "Keep-Alive", 10);
-    }else{
-        add_header(bucket, "Connection", 10, "close", 5);
+static int
+put_cached_headers(write_bucket *bucket, header_cache_entry *e)
+{
+    if(put_header_data(bucket, e->block, e->prefix_len) == -1 ||
+            add_date_header(bucket) == -1){
+        return -1;
     }
-    
-    set2bucket(bucket, CRLF, 2);
+    return put_header_data(bucket, e->block + e->prefix_len, e->block_len - e->prefix_len);
+}
 
-    //write body
-    client->bucket = bucket;
-    set_first_body_data(client, data, datalen);
+static status_cache_entry *
+lookup_status_cache(PyObject *status)
+{
+    int i;
+    status_cache_entry *e;
 
-    ret = writev_bucket(bucket);
-    if(ret != STATUS_SUSPEND){
-        client->header_done = 1;
-        if(ret == STATUS_OK && data){
-            client->write_bytes += datalen;
+    for(i = 0; i < status_cache_used; i++){
+        e = &status_cache[i];
+        if(same_str(e->status, status)){
+            status_cache_hits++;
+            return e;
         }
-        // clear
-        free_write_bucket(bucket);
-        client->bucket = NULL;
     }
+    status_cache_misses++;
+    return NULL;
+}
 
-    Py_DECREF(headers);
-    return ret;
-error:
-    if (PyErr_Occurred()){
-        /* write_error_log(__FILE__, __LINE__); */
-        call_error_logger();
+static void
+store_status_cache(PyObject *status, PyObject *bytes, int status_code)
+{
+    status_cache_entry *e;
+    PyObject *line10, *line11;
+
+    if(!NATIVE_CHECK_EXACT(status)){
+        return;
     }
-    Py_XDECREF(headers);
-    if(bucket){
-        free_write_bucket(bucket);
-        client->bucket = NULL;
+    line10 = create_status(bytes, PyBytes_GET_SIZE(bytes), 0);
+    line11 = create_status(bytes, PyBytes_GET_SIZE(bytes), 1);
+    if(line10 == NULL || line11 == NULL){
+        PyErr_Clear();
+        Py_XDECREF(line10);
+        Py_XDECREF(line11);
+        return;
+    }
+    if(status_cache_used < STATUS_CACHE_SIZE){
+        e = &status_cache[status_cache_used++];
+    }else{
+        e = &status_cache[status_cache_hand];
+        status_cache_hand = (status_cache_hand + 1) % STATUS_CACHE_SIZE;
+        Py_CLEAR(e->status);
+        Py_CLEAR(e->lines[0]);
+        Py_CLEAR(e->lines[1]);
+    }
+    Py_INCREF(status);
+    e->status = status;
+    e->status_code = status_code;
+    e->lines[0] = line10;
+    e->lines[1] = line11;
+}
+
+void
+clear_header_cache(void)
+{
+    int i;
+
+    for(i = 0; i < header_cache_used; i++){
+        free_header_cache_entry(&header_cache[i]);
+    }
+    for(i = 0; i < status_cache_used; i++){
+        Py_CLEAR(status_cache[i].status);
+        Py_CLEAR(status_cache[i].lines[0]);
+        Py_CLEAR(status_cache[i].lines[1]);
+    }
+    header_cache_used = header_cache_hand = 0;
+    status_cache_used = status_cache_hand = 0;
+}
+
+PyObject*
+get_header_cache_stats(void)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:i}",
+            "hits", header_cache_hits,
+            "misses", header_cache_misses,
+            "status_hits", status_cache_hits,
+            "status_misses", status_cache_misses,
+            "entries", header_cache_used);
+}
+
+/*
+ * File responses
+ *
+ * A file_wrapper response over a regular file is answered here: ETag,
+ * Last-Modified and Accept-Ranges are added unless the app sent them,
+ * If-None-Match/If-Modified-Since give a 304, Range (with If-Range) a
+ * 206, multipart/byteranges or 416. The app is not called again.
+ */
+static int
+find_app_header(PyObject *fast_headers, const char *key, size_t keylen, char **value, Py_ssize_t *valuelen)
+{
+    Py_ssize_t i, namelen;
+    PyObject *tuple;
+    char *name;
+
+    for(i = 0; i < PySequence_Fast_GET_SIZE(fast_headers); i++){
+        tuple = PySequence_Fast_GET_ITEM(fast_headers, i);
+        if(!PyTuple_Check(tuple) || PyTuple_GET_SIZE(tuple) != 2){
+            continue;
+        }
+        if(wsgi_header_data(PyTuple_GET_ITEM(tuple, 0), &name, &namelen) == -1){
+            PyErr_Clear();
+            continue;
+        }
+        if(namelen == (Py_ssize_t)keylen && !strncasecmp(name, key, keylen)){
+            if(wsgi_header_data(PyTuple_GET_ITEM(tuple, 1), value, valuelen) == -1){
+                PyErr_Clear();
+                return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+get_request_header(PyObject *env, const char *key, char **value, Py_ssize_t *valuelen)
+{
+    PyObject *obj;
+
+    obj = environ_get_item_string(env, key);
+    if(obj == NULL){
+        return 0;
+    }
+    if(wsgi_header_data(obj, value, valuelen) == -1){
+        PyErr_Clear();
+        return 0;
+    }
+    return 1;
+}
+
+static int
+parse_uint64(const char **p, const char *end, uint64_t *n)
+{
+    const char *s = *p;
+    uint64_t v = 0;
+
+    while(s < end && *s >= '0' && *s <= '9'){
+        if(v > (UINT64_MAX - (*s - '0')) / 10){
+            return -1;
+        }
+        v = v * 10 + (*s - '0');
+        s++;
+    }
+    if(s == *p){
+        return -1;
+    }
+    *p = s;
+    *n = v;
+    return 1;
+}
+
+#define SKIP_OWS(p, end) \
+    while((p) < (end) && (*(p) == ' ' || *(p) == '\t')) (p)++
+
+/*
+ * Range: bytes=first-last, first-, -suffix
+ * Returns the number of satisfiable ranges, -1 when the header is
+ * ignored (not bytes, malformed or more than MAX_BYTE_RANGES).
+ */
+static int
+parse_byte_ranges(const char *p, size_t len, uint64_t size, byte_range *ranges)
+{
+    const char *end = p + len;
+    uint64_t first, last;
+    int specs = 0, cnt = 0;
+
+    if(len < 6 || strncasecmp(p, "bytes=", 6)){
+        return -1;
+    }
+    p += 6;
+    for(;;){
+        SKIP_OWS(p, end);
+        if(p < end && *p == ','){
+            p++;
+            continue;
+        }
+        if(p == end){
+            break;
+        }
+        if(*p == '-'){
+            p++;
+            if(parse_uint64(&p, end, &last) == -1){
+                return -1;
+            }
+            // last N bytes
+            if(last == 0 || size == 0){
+                first = size;
+            }else{
+                first = last >= size ? 0 : size - last;
+            }
+            last = UINT64_MAX;
+        }else{
+            if(parse_uint64(&p, end, &first) == -1 || p == end || *p != '-'){
+                return -1;
+            }
+            p++;
+            if(p < end && *p >= '0' && *p <= '9'){
+                if(parse_uint64(&p, end, &last) == -1 || last < first){
+                    return -1;
+                }
+            }else{
+                last = UINT64_MAX;
+            }
+        }
+        SKIP_OWS(p, end);
+        if(p < end && *p != ','){
+            return -1;
+        }
+        if(++specs > MAX_BYTE_RANGES){
+            return -1;
+        }
+        if(first < size){
+            ranges[cnt].first = first;
+            ranges[cnt].last = last >= size ? size - 1 : last;
+            cnt++;
+        }
+    }
+    return specs ? cnt : -1;
+}
+
+/*
+ * If-None-Match list (weak comparison) or If-Range value (strong).
+ */
+static int
+etag_match(const char *p, size_t len, const char *etag, size_t etag_len, int weak)
+{
+    const char *end = p + len, *q;
+    int is_weak = 0, w;
+
+    if(etag_len > 2 && etag[0] == 'W' && etag[1] == '/'){
+        if(!weak){
+            return 0;
+        }
+        etag += 2;
+        etag_len -= 2;
+        is_weak = 1;
+    }
+    for(;;){
+        SKIP_OWS(p, end);
+        if(p < end && *p == ','){
+            p++;
+            continue;
+        }
+        if(p == end){
+            return 0;
+        }
+        if(*p == '*'){
+            return weak;
+        }
+        w = 0;
+        if(end - p > 2 && p[0] == 'W' && p[1] == '/'){
+            w = 1;
+            p += 2;
+        }
+        if(*p != '"' || (q = memchr(p + 1, '"', end - p - 1)) == NULL){
+            return 0;
+        }
+        q++;
+        if((weak || (!w && !is_weak)) &&
+                (size_t)(q - p) == etag_len && !memcmp(p, etag, etag_len)){
+            return 1;
+        }
+        p = q;
+    }
+}
+
+static int
+format_content_range(char *buf, size_t len, byte_range *range, uint64_t size)
+{
+    return snprintf(buf, len, "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+            range->first, range->last, size);
+}
+
+// "\r\n--boundary\r\n" part headers "\r\n", the closing one for i == cnt
+static uint64_t
+part_header_len(file_ranges *ranges, int i)
+{
+    char value[64];
+    uint64_t len = 4 + strlen(ranges->boundary);
+
+    if(i == ranges->cnt){
+        return len + 4;
+    }
+    len += 2;
+    if(ranges->content_type_len){
+        len += 14 + ranges->content_type_len + 2;
+    }
+    return len + 15 + format_content_range(value, sizeof(value), &ranges->ranges[i], ranges->size) + 4;
+}
+
+static int
+put_part_header(write_bucket *bucket, file_ranges *ranges, int i)
+{
+    char value[64];
+    int len;
+
+    if(put_header_data(bucket, CRLF "--", 4) == -1 ||
+            put_header_data(bucket, ranges->boundary, strlen(ranges->boundary)) == -1){
+        return -1;
+    }
+    if(i == ranges->cnt){
+        return put_header_data(bucket, "--" CRLF, 4);
+    }
+    if(put_header_data(bucket, CRLF, 2) == -1){
+        return -1;
+    }
+    if(ranges->content_type_len &&
+            add_header(bucket, "Content-Type", 12, ranges->content_type, ranges->content_type_len) == -1){
+        return -1;
+    }
+    len = format_content_range(value, sizeof(value), &ranges->ranges[i], ranges->size);
+    if(add_header(bucket, "Content-Range", 13, value, len) == -1){
+        return -1;
+    }
+    return put_header_data(bucket, CRLF, 2);
+}
+
+static file_ranges *
+new_file_ranges(byte_range *r, int cnt, uint64_t size, char *content_type, size_t content_type_len)
+{
+    static uint32_t seq = 0;
+    file_ranges *ranges;
+
+    ranges = PyMem_Malloc(sizeof(file_ranges) + content_type_len);
+    if(ranges == NULL){
+        PyErr_NoMemory();
+        return NULL;
+    }
+    ranges->cnt = cnt;
+    ranges->next = 0;
+    ranges->size = size;
+    memcpy(ranges->ranges, r, sizeof(byte_range) * cnt);
+    snprintf(ranges->boundary, sizeof(ranges->boundary), "%08" PRIx32 "%08" PRIx32,
+            (uint32_t)current_msec, (uint32_t)getpid() ^ ++seq);
+    ranges->content_type_len = content_type_len;
+    memcpy(ranges->content_type, content_type, content_type_len);
+    return ranges;
+}
+
+void
+free_file_ranges(client_t *client)
+{
+    if(client->file_ranges){
+        PyMem_Free(client->file_ranges);
+        client->file_ranges = NULL;
+    }
+}
+
+static const char *
+file_status_reason(int status)
+{
+    switch(status){
+        case 200:
+            return "200 OK";
+        case 206:
+            return "206 Partial Content";
+        case 304:
+            return "304 Not Modified";
+        default:
+            return "416 Range Not Satisfiable";
+    }
+}
+
+static int
+set_file_status(client_t *client, int status)
+{
+    PyObject *bytes, *line;
+
+    bytes = PyBytes_FromString(file_status_reason(status));
+    if(bytes == NULL){
+        return -1;
+    }
+    line = create_status(bytes, PyBytes_GET_SIZE(bytes), client->http_parser->http_minor);
+    Py_DECREF(bytes);
+    if(line == NULL){
+        if(!PyErr_Occurred()){
+            PyErr_NoMemory();
+        }
+        return -1;
+    }
+    Py_XDECREF(client->http_status);
+    client->http_status = line;
+    client->status_code = status;
+    return 1;
+}
+
+/*
+ * If-None-Match, If-Modified-Since, Range and If-Range of a GET or HEAD
+ * for the validators etag and mtime (-1, no date). Sets file->status and
+ * the ranges, the file is sent from offset 0.
+ */
+static int
+check_file_request(client_t *client, PyObject *env, file_response *file, int get,
+        const char *etag, size_t etag_len, time_t mtime,
+        char *content_type, size_t content_type_len)
+{
+    byte_range ranges[MAX_BYTE_RANGES];
+    char *value, *range;
+    Py_ssize_t valuelen, rangelen;
+    time_t t;
+    int cnt;
+
+    if(get_request_header(env, "HTTP_IF_NONE_MATCH", &value, &valuelen)){
+        if(etag_match(value, valuelen, etag, etag_len, 1)){
+            file->status = 304;
+        }
+    }else if(mtime != -1 && get_request_header(env, "HTTP_IF_MODIFIED_SINCE", &value, &valuelen)){
+        t = parse_http_time(value, valuelen);
+        if(t != -1 && mtime <= t){
+            file->status = 304;
+        }
+    }
+    if(file->status == 304 || !get || !get_request_header(env, "HTTP_RANGE", &range, &rangelen)){
+        return 1;
+    }
+    if(get_request_header(env, "HTTP_IF_RANGE", &value, &valuelen)){
+        if(valuelen && (value[0] == '"' || value[0] == 'W')){
+            if(!etag_match(value, valuelen, etag, etag_len, 0)){
+                return 1;
+            }
+        }else if(mtime == -1 || parse_http_time(value, valuelen) != mtime){
+            return 1;
+        }
+    }
+    cnt = parse_byte_ranges(range, rangelen, file->size, ranges);
+    if(cnt == -1){
+        return 1;
+    }
+    if(cnt == 0){
+        file->status = 416;
+    }else if(cnt == 1){
+        file->status = 206;
+        file->range = ranges[0];
+    }else{
+        file->ranges = new_file_ranges(ranges, cnt, file->size, content_type, content_type_len);
+        if(file->ranges == NULL){
+            return -1;
+        }
+        client->file_ranges = file->ranges;
+        file->status = 206;
+    }
+    return 1;
+}
+
+/* body range and length of file->status, offset is the start of the body */
+static void
+set_file_body(client_t *client, file_response *file, uint64_t offset, int head)
+{
+    file_ranges *ranges = file->ranges;
+    int i;
+
+    switch(file->status){
+        case 206:
+            if(ranges){
+                client->file_offset = client->file_end = 0;
+                file->length = 0;
+                for(i = 0; i <= ranges->cnt; i++){
+                    file->length += part_header_len(ranges, i);
+                    if(i < ranges->cnt){
+                        file->length += ranges->ranges[i].last - ranges->ranges[i].first + 1;
+                    }
+                }
+            }else{
+                client->file_offset = file->range.first;
+                client->file_end = file->range.last + 1;
+                file->length = file->range.last - file->range.first + 1;
+            }
+            break;
+        case 200:
+            file->length = file->app_length_set ? file->app_length : file->size;
+            client->file_offset = offset;
+            client->file_end = offset + file->length;
+            break;
+        default:
+            client->file_offset = client->file_end = 0;
+            file->length = 0;
+    }
+    if(head){
+        // Content-Length of the GET response, no body
+        client->file_end = client->file_offset;
+        free_file_ranges(client);
+    }
+}
+
+static int
+get_request_method(PyObject *env, int *get, int *head)
+{
+    char *value;
+    Py_ssize_t valuelen;
+
+    *get = *head = 0;
+    if(env && get_request_header(env, "REQUEST_METHOD", &value, &valuelen)){
+        *get = valuelen == 3 && !memcmp(value, "GET", 3);
+        *head = valuelen == 4 && !memcmp(value, "HEAD", 4);
+    }
+    return *get || *head;
+}
+
+/* the .gz file next to the wrapped file, info becomes its stat */
+static int
+open_precompressed_file(FileWrapperObject *filewrap, struct stat *info)
+{
+    PyObject *name, *path = NULL;
+    int fd = -1;
+
+    name = PyObject_GetAttrString(filewrap->filelike, "name");
+    if(name == NULL){
+        PyErr_Clear();
+        return -1;
+    }
+#ifdef PY3
+    if(PyUnicode_Check(name) && PyUnicode_FSConverter(name, &path)){
+        fd = open_precompressed(PyBytes_AS_STRING(path), PyBytes_GET_SIZE(path), info);
+    }
+#else
+    if(PyBytes_Check(name)){
+        fd = open_precompressed(PyBytes_AS_STRING(name), PyBytes_GET_SIZE(name), info);
+    }
+#endif
+    PyErr_Clear();
+    Py_XDECREF(path);
+    Py_DECREF(name);
+    filewrap->precompressed_fd = fd;
+    return fd;
+}
+
+static int
+prepare_file_response(client_t *client, FileWrapperObject *filewrap, int in_fd, file_response *file)
+{
+    struct stat info;
+    off_t offset;
+    PyObject *headers, *env = NULL;
+    char *value, *etag, *p, *content_type;
+    Py_ssize_t valuelen, etag_len, content_type_len;
+    time_t mtime;
+    int get, head;
+
+    if(fstat(in_fd, &info) == -1){
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    // body starts at the current position
+    offset = lseek(in_fd, 0, SEEK_CUR);
+    if(offset == -1){
+        offset = 0;
+    }
+    file->status = 200;
+    file->size = info.st_size > offset ? (uint64_t)(info.st_size - offset) : 0;
+
+    headers = PySequence_Fast(client->headers, "header must be list");
+    if(headers == NULL){
+        return -1;
+    }
+    if(client->current_req){
+        env = client->current_req->environ;
+    }
+    get_request_method(env, &get, &head);
+    if(find_app_header(headers, "Content-Length", 14, &value, &valuelen)){
+        p = value;
+        if(parse_uint64((const char **)&p, value + valuelen, &file->app_length) == -1 ||
+                p != value + valuelen){
+            // add_content_length reports it
+            goto done;
+        }
+        file->app_length_set = 1;
+    }
+    if(!S_ISREG(info.st_mode) || offset != 0 || client->status_code != 200 || !(get || head) ||
+            (file->app_length_set && file->app_length != file->size)){
+        goto done;
+    }
+    if(has_compress() && !find_app_header(headers, "Content-Encoding", 16, &value, &valuelen) &&
+            accept_compress(env) == COMPRESS_GZIP && open_precompressed_file(filewrap, &info) != -1){
+        file->encoding = COMPRESS_GZIP;
+        file->size = info.st_size;
+        file->app_length_set = 0;
+    }
+
+    file->accept_ranges = 1;
+    if(!find_app_header(headers, "ETag", 4, &etag, &etag_len)){
+        file->etag_len = snprintf(file->etag, sizeof(file->etag), "\"%" PRIx64 "-%" PRIx64 "\"",
+                (uint64_t)info.st_mtime, file->size);
+        etag = file->etag;
+        etag_len = file->etag_len;
+    }
+    mtime = info.st_mtime;
+    if(find_app_header(headers, "Last-Modified", 13, &value, &valuelen)){
+        mtime = parse_http_time(value, valuelen);
+    }else{
+        file->last_modified_len = format_http_time(mtime, file->last_modified, sizeof(file->last_modified));
+    }
+    if(!find_app_header(headers, "Content-Type", 12, &content_type, &content_type_len)){
+        content_type_len = 0;
+    }
+    if(check_file_request(client, env, file, get, etag, etag_len, mtime,
+                content_type, content_type_len) == -1){
+        Py_DECREF(headers);
+        return -1;
+    }
+
+done:
+    set_file_body(client, file, offset, head);
+    Py_DECREF(headers);
+    if(file->status != 200 && set_file_status(client, file->status) == -1){
+        return -1;
+    }
+    return 1;
+}
+
+static int
+add_file_headers(write_bucket *bucket, client_t *client, file_response *file)
+{
+    char value[64];
+    const char *encoding;
+    size_t encoding_len;
+    int len;
+
+    if(file->encoding){
+        encoding = compress_encoding(file->encoding, &encoding_len);
+        if(add_header(bucket, "Vary", 4, "Accept-Encoding", 15) == -1 ||
+                (file->status != 304 && file->status != 416 &&
+                 add_header(bucket, "Content-Encoding", 16, encoding, encoding_len) == -1)){
+            return -1;
+        }
+    }
+    if(file->accept_ranges && add_header(bucket, "Accept-Ranges", 13, "bytes", 5) == -1){
+        return -1;
+    }
+    if(file->etag_len && add_header(bucket, "ETag", 4, file->etag, file->etag_len) == -1){
+        return -1;
+    }
+    if(file->last_modified_len &&
+            add_header(bucket, "Last-Modified", 13, file->last_modified, file->last_modified_len) == -1){
+        return -1;
+    }
+    switch(file->status){
+        case 206:
+            if(file->ranges){
+                len = snprintf(value, sizeof(value), "multipart/byteranges; boundary=%s", file->ranges->boundary);
+                if(add_header(bucket, "Content-Type", 12, value, len) == -1){
+                    return -1;
+                }
+            }else{
+                len = format_content_range(value, sizeof(value), &file->range, file->size);
+                if(add_header(bucket, "Content-Range", 13, value, len) == -1){
+                    return -1;
+                }
+            }
+            break;
+        case 304:
+            client->content_length_set = 1;
+            client->content_length = 0;
+            return 1;
+        case 416:
+            len = snprintf(value, sizeof(value), "bytes */%" PRIu64, file->size);
+            if(add_header(bucket, "Content-Range", 13, value, len) == -1){
+                return -1;
+            }
+            break;
+        default:
+            if(client->content_length_set){
+                // app Content-Length
+                return 1;
+            }
+    }
+    client->content_length_set = 1;
+    client->content_length = file->length;
+    len = snprintf(value, sizeof(value), "%" PRIu64, file->length);
+    return add_header(bucket, "Content-Length", 14, value, len);
+}
+
+static int
+add_connection_header(write_bucket *bucket, client_t *client)
+{
+    if(client->status_code == 101){
+        return add_header(bucket, "Connection", 10, "upgrade", 7);
+    }else if(client->keep_alive == 1){
+        //Keep-Alive
+        return add_header(bucket, "Connection", 10, "Keep-Alive", 10);
+    }
+    return add_header(bucket, "Connection", 10, "close", 5);
+}
+
+/*
+ * Response of a request that missed the response cache, kept when it
+ * has X-Meinheld-Cache or other requests wait for it.
+ */
+static void
+begin_response_capture(client_t *client, PyObject *fast_headers, write_bucket *bucket,
+        size_t prefix_len, size_t app_start, size_t app_end, char *data, size_t datalen)
+{
+    char *control = NULL, *vary = NULL, *v;
+    Py_ssize_t control_len = 0, vary_len = 0, vlen;
+
+    if(client->status_code < 200 || client->status_code == 206 || client->status_code == 304 ||
+            find_app_header(fast_headers, "Set-Cookie", 10, &v, &vlen)){
+        abandon_response_capture(client);
+        return;
+    }
+    if(!find_app_header(fast_headers, "X-Meinheld-Cache", 16, &control, &control_len)){
+        control = NULL;
+    }
+    find_app_header(fast_headers, "Vary", 4, &vary, &vary_len);
+    if(!start_response_capture(client, client->current_req->environ, control, control_len,
+                vary, vary_len, bucket->header, prefix_len, app_start, app_end)){
+        abandon_response_capture(client);
+    }else if(data){
+        response_capture_data(client, data, datalen);
+    }
+}
+
+static void
+set_first_body_data(client_t *client, char *data, size_t datalen)
+{
+    write_bucket *bucket = client->bucket;
+    if(data){
+        if(client->chunked_response){
+            set2bucket(bucket, data, datalen);
+            set2bucket(bucket, CRLF, 2);
+        }else{
+            set2bucket(bucket, data, datalen);
+        }
+    }
+}
+
+/*
+ * Encoding of a response with data as the first item, 0 when it is
+ * sent as is. *whole is set when data is the whole body.
+ */
+static int
+choose_compress(client_t *client, PyObject *fast_headers, char *data, size_t datalen, int *whole)
+{
+    PyObject *response = client->response;
+    char *value, *p;
+    Py_ssize_t valuelen;
+    uint64_t length;
+    int get, head;
+
+    if(client->status_code < 200 || client->status_code == 204 || client->status_code == 206 ||
+            client->status_code == 304 || client->current_req == NULL){
+        return 0;
+    }
+    get_request_method(client->current_req->environ, &get, &head);
+    if(head || find_app_header(fast_headers, "Content-Encoding", 16, &value, &valuelen)){
+        return 0;
+    }
+    if(find_app_header(fast_headers, "Content-Type", 12, &value, &valuelen) &&
+            !compressible_type(value, valuelen)){
+        return 0;
+    }
+    *whole = (PyList_Check(response) && PyList_GET_SIZE(response) == 1) ||
+        (PyTuple_Check(response) && PyTuple_GET_SIZE(response) == 1);
+    if(*whole){
+        length = datalen;
+    }else if(client->http_parser->http_minor != 1){
+        // no chunked response
+        return 0;
+    }else if(find_app_header(fast_headers, "Content-Length", 14, &value, &valuelen)){
+        p = value;
+        if(parse_uint64((const char **)&p, value + valuelen, &length) == -1){
+            return 0;
+        }
+    }else{
+        length = get_compress_min_length();
+    }
+    if(length < get_compress_min_length()){
+        return 0;
+    }
+    return accept_compress(client->current_req->environ);
+}
+
+/*
+ * Content-Encoding, Vary and the length of a compressed response, data
+ * becomes the compressed first item. A whole body that does not get
+ * smaller is sent as is (0).
+ */
+static int
+add_compress_headers(write_bucket *bucket, client_t *client, int encoding, int whole,
+        char **data, size_t *datalen)
+{
+    compress_stream *s;
+    PyObject *out;
+    const char *name;
+    size_t name_len;
+    char value[24];
+    int len;
+
+    s = new_compress_stream(encoding);
+    if(s == NULL){
+        return -1;
+    }
+    if(whole){
+        out = compress_data(s, *data, *datalen, Z_FINISH);
+        release_compress_stream(s);
+    }else{
+        out = compress_data(s, *data, *datalen, Z_NO_FLUSH);
+        client->compress = s;
+    }
+    if(out == NULL){
+        return -1;
+    }
+    if(add_header(bucket, "Vary", 4, "Accept-Encoding", 15) == -1){
+        Py_DECREF(out);
+        return -1;
+    }
+    if(whole && (size_t)PyBytes_GET_SIZE(out) >= *datalen){
+        Py_DECREF(out);
+        return 0;
+    }
+    name = compress_encoding(encoding, &name_len);
+    if(add_header(bucket, "Content-Encoding", 16, name, name_len) == -1){
+        Py_DECREF(out);
+        return -1;
+    }
+    if(whole){
+        len = snprintf(value, sizeof(value), "%zd", PyBytes_GET_SIZE(out));
+        if(add_header(bucket, "Content-Length", 14, value, len) == -1){
+            Py_DECREF(out);
+            return -1;
+        }
+    }else{
+        if(add_header(bucket, "Transfer-Encoding", 17, "chunked", 7) == -1){
+            Py_DECREF(out);
+            return -1;
+        }
+        client->chunked_response = 1;
+    }
+    // the bucket keeps it until written
+    bucket->temp1 = out;
+    *data = PyBytes_GET_SIZE(out) ? PyBytes_AS_STRING(out) : NULL;
+    *datalen = PyBytes_GET_SIZE(out);
+    return 1;
+}
+
+static response_status
+write_headers(client_t *client, char *data, size_t datalen, file_response *file)
+{
+    write_bucket *bucket = 0; 
+    uint32_t hlen = 0;
+    PyObject *headers = NULL;
+    response_status ret;
+    header_cache_entry *cached = NULL;
+    size_t prefix_len = 0, app_start = 0, app_end;
+    char *app_data = data;
+    size_t app_datalen = datalen;
+    int cl_index = -1, encoding = 0, whole = 0, compressed = 0;
+    
+    DEBUG("header write? %d", client->header_done);
+    if(client->header_done){
+        return STATUS_OK;
+    }
+
+    //TODO ERROR CHECK
+    if (!client->headers){
+        goto error;
+    }
+    headers = PySequence_Fast(client->headers, "header must be list");
+    if (!headers){
+        goto error;
+    }
+    hlen = PySequence_Fast_GET_SIZE(headers);
+
+    // [header block][data][CRLF]
+    bucket = new_write_bucket(client, 3);
+
+    if(bucket == NULL){
+        goto error;
+    }
+
+    if(use_header_cache && client->http_status && (file == NULL || file->ranges == NULL)){
+        cached = lookup_header_cache(client->http_status, headers, hlen);
+    }
+    if(cached){
+        if(put_cached_headers(bucket, cached) == -1){
+            goto error;
+        }
+        cl_index = cached->cl_index;
+        prefix_len = cached->prefix_len;
+        app_start = bucket->header_len - (cached->block_len - cached->prefix_len);
+    }else{
+        if(add_status_line(bucket, client) == -1){
+            goto error;
+        }
+        prefix_len = bucket->header_len;
+        if(add_date_header(bucket) == -1){
+            goto error;
+        }
+        app_start = bucket->header_len;
+        //write header
+        if(add_all_headers(bucket, headers, hlen, &cl_index, file && file->ranges) == -1){
+            //Error
+            goto error;
+        }
+        if(use_header_cache && client->http_status && (file == NULL || file->ranges == NULL)){
+            store_header_cache(client->http_status, headers, hlen, cl_index, bucket, prefix_len, app_start);
+        }
+    }
+    app_end = bucket->header_len;
+    if(data && has_compress()){
+        encoding = choose_compress(client, headers, data, datalen, &whole);
+    }
+    if(encoding){
+        compressed = add_compress_headers(bucket, client, encoding, whole, &data, &datalen);
+        if(compressed == -1){
+            goto error;
+        }
+    }
+    // 206, 304 and 416 have their own length
+    if(!compressed && cl_index >= 0 && (file == NULL || (file->status == 200 && !file->encoding)) &&
+            add_content_length(bucket, client, headers, cl_index) == -1){
+        goto error;
+    }
+    if(file && add_file_headers(bucket, client, file) == -1){
+        goto error;
+    }
+    
+    // check content_length_set
+    if(data && !compressed && !client->content_length_set && client->http_parser->http_minor == 1){
+        //Transfer-Encoding chunked
+        if(add_header(bucket, "Transfer-Encoding", 17, "chunked", 7) == -1){
+            goto error;
+        }
+        client->chunked_response = 1;
+    }
+
+    if(add_connection_header(bucket, client) == -1 || put_header_data(bucket, CRLF, 2) == -1){
+        goto error;
+    }
+    if(data && client->chunked_response){
+        // first chunk size line goes with the headers
+        if(put_header_data(bucket, bucket->chunk_len, set_chunk_len(bucket, datalen)) == -1){
+            goto error;
+        }
+    }
+    if(client->cache_capture){
+        if(file == NULL){
+            // stored as the app made it
+            begin_response_capture(client, headers, bucket, prefix_len, app_start, app_end,
+                    app_data, app_datalen);
+        }else{
+            abandon_response_capture(client);
+        }
+    }
+    set2bucket(bucket, bucket->header, bucket->header_len);
+
+    //write body
+    client->bucket = bucket;
+    set_first_body_data(client, data, datalen);
+
+    ret = writev_bucket(bucket);
+    if(ret != STATUS_SUSPEND){
+        client->header_done = 1;
+        if(ret == STATUS_OK && data){
+            client->write_bytes += datalen;
+        }
+        // clear
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+
+    Py_DECREF(headers);
+    return ret;
+error:
+    if (PyErr_Occurred()){
+        /* write_error_log(__FILE__, __LINE__); */
+        call_error_logger();
+    }
+    Py_XDECREF(headers);
+    if(bucket){
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    return STATUS_ERROR;
+}
+
+static ssize_t
+write_sendfile(int out_fd, int in_fd, uint64_t *offset, uint64_t count)
+{
+    ssize_t res;
+#ifdef linux
+    off_t off = (off_t)*offset;
+
+    if (count > SENDFILE_MAX) {
+        count = SENDFILE_MAX;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    res = sendfile(out_fd, in_fd, &off, (size_t)count);
+    Py_END_ALLOW_THREADS
+    if (res > 0) {
+        *offset = off;
+    }
+    return res;
+#elif defined(__FreeBSD__)
+    off_t len = 0;
+    Py_BEGIN_ALLOW_THREADS
+    res = sendfile(in_fd, out_fd, (off_t)*offset, (size_t)count, NULL, &len, 0);
+    Py_END_ALLOW_THREADS
+    if (res == -1 && (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))) {
+        return -1;
+    }
+    *offset += len;
+    return len;
+#elif defined(__APPLE__) 
+    off_t len = (off_t)count;
+    Py_BEGIN_ALLOW_THREADS
+    res = sendfile(in_fd, out_fd, (off_t)*offset, &len, NULL, 0);
+    Py_END_ALLOW_THREADS
+    if (res == -1 && (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))) {
+        return -1;
+    }
+    *offset += len;
+    return len;
+#endif
+}
+
+response_status
+close_response(client_t *client)
+{
+    if(!client->response_closed){ 
+        //send all response
+        //closing reponse object
+        if (client->response && PyObject_HasAttrString(client->response, "close")) {
+            PyObject *close = NULL;
+            PyObject *args = NULL;
+            PyObject *data = NULL;
+
+            close = PyObject_GetAttrString(client->response, "close");
+
+            args = PyTuple_New(0);
+            data = PyEval_CallObject(close, args);
+            DEBUG("call response object close");
+            Py_DECREF(args);
+            Py_XDECREF(data);
+            Py_DECREF(close);
+            client->response_closed = 1;
+            if (PyErr_Occurred()){
+                return STATUS_ERROR;
+            }
+        }
+
+    }
+    return STATUS_OK;
+
+}
+
+
+static response_status
+write_next_part(client_t *client, file_ranges *ranges)
+{
+    write_bucket *bucket;
+    response_status ret;
+
+    bucket = new_write_bucket(client, 1);
+    if(bucket == NULL){
+        call_error_logger();
+        return STATUS_ERROR;
+    }
+    if(put_part_header(bucket, ranges, ranges->next) == -1){
+        call_error_logger();
+        free_write_bucket(client, bucket);
+        return STATUS_ERROR;
+    }
+    set2bucket(bucket, bucket->header, bucket->header_len);
+    if(ranges->next < ranges->cnt){
+        client->file_offset = ranges->ranges[ranges->next].first;
+        client->file_end = ranges->ranges[ranges->next].last + 1;
+    }
+    ranges->next++;
+
+    // process_body resumes the bucket
+    client->bucket = bucket;
+    ret = writev_bucket(bucket);
+    if(ret != STATUS_SUSPEND){
+        if(ret == STATUS_OK){
+            client->write_bytes += bucket->total_size;
+        }
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    return ret;
+}
+
+static response_status
+process_sendfile(client_t *client)
+{
+    PyObject *filelike = NULL;
+    FileWrapperObject *filewrap = NULL;
+    file_ranges *ranges;
+    int in_fd;
+    ssize_t ret;
+
+    if (client->static_file) {
+        in_fd = ((static_file *)client->static_file)->fd;
+    } else {
+        filewrap = (FileWrapperObject *)client->response;
+        filelike = filewrap->filelike;
+
+        if (filewrap->precompressed_fd != -1) {
+            in_fd = filewrap->precompressed_fd;
+        } else {
+            in_fd = PyObject_AsFileDescriptor(filelike);
+        }
+        if (in_fd == -1) {
+            PyErr_Clear();
+            return STATUS_OK;
+        }
+    }
+
+    for(;;){
+        while(client->file_offset < client->file_end){
+            ret = write_sendfile(client->fd, in_fd, &client->file_offset, client->file_end - client->file_offset);
+            DEBUG("process_sendfile send %d", (int)ret);
+            if(ret == -1){
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { /* try again later */
+                    //next
+                    DEBUG("process_sendfile EAGAIN %d", (int)ret);
+                    return STATUS_SUSPEND;
+                }
+                /* fatal error */
+                client->keep_alive = 0;
+                /* client->bad_request_code = 500; */
+                client->status_code = 500;
+                //close
+                return STATUS_ERROR;
+            }
+            if(ret == 0){
+                // file is shorter than Content-Length
+                RDEBUG("WARN file truncated fd:%d", in_fd);
+                client->keep_alive = 0;
+                return STATUS_ERROR;
+            }
+            client->write_bytes += ret;
+        }
+        ranges = (file_ranges *)client->file_ranges;
+        if(ranges == NULL || ranges->next > ranges->cnt){
+            break;
+        }
+        ret = write_next_part(client, ranges);
+        if(ret != STATUS_OK){
+            return ret;
+        }
     }
-    return STATUS_ERROR;
+    //all send
+    //disable_cork(client);
+    return close_response(client);
 }
 
-static int
-write_sendfile(int out_fd, int in_fd, int offset, size_t count)
+/*
+ * Write coalescing
+ *
+ * process_write collects consecutive items of the response iterator
+ * into one bucket and writes them with one writev. The bucket is flushed
+ * when it holds write_coalesce_size bytes or runs out of iovec entries,
+ * when the iterator ends, and when the app blocks (flush_write is called
+ * before the client greenlet switches to the hub).
+ */
+static coalesce_buf *
+alloc_coalesce_buf(void)
 {
-    int size = (int)count;
-    int res;
-#ifdef linux
-    /*
-    if (size == 0) {
-        struct stat info;
-        DEBUG("call fstat");
-        if (fstat(in_fd, &info) == -1){
-            PyErr_SetFromErrno(PyExc_IOError);
-            write_error_log(__FILE__, __LINE__);
-            return -1;
-        }
-
-        size = info.st_size - lseek(in_fd, 0, SEEK_CUR);
-    }*/
-    Py_BEGIN_ALLOW_THREADS
-    res = sendfile(out_fd, in_fd, NULL, size);
-    Py_END_ALLOW_THREADS
-    return res;
-#elif defined(__FreeBSD__)
-    off_t len;
-    Py_BEGIN_ALLOW_THREADS
-    res = sendfile(in_fd, out_fd, offset, 0, NULL, &len, 0);
-    Py_END_ALLOW_THREADS
-    if (res == 0) {
-        return len;
+    coalesce_buf *buf;
+    if (coalesce_buf_numfree) {
+        buf = coalesce_buf_free_list[--coalesce_buf_numfree];
+        GDEBUG("use pooled %p", buf);
     } else {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) { 
-            return len; 
+        buf = (coalesce_buf *)PyMem_Malloc(sizeof(coalesce_buf));
+        if (buf == NULL) {
+            PyErr_NoMemory();
+            return NULL;
         }
-        return -1;
+        GDEBUG("alloc %p", buf);
     }
-#elif defined(__APPLE__) 
-    off_t len;
-    Py_BEGIN_ALLOW_THREADS
-    res = sendfile(in_fd, out_fd, offset, &len, NULL, 0);
-    Py_END_ALLOW_THREADS
-    if (res == 0) {
-        return len;
+    buf->items_cnt = 0;
+    buf->scratch_len = 0;
+    return buf;
+}
+
+static void
+dealloc_coalesce_buf(coalesce_buf *buf)
+{
+    uint32_t i;
+    for (i = 0; i < buf->items_cnt; i++) {
+        Py_DECREF(buf->items[i]);
+    }
+    if (coalesce_buf_numfree < COALESCE_BUF_MAXFREELIST) {
+        coalesce_buf_free_list[coalesce_buf_numfree++] = buf;
+        GDEBUG("back to pool %p", buf);
     } else {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) { 
-            return len; 
-        }
-        return -1;
+        PyMem_Free(buf);
     }
-#endif
 }
 
-response_status
-close_response(client_t *client)
+void
+coalesce_buf_list_clear(void)
 {
-    if(!client->response_closed){ 
-        //send all response
-        //closing reponse object
-        if (client->response && PyObject_HasAttrString(client->response, "close")) {
-            PyObject *close = NULL;
-            PyObject *args = NULL;
-            PyObject *data = NULL;
-
-            close = PyObject_GetAttrString(client->response, "close");
+    while (coalesce_buf_numfree) {
+        PyMem_Free(coalesce_buf_free_list[--coalesce_buf_numfree]);
+    }
+}
 
-            args = PyTuple_New(0);
-            data = PyEval_CallObject(close, args);
-            DEBUG("call response object close");
-            Py_DECREF(args);
-            Py_XDECREF(data);
-            Py_DECREF(close);
-            client->response_closed = 1;
-            if (PyErr_Occurred()){
-                return STATUS_ERROR;
-            }
-        }
+static write_bucket *
+new_coalesce_bucket(client_t *client)
+{
+    write_bucket *bucket;
+    coalesce_buf *buf;
 
+    buf = alloc_coalesce_buf();
+    if (buf == NULL) {
+        return NULL;
     }
-    return STATUS_OK;
+    bucket = new_write_bucket(client, 0);
+    if (bucket == NULL) {
+        dealloc_coalesce_buf(buf);
+        return NULL;
+    }
+    bucket->iov = buf->iov;
+    bucket->iov_size = COALESCE_IOV;
+    bucket->coalesce = buf;
+    return bucket;
+}
+
+static void
+add_coalesce_item(write_bucket *bucket, PyObject *item, char chunked)
+{
+    coalesce_buf *buf = (coalesce_buf *)bucket->coalesce;
+    char *data = PyBytes_AS_STRING(item);
+    size_t datalen = PyBytes_GET_SIZE(item);
+    char *lendata;
+    int i;
 
+    buf->items[buf->items_cnt++] = item;
+    if (chunked) {
+        lendata = buf->scratch + buf->scratch_len;
+        i = snprintf(lendata, CHUNK_LEN_SIZE, "%zx" CRLF, datalen);
+        buf->scratch_len += i;
+        set2bucket(bucket, lendata, i);
+        set2bucket(bucket, data, datalen);
+        set2bucket(bucket, CRLF, 2);
+    } else {
+        set2bucket(bucket, data, datalen);
+    }
 }
 
+static int
+coalesce_bucket_full(write_bucket *bucket)
+{
+    return bucket->total >= (uint32_t)write_coalesce_size ||
+        bucket->iov_cnt + 3 > bucket->iov_size;
+}
 
 static response_status
-process_sendfile(client_t *client)
+flush_bucket(client_t *client, write_bucket *bucket)
 {
-    PyObject *filelike = NULL;
-    FileWrapperObject *filewrap = NULL;
-    int in_fd, ret;
+    response_status ret;
 
-    filewrap = (FileWrapperObject *)client->response;
-    filelike = filewrap->filelike;
+    ret = writev_bucket(bucket);
+    if (ret == STATUS_SUSPEND) {
+        // process_body sends the rest
+        return ret;
+    }
+    free_write_bucket(client, bucket);
+    client->bucket = NULL;
+    return ret;
+}
 
-    in_fd = PyObject_AsFileDescriptor(filelike);
-    if (in_fd == -1) {
-        PyErr_Clear();
-        return STATUS_OK;
+void
+flush_write(client_t *client)
+{
+    write_bucket *bucket = (write_bucket *)client->bucket;
+    compress_stream *s = (compress_stream *)client->compress;
+    PyObject *out = NULL;
+
+    if (s && s->pending && (bucket == NULL || bucket->coalesce)) {
+        // what zlib holds goes out before the app blocks
+        out = compress_data(s, NULL, 0, Z_SYNC_FLUSH);
+        if (out == NULL) {
+            call_error_logger();
+            return;
+        }
+        if (PyBytes_GET_SIZE(out) == 0) {
+            Py_DECREF(out);
+            out = NULL;
+        }
+    }
+    if (out) {
+        if (bucket == NULL) {
+            bucket = new_coalesce_bucket(client);
+            if (bucket == NULL) {
+                call_error_logger();
+                Py_DECREF(out);
+                return;
+            }
+            client->bucket = bucket;
+        }
+        client->write_bytes += PyBytes_GET_SIZE(out);
+        add_coalesce_item(bucket, out, 1);
+    }
+    if (bucket == NULL || bucket->coalesce == NULL) {
+        return;
     }
+    DEBUG("flush_write client:%p total:%d", client, bucket->total);
+    if (writev_bucket(bucket) == STATUS_OK) {
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    // else the rest goes out with the next flush in process_write
+}
 
-    while(client->content_length > client->write_bytes){
-        ret = write_sendfile(client->fd, in_fd, client->write_bytes, client->content_length);
-        DEBUG("process_sendfile send %d", ret);
-        switch (ret) {
-            case 0:
-                break;
-            case -1: /* error */
-                if (errno == EAGAIN || errno == EWOULDBLOCK) { /* try again later */
-                    //next
-                    DEBUG("process_sendfile EAGAIN %d", ret);
-                    return STATUS_SUSPEND;
-                } else { /* fatal error */
-                    client->keep_alive = 0;
-                    /* client->bad_request_code = 500; */
-                    client->status_code = 500;
-                    //close
-                    return STATUS_ERROR;
-                }
-            default:
-                client->write_bytes += ret;
+void
+discard_write(client_t *client)
+{
+    if (client->bucket) {
+        free_write_bucket(client, (write_bucket *)client->bucket);
+        client->bucket = NULL;
+    }
+}
 
-        }
+/* compressed item, item is released */
+static PyObject *
+compress_item(client_t *client, PyObject *item)
+{
+    PyObject *out;
+
+    out = compress_data((compress_stream *)client->compress,
+            PyBytes_AS_STRING(item), PyBytes_GET_SIZE(item), Z_NO_FLUSH);
+    Py_DECREF(item);
+    return out;
+}
+
+/* end of the compressed stream with the last chunk */
+static PyObject *
+finish_compress(client_t *client)
+{
+    PyObject *out, *last;
+    char chunk_len[CHUNK_LEN_SIZE];
+    Py_ssize_t len;
+    int i = 0;
+    char *p;
+
+    out = compress_data((compress_stream *)client->compress, NULL, 0, Z_FINISH);
+    release_compress_stream((compress_stream *)client->compress);
+    client->compress = NULL;
+    if(out == NULL){
+        return NULL;
     }
-    //all send
-    //disable_cork(client);
-    return close_response(client);
+    len = PyBytes_GET_SIZE(out);
+    if(len){
+        i = snprintf(chunk_len, sizeof(chunk_len), "%zx" CRLF, len);
+    }
+    last = PyBytes_FromStringAndSize(NULL, i + len + (len ? 2 : 0) + 5);
+    if(last == NULL){
+        Py_DECREF(out);
+        return NULL;
+    }
+    p = PyBytes_AS_STRING(last);
+    if(len){
+        memcpy(p, chunk_len, i);
+        p += i;
+        memcpy(p, PyBytes_AS_STRING(out), len);
+        p += len;
+        memcpy(p, CRLF, 2);
+        p += 2;
+    }
+    memcpy(p, "0" CRLF CRLF, 5);
+    Py_DECREF(out);
+    return last;
 }
 
 static response_status
 process_write(client_t *client)
 {
     PyObject *iterator = NULL;
-    PyObject *item, *chunk_data = NULL;
-    char *buf = NULL, *lendata = NULL;
-    Py_ssize_t buflen, len;
+    PyObject *item;
     write_bucket *bucket = NULL;
     response_status ret;
     
     DEBUG("process_write start");
     iterator = client->response_iter;
     if(iterator != NULL){
+        if(client->body_done){
+            // last flush was suspended
+            return close_response(client);
+        }
         while((item =  PyIter_Next(iterator))){
             if(PyBytes_Check(item)){
-                //TODO CHECK
-                PyBytes_AsStringAndSize(item, &buf, &buflen);
-                //write
-                if(client->chunked_response){
-                    bucket = new_write_bucket(client->fd, 4);
-                    if(bucket == NULL){
-                        /* write_error_log(__FILE__, __LINE__); */
+                if(PyBytes_GET_SIZE(item) == 0){
+                    // nothing to send, and "0" would end a chunked body
+                    Py_DECREF(item);
+                    continue;
+                }
+                if(client->cache_capture){
+                    response_capture_data(client, PyBytes_AS_STRING(item), PyBytes_GET_SIZE(item));
+                }
+                if(client->compress){
+                    item = compress_item(client, item);
+                    if(item == NULL){
                         call_error_logger();
-                        Py_DECREF(item);
                         return STATUS_ERROR;
                     }
-                    lendata  = NULL;
-                    len = 0;
-
-                    chunk_data = get_chunk_data(buflen);
-                    //TODO CHECK ERROR
-                    PyBytes_AsStringAndSize(chunk_data, &lendata, &len);
-                    set_chunked_data(bucket, lendata, len, buf, buflen);
-                    bucket->chunk_data = chunk_data;
-                }else{
-                    bucket = new_write_bucket(client->fd, 1);
+                    if(PyBytes_GET_SIZE(item) == 0){
+                        // still in the zlib stream
+                        Py_DECREF(item);
+                        continue;
+                    }
+                }
+                bucket = (write_bucket *)client->bucket;
+                if(bucket == NULL){
+                    bucket = new_coalesce_bucket(client);
                     if(bucket == NULL){
                         /* write_error_log(__FILE__, __LINE__); */
                         call_error_logger();
                         Py_DECREF(item);
                         return STATUS_ERROR;
                     }
-                    set2bucket(bucket, buf, buflen);
-                }
-                bucket->temp1 = item;
-                ret = writev_bucket(bucket);
-                if(ret != STATUS_OK){
                     client->bucket = bucket;
-                    /* Py_DECREF(item); */
-                    return ret;
                 }
-
-                free_write_bucket(bucket);
                 //mark
-                client->write_bytes += buflen;
+                client->write_bytes += PyBytes_GET_SIZE(item);
+                add_coalesce_item(bucket, item, client->chunked_response);
+
+                if(coalesce_bucket_full(bucket)){
+                    ret = flush_bucket(client, bucket);
+                    if(ret != STATUS_OK){
+                        return ret;
+                    }
+                }
                 //check write_bytes/content_length
                 if(client->content_length_set){
                     if(client->content_length <= client->write_bytes){
                         // all done
-                        /* Py_DECREF(item); */
                         break;
                     }
                 }
-                /* Py_DECREF(item); */
             }else{
                 PyErr_SetString(PyExc_TypeError, "response item must be a byte string");
                 Py_DECREF(item);
@@ -868,18 +2321,48 @@ process_write(client_t *client)
         if(PyErr_Occurred()){
             return STATUS_ERROR;
         }
-        if(client->chunked_response){
+        client->body_done = 1;
+        if(client->cache_capture){
+            store_response_capture(client);
+        }
+        bucket = (write_bucket *)client->bucket;
+        if(client->compress){
+            // the rest of the stream and the last chunk, one iovec entry
+            item = finish_compress(client);
+            if(item == NULL){
+                call_error_logger();
+                return STATUS_ERROR;
+            }
+            if(bucket == NULL){
+                bucket = new_coalesce_bucket(client);
+                if(bucket == NULL){
+                    call_error_logger();
+                    Py_DECREF(item);
+                    return STATUS_ERROR;
+                }
+                client->bucket = bucket;
+            }
+            client->write_bytes += PyBytes_GET_SIZE(item);
+            add_coalesce_item(bucket, item, 0);
+        }else if(client->chunked_response){
             DEBUG("write last chunk");
             //last packet
-            bucket = new_write_bucket(client->fd, 3);
             if(bucket == NULL){
-                /* write_error_log(__FILE__, __LINE__); */
-                call_error_logger();
-                return STATUS_ERROR;
+                bucket = new_write_bucket(client, 1);
+                if(bucket == NULL){
+                    /* write_error_log(__FILE__, __LINE__); */
+                    call_error_logger();
+                    return STATUS_ERROR;
+                }
+                client->bucket = bucket;
             }
             set_last_chunked_data(bucket);
-            writev_bucket(bucket);
-            free_write_bucket(bucket);
+        }
+        if(bucket){
+            ret = flush_bucket(client, bucket);
+            if(ret != STATUS_OK){
+                return ret;
+            }
         }
         return close_response(client);
     }
@@ -898,11 +2381,13 @@ process_body(client_t *client)
         ret = writev_bucket(bucket);
 
         if(ret == STATUS_OK){
-            client->write_bytes += bucket->total_size;
-            free_write_bucket(bucket);
+            if(bucket->coalesce == NULL){
+                client->write_bytes += bucket->total_size;
+            }
+            free_write_bucket(client, bucket);
             client->bucket = NULL;
         }else if(ret == STATUS_ERROR){
-            free_write_bucket(bucket);
+            free_write_bucket(client, bucket);
             client->bucket = NULL;
             return ret;
         }else{
@@ -911,7 +2396,10 @@ process_body(client_t *client)
         }
     }
 
-    if (CheckFileWrapper(client->response)) {
+    if (client->cache_entry) {
+        // the whole response was in the bucket
+        ret = STATUS_OK;
+    }else if (client->static_file || CheckFileWrapper(client->response)) {
         ret = process_sendfile(client);
     }else{
         ret = process_write(client);
@@ -925,8 +2413,8 @@ start_response_file(client_t *client)
 {
     PyObject *filelike;
     FileWrapperObject *filewrap;
-    int ret,in_fd, size;
-    struct stat info;
+    file_response file;
+    int in_fd;
 
     filewrap = (FileWrapperObject *)client->response;
     filelike = filewrap->filelike;
@@ -937,21 +2425,13 @@ start_response_file(client_t *client)
         DEBUG("can't get fd");
         return STATUS_ERROR;
     }
-    ret = write_headers(client, NULL, 0, 1);
-    if(!client->content_length_set){
-        if (fstat(in_fd, &info) == -1){
-            PyErr_SetFromErrno(PyExc_IOError);
-            /* write_error_log(__FILE__, __LINE__);  */
-            call_error_logger();
-            return STATUS_ERROR;
-        }
-
-        size = info.st_size;
-        client->content_length_set = 1;
-        client->content_length = size;
+    memset(&file, 0, sizeof(file));
+    if (prepare_file_response(client, filewrap, in_fd, &file) == -1) {
+        /* write_error_log(__FILE__, __LINE__);  */
+        call_error_logger();
+        return STATUS_ERROR;
     }
-    return ret;
-
+    return write_headers(client, NULL, 0, &file);
 }
 
 static response_status
@@ -980,7 +2460,7 @@ start_response_write(client_t *client)
         buflen = PyBytes_GET_SIZE(item);
 
         /* DEBUG("status_code %d body:%.*s", client->status_code, (int)buflen, buf); */
-        ret = write_headers(client, buf, buflen, 0);
+        ret = write_headers(client, buf, buflen, NULL);
         //TODO when ret == STATUS_SUSPEND keep item
         Py_DECREF(item);
         return ret;
@@ -988,7 +2468,7 @@ start_response_write(client_t *client)
         if (item == NULL && !PyErr_Occurred()){
             //Stop Iteration
             RDEBUG("WARN iter item == NULL");
-            return write_headers(client, NULL, 0, 0);
+            return write_headers(client, NULL, 0, NULL);
         }else{
             PyErr_SetString(PyExc_TypeError, "response item must be a string");
             Py_XDECREF(item);
@@ -1008,7 +2488,7 @@ response_start(client_t *client)
 {
     response_status ret ;
     if(client->status_code == 304){
-        return write_headers(client, NULL, 0, 0);
+        return write_headers(client, NULL, 0, NULL);
     }
 
     if (CheckFileWrapper(client->response)) {
@@ -1030,6 +2510,144 @@ response_start(client_t *client)
     return ret;
 }
 
+/*
+ * Response of a static mount, client->static_file is set by the server.
+ * The same 304/206/416 handling as file_wrapper, the headers are built
+ * from the cached stat result.
+ */
+response_status
+response_start_static(client_t *client)
+{
+    static_file *f = (static_file *)client->static_file, *gz;
+    PyObject *env = client->current_req->environ;
+    write_bucket *bucket = NULL;
+    file_response file;
+    const char *reason, *content_type = f->content_type;
+    size_t content_type_len = f->content_type_len;
+    response_status ret;
+    int get, head;
+
+    memset(&file, 0, sizeof(file));
+    get_request_method(env, &get, &head);
+    if(has_compress() && accept_compress(env) == COMPRESS_GZIP &&
+            (gz = lookup_precompressed_file(f)) != NULL){
+        release_static_file(f);
+        client->static_file = f = gz;
+        file.encoding = COMPRESS_GZIP;
+        count_precompressed();
+    }
+    file.status = 200;
+    file.size = f->size;
+    file.accept_ranges = 1;
+    memcpy(file.etag, f->etag, f->etag_len);
+    file.etag_len = f->etag_len;
+    memcpy(file.last_modified, f->last_modified, f->last_modified_len);
+    file.last_modified_len = f->last_modified_len;
+    if(check_file_request(client, env, &file, get, f->etag, f->etag_len, f->mtime,
+                (char *)content_type, content_type_len) == -1){
+        goto error;
+    }
+    set_file_body(client, &file, 0, head);
+    client->status_code = file.status;
+
+    bucket = new_write_bucket(client, 1);
+    if(bucket == NULL){
+        goto error;
+    }
+    reason = file_status_reason(file.status);
+    if(put_header_data(bucket, client->http_parser->http_minor == 1 ? "HTTP/1.1 " : "HTTP/1.0 ", 9) == -1 ||
+            put_header_data(bucket, reason, strlen(reason)) == -1 ||
+            put_header_data(bucket, CRLF, 2) == -1 ||
+            add_header(bucket, "Server", 6, SERVER, sizeof(SERVER) - 1) == -1 ||
+            add_date_header(bucket) == -1){
+        goto error;
+    }
+    if(file.ranges == NULL &&
+            add_header(bucket, "Content-Type", 12, content_type, content_type_len) == -1){
+        goto error;
+    }
+    if(add_file_headers(bucket, client, &file) == -1 ||
+            add_connection_header(bucket, client) == -1 ||
+            put_header_data(bucket, CRLF, 2) == -1){
+        goto error;
+    }
+    set2bucket(bucket, bucket->header, bucket->header_len);
+
+    client->bucket = bucket;
+    ret = writev_bucket(bucket);
+    if(ret != STATUS_SUSPEND){
+        client->header_done = 1;
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    if(ret == STATUS_OK){
+        ret = process_sendfile(client);
+    }
+    return ret;
+error:
+    call_error_logger();
+    if(bucket){
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    return STATUS_ERROR;
+}
+
+/*
+ * Response from the response cache, client->cache_entry is set by the
+ * server. Date, Content-Length and Connection are per request.
+ */
+response_status
+response_start_cached(client_t *client)
+{
+    response_cache_entry *e = (response_cache_entry *)client->cache_entry;
+    write_bucket *bucket;
+    response_status ret;
+    char value[24];
+    int len;
+
+    client->status_code = e->status_code;
+    bucket = new_write_bucket(client, 2);
+    if(bucket == NULL){
+        goto error;
+    }
+    len = snprintf(value, sizeof(value), "%zu", e->body_len);
+    if(put_header_data(bucket, cache_entry_prefix(e), e->prefix_len) == -1 ||
+            add_date_header(bucket) == -1 ||
+            put_header_data(bucket, cache_entry_headers(e), e->headers_len) == -1 ||
+            add_header(bucket, "Content-Length", 14, value, len) == -1 ||
+            add_connection_header(bucket, client) == -1 ||
+            put_header_data(bucket, CRLF, 2) == -1){
+        goto error;
+    }
+    set2bucket(bucket, bucket->header, bucket->header_len);
+    if(e->body_len){
+        set2bucket(bucket, cache_entry_body(e), e->body_len);
+    }
+    client->content_length_set = 1;
+    client->content_length = e->body_len;
+    client->body_done = 1;
+
+    client->bucket = bucket;
+    ret = writev_bucket(bucket);
+    if(ret != STATUS_SUSPEND){
+        client->header_done = 1;
+        if(ret == STATUS_OK){
+            client->write_bytes = e->body_len;
+        }
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    return ret;
+error:
+    call_error_logger();
+    if(bucket){
+        free_write_bucket(client, bucket);
+        client->bucket = NULL;
+    }
+    return STATUS_ERROR;
+}
+
 void
 setup_start_response(void)
 {
@@ -1098,6 +2716,7 @@ ResponseObject_call(PyObject *obj, PyObject *args, PyObject *kw)
     int bytelen = 0, int_code;
     ResponseObject *self = NULL;
     char *buf = NULL;
+    status_cache_entry *cached = NULL;
 
     self = (ResponseObject *)obj;
 #ifdef PY3
@@ -1140,8 +2759,24 @@ ResponseObject_call(PyObject *obj, PyObject *args, PyObject *kw)
         return NULL;
     }
 
+    if (use_header_cache) {
+        cached = lookup_status_cache(status);
+        if (cached) {
+            self->cli->status_code = cached->status_code;
+            Py_XDECREF(self->cli->headers);
+            self->cli->headers = headers;
+            Py_INCREF(self->cli->headers);
+            Py_XDECREF(self->cli->http_status);
+            self->cli->http_status = cached->lines[self->cli->http_parser->http_minor == 1];
+            Py_INCREF(self->cli->http_status);
+            Py_RETURN_NONE;
+        }
+    }
     
     bytes = wsgi_to_bytes(status);
+    if (!bytes) {
+        return NULL;
+    }
     bytelen = PyBytes_GET_SIZE(bytes);
     buf = PyMem_Malloc(sizeof(char*) * bytelen);
     if (!buf) { 
@@ -1201,6 +2836,9 @@ ResponseObject_call(PyObject *obj, PyObject *args, PyObject *kw)
     /* } */
 
     /* DEBUG("set http_status %p", self->cli); */
+    if (use_header_cache) {
+        store_status_cache(status, bytes, int_code);
+    }
     Py_XDECREF(bytes);
     if (buf) {
         PyMem_Free(buf);
@@ -1219,6 +2857,7 @@ FileWrapperObject_new(PyObject *self, PyObject *filelike, size_t blksize)
 
     f->filelike = filelike;
     Py_INCREF(f->filelike);
+    f->precompressed_fd = -1;
     GDEBUG("alloc FileWrapperObject %p", f);
     return (PyObject *)f;
 }
@@ -1241,6 +2880,9 @@ FileWrapperObject_dealloc(FileWrapperObject* self)
 {
     GDEBUG("dealloc FileWrapperObject %p", self);
     Py_XDECREF(self->filelike);
+    if (self->precompressed_fd != -1) {
+        close(self->precompressed_fd);
+    }
     PyObject_DEL(self);
 }
 
@@ -6,20 +6,6 @@
 #include "client.h"
 #include "time_cache.h"
 
-typedef struct iovec iovec_t;
-
-typedef struct {
-    int fd;
-    iovec_t *iov;
-    uint32_t iov_cnt;
-    uint32_t iov_size;
-    uint32_t total;
-    uint32_t total_size;
-    uint8_t sended;
-    PyObject *temp1; //keep origin pointer
-    PyObject *chunk_data; //keep chunk_data origin pointer
-} write_bucket;
-
 
 typedef struct {
     PyObject_HEAD
@@ -29,7 +15,7 @@ typedef struct {
 typedef struct {
     PyObject_HEAD
     PyObject *filelike;
-
+    int precompressed_fd;       // .gz file sent instead, -1 none
 } FileWrapperObject;
 
 typedef enum {
@@ -50,6 +36,10 @@ int CheckFileWrapper(PyObject *obj);
 
 response_status response_start(client_t *client);
 
+response_status response_start_static(client_t *client);
+
+response_status response_start_cached(client_t *client);
+
 response_status process_body(client_t *client);
 
 response_status close_response(client_t *client);
@@ -58,6 +48,18 @@ void setup_start_response(void);
 
 void clear_start_response(void);
 
+void clear_header_cache(void);
+
+PyObject* get_header_cache_stats(void);
+
+void flush_write(client_t *client);
+
+void discard_write(client_t *client);
+
+void free_file_ranges(client_t *client);
+
+void coalesce_buf_list_clear(void);
+
 void send_error_page(client_t *client);
 
 
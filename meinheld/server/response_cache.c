@@ -0,0 +1,736 @@
+#include "response_cache.h"
+#include "environ.h"
+#include "time_cache.h"
+#include "server.h"
+#include "log.h"
+
+/*
+ * Response cache
+ *
+ * An app marks a GET response as cacheable with
+ *
+ *     X-Meinheld-Cache: ttl=N[, stale=M]
+ *
+ * The header is never sent. While the cache is enabled
+ * (server.set_response_cache_size) the status line, headers and body
+ * are kept for N seconds and the same request is answered by the server
+ * without calling the app. The key is the HTTP version, Host, PATH_INFO,
+ * QUERY_STRING and the request headers named by the response's Vary.
+ * For M more seconds the stale copy is sent while one request goes to
+ * the app to replace it. Responses with Set-Cookie or "Vary: *" are not
+ * kept, nor entries larger than 1/8 of the cache.
+ *
+ * With server.set_single_flight(True) a GET arriving while the same
+ * request (without Cookie or Authorization) is running in the app waits
+ * for it and is sent the same response, cacheable or not.
+ */
+
+#define RESPONSE_CACHE_HASH_SIZE 1024
+#define CACHE_KEY_MAX 4096
+#define CACHE_VARY_MAX 1024
+#define CAPTURE_INITIAL_SIZE 4096
+#define FLIGHT_HASH_SIZE 256
+#define FLIGHT_MAX_SIZE (1024 * 1024)
+
+static response_cache_entry *hash_table[RESPONSE_CACHE_HASH_SIZE];
+static response_cache_entry *lru_head = NULL;  // most recently used
+static response_cache_entry *lru_tail = NULL;
+static response_cache_entry *flight_table[FLIGHT_HASH_SIZE];  // responses being made
+static size_t cache_limit = 0;
+static size_t cache_bytes = 0;
+static int cache_cnt = 0;
+static unsigned long long cache_hits = 0;
+static unsigned long long cache_stale_hits = 0;
+static unsigned long long cache_misses = 0;
+static unsigned long long cache_stores = 0;
+static unsigned long long cache_evictions = 0;
+static unsigned long long cache_coalesced = 0;
+
+static uint32_t
+key_hash(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static size_t
+entry_used(response_cache_entry *e)
+{
+    return e->key_len + e->vary_len + e->prefix_len + e->headers_len + e->body_len;
+}
+
+static void
+lru_unlink(response_cache_entry *e)
+{
+    if(e->lru_prev){
+        e->lru_prev->lru_next = e->lru_next;
+    }else{
+        lru_head = e->lru_next;
+    }
+    if(e->lru_next){
+        e->lru_next->lru_prev = e->lru_prev;
+    }else{
+        lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push(response_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if(lru_head){
+        lru_head->lru_prev = e;
+    }
+    lru_head = e;
+    if(lru_tail == NULL){
+        lru_tail = e;
+    }
+}
+
+static void
+free_entry(response_cache_entry *e)
+{
+    PyMem_Free(e->data);
+    PyMem_Free(e);
+}
+
+static void
+evict_entry(response_cache_entry *e)
+{
+    response_cache_entry **p = &hash_table[e->hash & (RESPONSE_CACHE_HASH_SIZE - 1)];
+
+    while(*p != e){
+        p = &(*p)->hash_next;
+    }
+    *p = e->hash_next;
+    e->hash_next = NULL;
+    lru_unlink(e);
+    e->cached = 0;
+    cache_cnt--;
+    cache_bytes -= sizeof(response_cache_entry) + e->size;
+    // being sent, the last release frees it
+    if(e->refcnt == 0){
+        free_entry(e);
+    }
+}
+
+void
+release_response_cache_entry(response_cache_entry *e)
+{
+    e->refcnt--;
+    if(!e->cached && e->refcnt == 0){
+        free_entry(e);
+    }
+}
+
+static void
+end_revalidate(response_cache_entry *c)
+{
+    if(c->revalidate){
+        c->revalidate->updating = 0;
+        release_response_cache_entry(c->revalidate);
+        c->revalidate = NULL;
+    }
+}
+
+static int
+append_key(char *key, size_t *len, const char *data, size_t n)
+{
+    if(*len + n + 1 > CACHE_KEY_MAX){
+        return -1;
+    }
+    memcpy(key + *len, data, n);
+    *len += n;
+    key[(*len)++] = '\0';
+    return 1;
+}
+
+static int
+build_key(client_t *client, PyObject *env, char *key, size_t *key_len)
+{
+    char *v;
+    Py_ssize_t vlen;
+
+    *key_len = 0;
+    if(append_key(key, key_len, client->http_parser->http_minor == 1 ? "1" : "0", 1) == -1){
+        return -1;
+    }
+    if(!environ_get_string(env, "HTTP_HOST", &v, &vlen) &&
+            !environ_get_string(env, "SERVER_NAME", &v, &vlen)){
+        vlen = 0;
+    }
+    if(append_key(key, key_len, v, vlen) == -1){
+        return -1;
+    }
+    if(!environ_get_string(env, "PATH_INFO", &v, &vlen)){
+        return -1;
+    }
+    if(append_key(key, key_len, v, vlen) == -1){
+        return -1;
+    }
+    if(!environ_get_string(env, "QUERY_STRING", &v, &vlen)){
+        vlen = 0;
+    }
+    return append_key(key, key_len, v, vlen);
+}
+
+/*
+ * vary is a list of "ENVIRON_KEY\0" + ('1' value | '0') + "\0",
+ * '0' when the request did not have the header.
+ */
+static int
+vary_match(response_cache_entry *e, PyObject *env)
+{
+    const char *p = cache_entry_vary(e), *end = p + e->vary_len;
+    const char *name, *value;
+    char *v;
+    Py_ssize_t vlen;
+    size_t len;
+    int found;
+
+    while(p < end){
+        name = p;
+        p += strlen(p) + 1;
+        value = p + 1;
+        len = strlen(value);
+        found = environ_get_string(env, name, &v, &vlen);
+        if(*p == '0'){
+            if(found){
+                return 0;
+            }
+        }else if(!found || (size_t)vlen != len || memcmp(v, value, len)){
+            return 0;
+        }
+        p = value + len + 1;
+    }
+    return 1;
+}
+
+static size_t
+build_vary(PyObject *env, const char *vary, size_t vary_len, char *buf)
+{
+    const char *p = vary, *end = vary + vary_len, *s;
+    char *name, *v;
+    Py_ssize_t vlen;
+    size_t len = 0, n, i;
+
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')){
+            p++;
+        }
+        s = p;
+        while(p < end && *p != ',' && *p != ' ' && *p != '\t'){
+            p++;
+        }
+        n = p - s;
+        if(n == 0){
+            continue;
+        }
+        if((n == 1 && *s == '*') || len + n + 8 > CACHE_VARY_MAX){
+            return (size_t)-1;
+        }
+        name = buf + len;
+        if(!((n == 12 && !strncasecmp(s, "Content-Type", 12)) ||
+                (n == 14 && !strncasecmp(s, "Content-Length", 14)))){
+            memcpy(buf + len, "HTTP_", 5);
+            len += 5;
+        }
+        for(i = 0; i < n; i++){
+            buf[len++] = s[i] == '-' ? '_' : toupper((unsigned char)s[i]);
+        }
+        buf[len++] = '\0';
+        if(environ_get_string(env, name, &v, &vlen) && !memchr(v, '\0', vlen)){
+            if(len + vlen + 2 > CACHE_VARY_MAX){
+                return (size_t)-1;
+            }
+            buf[len++] = '1';
+            memcpy(buf + len, v, vlen);
+            len += vlen;
+        }else{
+            buf[len++] = '0';
+        }
+        buf[len++] = '\0';
+    }
+    return len;
+}
+
+/* ttl=N[, stale=M] in seconds */
+static int
+parse_cache_control(const char *p, size_t len, uintptr_t *ttl_msec, uintptr_t *stale_msec)
+{
+    const char *end = p + len, *s;
+    uintptr_t *target;
+    uintptr_t n;
+
+    *ttl_msec = *stale_msec = 0;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',' || *p == ';')){
+            p++;
+        }
+        if(p == end){
+            break;
+        }
+        s = p;
+        while(p < end && *p != '='){
+            p++;
+        }
+        if(p - s == 3 && !strncasecmp(s, "ttl", 3)){
+            target = ttl_msec;
+        }else if(p - s == 5 && !strncasecmp(s, "stale", 5)){
+            target = stale_msec;
+        }else{
+            return -1;
+        }
+        p++;
+        if(p >= end || *p < '0' || *p > '9'){
+            return -1;
+        }
+        n = 0;
+        while(p < end && *p >= '0' && *p <= '9'){
+            if(n > 86400 * 365){
+                return -1;
+            }
+            n = n * 10 + (*p++ - '0');
+        }
+        *target = n * 1000;
+    }
+    return *ttl_msec > 0 ? 1 : -1;
+}
+
+/*
+ * The response c was made (share) or will not be. Waiting requests are
+ * sent c or run the app themselves.
+ */
+static void
+wake_waiters(response_cache_entry *c, int share)
+{
+    response_cache_entry **p;
+    client_t *w, *next;
+
+    if(!c->in_flight){
+        return;
+    }
+    p = &flight_table[c->hash & (FLIGHT_HASH_SIZE - 1)];
+    while(*p != c){
+        p = &(*p)->flight_next;
+    }
+    *p = c->flight_next;
+    c->flight_next = NULL;
+    c->in_flight = 0;
+
+    for(w = c->waiters; w; w = next){
+        next = w->cache_wait_next;
+        w->cache_wait = NULL;
+        w->cache_wait_next = NULL;
+        if(share && vary_match(c, w->request_queue->head->environ)){
+            c->refcnt++;
+            w->cache_entry = c;
+        }
+        resume_cache_waiter(w);
+    }
+    c->waiters = NULL;
+}
+
+static size_t
+capture_limit(response_cache_entry *c)
+{
+    size_t limit = cache_limit / 8;
+
+    if(c->in_flight && limit < FLIGHT_MAX_SIZE){
+        limit = FLIGHT_MAX_SIZE;
+    }
+    return limit;
+}
+
+/* room for n more bytes of the response being stored */
+static response_cache_entry *
+grow_capture(client_t *client, size_t n)
+{
+    response_cache_entry *c = client->cache_capture;
+    size_t used = entry_used(c), size, limit = capture_limit(c);
+    char *data;
+
+    if(used + n <= c->size){
+        return c;
+    }
+    if(sizeof(response_cache_entry) + used + n > limit){
+        DEBUG("response cache entry too large %d", (int)(used + n));
+        c->capturing = 0;
+        wake_waiters(c, 0);
+        return NULL;
+    }
+    size = c->size * 2;
+    if(size < used + n){
+        size = used + n;
+    }
+    if(sizeof(response_cache_entry) + size > limit){
+        size = limit - sizeof(response_cache_entry);
+    }
+    data = PyMem_Realloc(c->data, size);
+    if(data == NULL){
+        c->capturing = 0;
+        wake_waiters(c, 0);
+        return NULL;
+    }
+    c->data = data;
+    c->size = size;
+    return c;
+}
+
+/* the same request of another client running in the app */
+static response_cache_entry *
+find_flight(const char *key, size_t key_len, uint32_t hash)
+{
+    response_cache_entry *c = flight_table[hash & (FLIGHT_HASH_SIZE - 1)];
+
+    while(c){
+        if(c->hash == hash && c->key_len == key_len && !memcmp(c->data, key, key_len)){
+            return c;
+        }
+        c = c->flight_next;
+    }
+    return NULL;
+}
+
+static int
+single_flight_request(PyObject *env)
+{
+    char *v;
+    Py_ssize_t vlen;
+
+    // maybe a response for this user only
+    return use_single_flight &&
+        !environ_get_string(env, "HTTP_COOKIE", &v, &vlen) &&
+        !environ_get_string(env, "HTTP_AUTHORIZATION", &v, &vlen);
+}
+
+/*
+ * GET request of client. A fresh (or, while it is being replaced,
+ * stale) entry is returned with a reference, otherwise the response of
+ * the app may be stored. With single flight the request may be parked
+ * (client->cache_wait) behind the same request of another client.
+ */
+response_cache_entry *
+lookup_response_cache(client_t *client, PyObject *env)
+{
+    response_cache_entry *e, *next, *found = NULL, *revalidate = NULL, *c;
+    char key[CACHE_KEY_MAX];
+    char *method;
+    Py_ssize_t method_len;
+    size_t key_len;
+    uint32_t hash;
+    int flight;
+
+    if(!environ_get_string(env, "REQUEST_METHOD", &method, &method_len) ||
+            method_len != 3 || memcmp(method, "GET", 3)){
+        return NULL;
+    }
+    if(build_key(client, env, key, &key_len) == -1){
+        return NULL;
+    }
+    hash = key_hash(key, key_len);
+    e = hash_table[hash & (RESPONSE_CACHE_HASH_SIZE - 1)];
+    while(e){
+        next = e->hash_next;
+        if(e->hash == hash && e->key_len == key_len && !memcmp(e->data, key, key_len) &&
+                vary_match(e, env)){
+            if(current_msec < e->expires_msec){
+                cache_hits++;
+                found = e;
+            }else if(current_msec < e->stale_msec){
+                if(e->updating){
+                    cache_stale_hits++;
+                    found = e;
+                }else{
+                    // this request replaces it
+                    e->updating = 1;
+                    e->refcnt++;
+                    revalidate = e;
+                }
+            }else{
+                evict_entry(e);
+                e = next;
+                continue;
+            }
+            break;
+        }
+        e = next;
+    }
+    if(found){
+        lru_unlink(found);
+        lru_push(found);
+        found->refcnt++;
+        return found;
+    }
+
+    flight = revalidate == NULL && single_flight_request(env);
+    if(flight){
+        c = find_flight(key, key_len, hash);
+        if(c){
+            DEBUG("response cache wait client:%p for %p", client, c);
+            cache_coalesced++;
+            client->cache_wait = c;
+            client->cache_wait_next = c->waiters;
+            c->waiters = client;
+            return NULL;
+        }
+    }
+
+    cache_misses++;
+    c = PyMem_Malloc(sizeof(response_cache_entry));
+    if(c){
+        memset(c, 0, sizeof(response_cache_entry));
+        c->data = PyMem_Malloc(key_len + CAPTURE_INITIAL_SIZE);
+    }
+    if(c == NULL || c->data == NULL){
+        PyMem_Free(c);
+        if(revalidate){
+            revalidate->updating = 0;
+            release_response_cache_entry(revalidate);
+        }
+        return NULL;
+    }
+    c->revalidate = revalidate;
+    c->hash = hash;
+    c->key_len = key_len;
+    c->size = key_len + CAPTURE_INITIAL_SIZE;
+    memcpy(c->data, key, key_len);
+    if(flight){
+        c->in_flight = 1;
+        c->flight_next = flight_table[hash & (FLIGHT_HASH_SIZE - 1)];
+        flight_table[hash & (FLIGHT_HASH_SIZE - 1)] = c;
+    }
+    client->cache_capture = c;
+    return NULL;
+}
+
+int
+has_response_cache(void)
+{
+    return cache_limit > 0 || use_single_flight;
+}
+
+/*
+ * Called with the serialized headers of the response.
+ * header[0:prefix_len] is the status line and Server,
+ * header[app_start:app_end] the app headers. control is the value of
+ * X-Meinheld-Cache, NULL when the response is only sent to waiting
+ * requests.
+ */
+int
+start_response_capture(client_t *client, PyObject *env, const char *control, size_t control_len,
+        const char *vary, size_t vary_len, const char *header, size_t prefix_len,
+        size_t app_start, size_t app_end)
+{
+    response_cache_entry *c = client->cache_capture;
+    char vary_buf[CACHE_VARY_MAX];
+    uintptr_t ttl_msec = 0, stale_msec = 0;
+    size_t vlen = 0;
+    char *p;
+
+    if(control && cache_limit &&
+            parse_cache_control(control, control_len, &ttl_msec, &stale_msec) == -1){
+        DEBUG("invalid X-Meinheld-Cache %.*s", (int)control_len, control);
+        ttl_msec = 0;
+    }
+    if(ttl_msec == 0 && !c->in_flight){
+        return 0;
+    }
+    if(vary){
+        vlen = build_vary(env, vary, vary_len, vary_buf);
+        if(vlen == (size_t)-1){
+            return 0;
+        }
+    }
+    c->capturing = 1;
+    c = grow_capture(client, vlen + prefix_len + app_end - app_start);
+    if(c == NULL){
+        return 0;
+    }
+    p = c->data + c->key_len;
+    memcpy(p, vary_buf, vlen);
+    p += vlen;
+    memcpy(p, header, prefix_len);
+    p += prefix_len;
+    memcpy(p, header + app_start, app_end - app_start);
+    c->vary_len = vlen;
+    c->prefix_len = prefix_len;
+    c->headers_len = app_end - app_start;
+    c->status_code = client->status_code;
+    // lifetimes until the response is stored, 0 is not stored
+    c->expires_msec = ttl_msec;
+    c->stale_msec = stale_msec;
+    return 1;
+}
+
+void
+response_capture_data(client_t *client, const char *data, size_t len)
+{
+    response_cache_entry *c = client->cache_capture;
+
+    if(!c->capturing){
+        return;
+    }
+    c = grow_capture(client, len);
+    if(c == NULL){
+        return;
+    }
+    memcpy(cache_entry_body(c) + c->body_len, data, len);
+    c->body_len += len;
+}
+
+static void
+free_capture(client_t *client)
+{
+    response_cache_entry *c = client->cache_capture;
+
+    wake_waiters(c, 0);
+    end_revalidate(c);
+    client->cache_capture = NULL;
+    // else sent to waiting requests, the last release frees it
+    if(c->refcnt == 0){
+        free_entry(c);
+    }
+}
+
+/* the response is not stored or shared, a stale entry is sent until the request ends */
+void
+abandon_response_capture(client_t *client)
+{
+    response_cache_entry *c = client->cache_capture;
+
+    if(c){
+        c->capturing = 0;
+        wake_waiters(c, 0);
+    }
+}
+
+/* the whole body was captured */
+void
+store_response_capture(client_t *client)
+{
+    response_cache_entry *c = client->cache_capture, *e, *next;
+    PyObject *env = client->current_req->environ;
+    char *data;
+    size_t used;
+
+    if(!c->capturing ||
+            (client->content_length_set && client->content_length != c->body_len)){
+        DEBUG("response cache body %d != Content-Length %d", (int)c->body_len, (int)client->content_length);
+        free_capture(client);
+        return;
+    }
+    c->capturing = 0;
+    used = entry_used(c);
+    data = PyMem_Realloc(c->data, used);
+    if(data){
+        c->data = data;
+        c->size = used;
+    }
+    if(c->expires_msec == 0 || sizeof(response_cache_entry) + c->size > cache_limit / 8){
+        // for waiting requests only
+        wake_waiters(c, 1);
+        free_capture(client);
+        return;
+    }
+
+    // the same variant of an older response
+    e = hash_table[c->hash & (RESPONSE_CACHE_HASH_SIZE - 1)];
+    while(e){
+        next = e->hash_next;
+        if(e->hash == c->hash && e->key_len == c->key_len &&
+                !memcmp(e->data, c->data, c->key_len) && vary_match(e, env)){
+            evict_entry(e);
+        }
+        e = next;
+    }
+    end_revalidate(c);
+    client->cache_capture = NULL;
+
+    while(cache_bytes + sizeof(response_cache_entry) + c->size > cache_limit && lru_tail){
+        evict_entry(lru_tail);
+        cache_evictions++;
+    }
+    c->cached = 1;
+    c->expires_msec += current_msec;
+    c->stale_msec += c->expires_msec;
+    c->hash_next = hash_table[c->hash & (RESPONSE_CACHE_HASH_SIZE - 1)];
+    hash_table[c->hash & (RESPONSE_CACHE_HASH_SIZE - 1)] = c;
+    lru_push(c);
+    cache_cnt++;
+    cache_bytes += sizeof(response_cache_entry) + c->size;
+    cache_stores++;
+    DEBUG("response cache store %p status:%d body:%d", c, c->status_code, (int)c->body_len);
+    wake_waiters(c, 1);
+}
+
+/* end of a request */
+void
+release_response_cache(client_t *client)
+{
+    response_cache_entry *c = client->cache_wait;
+    client_t **p;
+
+    if(client->cache_entry){
+        release_response_cache_entry(client->cache_entry);
+        client->cache_entry = NULL;
+    }
+    if(client->cache_capture){
+        free_capture(client);
+    }
+    if(c){
+        // closed while waiting
+        p = &c->waiters;
+        while(*p != client){
+            p = &(*p)->cache_wait_next;
+        }
+        *p = client->cache_wait_next;
+        client->cache_wait = NULL;
+        client->cache_wait_next = NULL;
+    }
+}
+
+void
+clear_response_cache(void)
+{
+    while(lru_tail){
+        evict_entry(lru_tail);
+    }
+}
+
+void
+set_response_cache_size(size_t size)
+{
+    cache_limit = size;
+    while(cache_bytes > cache_limit && lru_tail){
+        evict_entry(lru_tail);
+        cache_evictions++;
+    }
+}
+
+size_t
+get_response_cache_size(void)
+{
+    return cache_limit;
+}
+
+PyObject*
+get_response_cache_stats(void)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:i,s:K}",
+            "hits", cache_hits,
+            "stale_hits", cache_stale_hits,
+            "misses", cache_misses,
+            "coalesced", cache_coalesced,
+            "stores", cache_stores,
+            "evictions", cache_evictions,
+            "entries", cache_cnt,
+            "bytes", (unsigned long long)cache_bytes);
+}
@@ -0,0 +1,69 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "meinheld.h"
+#include "client.h"
+
+/**
+ * cached response, data is [key][vary][prefix][headers][body].
+ * prefix is the status line and Server, headers the app headers
+ * without Date, Content-Length and Connection. While the response is
+ * made it is also the entry waiting requests are parked on.
+ */
+typedef struct response_cache_entry {
+    struct response_cache_entry *hash_next;
+    struct response_cache_entry *lru_prev;
+    struct response_cache_entry *lru_next;
+    struct response_cache_entry *revalidate; // stale entry this response replaces
+    struct response_cache_entry *flight_next;
+    client_t *waiters;          // requests waiting for this response
+    int refcnt;                 // responses sending body
+    uint8_t cached;             // still in the cache
+    uint8_t updating;           // a request is revalidating the stale entry
+    uint8_t capturing;          // the response is being stored
+    uint8_t in_flight;          // requests may wait for it
+    uint16_t status_code;
+    uint32_t hash;
+    uintptr_t expires_msec;
+    uintptr_t stale_msec;       // stale copy is sent until
+    size_t key_len;
+    size_t vary_len;
+    size_t prefix_len;
+    size_t headers_len;
+    size_t body_len;
+    size_t size;                // data allocated
+    char *data;
+} response_cache_entry;
+
+#define cache_entry_vary(e) ((e)->data + (e)->key_len)
+#define cache_entry_prefix(e) (cache_entry_vary(e) + (e)->vary_len)
+#define cache_entry_headers(e) (cache_entry_prefix(e) + (e)->prefix_len)
+#define cache_entry_body(e) (cache_entry_headers(e) + (e)->headers_len)
+
+int has_response_cache(void);
+
+response_cache_entry* lookup_response_cache(client_t *client, PyObject *env);
+
+void release_response_cache_entry(response_cache_entry *e);
+
+int start_response_capture(client_t *client, PyObject *env, const char *control, size_t control_len,
+        const char *vary, size_t vary_len, const char *header, size_t prefix_len,
+        size_t app_start, size_t app_end);
+
+void response_capture_data(client_t *client, const char *data, size_t len);
+
+void store_response_capture(client_t *client);
+
+void abandon_response_capture(client_t *client);
+
+void release_response_cache(client_t *client);
+
+void clear_response_cache(void);
+
+void set_response_cache_size(size_t size);
+
+size_t get_response_cache_size(void);
+
+PyObject* get_response_cache_stats(void);
+
+#endif
@@ -1,6 +1,7 @@
 #include "server.h"
 
 #include <arpa/inet.h>
+#include <math.h>
 #include <signal.h>
 
 #ifdef linux
@@ -10,27 +11,40 @@
 
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "http_request_parser.h"
+#include "http_fast_parser.h"
+#include "environ.h"
 #include "response.h"
+#include "static_file.h"
+#include "response_cache.h"
+#include "compress.h"
 #include "log.h"
 #include "client.h"
 #include "util.h"
 #include "input.h"
 #include "timer.h"
-#include "heapq.h"
+#include "timer_wheel.h"
 
 #ifdef WITH_GREENLET
 #include "greensupport.h"
 #endif
 
-#define ACCEPT_TIMEOUT_SECS 1
-#define READ_TIMEOUT_SECS 30
+#define ACCEPT_TIMEOUT_MSEC 1000
+#define WRITE_TIMEOUT_MSEC 300000
+#define TIMEOUT_WHEEL_MSEC 128 // fd timeouts in 1msec slots
+#define LOOP_MAX_WAIT 10000 // msec the loop sleeps with nothing due
+#define RUN_QUEUE_BUDGET 256 // pending calls run between two polls
+#define RUN_QUEUE_BUDGET_MSEC 5 // msec of pending calls between two polls
 
 #define READ_BUF_SIZE 1024 * 64
+#define READ_BUDGET READ_BUF_SIZE * 16 // bytes read from a client per event
+#define SPLICE_PIPE_SIZE 1024 * 1024
 
 typedef struct {
-   TimerObject **q;
+   TimerObject **q;   // ring, max is a power of 2
+   uint32_t head;     // next to run
    uint32_t size;
    uint32_t max;
 } pending_queue_t;
@@ -45,7 +59,7 @@ static volatile sig_atomic_t call_shutdown = 0;
 static volatile sig_atomic_t catch_signal = 0;
 
 static picoev_loop* main_loop = NULL; //main loop
-static heapq_t *g_timers;
+static timer_wheel_t *g_timers;
 static pending_queue_t *g_pendings = NULL;
 
 // active event cnt
@@ -58,12 +72,33 @@ static PyObject *watchdog = NULL; //watchdog
 static char is_write_access_log = 0;
 
 static int is_keep_alive = 0; //keep alive support
-static int keep_alive_timeout = 5;
+static int keep_alive_timeout = 5000; //msec
+static int client_read_timeout = 30000; //msec a client may stay silent mid request
 
 uint64_t max_content_length = 1024 * 1024 * 16; //max_content_length
 int client_body_buffer_size = 1024 * 500;  //client_body_buffer_size
+int use_fast_parser = 0; //parse request head with http_fast_parser
+int use_lazy_environ = 0; //set HTTP_* environ items on access
+int use_header_cache = 0; //reuse serialized status line and headers
+int write_coalesce_size = 1024 * 64; //response items written with one writev
+int use_single_flight = 0; //identical GETs wait for the running one
+int use_streaming_input = 0; //the app runs before the body is read
+int use_form_parser = 0; //multipart/form-data bodies parsed to meinheld.form
+int form_file_parts_max = 32; //file parts of a form, each holds a spool fd
+
+#ifdef linux
+static int splice_pipe[2] = {-1, -1}; // spooled bodies pass it
+static int splice_failed = 0; // splice() does not work here, bodies are read
+#endif
 
 static char *unix_sock_name = NULL;
+static char is_inet_listen = 0; // listen socket created by listen((host, port))
+
+/* prefork workers */
+static int num_workers = 0;
+static pid_t *worker_pids = NULL;
+static time_t *worker_spawned = NULL;
+static char is_worker = 0;
 
 static int backlog = 1024 * 4; // backlog size
 static int max_fd = 1024 * 4;  // picoev max_fd
@@ -72,6 +107,7 @@ static int max_fd = 1024 * 4;  // picoev max_fd
 static PyObject *hub_switch_value;
 PyObject* current_client;
 PyObject* timeout_error;
+static PyObject* greenlet_required; // an app called without a greenlet has to wait
 
 /* reuse object */
 static PyObject *client_key = NULL; //meinheld.client
@@ -84,8 +120,28 @@ static PyObject *empty_string = NULL; //""
 
 static PyObject *app_handler_func = NULL;
 
+/* greenlet='lazy': the app runs on the hub stack until it has to wait */
+static char lazy_greenlet = 0;
+static char need_greenlet = 0; // the app had to wait on the hub, no more direct calls
+static int direct_depth = 0;   // direct app calls on the hub stack
+static char hub_waited = 0;    // the current direct call tried to wait
+
+/* loop stats */
+static uint64_t loop_wakeups = 0;
+static uint64_t timers_fired = 0;
+static uint64_t timer_late_msec = 0;
+static uint64_t timer_late_max_msec = 0;
+static uint32_t run_queue_max = 0;
+static uint64_t run_queue_runs = 0;
+static uint64_t run_queue_wait_msec = 0;
+static uint64_t run_queue_wait_max_msec = 0;
+static uint64_t run_queue_deferred = 0;
+static uint64_t app_greenlets = 0;
+static uint64_t app_direct_calls = 0;
+static uint64_t app_hub_waits = 0;
+
 /* gunicorn */
-static time_t watchdog_lasttime;
+static uintptr_t watchdog_lasttime; // sec
 static int spinner = 0;
 static int tempfile_fd = 0;
 static int gtimeout = 0;
@@ -99,10 +155,8 @@ static int client_numfree = 0;
 static void
 read_callback(picoev_loop* loop, int fd, int events, void* cb_arg);
 
-#ifndef WITH_GREENLET
 static void
 write_callback(picoev_loop* loop, int fd, int events, void* cb_arg);
-#endif
 
 static void
 kill_callback(picoev_loop* loop, int fd, int events, void* cb_arg);
@@ -111,7 +165,7 @@ static void
 trampoline_callback(picoev_loop* loop, int fd, int events, void* cb_arg);
 
 static PyObject*
-internal_schedule_call(int seconds, PyObject *cb, PyObject *args, PyObject *kwargs, PyObject *greenlet);
+internal_schedule_call(uintptr_t msec, PyObject *cb, PyObject *args, PyObject *kwargs, PyObject *greenlet);
 
 static int
 prepare_call_wsgi(client_t *client);
@@ -122,6 +176,12 @@ call_wsgi_handler(client_t *client);
 static int
 check_status_code(client_t *client);
 
+static int
+request_ready(client_t *client);
+
+static void
+run_requests(client_t *client);
+
 static pending_queue_t*
 init_pendings(void)
 {
@@ -131,6 +191,7 @@ init_pendings(void)
     if (pendings == NULL) {
         return NULL;
     }
+    pendings->head = 0;
     pendings->size = 0;
     pendings->max= 1024;
     pendings->q = (TimerObject**)malloc(sizeof(TimerObject*) * pendings->max);
@@ -142,43 +203,59 @@ init_pendings(void)
 }
 
 static int
-realloc_pendings(void)
+push_pending(TimerObject *timer)
 {
-    TimerObject **new_heap;
-    uint32_t max;
+    TimerObject **q;
+    uint32_t i;
     pending_queue_t *pendings = g_pendings;
 
     if (pendings->size >= pendings->max) {
-        //realloc
-        max = pendings->max * 2;
-        new_heap = (TimerObject**)realloc(pendings->q, sizeof(TimerObject*) * max);
-        if (new_heap == NULL) {
+        //grow, the calls keep their order from the start of the new ring
+        q = (TimerObject**)malloc(sizeof(TimerObject*) * pendings->max * 2);
+        if (q == NULL) {
             PyErr_SetString(PyExc_Exception, "size over timer queue");
             return -1;
         }
-        pendings->max = max;
-        pendings->q = new_heap;
+        for (i = 0; i < pendings->size; i++) {
+            q[i] = pendings->q[(pendings->head + i) & (pendings->max - 1)];
+        }
+        free(pendings->q);
+        pendings->q = q;
+        pendings->head = 0;
+        pendings->max *= 2;
         RDEBUG("realloc max:%d", pendings->max);
     }
+    pendings->q[(pendings->head + pendings->size) & (pendings->max - 1)] = timer;
+    pendings->size++;
+    if (pendings->size > run_queue_max) {
+        run_queue_max = pendings->size;
+    }
     return 1;
 }
 
+static TimerObject*
+pop_pending(void)
+{
+    TimerObject *timer;
+    pending_queue_t *pendings = g_pendings;
+
+    timer = pendings->q[pendings->head];
+    pendings->head = (pendings->head + 1) & (pendings->max - 1);
+    pendings->size--;
+    return timer;
+}
+
 static void
 destroy_pendings(void)
 {
-    int i = 0, len; 
     TimerObject *timer = NULL;
-    TimerObject **t = g_pendings->q;
     if (g_pendings == NULL) {
         return;
     }
-    len = g_pendings->size;
-    t += i;
 
-    while(len--) {
-        timer = *t;
+    while(g_pendings->size) {
+        timer = pop_pending();
         Py_DECREF(timer);
-        t++;
     }
 
     free(g_pendings->q);
@@ -219,7 +296,8 @@ alloc_client_t(void)
         client = (client_t *)PyMem_Malloc(sizeof(client_t));
         GDEBUG("alloc %p", client);
     }
-    memset(client, 0, sizeof(client_t));
+    // write_arena and header_buf are set up by new_write_bucket
+    memset(client, 0, offsetof(client_t, write_arena));
     return client;
 }
 
@@ -308,8 +386,13 @@ clean_client(client_t *client)
         } else {
             if (client->status_code != 408) {
                 environ = new_environ(client);
-                set_log_value(client, environ, delta_msec);
-                call_access_logger(environ);
+                if (environ) {
+                    set_log_value(client, environ, delta_msec);
+                    call_access_logger(environ);
+                    Py_DECREF(environ);
+                } else {
+                    PyErr_Clear();
+                }
             }
         }
     }
@@ -318,25 +401,43 @@ clean_client(client_t *client)
     Py_CLEAR(client->headers);
     Py_CLEAR(client->response_iter);
     Py_CLEAR(client->response);
+    // unsent items of a failed response
+    discard_write(client);
+    free_file_ranges(client);
+    if (client->static_file) {
+        release_static_file(client->static_file);
+        client->static_file = NULL;
+    }
+    release_response_cache(client);
+    if (client->compress) {
+        release_compress_stream(client->compress);
+        client->compress = NULL;
+    }
 
     if (req == NULL) {
         goto init;
     }
 
     DEBUG("status_code:%d env:%p", client->status_code, req->environ);
+    if (req->input) {
+        // the input object owns the buffer
+        end_input_stream(req->input);
+        Py_CLEAR(req->input);
+        req->body = NULL;
+    }
     if (req->environ) { 
         /* PyDict_Clear(client->environ); */
         /* DEBUG("CLEAR environ"); */
         Py_CLEAR(req->environ);
     }
     if (req->body) {
-        if (req->body_type == BODY_TYPE_TMPFILE) {
-            fclose(req->body);
-        } else {
-            free_buffer(req->body);
-        }
+        free_buffer(req->body);
         req->body = NULL;
     }
+    if (req->body_fd != -1) {
+        close(req->body_fd);
+        req->body_fd = -1;
+    }
     free_request(req);
 
 init:
@@ -344,9 +445,12 @@ init:
     client->header_done = 0;
     client->response_closed = 0;
     client->chunked_response = 0;
+    client->body_done = 0;
     client->content_length_set = 0;
     client->content_length = 0;
     client->write_bytes = 0;
+    client->file_offset = 0;
+    client->file_end = 0;
 }
 
 static void
@@ -358,6 +462,11 @@ close_client(client_t *client)
     if (!client->response_closed) {
         close_response(client);
     }
+    if (client->current_req && client->current_req->body_type == BODY_TYPE_STREAM &&
+            !client->current_req->complete) {
+        // the rest of the body is not read, the parser can not go on
+        client->keep_alive = 0;
+    }
     DEBUG("start close client:%p fd:%d status_code %d", client, client->fd, client->status_code);
 
     if (picoev_is_active(main_loop, client->fd)) {
@@ -371,14 +480,20 @@ close_client(client_t *client)
     clean_client(client);
 
     DEBUG("remain http pipeline size :%d", client->request_queue->size);
-    if (client->request_queue->size > 0) {
-        if (check_status_code(client) > 0) {
-            //process pipeline
-            if (prepare_call_wsgi(client) > 0) {
-                call_wsgi_handler(client);
-            }
+    // without keep-alive the queued requests are dropped with the connection
+    if (client->keep_alive && request_ready(client)) {
+        //process pipeline
+        run_requests(client);
+        return;
+    }
+    disable_cork(client);
+    if (client->request_queue->size > 0 && client->keep_alive) {
+        // next pipelined request is still being read, keep the parser
+        ret = picoev_add(main_loop, client->fd, PICOEV_READ, client_read_timeout, read_callback, (void *)client);
+        if (ret == 0) {
+            activecnt++;
         }
-        return ;
+        return;
     }
 
     if (client->http_parser != NULL) {
@@ -410,7 +525,7 @@ static void init_main_loop(void)
         /* init picoev */
         picoev_init(max_fd);
         /* create loop */
-        main_loop = picoev_create_loop(60);
+        main_loop = picoev_create_loop(TIMEOUT_WHEEL_MSEC);
     }
 }
 
@@ -462,9 +577,9 @@ kill_server(int timeout)
                 //shutdown timeout
                 if (timeout > 0) {
                     //set timeout
-                    (void)picoev_add(main_loop, listen_sock, PICOEV_TIMEOUT, timeout, kill_callback, NULL);
+                    (void)picoev_add(main_loop, listen_sock, PICOEV_TIMEOUT, timeout * 1000, kill_callback, NULL);
                 } else {
-                    (void)picoev_add(main_loop, listen_sock, PICOEV_TIMEOUT, 1, kill_callback, NULL);
+                    (void)picoev_add(main_loop, listen_sock, PICOEV_TIMEOUT, 1000, kill_callback, NULL);
                 }
                 set_callback = 1;
             }
@@ -506,6 +621,7 @@ check_status_code(client_t *client)
         DEBUG("bad status code %d", req->bad_request_code);
         set_current_request(client);
         client->status_code = req->bad_request_code;
+        client->keep_alive = 0;
         send_error_page(client);
         close_client(client);
         return -1;
@@ -513,6 +629,177 @@ check_status_code(client_t *client)
     return 1;
 }
 
+/* head of the pipeline is complete, streams its body (or failed), it can run */
+static int
+request_ready(client_t *client)
+{
+    request *req = client->request_queue->head;
+    return req != NULL && (req->complete || req->body_type == BODY_TYPE_STREAM ||
+            req->bad_request_code > 200);
+}
+
+static client_t *running_client = NULL; // client in the run_requests loop
+static char run_next = 0;
+
+static void
+direct_write_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
+{
+    client_t *client = (client_t *)cb_arg;
+
+    if ((events & PICOEV_TIMEOUT) != 0) {
+        DEBUG("** direct_write_callback timeout **");
+        client->keep_alive = 0;
+        close_client(client);
+    } else if ((events & PICOEV_WRITE) != 0) {
+        if (process_body(client) != STATUS_SUSPEND) {
+            close_client(client);
+        }
+    }
+}
+
+/* finish a response the server made without the app */
+static void
+end_direct_response(client_t *client, response_status status)
+{
+    int ret, active;
+
+    switch (status) {
+        case STATUS_ERROR:
+            client->keep_alive = 0;
+            if (!client->header_done) {
+                client->status_code = 500;
+                send_error_page(client);
+            }
+            close_client(client);
+            break;
+        case STATUS_SUSPEND:
+            active = picoev_is_active(main_loop, client->fd);
+            ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, WRITE_TIMEOUT_MSEC, direct_write_callback, (void *)client);
+            if ((ret == 0 && !active)) {
+                activecnt++;
+            }
+            break;
+        default:
+            close_client(client);
+    }
+}
+
+/*
+ * GET/HEAD under a static mount, answered without calling the app.
+ * Returns 0 when the request goes to the app.
+ */
+static int
+call_static_handler(client_t *client)
+{
+    static_file *f;
+
+    f = lookup_static_file(client->request_queue->head->environ);
+    if (f == NULL) {
+        return 0;
+    }
+    set_current_request(client);
+    client->keep_alive = client->current_req->keep_alive && is_keep_alive;
+    client->static_file = f;
+    end_direct_response(client, response_start_static(client));
+    return 1;
+}
+
+/*
+ * GET in the response cache, answered without the input object, a
+ * greenlet or the app. Returns 0 when the request goes to the app.
+ */
+static int
+call_cached_handler(client_t *client)
+{
+    response_cache_entry *e;
+
+    // set when the request waited for the same request of another client
+    e = client->cache_entry;
+    if (e == NULL) {
+        e = lookup_response_cache(client, client->request_queue->head->environ);
+        if (e == NULL) {
+            // parked until resume_cache_waiter
+            return client->cache_wait != NULL;
+        }
+    }
+    set_current_request(client);
+    client->keep_alive = client->current_req->keep_alive && is_keep_alive;
+    client->cache_entry = e;
+    end_direct_response(client, response_start_cached(client));
+    return 1;
+}
+
+static void
+cache_waiter_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
+{
+    client_t *client = (client_t *)cb_arg;
+
+    if (!picoev_del(loop, fd)) {
+        activecnt--;
+        DEBUG("activecnt:%d", activecnt);
+    }
+    run_requests(client);
+}
+
+/*
+ * The request client waited for is done, run its requests again from
+ * the loop, the waker may be deep in another response.
+ */
+void
+resume_cache_waiter(client_t *client)
+{
+    int ret, active;
+
+    active = picoev_is_active(main_loop, client->fd);
+    ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 0, cache_waiter_callback, (void *)client);
+    if ((ret == 0 && !active)) {
+        activecnt++;
+    }
+}
+
+/*
+ * Run the ready requests of client in order.
+ * A request finishing inside the loop (close_client) only sets run_next,
+ * so a deep pipeline does not nest close_client -> call_wsgi_handler.
+ * While more than one request is queued the socket is corked, the
+ * responses go out in full segments and close_client uncorks after the
+ * last one.
+ */
+static void
+run_requests(client_t *client)
+{
+    client_t *prev_client;
+    char prev_next;
+
+    if (running_client == client) {
+        run_next = 1;
+        return;
+    }
+    prev_client = running_client;
+    prev_next = run_next;
+    running_client = client;
+    do {
+        run_next = 0;
+        if (client->request_queue->size > 1 && !client->use_cork) {
+            enable_cork(client);
+        }
+        if (check_status_code(client) > 0) {
+            if (has_static_mounts() && call_static_handler(client)) {
+                continue;
+            }
+            if ((has_response_cache() || client->cache_entry) && call_cached_handler(client)) {
+                continue;
+            }
+            //current request ok
+            if (prepare_call_wsgi(client) > 0) {
+                call_wsgi_handler(client);
+            }
+        }
+    } while (run_next);
+    running_client = prev_client;
+    run_next = prev_next;
+}
+
 static PyObject *
 app_handler(PyObject *self, PyObject *args)
 {
@@ -543,6 +830,19 @@ app_handler(PyObject *self, PyObject *args)
     Py_DECREF(wsgi_args);
     DEBUG("called wsgi app");
 
+#ifdef WITH_GREENLET
+    if (pyclient->greenlet == NULL && hub_waited) {
+        // fail the request even if the app caught greenlet_required
+        if (res) {
+            // log it now, close_response clears the error
+            PyErr_SetString(greenlet_required, "the app waited without a greenlet");
+            call_error_logger();
+            client->response = res;
+        }
+        goto error;
+    }
+#endif
+
     //check response & PyErr_Occurred
     if (res && res == Py_None) {
         PyErr_SetString(PyExc_Exception, "response must be a iter or sequence object");
@@ -563,6 +863,10 @@ app_handler(PyObject *self, PyObject *args)
     status = response_start(client);
 
 #ifdef WITH_GREENLET
+    if (pyclient->greenlet == NULL) {
+        // called on the hub stack, the rest of the body goes from write_callback
+        goto write_later;
+    }
     while(status != STATUS_OK) {
         if (status == STATUS_ERROR) {
             // Internal Server Error
@@ -570,7 +874,7 @@ app_handler(PyObject *self, PyObject *args)
             goto error;
         } else {
             active = picoev_is_active(main_loop, client->fd);
-            ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 300, trampoline_callback, (void *)pyclient);
+            ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, WRITE_TIMEOUT_MSEC, trampoline_callback, (void *)pyclient);
             if ((ret == 0 && !active)) {
                 activecnt++;
             }
@@ -593,7 +897,10 @@ app_handler(PyObject *self, PyObject *args)
     }
     // send OK
     close_client(client);
-#else
+    Py_RETURN_NONE;
+
+write_later:
+#endif
     switch(status) {
         case STATUS_ERROR:
             // Internal Server Error
@@ -603,15 +910,15 @@ app_handler(PyObject *self, PyObject *args)
             // continue
             // set callback
             active = picoev_is_active(main_loop, client->fd);
-            ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 300, write_callback, (void *)pyclient);
+            ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, WRITE_TIMEOUT_MSEC, write_callback, (void *)pyclient);
             if ((ret == 0 && !active)) {
                 activecnt++;
             }
+            break;
         default:
             // send OK
             close_client(client);
     }
-#endif
     Py_RETURN_NONE;
 
 error:
@@ -696,6 +1003,33 @@ resume_wsgi_handler(ClientObject *pyclient)
     Py_CLEAR(pyclient->kwargs);
     Py_XDECREF(res);
 }
+
+/*
+ * True when the caller is an app called on the hub stack (greenlet='lazy')
+ * and there is no greenlet to switch away from.
+ */
+static int
+on_hub_stack(PyObject *parent)
+{
+    return parent == NULL && direct_depth > 0;
+}
+
+/*
+ * The app called on the hub stack has to wait. Raise greenlet_required,
+ * app_handler answers the request with 500 and from now on every request
+ * gets a greenlet.
+ */
+static void
+set_greenlet_required(void)
+{
+    if (!need_greenlet) {
+        RDEBUG("app waits on the hub, greenlets from now on");
+        need_greenlet = 1;
+    }
+    hub_waited = 1;
+    app_hub_waits++;
+    PyErr_SetString(greenlet_required, "the app can not wait without a greenlet");
+}
 #endif
 
 static void
@@ -704,6 +1038,9 @@ call_wsgi_handler(client_t *client)
     PyObject *handler, *greenlet, *args, *res;
     ClientObject *pyclient;
     request *req = NULL;
+#ifdef WITH_GREENLET
+    char prev_waited;
+#endif
 
     handler = get_app_handler();
     req = client->current_req;
@@ -712,6 +1049,22 @@ call_wsgi_handler(client_t *client)
 
     args = PyTuple_Pack(1, req->environ);
 #ifdef WITH_GREENLET
+    // a streamed body is read while the app runs, it waits for the body
+    if (lazy_greenlet && !need_greenlet && req->input == NULL) {
+        // no greenlet until the app has to wait
+        pyclient->greenlet = NULL;
+        app_direct_calls++;
+        prev_waited = hub_waited;
+        hub_waited = 0;
+        direct_depth++;
+        res = PyObject_CallObject(handler, args);
+        direct_depth--;
+        hub_waited = prev_waited;
+        Py_XDECREF(res);
+        Py_DECREF(args);
+        return;
+    }
+    app_greenlets++;
     //new greenlet
     greenlet = greenlet_new(handler, NULL);
     // set_greenlet
@@ -761,7 +1114,7 @@ timeout_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
     if ((events & PICOEV_TIMEOUT) != 0) {
         DEBUG("timeout_callback pyclient:%p client:%p fd:%d", pyclient, pyclient->client, pyclient->client->fd);
         //next intval 30sec
-        picoev_set_timeout(loop, client->fd, 30);
+        picoev_set_timeout(loop, client->fd, 30000);
         // is_active ??
         if (write(client->fd, "", 0) < 0) {
             if (!picoev_del(loop, fd)) {
@@ -816,7 +1169,6 @@ trampoline_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 }
 #endif
 
-#ifndef WITH_GREENLET
 static void
 write_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 {
@@ -834,15 +1186,25 @@ write_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
         close_client(client);
 
     } else if ((events & PICOEV_WRITE) != 0) {
+#ifdef WITH_GREENLET
+        // the body of a direct call (greenlet='lazy') is iterated on the hub
+        if (pyclient->greenlet == NULL) {
+            direct_depth++;
+            ret = process_body(client);
+            direct_depth--;
+        } else {
+            ret = process_body(client);
+        }
+#else
         ret = process_body(client);
+#endif
         DEBUG("process_body ret %d", ret);
-        if (ret != 0) {
+        if (ret != STATUS_SUSPEND) {
             //ok or die
             close_client(client);
         }
     }
 }
-#endif
 
 static int
 check_http_expect(client_t *client)
@@ -854,7 +1216,7 @@ check_http_expect(client_t *client)
 
     if (client->http_parser->http_minor == 1) {
         ///TODO CHECK
-        c = PyDict_GetItemString(req->environ, "HTTP_EXPECT");
+        c = environ_get_item_string(req->environ, "HTTP_EXPECT");
         if (c) {
             val = PyBytes_AS_STRING(c);
             if (!strncasecmp(val, "100-continue", 12)) {
@@ -889,25 +1251,22 @@ static int
 set_input_file(client_t *client)
 {
     PyObject *input;
-    int fd;
     request *req = client->current_req;
 
-    FILE *tmp = (FILE *)req->body;
-    fflush(tmp);
-    rewind(tmp);
-    
-    fd = fileno(tmp);
-    input = PyFile_FromFd(fd, "<tmpfile>", "rb", -1, NULL, NULL, NULL, 1);
+    if (lseek(req->body_fd, 0, SEEK_SET) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    input = PyFile_FromFd(req->body_fd, "<tmpfile>", "rb", -1, NULL, NULL, NULL, 1);
     if (input == NULL) {
-        fclose(tmp);
-        req->body = NULL;
         return -1;
     }
+    // the file object closes it
+    req->body_fd = -1;
     //env["wsgi.input"] = tmpfile
     //
     PyDict_SetItem((PyObject *)req->environ, wsgi_input_key, input);
     Py_DECREF(input);
-    req->body = NULL;
     return 1;
 }
 
@@ -917,20 +1276,23 @@ set_input_file(client_t *client)
 {
     PyObject *input;
     request *req = client->current_req;
-    FILE *tmp = (FILE *)req->body;
-    fflush(tmp);
-    rewind(tmp);
-    input = PyFile_FromFile(tmp, "<tmpfile>", "r", fclose);
+    FILE *tmp;
+
+    if (lseek(req->body_fd, 0, SEEK_SET) == -1 ||
+            (tmp = fdopen(req->body_fd, "rb")) == NULL) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    req->body_fd = -1;
+    input = PyFile_FromFile(tmp, "<tmpfile>", "rb", fclose);
     if (input == NULL) {
         fclose(tmp);
-        req->body = NULL;
         return -1;
     }
     //env["wsgi.input"] = tmpfile
     //
     PyDict_SetItem((PyObject *)req->environ, wsgi_input_key, input);
     Py_DECREF(input);
-    req->body = NULL;
     return 0;
 }
 #endif
@@ -959,6 +1321,22 @@ set_input_object(client_t *client)
     return 1;
 }
 
+static int
+set_input_stream(client_t *client)
+{
+    PyObject *input = NULL;
+    request *req = client->current_req;
+
+    input = StreamInputObject_New((buffer_t*)req->body, client);
+    if (input == NULL) {
+        return -1;
+    }
+    PyDict_SetItem((PyObject *)req->environ, wsgi_input_key, input);
+    // body_cb still writes req->body, clean_client ends the stream
+    req->input = input;
+    return 1;
+}
+
 /*
 static void 
 setting_keepalive(client_t *client)
@@ -967,7 +1345,7 @@ setting_keepalive(client_t *client)
     char *val;
     if (is_keep_alive) {
         //support keep-alive
-        c = PyDict_GetItemString(client->environ, "HTTP_CONNECTION");
+        c = environ_get_item_string(client->environ, "HTTP_CONNECTION");
         if (client->http_parser->http_minor == 1) {
             //HTTP 1.1
             if (c) {
@@ -1005,6 +1383,7 @@ prepare_call_wsgi(client_t *client)
     set_current_request(client);
     
     req = client->current_req;
+    client->keep_alive = req->keep_alive;
 
     //check Expect
     if (check_http_expect(client) < 0) {
@@ -1015,6 +1394,10 @@ prepare_call_wsgi(client_t *client)
         if (set_input_file(client) == -1) {
             return -1;
         }
+    } else if (req->body_type == BODY_TYPE_STREAM && !req->complete) {
+        if (set_input_stream(client) == -1) {
+            return -1;
+        }
     } else {
         if (set_input_object(client) == -1) {
             return -1;
@@ -1028,47 +1411,240 @@ prepare_call_wsgi(client_t *client)
     return 1;
 }
 
-static int
-set_read_error(client_t *client, int status_code)
-{
-    client->keep_alive = 0;
-    if (status_code == 0) {
-        // bad request
-        status_code = 400;
+#ifdef linux
+/*
+ * The next part of a spooled body goes from the socket through a pipe
+ * into its file without a copy in user space.
+ * Returns -2 when the socket can not be spliced.
+ */
+static ssize_t
+splice_client(client_t *client, int fd, char *buf, size_t len, size_t body_len)
+{
+    ssize_t r, w;
+    size_t moved = 0;
+    int err;
+
+    if (splice_pipe[0] == -1) {
+        if (pipe2(splice_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return -2;
+        }
+        // one splice for more than the default 64KB
+        fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
     }
-    if (client->request_queue->size > 0) {
-        //piplining
-        set_bad_request_code(client, status_code);
-        //finish = 1
-        return 1;
-    } else {
-        if (!client->complete) {
-            // read error while reading request.
-            client->status_code = status_code;
-            send_error_page(client);
-        } // else keepalive timeout. should not send any data.
-        close_client(client);
-        return -1;
+    r = splice(client->fd, NULL, splice_pipe[1], NULL, body_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (r == -1 && errno == EINVAL) {
+        return -2;
+    }
+    if (r <= 0) {
+        return r;
+    }
+    while (moved < (size_t)r) {
+        w = splice(splice_pipe[0], NULL, fd, NULL, r - moved, SPLICE_F_MOVE);
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            // the body is lost, empty the pipe for the next one
+            err = w == 0 ? EIO : errno;
+            if (err == EINVAL) {
+                // the file system can not take it
+                splice_failed = 1;
+            }
+            while (read(splice_pipe[0], buf, len) > 0) {
+            }
+            errno = err;
+            return -1;
+        }
+        moved += w;
     }
+    return r;
 }
+#endif
 
-static int
-read_timeout(int fd, client_t *client)
-{
-    RDEBUG("** read timeout fd:%d", fd);
-    //timeout
-    return set_read_error(client, 408);
+/*
+ * One read from the client. The rest of a Content-Length body kept in
+ * memory is read straight into its buffer (body, body_len) and the bytes
+ * after it into buf, the rest of one spooled to a file is spliced into
+ * the file. want is the number of bytes asked for, fewer mean a drained
+ * socket.
+ */
+static ssize_t
+read_client(client_t *client, char *buf, size_t len, char **body, size_t *body_len, size_t *want)
+{
+    iovec_t iov[2];
+    ssize_t r;
+#ifdef linux
+    int fd;
+#endif
+
+    *body_len = body_read_space(client, body);
+#ifdef linux
+    if (*body_len == 0 && !splice_failed) {
+        *body_len = body_spool_space(client, &fd, body);
+        if (*body_len > 0) {
+            *want = *body_len;
+            r = splice_client(client, fd, buf, len, *body_len);
+            if (r != -2) {
+                if (r > 0) {
+                    *body_len = r;
+                }
+                return r;
+            }
+            DEBUG("splice failed errno %d, read spooled bodies", errno);
+            splice_failed = 1;
+            *body_len = 0;
+        }
+    }
+#endif
+    *want = *body_len + len;
+    if (*body_len == 0) {
+        return read(client->fd, buf, len);
+    }
+    iov[0].iov_base = *body;
+    iov[0].iov_len = *body_len;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+    r = readv(client->fd, iov, 2);
+    if (r >= 0 && (size_t)r < *body_len) {
+        *body_len = r;
+    }
+    return r;
 }
 
-static int
-compare_key(PyObject *env, char *key, char *compare)
+#ifdef WITH_GREENLET
+/*
+ * Read and parse more of the streamed body of the current request, the
+ * calling greenlet waits for the client like trampoline().
+ * Returns 1 when more of the body follows, 0 at its end, -1 with an
+ * exception set.
+ */
+int
+read_input_stream(client_t *client)
 {
-    int ret = -1;
-    char *val = NULL;
-
-    PyObject *c = PyDict_GetItemString(env, key);
-    if (c) {
-#ifdef PY3
+    char buf[READ_BUF_SIZE];
+    PyObject *current = NULL, *parent = NULL, *res = NULL;
+    ClientObject *pyclient;
+    request *req = client->current_req;
+    char *body;
+    size_t body_len, want;
+    ssize_t r;
+    int ret, active, parsed = 1;
+
+    if (req->complete) {
+        return 0;
+    }
+    for (;;) {
+        r = read_client(client, buf, sizeof(buf), &body, &body_len, &want);
+        if (r > 0) {
+            break;
+        }
+        if (r == 0) {
+            client->keep_alive = 0;
+            PyErr_SetString(PyExc_IOError, "client closed before the end of the body");
+            return -1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            client->keep_alive = 0;
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+
+        current = greenlet_getcurrent();
+        Py_DECREF(current);
+        parent = greenlet_getparent(current);
+        if (on_hub_stack(parent)) {
+            set_greenlet_required();
+            return -1;
+        }
+        if (parent == NULL) {
+            PyErr_SetString(PyExc_IOError, "call from same greenlet");
+            return -1;
+        }
+        pyclient = (ClientObject *)PyDict_GetItem(req->environ, client_key);
+        active = picoev_is_active(main_loop, client->fd);
+        if (pyclient != NULL && pyclient->greenlet == current) {
+            ret = picoev_add(main_loop, client->fd, PICOEV_READ, client_read_timeout, trampoline_callback, (void *)pyclient);
+        } else {
+            ret = picoev_add(main_loop, client->fd, PICOEV_READ, client_read_timeout, trampoline_callback, current);
+        }
+        if ((ret == 0 && !active)) {
+            activecnt++;
+        }
+        flush_write(client);
+        res = greenlet_switch(parent, hub_switch_value, NULL);
+        if (res == NULL) {
+            // timeout
+            client->keep_alive = 0;
+            return -1;
+        }
+        Py_DECREF(res);
+    }
+
+    if (body_len > 0) {
+        parsed = execute_parse(client, body, body_len) == body_len;
+    }
+    if (parsed && (size_t)r > body_len) {
+        parsed = execute_parse(client, buf, r - body_len) == r - body_len;
+    }
+    if (req->bad_request_code > 0 || (!parsed && !req->complete)) {
+        client->keep_alive = 0;
+        PyErr_Format(PyExc_IOError, "bad request body (%d)",
+                req->bad_request_code > 0 ? req->bad_request_code : 400);
+        return -1;
+    }
+    if (!parsed) {
+        // the next request is bad, answered after this one
+        if (client->request_queue->tail) {
+            set_bad_request_code(client, 400);
+        } else {
+            client->keep_alive = 0;
+        }
+    }
+    return !req->complete;
+}
+#endif
+
+static int
+set_read_error(client_t *client, int status_code)
+{
+    client->keep_alive = 0;
+    if (status_code == 0) {
+        // bad request
+        status_code = 400;
+    }
+    if (client->request_queue->size > 0) {
+        //piplining
+        set_bad_request_code(client, status_code);
+        //finish = 1
+        return 1;
+    } else {
+        if (!client->complete) {
+            // read error while reading request.
+            client->status_code = status_code;
+            send_error_page(client);
+        } // else keepalive timeout. should not send any data.
+        close_client(client);
+        return -1;
+    }
+}
+
+static int
+read_timeout(int fd, client_t *client)
+{
+    RDEBUG("** read timeout fd:%d", fd);
+    //timeout
+    return set_read_error(client, 408);
+}
+
+static int
+compare_key(PyObject *env, char *key, char *compare)
+{
+    int ret = -1;
+    char *val = NULL;
+
+    PyObject *c = environ_get_item_string(env, key);
+    if (c) {
+#ifdef PY3
         c = PyUnicode_AsLatin1String(c);
         val = PyBytes_AS_STRING(c);
 #else
@@ -1103,7 +1679,7 @@ parse_new_protocol(request *req, char *buf, ssize_t readed, int nread)
     char *val = NULL;
 
     env = req->environ;
-    c = PyDict_GetItemString(env, "HTTP_UPGRADE");
+    c = environ_get_item_string(env, "HTTP_UPGRADE");
     if (c) {
 #ifdef PY3
         c = PyUnicode_AsLatin1String(c);
@@ -1134,7 +1710,8 @@ parse_http_request(int fd, client_t *client, char *buf, ssize_t r)
     nread = execute_parse(client, buf, r);
     BDEBUG("read request fd %d readed %d nread %d", fd, (int)r, nread);
 
-    req = client->current_req;
+    // last parsed request
+    req = client->request_queue->tail;
 
     if (client->upgrade) {
         //TODO  New protocol
@@ -1155,46 +1732,64 @@ parse_http_request(int fd, client_t *client, char *buf, ssize_t r)
     return 0;
 }
 
+/*
+ * Read and parse while the reads fill the buffers, up to READ_BUDGET,
+ * a short read means the socket is drained.
+ */
 static int
 read_request(picoev_loop *loop, int fd, client_t *client, char call_time_update)
 {
     char buf[READ_BUF_SIZE];
+    char *body;
+    size_t body_len, want, total = 0;
     ssize_t r;
+    int ret;
 
-    if (!client->keep_alive) {
-        picoev_set_timeout(loop, fd, READ_TIMEOUT_SECS);
-    }
-
-    Py_BEGIN_ALLOW_THREADS
-    r = read(client->fd, buf, sizeof(buf));
-    Py_END_ALLOW_THREADS
-    switch (r) {
-        case 0: 
-            return set_read_error(client, 503);
-        case -1:
-            // Error
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // try again later
-                return 0;
-            } else {
-                // Fatal error
-                client->keep_alive = 0;
-                if (errno == ECONNRESET) {
-                    client->header_done = 1;
-                    client->response_closed = 1;
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        r = read_client(client, buf, sizeof(buf), &body, &body_len, &want);
+        Py_END_ALLOW_THREADS
+        switch (r) {
+            case 0: 
+                return set_read_error(client, 503);
+            case -1:
+                // Error
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // try again later
+                    return 0;
                 } else {
-                    PyErr_SetFromErrno(PyExc_IOError);
-                    /* write_error_log(__FILE__, __LINE__);  */
-                    call_error_logger();
+                    // Fatal error
+                    client->keep_alive = 0;
+                    if (errno == ECONNRESET) {
+                        client->header_done = 1;
+                        client->response_closed = 1;
+                    } else {
+                        PyErr_SetFromErrno(PyExc_IOError);
+                        /* write_error_log(__FILE__, __LINE__);  */
+                        call_error_logger();
+                    }
+                    return set_read_error(client, 500);
                 }
-                return set_read_error(client, 500);
-            }
-        default:
-            if (call_time_update) {
-                cache_time_update();
+            default:
+                break;
+        }
+        if (call_time_update && total == 0) {
+            cache_time_update();
+        }
+        ret = 0;
+        if (body_len > 0) {
+            ret = parse_http_request(fd, client, body, body_len);
+            if (ret == -1) {
+                return ret;
             }
-            return parse_http_request(fd, client, buf, r);
-
+        }
+        if ((size_t)r > body_len) {
+            ret = parse_http_request(fd, client, buf, r - body_len);
+        }
+        total += r;
+        if (ret != 0 || (size_t)r < want || total >= READ_BUDGET) {
+            return ret;
+        }
     }
 }
 
@@ -1209,18 +1804,17 @@ read_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 
     } else if ((events & PICOEV_READ) != 0) {
         finish = read_request(loop, fd, client, 0);
+        if (finish == 0 && client->request_queue->size > 0) {
+            // in the middle of a request
+            picoev_set_timeout(loop, fd, client_read_timeout);
+        }
     }
     if (finish == 1) {
         if (!picoev_del(main_loop, client->fd)) {
             activecnt--;
             DEBUG("activecnt:%d", activecnt);
         }
-        if (check_status_code(client) > 0) {
-            //current request ok
-            if (prepare_call_wsgi(client) > 0) {
-                call_wsgi_handler(client);
-            }
-        }
+        run_requests(client);
         return;
     }
 }
@@ -1266,14 +1860,11 @@ accept_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 
                 finish = read_request(loop, fd, client, 1);
                 if (finish == 1) {
-                    if (check_status_code(client) > 0) {
-                        //current request ok
-                        if (prepare_call_wsgi(client) > 0) {
-                            call_wsgi_handler(client);
-                        }
-                    }
+                    run_requests(client);
                 } else if (finish == 0) {
-                    ret = picoev_add(loop, client_fd, PICOEV_READ, keep_alive_timeout, read_callback, (void *)client);
+                    ret = picoev_add(loop, client_fd, PICOEV_READ,
+                            client->request_queue->size > 0 ? client_read_timeout : keep_alive_timeout,
+                            read_callback, (void *)client);
                     if (ret == 0) {
                         activecnt++;
                     }
@@ -1321,6 +1912,11 @@ clear_server_env(void)
 {
     //clean
     clear_start_response();
+    clear_header_cache();
+    coalesce_buf_list_clear();
+    clear_static_file_cache();
+    clear_response_cache();
+    clear_compress_streams();
     clear_static_env();
     client_t_list_clear();
     parser_list_clear();
@@ -1341,7 +1937,7 @@ clear_server_env(void)
 
 
 static int 
-inet_listen(void)
+inet_listen(int reuse_port, int do_listen)
 {
     struct addrinfo hints, *servinfo, *p;
     int flag = 1;
@@ -1377,6 +1973,15 @@ inet_listen(void)
             return -1;
         }
 
+#ifdef SO_REUSEPORT
+        if (reuse_port && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &flag,
+                sizeof(int)) == -1) {
+            close(listen_sock);
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+#endif
+
         Py_BEGIN_ALLOW_THREADS
         res = bind(listen_sock, p->ai_addr, p->ai_addrlen);
         Py_END_ALLOW_THREADS
@@ -1398,13 +2003,15 @@ inet_listen(void)
     freeaddrinfo(servinfo); // all done with this structure
     
     // BACKLOG 
-    Py_BEGIN_ALLOW_THREADS
-    res = listen(listen_sock, backlog);
-    Py_END_ALLOW_THREADS
-    if (res == -1) {
-        close(listen_sock);
-        PyErr_SetFromErrno(PyExc_IOError);
-        return -1;
+    if (do_listen) {
+        Py_BEGIN_ALLOW_THREADS
+        res = listen(listen_sock, backlog);
+        Py_END_ALLOW_THREADS
+        if (res == -1) {
+            close(listen_sock);
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
     }
 
 #ifdef PY3
@@ -1569,7 +2176,8 @@ meinheld_listen(PyObject *self, PyObject *args, PyObject *kwds)
         if (!PyArg_ParseTuple(o, "si:listen", &server_name, &server_port)) {
             return NULL;
         }
-        ret = inet_listen();
+        ret = inet_listen(0, 1);
+        is_inet_listen = ret > 0;
     } else if (PyBytes_Check(o)) {
         // unix domain
         if (!PyArg_Parse(o, "s#", &path, &len)) {
@@ -1678,15 +2286,32 @@ meinheld_stop(PyObject *self, PyObject *args, PyObject *kwds)
 }
 
 
+/**
+ * Run pending calls oldest first. Only the calls queued before this turn
+ * run, at most RUN_QUEUE_BUDGET of them for RUN_QUEUE_BUDGET_MSEC, the rest
+ * wait for the next turn so that I/O is polled in between.
+ */
 static inline int
 fire_pendings(void)
 {
     int ret = 1;
+    uint32_t queued, ran = 0;
+    uintptr_t start = current_msec, wait;
     TimerObject *timer = NULL;
     pending_queue_t *pendings = g_pendings;
 
-    while(pendings->size && loop_done && activecnt > 0) {
-        timer =  *(pendings->q + --pendings->size);
+    queued = pendings->size;
+    while(ran < queued && ran < RUN_QUEUE_BUDGET && loop_done && activecnt > 0) {
+        timer = pop_pending();
+        ran++;
+        run_queue_runs++;
+        if (current_msec > timer->expires_msec) {
+            wait = current_msec - timer->expires_msec;
+            run_queue_wait_msec += wait;
+            if (wait > run_queue_wait_max_msec) {
+                run_queue_wait_max_msec = wait;
+            }
+        }
         DEBUG("start timer:%p activecnt:%d", timer, activecnt);
         fire_timer(timer);
         Py_DECREF(timer);
@@ -1699,6 +2324,13 @@ fire_pendings(void)
             ret = -1;
             break;
         }
+        cache_time_update();
+        if (current_msec - start >= RUN_QUEUE_BUDGET_MSEC) {
+            break;
+        }
+    }
+    if (ran < queued && ret == 1 && loop_done && activecnt > 0) {
+        run_queue_deferred++;
     }
     return ret;
 }
@@ -1708,31 +2340,31 @@ fire_timers(void)
 {
     TimerObject *timer;
     int ret = 1;
-    heapq_t *q = g_timers;
-    time_t now = current_msec / 1000;
-
-    while(q->size > 0 && loop_done && activecnt > 0) {
-
-        timer = q->heap[0];
-        DEBUG("seconds:%d", timer->seconds);
-        DEBUG("now:%d", now);
-        if (timer->seconds <= now) {
-            //call
-            timer = heappop(q);
-            fire_timer(timer);
+    uint64_t late;
+    timer_wheel_t *w = g_timers;
+
+    timer_wheel_run(w, current_msec);
+
+    while(loop_done && activecnt > 0 && (timer = timer_wheel_pop(w)) != NULL) {
+        DEBUG("expires:%lu now:%lu", (unsigned long)timer->expires_msec, (unsigned long)current_msec);
+        timers_fired++;
+        if (current_msec > timer->expires_msec) {
+            late = current_msec - timer->expires_msec;
+            timer_late_msec += late;
+            if (late > timer_late_max_msec) {
+                timer_late_max_msec = late;
+            }
+        }
+        fire_timer(timer);
 
-            Py_DECREF(timer);
-            activecnt--;
-            DEBUG("fin timer:%p activecnt:%d", timer, activecnt);
+        Py_DECREF(timer);
+        activecnt--;
+        DEBUG("fin timer:%p activecnt:%d", timer, activecnt);
 
-            if (PyErr_Occurred()) {
-                RDEBUG("scheduled call raise exception");
-                call_error_logger();
-                ret = -1;
-                break;
-            }
-            /* timer = q->heap[0]; */
-        } else {
+        if (PyErr_Occurred()) {
+            RDEBUG("scheduled call raise exception");
+            call_error_logger();
+            ret = -1;
             break;
         }
     }
@@ -1740,6 +2372,37 @@ fire_timers(void)
 
 }
 
+/**
+ * msec the loop may sleep in poll: none while calls are pending or the loop
+ * is about to end, else up to the next timer or fd timeout, once a second
+ * for the watchdog.
+ */
+static int
+loop_wait(void)
+{
+    intptr_t wait, next;
+
+    if (g_pendings->size || !loop_done || activecnt <= 0) {
+        return 0;
+    }
+    wait = LOOP_MAX_WAIT;
+    next = timer_wheel_next(g_timers, current_msec);
+    if (next >= 0 && next < wait) {
+        wait = next;
+    }
+    next = picoev_next_timeout(main_loop);
+    if (next >= 0 && next < wait) {
+        wait = next;
+    }
+    if (watch_loop) {
+        next = 1000 - current_msec % 1000;
+        if (next < wait) {
+            wait = next;
+        }
+    }
+    return (int)wait;
+}
+
 static int
 listen_all_sockets(void)
 {
@@ -1766,7 +2429,7 @@ listen_all_sockets(void)
             listen_sock = (int)PyInt_AsLong(item);
 #endif
             setup_listen_sock(listen_sock);
-            ret = picoev_add(main_loop, listen_sock, PICOEV_READ, ACCEPT_TIMEOUT_SECS, accept_callback, NULL);
+            ret = picoev_add(main_loop, listen_sock, PICOEV_READ, ACCEPT_TIMEOUT_MSEC, accept_callback, NULL);
             if (ret == 0) {
                 activecnt++;
             }
@@ -1810,18 +2473,198 @@ close_all_sockets(void)
     return 1;
 }
 
+static int
+use_reuseport(void)
+{
+#ifdef SO_REUSEPORT
+    return is_inet_listen;
+#else
+    return 0;
+#endif
+}
+
+static int
+reopen_listen_socket(int do_listen)
+{
+    // each worker binds own SO_REUSEPORT socket, kernel balances accepts
+    if (close_all_sockets() < 0) {
+        return -1;
+    }
+    Py_CLEAR(listen_socks);
+    return inet_listen(1, do_listen);
+}
+
+static pid_t
+spawn_worker(int idx)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid != 0) {
+        if (pid > 0) {
+            worker_pids[idx] = pid;
+            worker_spawned[idx] = time(NULL);
+            DEBUG("spawn worker idx:%d pid:%d", idx, (int)pid);
+        }
+        return pid;
+    }
+
+    // child
+#if PY_VERSION_HEX >= 0x03070000
+    PyOS_AfterFork_Child();
+#else
+    PyOS_AfterFork();
+#endif
+#ifdef linux
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    is_worker = 1;
+    PyMem_Free(worker_pids);
+    PyMem_Free(worker_spawned);
+    worker_pids = NULL;
+    worker_spawned = NULL;
+    return 0;
+}
+
+static void
+kill_workers(int signum)
+{
+    int i;
+    for (i = 0; i < num_workers; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], signum);
+        }
+    }
+}
+
+/*
+ * Fork workers and supervise them.
+ * return 0 in worker process, 1 in master after all workers exited, -1 on error.
+ */
+static int
+run_workers(int workers, int *interrupted)
+{
+    int i, status, alive = 0, stopping = 0;
+    pid_t pid;
+
+    if (use_reuseport()) {
+        // master keeps a bound (not listening) socket to hold the port
+        if (reopen_listen_socket(0) < 0) {
+            return -1;
+        }
+    }
+
+    num_workers = workers;
+    worker_pids = PyMem_Malloc(sizeof(pid_t) * workers);
+    worker_spawned = PyMem_Malloc(sizeof(time_t) * workers);
+    if (worker_pids == NULL || worker_spawned == NULL) {
+        PyMem_Free(worker_pids);
+        PyMem_Free(worker_spawned);
+        worker_pids = NULL;
+        worker_spawned = NULL;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(worker_pids, 0, sizeof(pid_t) * workers);
+
+    PyOS_setsig(SIGINT, sigint_cb);
+    PyOS_setsig(SIGTERM, sigint_cb);
+
+    for (i = 0; i < workers; i++) {
+        pid = spawn_worker(i);
+        if (pid == 0) {
+            return 0;
+        } else if (pid < 0) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            call_error_logger();
+            stopping = 1;
+            kill_workers(SIGTERM);
+            break;
+        }
+        alive++;
+    }
+
+    while (alive > 0) {
+        pid = waitpid(-1, &status, 0);
+        if (catch_signal != 0) {
+            if (catch_signal == SIGINT) {
+                *interrupted = 1;
+            }
+            catch_signal = 0;
+            if (!stopping) {
+                stopping = 1;
+                kill_workers(SIGTERM);
+            }
+        }
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // ECHILD
+            break;
+        }
+        for (i = 0; i < num_workers; i++) {
+            if (worker_pids[i] == pid) {
+                break;
+            }
+        }
+        if (i == num_workers) {
+            continue;
+        }
+        worker_pids[i] = 0;
+        alive--;
+        RDEBUG("worker exited pid:%d status:%d", (int)pid, status);
+
+        if (!stopping) {
+            // respawn, but don't spin when worker dies at boot
+            if (time(NULL) - worker_spawned[i] < 1) {
+                sleep(1);
+            }
+            pid = spawn_worker(i);
+            if (pid == 0) {
+                return 0;
+            } else if (pid > 0) {
+                alive++;
+            } else {
+                PyErr_SetFromErrno(PyExc_IOError);
+                call_error_logger();
+            }
+        }
+    }
+
+    PyMem_Free(worker_pids);
+    PyMem_Free(worker_spawned);
+    worker_pids = NULL;
+    worker_spawned = NULL;
+    num_workers = 0;
+    return 1;
+}
+
 static PyObject *
 meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
 {
     PyObject *watchdog_result;
     int silent = 0;
     int interrupted = 0;
+    int workers = 0;
+    int ret;
+    char *greenlet = "always";
+
+    static char *kwlist[] = {"app", "silent", "workers", "greenlet", 0};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iis:run",
+                                     kwlist, &wsgi_app, &silent, &workers, &greenlet)) {
+        return NULL;
+    }
 
-    static char *kwlist[] = {"app", "silent", 0};
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:run",
-                                     kwlist, &wsgi_app, &silent)) {
+    if (!strcmp(greenlet, "always")) {
+        lazy_greenlet = 0;
+    } else if (!strcmp(greenlet, "lazy")) {
+        lazy_greenlet = 1;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "greenlet must be 'always' or 'lazy'");
         return NULL;
     }
+    need_greenlet = 0;
 
     if (listen_socks == NULL) {
         PyErr_Format(PyExc_TypeError, "not found listen socket");
@@ -1829,6 +2672,31 @@ meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
 
     }
 
+    if (workers < 0) {
+        PyErr_SetString(PyExc_ValueError, "workers value out of range ");
+        return NULL;
+    }
+
+    if (workers > 0) {
+        ret = run_workers(workers, &interrupted);
+        if (ret < 0) {
+            return NULL;
+        }
+        if (ret > 0) {
+            // master
+            close_all_sockets();
+            Py_CLEAR(listen_socks);
+            if (!silent && interrupted) {
+                PyErr_SetNone(PyExc_KeyboardInterrupt);
+                return NULL;
+            }
+            Py_RETURN_NONE;
+        }
+        if (use_reuseport() && reopen_listen_socket(1) < 0) {
+            return NULL;
+        }
+    }
+
     Py_INCREF(wsgi_app);
     setup_server_env();
 
@@ -1850,7 +2718,8 @@ meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
         /* DEBUG("before activecnt:%d", activecnt); */
         fire_pendings();
         fire_timers();
-        picoev_loop_once(main_loop, 10);
+        picoev_loop_once(main_loop, loop_wait());
+        loop_wakeups++;
         if (unlikely(catch_signal != 0)) {
             if (catch_signal == SIGINT) {
                 interrupted = 1;
@@ -1858,8 +2727,8 @@ meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
             catch_signal = 0;
             kill_server(0);
         }
-        if (watch_loop && watchdog_lasttime != main_loop->now) {
-            watchdog_lasttime = main_loop->now;
+        if (watch_loop && watchdog_lasttime != main_loop->now / 1000) {
+            watchdog_lasttime = main_loop->now / 1000;
             if (tempfile_fd) {
                 fast_notify();
             } else if (watchdog) {
@@ -1891,6 +2760,12 @@ meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
     }
     Py_CLEAR(listen_socks);
 
+    if (is_worker) {
+        // worker process never returns to the caller
+        PyErr_Clear();
+        PyErr_SetNone(PyExc_SystemExit);
+        return NULL;
+    }
 
     if (!silent && interrupted) {
         //override
@@ -1902,21 +2777,43 @@ meinheld_run_loop(PyObject *self, PyObject *args, PyObject *kwds)
 }
 
 
+/* int or float seconds to a timeout in msec, rounded up. -1 if out of range */
+static int
+timeout_msec(double secs)
+{
+    if (!(secs >= 0 && secs <= INT_MAX / 1000)) {
+        return -1;
+    }
+    return (int)ceil(secs * 1000);
+}
+
+/* whole seconds go back as int, as they were set before msec timeouts */
+static PyObject *
+timeout_secs(int msec)
+{
+    if (msec % 1000 == 0) {
+        return Py_BuildValue("i", msec / 1000);
+    }
+    return PyFloat_FromDouble(msec / 1000.0);
+}
+
 PyObject *
 meinheld_set_keepalive(PyObject *self, PyObject *args)
 {
-    int on;
-    if (!PyArg_ParseTuple(args, "i", &on))
+    double on;
+    int msec;
+    if (!PyArg_ParseTuple(args, "d", &on))
         return NULL;
-    if (on < 0) {
+    msec = timeout_msec(on);
+    if (msec < 0) {
         PyErr_SetString(PyExc_ValueError, "keep alive value out of range ");
         return NULL;
     }
-    is_keep_alive = on;
+    is_keep_alive = msec > 0;
     if (is_keep_alive) {
-        keep_alive_timeout = on;
+        keep_alive_timeout = msec;
     } else {
-        keep_alive_timeout = 2;
+        keep_alive_timeout = 2000;
     }
     Py_RETURN_NONE;
 }
@@ -1924,7 +2821,32 @@ meinheld_set_keepalive(PyObject *self, PyObject *args)
 PyObject *
 meinheld_get_keepalive(PyObject *self, PyObject *args)
 {
-    return Py_BuildValue("i", is_keep_alive);
+    if (!is_keep_alive) {
+        return Py_BuildValue("i", 0);
+    }
+    return timeout_secs(keep_alive_timeout);
+}
+
+PyObject *
+meinheld_set_read_timeout(PyObject *self, PyObject *args)
+{
+    double secs;
+    int msec;
+    if (!PyArg_ParseTuple(args, "d", &secs))
+        return NULL;
+    msec = timeout_msec(secs);
+    if (msec <= 0) {
+        PyErr_SetString(PyExc_ValueError, "read timeout value out of range ");
+        return NULL;
+    }
+    client_read_timeout = msec;
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_read_timeout(PyObject *self, PyObject *args)
+{
+    return timeout_secs(client_read_timeout);
 }
 
 PyObject *
@@ -2007,6 +2929,328 @@ meinheld_get_client_body_buffer_size(PyObject *self, PyObject *args)
     return Py_BuildValue("i", client_body_buffer_size);
 }
 
+PyObject *
+meinheld_set_fast_parser(PyObject *self, PyObject *args)
+{
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_fast_parser", &flag))
+        return NULL;
+    use_fast_parser = PyObject_IsTrue(flag);
+    if (use_fast_parser == -1) {
+        use_fast_parser = 0;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_fast_parser(PyObject *self, PyObject *args)
+{
+    if (use_fast_parser) {
+        return NATIVE_FROMSTRING(fast_parser_impl());
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_set_lazy_environ(PyObject *self, PyObject *args)
+{
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_lazy_environ", &flag))
+        return NULL;
+    use_lazy_environ = PyObject_IsTrue(flag);
+    if (use_lazy_environ == -1) {
+        use_lazy_environ = 0;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_lazy_environ(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("O", use_lazy_environ ? Py_True : Py_False);
+}
+
+PyObject *
+meinheld_set_header_cache(PyObject *self, PyObject *args)
+{
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_header_cache", &flag))
+        return NULL;
+    use_header_cache = PyObject_IsTrue(flag);
+    if (use_header_cache == -1) {
+        use_header_cache = 0;
+        return NULL;
+    }
+    if (!use_header_cache) {
+        clear_header_cache();
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_header_cache(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("O", use_header_cache ? Py_True : Py_False);
+}
+
+PyObject *
+meinheld_get_header_cache_stats(PyObject *self, PyObject *args)
+{
+    return get_header_cache_stats();
+}
+
+PyObject *
+meinheld_set_write_coalesce_size(PyObject *self, PyObject *args)
+{
+    int temp;
+    if (!PyArg_ParseTuple(args, "i", &temp)) {
+        return NULL;
+    }
+    if (temp < 0) {
+        PyErr_SetString(PyExc_ValueError, "write_coalesce_size value out of range ");
+        return NULL;
+    }
+    write_coalesce_size = temp;
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_write_coalesce_size(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", write_coalesce_size);
+}
+
+PyObject *
+meinheld_add_static(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    char *prefix, *root;
+    int ttl = 1;
+    static char *kwlist[] = {"prefix", "root", "ttl", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|i:add_static",
+                kwlist, &prefix, &root, &ttl)) {
+        return NULL;
+    }
+    if (add_static_mount(prefix, strlen(prefix), root, strlen(root), ttl) == -1) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_clear_static(PyObject *self, PyObject *args)
+{
+    clear_static_mounts();
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_set_static_cache_size(PyObject *self, PyObject *args)
+{
+    int temp;
+    if (!PyArg_ParseTuple(args, "i", &temp)) {
+        return NULL;
+    }
+    if (temp < 1) {
+        PyErr_SetString(PyExc_ValueError, "static_cache_size value out of range ");
+        return NULL;
+    }
+    set_static_cache_size(temp);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_static_cache_size(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", get_static_cache_size());
+}
+
+PyObject *
+meinheld_get_static_cache_stats(PyObject *self, PyObject *args)
+{
+    return get_static_cache_stats();
+}
+
+PyObject *
+meinheld_set_response_cache_size(PyObject *self, PyObject *args)
+{
+    Py_ssize_t temp;
+    if (!PyArg_ParseTuple(args, "n", &temp)) {
+        return NULL;
+    }
+    if (temp < 0) {
+        PyErr_SetString(PyExc_ValueError, "response_cache_size value out of range ");
+        return NULL;
+    }
+    set_response_cache_size(temp);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_response_cache_size(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("n", (Py_ssize_t)get_response_cache_size());
+}
+
+PyObject *
+meinheld_get_response_cache_stats(PyObject *self, PyObject *args)
+{
+    return get_response_cache_stats();
+}
+
+PyObject *
+meinheld_set_compress_level(PyObject *self, PyObject *args)
+{
+    int temp;
+    if (!PyArg_ParseTuple(args, "i", &temp)) {
+        return NULL;
+    }
+    if (temp < 0 || temp > 9) {
+        PyErr_SetString(PyExc_ValueError, "compress_level value out of range ");
+        return NULL;
+    }
+    set_compress_level(temp);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_compress_level(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", get_compress_level());
+}
+
+PyObject *
+meinheld_set_compress_min_length(PyObject *self, PyObject *args)
+{
+    Py_ssize_t temp;
+    if (!PyArg_ParseTuple(args, "n", &temp)) {
+        return NULL;
+    }
+    if (temp < 0) {
+        PyErr_SetString(PyExc_ValueError, "compress_min_length value out of range ");
+        return NULL;
+    }
+    set_compress_min_length(temp);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_compress_min_length(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("n", (Py_ssize_t)get_compress_min_length());
+}
+
+PyObject *
+meinheld_get_compress_stats(PyObject *self, PyObject *args)
+{
+    return get_compress_stats();
+}
+
+PyObject *
+meinheld_get_loop_stats(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:I,s:I,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+            "wakeups", loop_wakeups,
+            "timers", timers_fired,
+            "timer_late_msec", timer_late_msec,
+            "timer_late_max_msec", timer_late_max_msec,
+            "run_queue", g_pendings->size,
+            "run_queue_max", run_queue_max,
+            "runs", run_queue_runs,
+            "run_wait_msec", run_queue_wait_msec,
+            "run_wait_max_msec", run_queue_wait_max_msec,
+            "run_deferred", run_queue_deferred,
+            "app_greenlets", app_greenlets,
+            "app_direct_calls", app_direct_calls,
+            "app_hub_waits", app_hub_waits);
+}
+
+PyObject *
+meinheld_set_single_flight(PyObject *self, PyObject *args)
+{
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_single_flight", &flag))
+        return NULL;
+    use_single_flight = PyObject_IsTrue(flag);
+    if (use_single_flight == -1) {
+        use_single_flight = 0;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_single_flight(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("O", use_single_flight ? Py_True : Py_False);
+}
+
+PyObject *
+meinheld_set_streaming_input(PyObject *self, PyObject *args)
+{
+#ifdef WITH_GREENLET
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_streaming_input", &flag))
+        return NULL;
+    use_streaming_input = PyObject_IsTrue(flag);
+    if (use_streaming_input == -1) {
+        use_streaming_input = 0;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+#else
+    NO_GREENLET_ERROR;
+#endif
+}
+
+PyObject *
+meinheld_get_streaming_input(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("O", use_streaming_input ? Py_True : Py_False);
+}
+
+PyObject *
+meinheld_set_form_parser(PyObject *self, PyObject *args)
+{
+    PyObject *flag;
+    if (!PyArg_ParseTuple(args, "O:set_form_parser", &flag))
+        return NULL;
+    use_form_parser = PyObject_IsTrue(flag);
+    if (use_form_parser == -1) {
+        use_form_parser = 0;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_form_parser(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("O", use_form_parser ? Py_True : Py_False);
+}
+
+PyObject *
+meinheld_set_form_file_parts_max(PyObject *self, PyObject *args)
+{
+    int temp;
+    if (!PyArg_ParseTuple(args, "i", &temp))
+        return NULL;
+    if (temp < 0) {
+        PyErr_SetString(PyExc_ValueError, "form_file_parts_max value out of range ");
+        return NULL;
+    }
+    form_file_parts_max = temp;
+    Py_RETURN_NONE;
+}
+
+PyObject *
+meinheld_get_form_file_parts_max(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", form_file_parts_max);
+}
+
 PyObject *
 meinheld_set_listen_socket(PyObject *self, PyObject *args)
 {
@@ -2088,11 +3332,13 @@ meinheld_suspend_client(PyObject *self, PyObject *args)
     PyObject *temp = NULL, *parent = NULL, *res = NULL;
     ClientObject *pyclient;
     client_t *client;
-    int timeout = 0, ret = 0, active = 0;
+    double secs = 0;
+    int timeout, ret = 0, active = 0;
 
-    if (!PyArg_ParseTuple(args, "O|i:_suspend_client", &temp, &timeout)) {
+    if (!PyArg_ParseTuple(args, "O|d:_suspend_client", &temp, &secs)) {
         return NULL;
     }
+    timeout = timeout_msec(secs);
     if (timeout < 0) {
         PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
         return NULL;
@@ -2108,6 +3354,11 @@ meinheld_suspend_client(PyObject *self, PyObject *args)
     client = pyclient->client;
 
     if (!pyclient->greenlet) {
+        if (direct_depth > 0) {
+            // called on the hub stack, suspend in a greenlet
+            set_greenlet_required();
+            return NULL;
+        }
         PyErr_SetString(PyExc_ValueError, "greenlet is not set");
         return NULL;
     }
@@ -2131,11 +3382,12 @@ meinheld_suspend_client(PyObject *self, PyObject *args)
         if (timeout > 0) {
             ret = picoev_add(main_loop, client->fd, PICOEV_TIMEOUT, timeout, timeout_error_callback, (void *)pyclient);
         } else {
-            ret = picoev_add(main_loop, client->fd, PICOEV_TIMEOUT, 3, timeout_callback, (void *)pyclient);
+            ret = picoev_add(main_loop, client->fd, PICOEV_TIMEOUT, 3000, timeout_callback, (void *)pyclient);
         }
         if ((ret == 0 && !active)) {
             activecnt++;
         }
+        flush_write(client);
         /* Py_INCREF(hub_switch_value); */
         res = greenlet_switch(parent, hub_switch_value, NULL);
         return res;
@@ -2242,14 +3494,16 @@ meinheld_trampoline(PyObject *self, PyObject *args, PyObject *kwargs)
 #ifdef WITH_GREENLET
     PyObject *current = NULL, *parent = NULL, *res = NULL;
     ClientObject *pyclient;
-    int fd, event, timeout = 0, ret, active;
+    int fd, event, timeout, ret, active;
+    double secs = 0;
     PyObject *read = Py_None, *write = Py_None;
 
     static char *keywords[] = {"fileno", "read", "write", "timeout", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|OOi:trampoline", keywords, &fd, &read, &write, &timeout)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|OOd:trampoline", keywords, &fd, &read, &write, &secs)) {
         return NULL;
     }
+    timeout = timeout_msec(secs);
 
     if (fd < 0) {
         PyErr_SetString(PyExc_ValueError, "fileno value out of range ");
@@ -2298,6 +3552,9 @@ meinheld_trampoline(PyObject *self, PyObject *args, PyObject *kwargs)
         current = pyclient->greenlet;
         parent = greenlet_getparent(current);
         YDEBUG("trampoline fd:%d event:%d current:%p parent:%p cb_arg:%p", fd, event, current, parent, pyclient);
+        if (pyclient->client) {
+            flush_write(pyclient->client);
+        }
         
         /* Py_INCREF(hub_switch_value); */
         res = greenlet_switch(parent, hub_switch_value, NULL);
@@ -2305,6 +3562,10 @@ meinheld_trampoline(PyObject *self, PyObject *args, PyObject *kwargs)
     } else {
         DEBUG("call from greenlet");
         parent = greenlet_getparent(current);
+        if (on_hub_stack(parent)) {
+            set_greenlet_required();
+            return NULL;
+        }
         if (parent == NULL) {
             PyErr_SetString(PyExc_IOError, "call from same greenlet");
             return NULL;
@@ -2360,23 +3621,38 @@ meinheld_sleep(PyObject *self, PyObject *args, PyObject *kwargs)
 {
 #ifdef WITH_GREENLET
     PyObject *current = NULL, *parent = NULL, *res = NULL;
-    int sec = 0;
+    double sec = 0;
+    uintptr_t msec = 0;
     static char *keywords[] = {"seconds", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i:sleep", keywords, &sec)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "d:sleep", keywords, &sec)) {
         return NULL;
     }
+    if (sec > INT_MAX) {
+        sec = INT_MAX;
+    }
+    if (sec > 0) {
+        msec = (uintptr_t)ceil(sec * 1000);
+    }
     
     current = greenlet_getcurrent();
     parent = greenlet_getparent(current);
     Py_DECREF(current);
+    if (on_hub_stack(parent)) {
+        set_greenlet_required();
+        return NULL;
+    }
     if (parent == NULL) {
         PyErr_SetString(PyExc_IOError, "call from same greenlet");
         return NULL;
     }
-    DEBUG("sleep sec:%d", sec);
-    res = internal_schedule_call(sec, NULL, NULL, NULL, current);
+    DEBUG("sleep msec:%lu", (unsigned long)msec);
+    res = internal_schedule_call(msec, NULL, NULL, NULL, current);
     Py_XDECREF(res);
+    if (current_client && ((ClientObject *)current_client)->greenlet == current
+            && ((ClientObject *)current_client)->client) {
+        flush_write(((ClientObject *)current_client)->client);
+    }
     res = greenlet_switch(parent, hub_switch_value, NULL);
     Py_XDECREF(res);
 
@@ -2398,43 +3674,50 @@ meinheld_get_ident(PyObject *self, PyObject *args)
 }
 
 static PyObject*
-internal_schedule_call(int seconds, PyObject *cb, PyObject *args, PyObject *kwargs, PyObject *greenlet)
+internal_schedule_call(uintptr_t msec, PyObject *cb, PyObject *args, PyObject *kwargs, PyObject *greenlet)
 {
     TimerObject* timer;
-    heapq_t *timers = g_timers;
-    pending_queue_t *pendings = g_pendings;
 
-    timer = TimerObject_new(seconds, cb, args, kwargs, greenlet);
+    if (!loop_done) {
+        //the time cache is only updated by the running loop
+        cache_time_update();
+    }
+    timer = TimerObject_new(msec, cb, args, kwargs, greenlet);
     if (timer == NULL) {
         return NULL;
     }
-    DEBUG("seconds:%d", seconds);
-    if (!seconds) {
-        if (realloc_pendings() == -1) {
+    DEBUG("msec:%lu", (unsigned long)msec);
+    if (!msec) {
+        if (push_pending(timer) == -1) {
             Py_DECREF(timer);
             return NULL;
         }
         Py_INCREF(timer);
-
-        //timer->pending = ++pendings->size;
-        pendings->q[pendings->size] = timer;
-        pendings->size++;
-        DEBUG("add timer:%p pendings->size:%d", timer, pendings->size);
+        DEBUG("add timer:%p pendings->size:%d", timer, g_pendings->size);
     } else {
-        if (heappush(timers, timer) == -1) {
-            Py_DECREF(timer);
-            return NULL;
-        }
+        timer_wheel_add(g_timers, timer);
     }
         
     activecnt++;
     return (PyObject*)timer;
 }
 
+void
+cancel_timer(TimerObject *timer)
+{
+    //a cancelled timer leaves the wheel at once and no longer keeps the loop running
+    if (g_timers && timer_wheel_remove(g_timers, timer)) {
+        Py_DECREF(timer);
+        activecnt--;
+        DEBUG("cancel timer:%p activecnt:%d", timer, activecnt);
+    }
+}
+
 static PyObject*
 meinheld_schedule_call(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    long seconds = 0, ret;
+    double seconds = 0;
+    uintptr_t msec = 0;
     Py_ssize_t size;
     PyObject *sec = NULL, *cb = NULL, *cbargs = NULL, *timer;
 
@@ -2449,11 +3732,11 @@ meinheld_schedule_call(PyObject *self, PyObject *args, PyObject *kwargs)
     cb = PyTuple_GET_ITEM(args, 1);
 
 #ifdef PY3
-    if (!PyLong_Check(sec)) {
+    if (!PyLong_Check(sec) && !PyFloat_Check(sec)) {
 #else
-    if (!PyInt_Check(sec)) {
+    if (!PyInt_Check(sec) && !PyLong_Check(sec) && !PyFloat_Check(sec)) {
 #endif
-        PyErr_SetString(PyExc_TypeError, "must be integer");
+        PyErr_SetString(PyExc_TypeError, "must be integer or float");
         return NULL;
     }
     if (!PyCallable_Check(cb)) {
@@ -2461,21 +3744,21 @@ meinheld_schedule_call(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    ret = PyLong_AsLong(sec);
+    seconds = PyFloat_AsDouble(sec);
     if (PyErr_Occurred()) {
         return NULL;
     }
-    if (ret < 0) {
+    if (!(seconds >= 0 && seconds <= INT_MAX)) {
         PyErr_SetString(PyExc_TypeError, "seconds value out of range");
         return NULL;
     }
-    seconds = ret;
+    msec = (uintptr_t)ceil(seconds * 1000);
 
     if (size > 2) {
         cbargs = PyTuple_GetSlice(args, 2, size);
     }
 
-    timer = internal_schedule_call(seconds, cb, cbargs, kwargs, NULL);
+    timer = internal_schedule_call(msec, cb, cbargs, kwargs, NULL);
     Py_XDECREF(cbargs);
     return timer;
 }
@@ -2485,15 +3768,50 @@ static PyMethodDef ServerMethods[] = {
     {"set_access_logger", meinheld_access_log, METH_VARARGS, "set access logger function."},
     {"set_error_logger", meinheld_error_log, METH_VARARGS, "set error logger function."},
 
-    {"set_keepalive", meinheld_set_keepalive, METH_VARARGS, "set keep-alive support. value set timeout sec. default 0. (disable keep-alive)"},
+    {"set_keepalive", meinheld_set_keepalive, METH_VARARGS, "set keep-alive support. value set timeout sec, int or float. default 0. (disable keep-alive)"},
     {"get_keepalive", meinheld_get_keepalive, METH_VARARGS, "return keep-alive support."},
 
+    {"set_read_timeout", meinheld_set_read_timeout, METH_VARARGS, "set the seconds a client may stay silent in the middle of a request, int or float. default 30"},
+    {"get_read_timeout", meinheld_get_read_timeout, METH_VARARGS, "return read timeout seconds"},
+
     {"set_max_content_length", meinheld_set_max_content_length, METH_VARARGS, "set max_content_length"},
     {"get_max_content_length", meinheld_get_max_content_length, METH_VARARGS, "return max_content_length"},
 
     {"set_client_body_buffer_size", meinheld_set_client_body_buffer_size, METH_VARARGS, "set client_body_buffer_size"},
     {"get_client_body_buffer_size", meinheld_get_client_body_buffer_size, METH_VARARGS, "return client_body_buffer_size"},
 
+    {"set_fast_parser", meinheld_set_fast_parser, METH_VARARGS, "parse request headers with the SIMD fast parser. default False"},
+    {"get_fast_parser", meinheld_get_fast_parser, METH_VARARGS, "return fast parser implementation (avx2, sse4.2, scalar) or None"},
+    {"set_lazy_environ", meinheld_set_lazy_environ, METH_VARARGS, "set HTTP_* environ items on first access. default False"},
+    {"get_lazy_environ", meinheld_get_lazy_environ, METH_VARARGS, "return lazy environ flag"},
+    {"set_header_cache", meinheld_set_header_cache, METH_VARARGS, "reuse the serialized status line and headers of repeated responses. default False"},
+    {"get_header_cache", meinheld_get_header_cache, METH_VARARGS, "return header cache flag"},
+    {"get_header_cache_stats", meinheld_get_header_cache_stats, METH_VARARGS, "return header cache hits and misses"},
+    {"set_write_coalesce_size", meinheld_set_write_coalesce_size, METH_VARARGS, "set bytes of response items written with one writev. 0 writes every item. default 65536"},
+    {"get_write_coalesce_size", meinheld_get_write_coalesce_size, METH_VARARGS, "return write_coalesce_size"},
+    {"add_static", (PyCFunction)meinheld_add_static, METH_VARARGS|METH_KEYWORDS, "serve files under root for GET/HEAD requests of prefix. stat is checked again after ttl seconds"},
+    {"clear_static", meinheld_clear_static, METH_VARARGS, "remove all static mounts"},
+    {"set_static_cache_size", meinheld_set_static_cache_size, METH_VARARGS, "set open static files kept in the cache. default 256"},
+    {"get_static_cache_size", meinheld_get_static_cache_size, METH_VARARGS, "return static_cache_size"},
+    {"get_static_cache_stats", meinheld_get_static_cache_stats, METH_VARARGS, "return static file cache hits and misses"},
+    {"set_response_cache_size", meinheld_set_response_cache_size, METH_VARARGS, "set bytes of X-Meinheld-Cache responses kept in memory. default 0 (disable)"},
+    {"get_response_cache_size", meinheld_get_response_cache_size, METH_VARARGS, "return response_cache_size"},
+    {"get_response_cache_stats", meinheld_get_response_cache_stats, METH_VARARGS, "return response cache hits, misses and size"},
+    {"set_single_flight", meinheld_set_single_flight, METH_VARARGS, "GET requests wait for the same request running in the app and get its response. default False"},
+    {"get_single_flight", meinheld_get_single_flight, METH_VARARGS, "return single flight flag"},
+    {"set_compress_level", meinheld_set_compress_level, METH_VARARGS, "set gzip/deflate level of responses to clients accepting it. default 0 (disable)"},
+    {"get_compress_level", meinheld_get_compress_level, METH_VARARGS, "return compress_level"},
+    {"set_compress_min_length", meinheld_set_compress_min_length, METH_VARARGS, "set smallest body compressed. default 256"},
+    {"get_compress_min_length", meinheld_get_compress_min_length, METH_VARARGS, "return compress_min_length"},
+    {"get_compress_stats", meinheld_get_compress_stats, METH_VARARGS, "return compressed responses and bytes"},
+    {"set_streaming_input", meinheld_set_streaming_input, METH_VARARGS, "call the app when the request head is read, wsgi.input reads the body from the client. default False"},
+    {"get_streaming_input", meinheld_get_streaming_input, METH_VARARGS, "return streaming input flag"},
+    {"set_form_parser", meinheld_set_form_parser, METH_VARARGS, "parse multipart/form-data bodies as they arrive to environ['meinheld.form'], wsgi.input is empty. default False"},
+    {"get_form_parser", meinheld_get_form_parser, METH_VARARGS, "return form parser flag"},
+    {"set_form_file_parts_max", meinheld_set_form_file_parts_max, METH_VARARGS, "set file parts of a parsed form, more get a 413. default 32"},
+    {"get_form_file_parts_max", meinheld_get_form_file_parts_max, METH_VARARGS, "return form_file_parts_max"},
+    {"get_loop_stats", meinheld_get_loop_stats, METH_VARARGS, "return loop wakeups, timers fired and their lateness, run queue depth, calls run and their wait in msec, app calls in a greenlet and on the hub"},
+
     {"set_backlog", meinheld_set_backlog, METH_VARARGS, "set backlog size"},
     {"get_backlog", meinheld_get_backlog, METH_VARARGS, "return backlog size"},
 
@@ -2512,7 +3830,7 @@ static PyMethodDef ServerMethods[] = {
     {"set_listen_socket", meinheld_set_listen_socket, METH_VARARGS, "set listen_sock"},
     {"set_watchdog", meinheld_set_watchdog, METH_VARARGS, "set watchdog"},
     {"set_fastwatchdog", meinheld_set_fastwatchdog, METH_VARARGS, "set watchdog"},
-    {"run", (PyCFunction)meinheld_run_loop, METH_VARARGS|METH_KEYWORDS, "set wsgi app, run the main loop"},
+    {"run", (PyCFunction)meinheld_run_loop, METH_VARARGS|METH_KEYWORDS, "set wsgi app, run the main loop. workers > 0 forks worker processes. greenlet='lazy' calls the app without a greenlet until it has to wait, that request gets a 500"},
     // greenlet and continuation
     {"_suspend_client", meinheld_suspend_client, METH_VARARGS, "resume client"},
     {"_resume_client", meinheld_resume_client, METH_VARARGS, "resume client"},
@@ -2574,6 +3892,10 @@ initserver(void)
         INITERROR;
     }
 
+    if (EnvironObject_Ready() < 0) {
+        INITERROR;
+    }
+
     timeout_error = PyErr_NewException("meinheld.server.timeout",
                       PyExc_IOError, NULL);
     if (timeout_error == NULL) {
@@ -2582,10 +3904,19 @@ initserver(void)
     Py_INCREF(timeout_error);
     PyModule_AddObject(m, "timeout", timeout_error);
 
+    // BaseException, "except Exception" in the app does not swallow it
+    greenlet_required = PyErr_NewException("meinheld.server.greenlet_required",
+                      PyExc_BaseException, NULL);
+    if (greenlet_required == NULL) {
+        INITERROR;
+    }
+    Py_INCREF(greenlet_required);
+    PyModule_AddObject(m, "greenlet_required", greenlet_required);
+
     //DEBUG("client size %u", sizeof(client_t));
     //DEBUG("request size %u", sizeof(request));
     //DEBUG("header bucket %u", sizeof(write_bucket));
-    g_timers = init_queue();
+    g_timers = init_timer_wheel();
     if (g_timers == NULL) {
         INITERROR;
     }
@@ -2593,6 +3924,7 @@ initserver(void)
     if (g_pendings == NULL) {
         INITERROR;
     }
+    fast_parser_init();
 
 #ifdef WITH_GREENLET
     hub_switch_value = PyTuple_New(0);
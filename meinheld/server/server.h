@@ -4,12 +4,28 @@
 #include "meinheld.h"
 #include "picoev.h"
 #include "request.h"
+#include "client.h"
 #include "time_cache.h"
+#include "timer.h"
 
 
 extern uint64_t max_content_length;      //max_content_length
 extern int client_body_buffer_size; //client_body_buffer_size
+extern int use_fast_parser;
+extern int use_lazy_environ;
+extern int use_header_cache;
+extern int write_coalesce_size;
+extern int use_single_flight;
+extern int use_streaming_input;
+extern int use_form_parser;
+extern int form_file_parts_max;
 extern PyObject* current_client;
 extern PyObject* timeout_error;
 
+void resume_cache_waiter(client_t *client);
+
+int read_input_stream(client_t *client);
+
+void cancel_timer(TimerObject *timer);
+
 #endif
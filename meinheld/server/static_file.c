@@ -0,0 +1,521 @@
+#include "static_file.h"
+#include "environ.h"
+#include "time_cache.h"
+#include "log.h"
+
+/*
+ * Static files
+ *
+ * server.add_static(prefix, root) mounts a directory. GET and HEAD
+ * requests under prefix are answered by the server before the app is
+ * called. Open fds and their stat results are kept in a LRU cache and
+ * checked again with stat(2) after ttl seconds. Anything that is not a
+ * regular file under root goes to the app, so does a symlink leading out
+ * of root. With compression enabled
+ * path.gz is sent to clients accepting gzip (see compress.c).
+ */
+
+#define STATIC_HASH_SIZE 512
+#define STATIC_CACHE_SIZE 256
+
+typedef struct {
+    char *prefix;       // without the trailing '/'
+    size_t prefix_len;
+    char *root;         // absolute, without the trailing '/'
+    size_t root_len;
+    uintptr_t ttl_msec;
+} static_mount;
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} mime_type;
+
+static const mime_type mime_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"xml", "text/xml"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"bmp", "image/bmp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"mp3", "audio/mpeg"},
+    {"m4a", "audio/mp4"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"wasm", "application/wasm"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"manifest", "text/cache-manifest"},
+    {"webmanifest", "application/manifest+json"},
+    {NULL, NULL}
+};
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+static static_mount mounts[STATIC_MAX_MOUNTS];
+static int mount_cnt = 0;
+
+static static_file *hash_table[STATIC_HASH_SIZE];
+static static_file *lru_head = NULL;    // most recently used
+static static_file *lru_tail = NULL;
+static int cache_cnt = 0;
+static int cache_size = STATIC_CACHE_SIZE;
+static unsigned long long cache_hits = 0;
+static unsigned long long cache_misses = 0;
+
+static const mime_type *
+lookup_mime_type(const char *path, size_t len)
+{
+    const mime_type *m;
+    const char *p = path + len;
+    size_t ext_len;
+
+    while(p > path && p[-1] != '.' && p[-1] != '/'){
+        p--;
+    }
+    if(p == path || p[-1] != '.'){
+        return NULL;
+    }
+    ext_len = path + len - p;
+    for(m = mime_types; m->ext; m++){
+        if(strlen(m->ext) == ext_len && !strncasecmp(m->ext, p, ext_len)){
+            return m;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t
+path_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void
+lru_unlink(static_file *f)
+{
+    if(f->lru_prev){
+        f->lru_prev->lru_next = f->lru_next;
+    }else{
+        lru_head = f->lru_next;
+    }
+    if(f->lru_next){
+        f->lru_next->lru_prev = f->lru_prev;
+    }else{
+        lru_tail = f->lru_prev;
+    }
+    f->lru_prev = f->lru_next = NULL;
+}
+
+static void
+lru_push(static_file *f)
+{
+    f->lru_prev = NULL;
+    f->lru_next = lru_head;
+    if(lru_head){
+        lru_head->lru_prev = f;
+    }
+    lru_head = f;
+    if(lru_tail == NULL){
+        lru_tail = f;
+    }
+}
+
+static void
+free_static_file(static_file *f)
+{
+    DEBUG("close static file %.*s fd:%d", (int)f->path_len, f->path, f->fd);
+    close(f->fd);
+    PyMem_Free(f);
+}
+
+static void
+evict_static_file(static_file *f)
+{
+    static_file **p = &hash_table[f->hash & (STATIC_HASH_SIZE - 1)];
+
+    while(*p != f){
+        p = &(*p)->hash_next;
+    }
+    *p = f->hash_next;
+    lru_unlink(f);
+    f->cached = 0;
+    cache_cnt--;
+    // in use, the last release_static_file closes it
+    if(f->refcnt == 0){
+        free_static_file(f);
+    }
+}
+
+void
+release_static_file(static_file *f)
+{
+    f->refcnt--;
+    if(!f->cached && f->refcnt == 0){
+        free_static_file(f);
+    }
+}
+
+/* path with symlinks resolved, -1 when it is not under the root */
+static int
+resolve_static_path(const char *path, size_t root_len, char *resolved)
+{
+    if(realpath(path, resolved) == NULL){
+        return -1;
+    }
+    if(strncmp(resolved, path, root_len) || resolved[root_len] != '/'){
+        DEBUG("static file %s leads out of root to %s", path, resolved);
+        return -1;
+    }
+    return 1;
+}
+
+static static_file *
+open_static_file(const char *path, size_t len, size_t root_len, uint32_t hash, uintptr_t ttl_msec)
+{
+    static_file *f;
+    struct stat info;
+    const mime_type *m;
+    char resolved[PATH_MAX];
+    int fd;
+
+    if(resolve_static_path(path, root_len, resolved) == -1){
+        return NULL;
+    }
+    // a symlink swapped in after realpath is not followed
+    fd = open(resolved, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    if(fd == -1){
+        return NULL;
+    }
+    if(fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)){
+        close(fd);
+        return NULL;
+    }
+    f = PyMem_Malloc(sizeof(static_file) + len + 1);
+    if(f == NULL){
+        close(fd);
+        return NULL;
+    }
+    f->hash_next = f->lru_prev = f->lru_next = NULL;
+    f->fd = fd;
+    f->refcnt = 0;
+    f->cached = 0;
+    f->precompressed = 0;
+    f->dev = info.st_dev;
+    f->ino = info.st_ino;
+    f->size = info.st_size;
+    f->mtime = info.st_mtime;
+    f->checked_msec = current_msec;
+    f->ttl_msec = ttl_msec;
+    m = lookup_mime_type(path, len);
+    f->content_type = m ? m->type : DEFAULT_MIME_TYPE;
+    f->content_type_len = strlen(f->content_type);
+    f->etag_len = snprintf(f->etag, sizeof(f->etag), "\"%" PRIx64 "-%" PRIx64 "\"",
+            (uint64_t)f->mtime, f->size);
+    f->last_modified_len = format_http_time(f->mtime, f->last_modified, sizeof(f->last_modified));
+    f->hash = hash;
+    f->root_len = root_len;
+    f->path_len = len;
+    memcpy(f->path, path, len + 1);
+    DEBUG("open static file %s fd:%d", path, fd);
+    return f;
+}
+
+static void
+store_static_file(static_file *f)
+{
+    static_file **p = &hash_table[f->hash & (STATIC_HASH_SIZE - 1)];
+
+    while(cache_cnt >= cache_size && lru_tail){
+        evict_static_file(lru_tail);
+    }
+    f->hash_next = *p;
+    *p = f;
+    lru_push(f);
+    f->cached = 1;
+    cache_cnt++;
+}
+
+static static_file *
+find_static_file(const char *path, size_t len, uint32_t hash)
+{
+    static_file *f = hash_table[hash & (STATIC_HASH_SIZE - 1)];
+
+    while(f){
+        if(f->hash == hash && f->path_len == len && !memcmp(f->path, path, len)){
+            return f;
+        }
+        f = f->hash_next;
+    }
+    return NULL;
+}
+
+/* the file at path is still the one we have open */
+static int
+revalidate_static_file(static_file *f)
+{
+    struct stat info;
+
+    if(stat(f->path, &info) == -1 ||
+            info.st_dev != f->dev || info.st_ino != f->ino ||
+            (uint64_t)info.st_size != f->size || info.st_mtime != f->mtime){
+        return -1;
+    }
+    f->checked_msec = current_msec;
+    f->precompressed = 0;
+    return 1;
+}
+
+/* no "..", NUL or empty file name */
+static int
+check_static_path(const char *p, size_t len)
+{
+    const char *end = p + len, *s;
+
+    if(len < 2 || p[0] != '/' || p[len - 1] == '/' || memchr(p, '\0', len)){
+        return -1;
+    }
+    while(p < end){
+        s = ++p;
+        while(p < end && *p != '/'){
+            p++;
+        }
+        if(p - s == 2 && s[0] == '.' && s[1] == '.'){
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* open file of path, from the cache or opened and cached */
+static static_file *
+get_static_file(const char *path, size_t len, size_t root_len, uintptr_t ttl_msec)
+{
+    static_file *f;
+    uint32_t hash;
+
+    hash = path_hash(path, len);
+    f = find_static_file(path, len, hash);
+    if(f && current_msec - f->checked_msec >= f->ttl_msec && revalidate_static_file(f) == -1){
+        evict_static_file(f);
+        f = NULL;
+    }
+    if(f){
+        cache_hits++;
+        lru_unlink(f);
+        lru_push(f);
+    }else{
+        cache_misses++;
+        f = open_static_file(path, len, root_len, hash, ttl_msec);
+        if(f == NULL){
+            return NULL;
+        }
+        store_static_file(f);
+    }
+    f->refcnt++;
+    return f;
+}
+
+static_file *
+lookup_static_file(PyObject *env)
+{
+    static_mount *m = NULL;
+    char *method, *path, *rest;
+    Py_ssize_t method_len, path_len;
+    char full[PATH_MAX];
+    size_t rest_len, full_len;
+    int i;
+
+    if(!environ_get_string(env, "REQUEST_METHOD", &method, &method_len) ||
+            !((method_len == 3 && !memcmp(method, "GET", 3)) ||
+              (method_len == 4 && !memcmp(method, "HEAD", 4)))){
+        return NULL;
+    }
+    if(!environ_get_string(env, "PATH_INFO", &path, &path_len)){
+        return NULL;
+    }
+    for(i = 0; i < mount_cnt; i++){
+        if((size_t)path_len > mounts[i].prefix_len &&
+                path[mounts[i].prefix_len] == '/' &&
+                !memcmp(path, mounts[i].prefix, mounts[i].prefix_len)){
+            m = &mounts[i];
+            break;
+        }
+    }
+    if(m == NULL){
+        return NULL;
+    }
+    rest = path + m->prefix_len;
+    rest_len = path_len - m->prefix_len;
+    if(check_static_path(rest, rest_len) == -1 || m->root_len + rest_len >= sizeof(full)){
+        return NULL;
+    }
+    memcpy(full, m->root, m->root_len);
+    memcpy(full + m->root_len, rest, rest_len);
+    full_len = m->root_len + rest_len;
+    full[full_len] = '\0';
+    return get_static_file(full, full_len, m->root_len, m->ttl_msec);
+}
+
+/*
+ * path.gz of f when it is not older, sent to clients accepting gzip.
+ * A missing one is remembered until f is checked again.
+ */
+static_file *
+lookup_precompressed_file(static_file *f)
+{
+    static_file *gz;
+    char path[PATH_MAX];
+
+    if(f->precompressed == -1 || f->path_len + 4 > sizeof(path)){
+        return NULL;
+    }
+    memcpy(path, f->path, f->path_len);
+    memcpy(path + f->path_len, ".gz", 4);
+    gz = get_static_file(path, f->path_len + 3, f->root_len, f->ttl_msec);
+    if(gz && gz->mtime < f->mtime){
+        release_static_file(gz);
+        gz = NULL;
+    }
+    f->precompressed = gz ? 1 : -1;
+    return gz;
+}
+
+int
+add_static_mount(const char *prefix, size_t prefix_len, const char *root, size_t root_len, int ttl)
+{
+    static_mount *m;
+    char path[PATH_MAX];
+
+    if(mount_cnt >= STATIC_MAX_MOUNTS){
+        PyErr_SetString(PyExc_ValueError, "too many static mounts");
+        return -1;
+    }
+    if(prefix_len == 0 || prefix[0] != '/'){
+        PyErr_SetString(PyExc_ValueError, "static prefix must start with '/'");
+        return -1;
+    }
+    if(ttl < 0){
+        PyErr_SetString(PyExc_ValueError, "ttl value out of range ");
+        return -1;
+    }
+    if(root_len == 0 || realpath(root, path) == NULL){
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)root);
+        return -1;
+    }
+    while(prefix_len > 0 && prefix[prefix_len - 1] == '/'){
+        prefix_len--;
+    }
+    root_len = strlen(path);
+    if(root_len == 1){
+        // "/"
+        root_len = 0;
+    }
+
+    m = &mounts[mount_cnt];
+    m->prefix = PyMem_Malloc(prefix_len + 1);
+    m->root = PyMem_Malloc(root_len + 1);
+    if(m->prefix == NULL || m->root == NULL){
+        PyMem_Free(m->prefix);
+        PyMem_Free(m->root);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(m->prefix, prefix, prefix_len);
+    m->prefix[prefix_len] = '\0';
+    m->prefix_len = prefix_len;
+    memcpy(m->root, path, root_len);
+    m->root[root_len] = '\0';
+    m->root_len = root_len;
+    m->ttl_msec = (uintptr_t)ttl * 1000;
+    mount_cnt++;
+    DEBUG("add static mount %s -> %s ttl:%d", m->prefix, m->root, ttl);
+    return 1;
+}
+
+int
+has_static_mounts(void)
+{
+    return mount_cnt > 0;
+}
+
+void
+clear_static_mounts(void)
+{
+    int i;
+
+    for(i = 0; i < mount_cnt; i++){
+        PyMem_Free(mounts[i].prefix);
+        PyMem_Free(mounts[i].root);
+    }
+    mount_cnt = 0;
+    clear_static_file_cache();
+}
+
+void
+clear_static_file_cache(void)
+{
+    while(lru_tail){
+        evict_static_file(lru_tail);
+    }
+}
+
+void
+set_static_cache_size(int size)
+{
+    cache_size = size;
+    while(cache_cnt > cache_size && lru_tail){
+        evict_static_file(lru_tail);
+    }
+}
+
+int
+get_static_cache_size(void)
+{
+    return cache_size;
+}
+
+PyObject*
+get_static_cache_stats(void)
+{
+    return Py_BuildValue("{s:K,s:K,s:i}",
+            "hits", cache_hits,
+            "misses", cache_misses,
+            "entries", cache_cnt);
+}
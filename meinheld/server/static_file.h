@@ -0,0 +1,57 @@
+#ifndef STATIC_FILE_H
+#define STATIC_FILE_H
+
+#include "meinheld.h"
+
+#define STATIC_MAX_MOUNTS 16
+
+/**
+ * open file of a static mount, shared by the responses sending it.
+ */
+typedef struct static_file {
+    struct static_file *hash_next;
+    struct static_file *lru_prev;
+    struct static_file *lru_next;
+    int fd;
+    int refcnt;             // responses using fd
+    uint8_t cached;         // still in the cache
+    int8_t precompressed;   // path.gz exists 1, does not -1, not checked 0
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    time_t mtime;
+    uintptr_t checked_msec; // last stat
+    uintptr_t ttl_msec;
+    const char *content_type;
+    size_t content_type_len;
+    char etag[48];
+    size_t etag_len;
+    char last_modified[32];
+    size_t last_modified_len;
+    uint32_t hash;
+    size_t root_len;        // path starts with the mount root
+    size_t path_len;
+    char path[];
+} static_file;
+
+int add_static_mount(const char *prefix, size_t prefix_len, const char *root, size_t root_len, int ttl);
+
+void clear_static_mounts(void);
+
+int has_static_mounts(void);
+
+static_file* lookup_static_file(PyObject *env);
+
+static_file* lookup_precompressed_file(static_file *f);
+
+void release_static_file(static_file *f);
+
+void clear_static_file_cache(void);
+
+void set_static_cache_size(int size);
+
+int get_static_cache_size(void);
+
+PyObject* get_static_cache_stats(void);
+
+#endif
@@ -118,3 +118,75 @@ cache_time_update(void)
 
 }
 
+size_t
+format_http_time(time_t t, char *buf, size_t len)
+{
+    struct tm gmt;
+
+    if (gmtime_r(&t, &gmt) == NULL) {
+        return 0;
+    }
+    return snprintf(buf, len, "%s, %02d %s %4d %02d:%02d:%02d GMT",
+                       week[gmt.tm_wday], gmt.tm_mday,
+                       months[gmt.tm_mon], gmt.tm_year + 1900,
+                       gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+}
+
+static int
+parse_month(const char *m)
+{
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        if (!strncmp(m, months[i], 3)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * HTTP-date, IMF-fixdate and the obsolete RFC 850 and asctime forms.
+ * Returns -1 when the value is not a date.
+ */
+time_t
+parse_http_time(const char *value, size_t len)
+{
+    char buf[64], mon[4];
+    struct tm tm;
+    int n = 0;
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n",
+                &tm.tm_mday, mon, &tm.tm_year,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n == (int)len) {
+        tm.tm_year -= 1900;
+    // Sunday, 06-Nov-94 08:49:37 GMT
+    } else if (sscanf(buf, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n",
+                &tm.tm_mday, mon, &tm.tm_year,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n == (int)len) {
+        if (tm.tm_year < 70) {
+            tm.tm_year += 100;
+        }
+    // Sun Nov  6 08:49:37 1994
+    } else if (sscanf(buf, "%*3s %3s %2d %2d:%2d:%2d %4d%n",
+                mon, &tm.tm_mday,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year, &n) == 6 && n == (int)len) {
+        tm.tm_year -= 1900;
+    } else {
+        return -1;
+    }
+    tm.tm_mon = parse_month(mon);
+    if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 ||
+            tm.tm_min > 59 || tm.tm_sec > 60) {
+        return -1;
+    }
+    return timegm(&tm);
+}
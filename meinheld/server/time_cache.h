@@ -13,6 +13,10 @@ void cache_time_init(void);
 
 void cache_time_update(void);
 
+size_t format_http_time(time_t t, char *buf, size_t len);
+
+time_t parse_http_time(const char *value, size_t len);
+
 extern volatile uintptr_t current_msec;
 extern volatile char *err_log_time;
 extern volatile char *http_time;
@@ -1,6 +1,7 @@
 #include "timer.h"
 #include "greensupport.h"
 #include "time_cache.h"
+#include "server.h"
 
 int
 is_active_timer(TimerObject *timer)
@@ -9,7 +10,7 @@ is_active_timer(TimerObject *timer)
 }
 
 TimerObject*
-TimerObject_new(long seconds, PyObject *callback, PyObject *args, PyObject *kwargs, PyObject *greenlet)
+TimerObject_new(uintptr_t msec, PyObject *callback, PyObject *args, PyObject *kwargs, PyObject *greenlet)
 {
     TimerObject *self;
     PyObject *temp = NULL;
@@ -20,13 +21,11 @@ TimerObject_new(long seconds, PyObject *callback, PyObject *args, PyObject *kwar
         return NULL;
     }
 
-    //DEBUG("args seconds:%ld callback:%p args:%p kwargs:%p", seconds, callback, args, kwargs);
+    //DEBUG("args msec:%lu callback:%p args:%p kwargs:%p", msec, callback, args, kwargs);
 
-    if(seconds > 0){
-        self->seconds = current_msec/1000 + seconds;
-    }else{
-        self->seconds = 0;
-    }
+    self->expires_msec = current_msec + msec;
+    self->next = NULL;
+    self->pprev = NULL;
 
     Py_XINCREF(callback);
     Py_XINCREF(args);
@@ -108,6 +107,7 @@ TimerObject_cancel(TimerObject *self, PyObject *args)
 {
     DEBUG("self %p", self);
     self->called = 1;
+    cancel_timer(self);
 
     Py_RETURN_NONE;
 }
@@ -3,19 +3,21 @@
 
 #include "meinheld.h"
 
-typedef struct {
+typedef struct _TimerObject {
     PyObject_HEAD
     PyObject *args;
     PyObject *kwargs;
     PyObject *callback;
-    time_t seconds;
+    uintptr_t expires_msec;     // due, or queued for the pending calls
     char called;
     PyObject *greenlet;
+    struct _TimerObject *next;  // timer wheel slot
+    struct _TimerObject **pprev;
 } TimerObject;
 
 extern PyTypeObject TimerObjectType;
 
-TimerObject* TimerObject_new(long seconds, PyObject *callback, PyObject *args, PyObject *kwargs, PyObject *greenlet);
+TimerObject* TimerObject_new(uintptr_t msec, PyObject *callback, PyObject *args, PyObject *kwargs, PyObject *greenlet);
 
 void fire_timer(TimerObject *timer);
 
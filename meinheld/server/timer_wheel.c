@@ -0,0 +1,313 @@
+#include "timer_wheel.h"
+#include "time_cache.h"
+
+#define TV_INDEX(msec, n) (((msec) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+#define TV_MAX_DELAY 0xffffffffUL
+
+timer_wheel_t *
+init_timer_wheel(void)
+{
+    timer_wheel_t *w;
+    w = (timer_wheel_t *)PyMem_Malloc(sizeof(timer_wheel_t));
+    if(w == NULL){
+        return NULL;
+    }
+    memset(w, 0, sizeof(timer_wheel_t));
+    w->expired_tail = &w->expired;
+    GDEBUG("alloc timer_wheel_t : %p ", w);
+    return w;
+}
+
+static void
+clear_slot(TimerObject **slot)
+{
+    TimerObject *timer, *next;
+
+    timer = *slot;
+    *slot = NULL;
+    while(timer){
+        next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        Py_DECREF(timer);
+        timer = next;
+    }
+}
+
+void
+destroy_timer_wheel(timer_wheel_t *w)
+{
+    int i, n;
+
+    for(i = 0; i < TVR_SIZE; i++){
+        clear_slot(&w->tv1[i]);
+    }
+    for(n = 0; n < TVN_LEVELS; n++){
+        for(i = 0; i < TVN_SIZE; i++){
+            clear_slot(&w->tvn[n][i]);
+        }
+    }
+    clear_slot(&w->expired);
+    GDEBUG("dealloc timer_wheel_t : %p ", w);
+    PyMem_Free(w);
+}
+
+static inline void
+link_timer(TimerObject **slot, TimerObject *timer)
+{
+    timer->next = *slot;
+    if(timer->next){
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static inline void
+unlink_timer(timer_wheel_t *w, TimerObject *timer)
+{
+    uintptr_t i;
+    TimerObject **pprev = timer->pprev;
+
+    *pprev = timer->next;
+    if(timer->next){
+        timer->next->pprev = pprev;
+    }else if(w->expired_tail == &timer->next){
+        w->expired_tail = pprev;
+    }else if(pprev >= w->tv1 && pprev < w->tv1 + TVR_SIZE){
+        //tv1 slot is empty now
+        i = pprev - w->tv1;
+        w->tv1_map[i >> 6] &= ~(1ULL << (i & 63));
+    }else if(pprev >= w->tvn[0] && pprev < w->tvn[0] + TVN_LEVELS * TVN_SIZE){
+        i = pprev - w->tvn[0];
+        w->tvn_map[i / TVN_SIZE] &= ~(1ULL << (i % TVN_SIZE));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void
+add_timer(timer_wheel_t *w, TimerObject *timer)
+{
+    uintptr_t expires = timer->expires_msec;
+    uintptr_t idx = expires - w->now;
+    uintptr_t i;
+    int n;
+
+    if((intptr_t)idx < 0){
+        //already due, expire at the next run
+        expires = w->now;
+        idx = 0;
+    }
+    if(idx < TVR_SIZE){
+        i = expires & TVR_MASK;
+        link_timer(&w->tv1[i], timer);
+        w->tv1_map[i >> 6] |= 1ULL << (i & 63);
+        return;
+    }
+    if(idx > TV_MAX_DELAY){
+        //cascaded again when the last level comes round
+        expires = w->now + TV_MAX_DELAY;
+        idx = TV_MAX_DELAY;
+    }
+    for(n = 0; n < TVN_LEVELS - 1; n++){
+        if(idx < (uintptr_t)1 << (TVR_BITS + (n + 1) * TVN_BITS)){
+            break;
+        }
+    }
+    i = TV_INDEX(expires, n);
+    link_timer(&w->tvn[n][i], timer);
+    w->tvn_map[n] |= 1ULL << i;
+}
+
+static int
+cascade(timer_wheel_t *w, int n)
+{
+    int index = TV_INDEX(w->now, n);
+    TimerObject *timer, *next, *list = NULL;
+
+    timer = w->tvn[n][index];
+    w->tvn[n][index] = NULL;
+    w->tvn_map[n] &= ~(1ULL << index);
+
+    //reverse, re-added timers keep the order they were scheduled in
+    while(timer){
+        next = timer->next;
+        timer->next = list;
+        list = timer;
+        timer = next;
+    }
+    while(list){
+        next = list->next;
+        add_timer(w, list);
+        list = next;
+    }
+    return index;
+}
+
+static inline uint32_t
+expire_slot(timer_wheel_t *w, uintptr_t index)
+{
+    uint32_t count = 0;
+    TimerObject *timer, *next, *list = NULL;
+
+    timer = w->tv1[index];
+    w->tv1[index] = NULL;
+    w->tv1_map[index >> 6] &= ~(1ULL << (index & 63));
+
+    while(timer){
+        next = timer->next;
+        timer->next = list;
+        list = timer;
+        timer = next;
+    }
+    while(list){
+        next = list->next;
+        list->next = NULL;
+        list->pprev = w->expired_tail;
+        *w->expired_tail = list;
+        w->expired_tail = &list->next;
+        list = next;
+        count++;
+    }
+    return count;
+}
+
+static inline uintptr_t
+next_slot(timer_wheel_t *w, uintptr_t from)
+{
+    uintptr_t i;
+    uint64_t bits;
+
+    for(i = from >> 6; i < TVR_SIZE / 64; i++){
+        bits = w->tv1_map[i];
+        if(i == from >> 6){
+            bits &= ~0ULL << (from & 63);
+        }
+        if(bits){
+            return (i << 6) + __builtin_ctzll(bits);
+        }
+    }
+    return TVR_SIZE;
+}
+
+void
+timer_wheel_add(timer_wheel_t *w, TimerObject *timer)
+{
+    if(w->size == 0){
+        w->now = current_msec;
+    }
+    Py_INCREF(timer);
+    add_timer(w, timer);
+    w->size++;
+    DEBUG("timer_wheel_add size %d", w->size);
+}
+
+int
+timer_wheel_remove(timer_wheel_t *w, TimerObject *timer)
+{
+    if(timer->pprev == NULL){
+        return 0;
+    }
+    unlink_timer(w, timer);
+    w->size--;
+    return 1;
+}
+
+/**
+ * Move every timer due by now to the expired list, a whole slot at a time.
+ * Empty tv1 slots are skipped, stopping at each cascade point.
+ */
+uint32_t
+timer_wheel_run(timer_wheel_t *w, uintptr_t now)
+{
+    uint32_t count = 0;
+    uintptr_t index, next;
+
+    if(w->size == 0){
+        w->now = now + 1;
+        return 0;
+    }
+    while(w->now <= now){
+        index = w->now & TVR_MASK;
+        if(index == 0 && cascade(w, 0) == 0 && cascade(w, 1) == 0 && cascade(w, 2) == 0){
+            cascade(w, 3);
+        }
+        if(w->tv1[index]){
+            count += expire_slot(w, index);
+        }
+        next = next_slot(w, index + 1);
+        w->now += next - index;
+        if(w->now > now + 1){
+            w->now = now + 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * msec until the wheel has timers due, or until the cascade point that
+ * brings them down to tv1. -1 when there are no timers.
+ */
+intptr_t
+timer_wheel_next(timer_wheel_t *w, uintptr_t now)
+{
+    uintptr_t index, slot, due, at;
+    uint64_t map;
+    int n, shift, cur;
+
+    if(w->size == 0){
+        return -1;
+    }
+    if(w->expired){
+        return 0;
+    }
+    index = w->now & TVR_MASK;
+    slot = next_slot(w, index);
+    if(index == 0){
+        //cascade point not run yet
+        due = w->now;
+    }else if(slot < TVR_SIZE){
+        due = w->now + (slot - index);
+    }else{
+        due = UINTPTR_MAX;
+        slot = next_slot(w, 0);
+        if(slot < TVR_SIZE){
+            //wrapped into the next 256ms
+            due = (w->now | TVR_MASK) + 1 + slot;
+        }
+        for(n = 0; n < TVN_LEVELS; n++){
+            map = w->tvn_map[n];
+            if(map == 0){
+                continue;
+            }
+            //first non-empty slot after the current one, 1 to 64 slots on
+            shift = TVR_BITS + n * TVN_BITS;
+            cur = (TV_INDEX(w->now, n) + 1) & TVN_MASK;
+            if(cur){
+                map = (map >> cur) | (map << (TVN_SIZE - cur));
+            }
+            at = ((w->now >> shift) + __builtin_ctzll(map) + 1) << shift;
+            if(at < due){
+                due = at;
+            }
+        }
+    }
+    if(due <= now){
+        return 0;
+    }
+    return due - now;
+}
+
+TimerObject *
+timer_wheel_pop(timer_wheel_t *w)
+{
+    TimerObject *timer = w->expired;
+
+    if(timer == NULL){
+        return NULL;
+    }
+    unlink_timer(w, timer);
+    w->size--;
+    return timer;
+}
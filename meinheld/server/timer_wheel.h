@@ -0,0 +1,45 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "meinheld.h"
+#include "timer.h"
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+/**
+ * Hierarchical timing wheel in msec.
+ * tv1 holds the next 256ms one slot per msec, every upper level covers
+ * 64 slots of the one below it, about 49 days in all.
+ */
+typedef struct {
+    uintptr_t now;              // next msec to expire
+    uint32_t size;              // timers in the wheel and the expired list
+    TimerObject *expired;       // due timers waiting to be fired
+    TimerObject **expired_tail;
+    uint64_t tv1_map[TVR_SIZE / 64];   // non-empty tv1 slots
+    uint64_t tvn_map[TVN_LEVELS];      // non-empty slots of each level
+    TimerObject *tv1[TVR_SIZE];
+    TimerObject *tvn[TVN_LEVELS][TVN_SIZE];
+} timer_wheel_t;
+
+timer_wheel_t* init_timer_wheel(void);
+
+void destroy_timer_wheel(timer_wheel_t *w);
+
+void timer_wheel_add(timer_wheel_t *w, TimerObject *timer);
+
+int timer_wheel_remove(timer_wheel_t *w, TimerObject *timer);
+
+uint32_t timer_wheel_run(timer_wheel_t *w, uintptr_t now);
+
+TimerObject* timer_wheel_pop(timer_wheel_t *w);
+
+intptr_t timer_wheel_next(timer_wheel_t *w, uintptr_t now);
+
+#endif
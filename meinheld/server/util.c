@@ -106,3 +106,38 @@ get_current_msec()
     return (uintptr_t) sec * 1000 + msec;
 }
 
+
+/*
+ * Unnamed read/write file for a large request body, O_TMPFILE when the
+ * file system has it, else a removed mkstemp file. In $TMPDIR or /tmp.
+ */
+int
+open_spool_file(void)
+{
+    char path[PATH_MAX];
+    const char *dir;
+    int fd, r;
+
+    dir = getenv("TMPDIR");
+    if(dir == NULL || *dir == '\0'){
+        dir = P_tmpdir;
+    }
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(fd != -1){
+        return fd;
+    }
+#endif
+    r = snprintf(path, sizeof(path), "%s/meinheld-body-XXXXXX", dir);
+    if(r < 0 || (size_t)r >= sizeof(path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(path);
+    if(fd == -1){
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
@@ -16,4 +16,6 @@ int set_so_keepalive(int fd, int flag);
 
 uintptr_t get_current_msec(void);
 
+int open_spool_file(void);
+
 #endif
@@ -19,6 +19,9 @@ nogreen = False
 if os.environ.get("MEINHELD_NOGREEN") == "1":
     nogreen = True
 
+# epoll (default on Linux) or uring (Linux >= 5.11)
+poller = os.environ.get("MEINHELD_POLLER")
+
 
 def read(name):
     return open(os.path.join(os.path.dirname(__file__), name)).read()
@@ -36,7 +39,10 @@ def get_picoev_file():
     poller_file = None
 
     if "Linux" == platform.system():
-        poller_file = 'meinheld/server/picoev_epoll.c'
+        if poller == "uring":
+            poller_file = 'meinheld/server/picoev_uring.c'
+        else:
+            poller_file = 'meinheld/server/picoev_epoll.c'
     elif "Darwin" == platform.system():
         poller_file = 'meinheld/server/picoev_kqueue.c'
     elif "FreeBSD" == platform.system():
@@ -104,6 +110,7 @@ setup(name='meinheld',
             sources=sources,
             include_dirs=include_dirs,
             library_dirs=library_dirs,
+            libraries=["z"],
             # libraries=["profiler"],
             # extra_compile_args=[""],
             define_macros=define_macros
@@ -121,3 +121,58 @@ def test_many():
     server.run(App())
 
 
+
+def test_msec():
+
+    l = []
+
+    def _schedule_call():
+        assert(l == [0.01, 0.02])
+        server.shutdown()
+
+    def _call(i):
+        l.append(i)
+
+    server.listen(("0.0.0.0", 8000))
+
+    timer = server.schedule_call(0.015, _call, "cancelled")
+    server.schedule_call(0.02, _call, 0.02)
+    server.schedule_call(0.01, _call, 0.01)
+    timer.cancel()
+
+    server.schedule_call(0.1, _schedule_call)
+    server.run(App())
+
+def test_loop_stats():
+
+    def _call():
+        stats = server.get_loop_stats()
+        assert(stats["timers"] > start["timers"])
+        assert(stats["wakeups"] > start["wakeups"])
+        server.shutdown()
+
+    server.listen(("0.0.0.0", 8000))
+    start = server.get_loop_stats()
+    server.schedule_call(0.05, _call)
+    server.run(App())
+
+def test_run_queue():
+
+    l = []
+
+    def _fan_out():
+        for i in range(1000):
+            server.schedule_call(0, l.append, i)
+        server.schedule_call(0.05, server.shutdown)
+
+    server.listen(("0.0.0.0", 8000))
+    start = server.get_loop_stats()
+    server.schedule_call(0, _fan_out)
+    server.run(App())
+    stats = server.get_loop_stats()
+    # oldest first, over several turns of the loop
+    assert(l == list(range(1000)))
+    assert(stats["runs"] - start["runs"] >= 1001)
+    assert(stats["run_queue_max"] >= 1000)
+    assert(stats["run_deferred"] > start["run_deferred"])
+    assert(stats["run_queue"] == 0)
@@ -104,6 +104,18 @@ class ManyResumeApp(BaseApp):
         print(environ)
         return [path.encode()]
 
+class LazyResumeApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        c = environ[CONTINUATION_KEY]
+        server.schedule_call(0.05, c.resume)
+        c.suspend(3)
+        return [b"RESUMED"]
+
 def test_middleware():
 
     def client():
@@ -145,8 +157,9 @@ def test_resume():
     env2, res2 = r2.get_result()
     assert(res1.status_code == 200)
     assert(res2.status_code == 200)
-    assert(res2.content == b"RESUMED")
-    assert(res1.content == RESPONSE)
+    # spawned calls run in order, the first request is the one suspended
+    assert(res1.content == b"RESUMED")
+    assert(res2.content == RESPONSE)
     assert(env1.get(CONTINUATION_KEY))
     assert(env2.get(CONTINUATION_KEY))
 
@@ -211,3 +224,23 @@ def test_many_resume():
     assert(results == [b'/0', b'/1', b'/2', b'/3', b'/4', b'/5', b'/6', b'/7', b'/8', b'/9', b'/wakeup'])
 
 
+
+def test_lazy_greenlet_suspend():
+
+    def client():
+        # the direct call can not suspend, the next request gets a greenlet
+        first = requests.get("http://localhost:8000/")
+        return first, requests.get("http://localhost:8000/")
+
+    application = LazyResumeApp()
+    r = ClientRunner(application, client)
+    r.run()
+    server.listen(("0.0.0.0", 8000))
+    start = server.get_loop_stats()
+    server.run(ContinuationMiddleware(application), greenlet="lazy")
+    stats = server.get_loop_stats()
+    first, res = r.receive_data
+    assert(first.status_code == 500)
+    assert(res.status_code == 200)
+    assert(res.content == b"RESUMED")
+    assert(stats["app_hub_waits"] - start["app_hub_waits"] == 1)
@@ -0,0 +1,70 @@
+import _socket
+import os
+import signal
+import time
+from multiprocessing import Process
+
+from pytest import *
+from base import *
+
+class App(BaseApp):
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        return [str(os.getpid()).encode()]
+
+def _get():
+    # the socket module is patched by base, the test runs outside the loop
+    s = _socket.socket(_socket.AF_INET, _socket.SOCK_STREAM)
+    s.connect(("127.0.0.1", 8000))
+    s.sendall(b"GET / HTTP/1.0\r\n\r\n")
+    data = b""
+    while True:
+        d = s.recv(4096)
+        if not d:
+            break
+        data += d
+    s.close()
+    return data.split(b"\r\n\r\n", 1)
+
+def _run_workers():
+    server.listen(("0.0.0.0", 8000))
+    server.run(App(), workers=2)
+
+def test_workers():
+    p = Process(target=_run_workers)
+    p.start()
+    try:
+        time.sleep(1)
+        pids = set()
+        for i in range(20):
+            head, body = _get()
+            assert(head.startswith(b"HTTP/1.0 200 OK"))
+            pids.add(int(body))
+        assert(p.pid not in pids)
+        assert(len(pids) <= 2)
+
+        # the master respawns a killed worker and it serves requests
+        dead = pids.pop()
+        os.kill(dead, signal.SIGKILL)
+        respawned = None
+        deadline = time.time() + 10
+        while respawned is None and time.time() < deadline:
+            try:
+                head, body = _get()
+            except OSError:
+                # a connection queued on the dead worker's socket
+                continue
+            assert(head.startswith(b"HTTP/1.0 200 OK"))
+            pid = int(body)
+            assert(pid != dead)
+            if pid not in pids:
+                respawned = pid
+        assert(respawned is not None)
+        assert(respawned != p.pid)
+    finally:
+        os.kill(p.pid, signal.SIGTERM)
+        p.join(5)
+    assert(p.exitcode == 0)
@@ -111,3 +111,44 @@ def test_bad_path():
     env, res = run_client(client, App)
     assert(res.split(b"\r\n")[0] == ERR_400)
 
+
+def test_pipelining():
+
+    def client():
+        sock = socket.create_connection(DEFAULT_ADDR)
+        sock.send(b"GET /1 HTTP/1.1\r\nHost: localhost\r\n\r\n" * 3 +
+                  b"GET /2 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024 * 8)
+            if not d:
+                return data
+            data += d
+
+    server.set_keepalive(10)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_keepalive(0)
+    assert(res.count(b"HTTP/1.1 200 OK") == 4)
+    # chunked, one chunk per item
+    assert(res.count(b"world!\r\n") == 4)
+    assert(env["PATH_INFO"] == "/2")
+
+def test_pipelining_no_keepalive():
+
+    def client():
+        sock = socket.create_connection(DEFAULT_ADDR)
+        sock.send(b"GET /1 HTTP/1.1\r\nHost: localhost\r\n\r\n" +
+                  b"GET /2 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024 * 8)
+            if not d:
+                return data
+            data += d
+
+    # keep-alive is off, the connection closes after the first response
+    env, res = run_client(client, App)
+    assert(res.count(b"HTTP/1.1 200 OK") == 1)
+    assert(env["PATH_INFO"] == "/1")
@@ -1,7 +1,11 @@
 # -*- coding: utf-8 -*-
 from collections import OrderedDict
 import os
+import shutil
+import socket
 import sys
+import tempfile
+import time
 
 from base import *
 import requests
@@ -53,6 +57,69 @@ class IterErrApp(BaseApp):
 
         return [1]
 
+class StreamApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        return (b"%d," % i for i in range(2000))
+
+class FileApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        return environ['wsgi.file_wrapper'](open(__file__, 'rb'))
+
+class CacheApp(BaseApp):
+
+    calls = 0
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain'), ('X-Meinheld-Cache', 'ttl=10')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        self.calls += 1
+        return [b"call %d" % self.calls]
+
+class FlightApp(BaseApp):
+
+    def __init__(self):
+        self.calls = 0
+
+    def __call__(self, environ, start_response):
+        self.calls += 1
+        call = self.calls
+        # the same requests of the other clients arrive meanwhile
+        server.sleep(1)
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        if environ["PATH_INFO"] == "/big":
+            # over FLIGHT_MAX_SIZE, not shared
+            return [b"call %d " % call, b"x" * (2 * 1024 * 1024)]
+        return [b"call %d" % call]
+
+class InputStreamApp(BaseApp):
+
+    sent = []
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        first = environ["wsgi.input"].readline()
+        early = not self.sent
+        rest = environ["wsgi.input"].read()
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        return [first, rest, b"early" if early else b"late"]
+
 class UpgradeApp(BaseApp):
 
     def __call__(self, environ, start_response):
@@ -168,6 +235,355 @@ def test_post():
     assert(res.content == ASSERT_RESPONSE)
     assert(env.get("wsgi.input").read() == b"key1=value1&key2=value2")
 
+def test_input_buffer():
+
+    def client():
+        return requests.post("http://localhost:8000/", data=b"a=1\nb=22\nc=333")
+
+    env, res = run_client(client, App)
+    assert(res.status_code == 200)
+    inp = env.get("wsgi.input")
+    assert(inp.readline(2) == b"a=")
+    assert(inp.readline() == b"1\n")
+    buf = bytearray(3)
+    assert(inp.readinto(buf) == 3)
+    assert(buf == b"b=2")
+    view = inp.getbuffer()
+    assert(view.readonly)
+    assert(view.tobytes() == b"2\nc=333")
+    assert(inp.readlines() == [b"2\n", b"c=333"])
+    assert(inp.readinto(buf) == 0)
+
+def test_fast_parser():
+
+    def client():
+        # requests refuses the leading whitespace of X-Space
+        sock = socket.create_connection(("localhost", 8000))
+        sock.send(b"GET /foo/bar?a=1 HTTP/1.0\r\nHost: localhost\r\n"
+                  b"X-TEST: 123\r\nDNT: 1\r\nX-Space:   v  \r\n\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024 * 8)
+            if not d:
+                return data
+            data += d
+
+    server.set_fast_parser(True)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_fast_parser(False)
+    assert(res.startswith(b"HTTP/1.0 200 OK"))
+    assert(res.endswith(ASSERT_RESPONSE))
+    assert(env["PATH_INFO"] == "/foo/bar")
+    assert(env["QUERY_STRING"] == "a=1")
+    assert(env["HTTP_X_TEST"] == "123")
+    assert(env["HTTP_DNT"] == "1")
+    assert(env["HTTP_X_SPACE"] == "v  ")
+
+def test_fast_parser_ows():
+
+    long_value = b"abcdefghij" * 7
+
+    def client():
+        sock = socket.create_connection(("localhost", 8000))
+        # trailing OWS on Connection, the third request is dropped
+        sock.send(b"GET /1 HTTP/1.0\r\nConnection: keep-alive  \r\n\r\n"
+                  b"GET /2 HTTP/1.1\r\nHost: localhost\r\nX-Long: " + long_value +
+                  b"  \r\nConnection: close \r\n\r\n"
+                  b"GET /3 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024 * 8)
+            if not d:
+                return data
+            data += d
+
+    server.set_fast_parser(True)
+    server.set_keepalive(10)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_keepalive(0)
+        server.set_fast_parser(False)
+    assert(res.count(b"200 OK") == 2)
+    assert(env["PATH_INFO"] == "/2")
+    # over 32 bytes, trailing whitespace kept as http_parser does
+    assert(env["HTTP_X_LONG"] == long_value.decode() + "  ")
+
+def test_fast_parser_post():
+
+    def client():
+        payload = OrderedDict([('key1', 'value1'), ('key2', 'value2')])
+        return requests.post("http://localhost:8000/", data=payload)
+
+    server.set_fast_parser(True)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_fast_parser(False)
+    assert(res.status_code == 200)
+    assert(env["CONTENT_TYPE"] == "application/x-www-form-urlencoded")
+    assert(env.get("wsgi.input").read() == b"key1=value1&key2=value2")
+
+def test_lazy_environ():
+
+    def client():
+        headers = {"X-TEST":"123", "Content-Type":"text/plain"}
+        return requests.get("http://localhost:8000/foo/bar?a=1", headers=headers)
+
+    server.set_lazy_environ(True)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_lazy_environ(False)
+    assert(res.status_code == 200)
+    assert(isinstance(env, dict))
+    assert(env["HTTP_X_TEST"] == "123")
+    assert(env["CONTENT_TYPE"] == "text/plain")
+    assert("HTTP_CONTENT_TYPE" not in env)
+    assert("HTTP_HOST" in dict(env))
+    assert(env["REMOTE_ADDR"] == "127.0.0.1")
+
+def test_header_cache():
+
+    def client():
+        requests.get("http://localhost:8000/")
+        return requests.get("http://localhost:8000/")
+
+    before = server.get_header_cache_stats()
+    server.set_header_cache(True)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_header_cache(False)
+    after = server.get_header_cache_stats()
+    assert(res.status_code == 200)
+    assert(res.content == ASSERT_RESPONSE)
+    assert(res.headers["Content-type"] == "text/plain")
+    assert(after["hits"] - before["hits"] == 1)
+    assert(after["misses"] - before["misses"] == 1)
+
+def test_write_coalesce():
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    server.set_write_coalesce_size(100)
+    try:
+        env, res = run_client(client, StreamApp)
+    finally:
+        server.set_write_coalesce_size(1024 * 64)
+    assert(res.status_code == 200)
+    assert(res.content == b"".join(b"%d," % i for i in range(2000)))
+
+def test_file_range():
+
+    def client():
+        full = requests.get("http://localhost:8000/")
+        part = requests.get("http://localhost:8000/", headers={"Range": "bytes=10-19"})
+        cond = requests.get("http://localhost:8000/", headers={"If-None-Match": full.headers["ETag"]})
+        return full, part, cond
+
+    env, (full, part, cond) = run_client(client, FileApp)
+    with open(__file__, 'rb') as f:
+        data = f.read()
+    assert(full.status_code == 200)
+    assert(full.content == data)
+    assert(full.headers["Accept-Ranges"] == "bytes")
+    assert(part.status_code == 206)
+    assert(part.content == data[10:20])
+    assert(part.headers["Content-Range"] == "bytes 10-19/%d" % len(data))
+    assert(cond.status_code == 304)
+    assert(cond.content == b"")
+
+def test_static():
+
+    def client():
+        return requests.get("http://localhost:8000/static/test_wsgi_spec.py")
+
+    server.add_static("/static", os.path.dirname(os.path.abspath(__file__)))
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.clear_static()
+    with open(__file__, 'rb') as f:
+        data = f.read()
+    assert(env == None)
+    assert(res.status_code == 200)
+    assert(res.content == data)
+    assert(res.headers["Content-Type"] == "application/octet-stream")
+
+def test_static_symlink():
+
+    def client():
+        inside = requests.get("http://localhost:8000/static/inside.txt")
+        outside = requests.get("http://localhost:8000/static/outside.txt")
+        return inside, outside
+
+    top = tempfile.mkdtemp()
+    root = os.path.join(top, "root")
+    os.mkdir(root)
+    with open(os.path.join(root, "file.txt"), "wb") as f:
+        f.write(b"inside")
+    with open(os.path.join(top, "secret.txt"), "wb") as f:
+        f.write(b"secret")
+    os.symlink(os.path.join(root, "file.txt"), os.path.join(root, "inside.txt"))
+    os.symlink(os.path.join(top, "secret.txt"), os.path.join(root, "outside.txt"))
+    server.add_static("/static", root)
+    try:
+        env, (inside, outside) = run_client(client, App)
+    finally:
+        server.clear_static()
+        shutil.rmtree(top)
+    assert(inside.content == b"inside")
+    # leads out of root, the app answers
+    assert(outside.content == ASSERT_RESPONSE)
+    assert(env["PATH_INFO"] == "/static/outside.txt")
+
+def test_response_cache():
+
+    def client():
+        first = requests.get("http://localhost:8000/cached?a=1")
+        second = requests.get("http://localhost:8000/cached?a=1")
+        other = requests.get("http://localhost:8000/cached?a=2")
+        return first, second, other
+
+    server.set_response_cache_size(1024 * 1024)
+    try:
+        env, (first, second, other) = run_client(client, CacheApp)
+        stats = server.get_response_cache_stats()
+    finally:
+        server.set_response_cache_size(0)
+    assert(first.content == b"call 1")
+    assert(second.content == b"call 1")
+    assert(other.content == b"call 2")
+    assert("X-Meinheld-Cache" not in second.headers)
+    assert(second.headers["Content-Length"] == "6")
+    assert(stats["hits"] == 1)
+
+def test_single_flight():
+
+    def client():
+        first = requests.get("http://localhost:8000/flight")
+        second = requests.get("http://localhost:8000/flight")
+        return first, second
+
+    server.set_single_flight(True)
+    try:
+        env, (first, second) = run_client(client, CacheApp)
+        stats = server.get_response_cache_stats()
+        enabled = server.get_single_flight()
+    finally:
+        server.set_single_flight(False)
+    assert(enabled)
+    # nothing to wait for, each request runs the app
+    assert(first.content == b"call 1")
+    assert(second.content == b"call 2")
+    assert(stats["coalesced"] == 0)
+
+def run_flight(path, headers=None, clients=3):
+    application = FlightApp()
+    results = []
+    done = []
+
+    def client():
+        try:
+            results.append(requests.get("http://localhost:8000" + path, headers=headers))
+        finally:
+            done.append(1)
+            if len(done) == clients:
+                server.shutdown(1)
+
+    for i in range(clients):
+        server.spawn(client)
+    server.listen(("0.0.0.0", 8000))
+    server.set_single_flight(True)
+    try:
+        start = server.get_response_cache_stats()
+        server.run(application)
+        stats = server.get_response_cache_stats()
+    finally:
+        server.set_single_flight(False)
+    return application.calls, results, stats["coalesced"] - start["coalesced"]
+
+def test_single_flight_concurrent():
+    calls, results, coalesced = run_flight("/flight")
+    # the first request runs the app, the others wait and share its response
+    assert(calls == 1)
+    assert(len(results) == 3)
+    for res in results:
+        assert(res.status_code == 200)
+        assert(res.content == b"call 1")
+    assert(coalesced >= 1)
+
+def test_single_flight_cookie():
+    calls, results, coalesced = run_flight("/flight", headers={"Cookie": "user=1"})
+    # maybe a response for this user only, every request runs the app
+    assert(calls == 3)
+    assert(sorted(res.content for res in results) == [b"call 1", b"call 2", b"call 3"])
+    assert(coalesced == 0)
+
+def test_single_flight_large():
+    calls, results, coalesced = run_flight("/big")
+    # too large to share, the waiting requests run the app themselves
+    assert(calls == 3)
+    assert(len(results) == 3)
+    bodies = set()
+    for res in results:
+        assert(res.status_code == 200)
+        assert(res.content.endswith(b"x" * (2 * 1024 * 1024)))
+        bodies.add(res.content.split(b" ")[1])
+    assert(bodies == set([b"1", b"2", b"3"]))
+
+def test_compress():
+
+    def client():
+        gzip = requests.get("http://localhost:8000/")
+        plain = requests.get("http://localhost:8000/", headers={"Accept-Encoding": "identity"})
+        return gzip, plain
+
+    server.set_compress_level(6)
+    try:
+        env, (gzip, plain) = run_client(client, StreamApp)
+    finally:
+        server.set_compress_level(0)
+    body = b"".join(b"%d," % i for i in range(2000))
+    assert(gzip.headers["Content-Encoding"] == "gzip")
+    assert(gzip.headers["Vary"] == "Accept-Encoding")
+    assert(gzip.content == body)
+    assert("Content-Encoding" not in plain.headers)
+    assert(plain.content == body)
+
+def test_streaming_input():
+
+    def client():
+        sock = socket.create_connection(("localhost", 8000))
+        sock.send(b"POST / HTTP/1.1\r\nHost: localhost\r\n"
+                  b"Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+                  b"6\r\nline1\n\r\n")
+        server.sleep(1)
+        InputStreamApp.sent.append(1)
+        sock.send(b"6\r\nline2\n\r\n0\r\n\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024 * 8)
+            if not d:
+                return data
+            data += d
+
+    server.set_streaming_input(True)
+    try:
+        env, res = run_client(client, InputStreamApp)
+    finally:
+        server.set_streaming_input(False)
+    assert(res.startswith(b"HTTP/1.1 200 OK"))
+    # the app ran before the second chunk was sent
+    assert(b"line1\n" in res)
+    assert(b"line2\n" in res)
+    assert(b"early" in res)
+    assert("CONTENT_LENGTH" not in env)
+
 def test_upload_file():
 
     def client():
@@ -182,6 +598,86 @@ def test_upload_file():
     data = env.get("wsgi.input").read()
     assert(len(data) == int(length))
 
+def test_form_parser():
+
+    def client():
+        filepath = os.path.join(os.path.dirname(__file__), "wallpaper.jpg")
+        files = {'wallpaper': ('wallpaper.jpg', open(filepath, 'rb'), 'image/jpeg')}
+        return requests.post("http://localhost:8000/", data={"key1": "value1"}, files=files)
+
+    server.set_form_parser(True)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_form_parser(False)
+    assert(res.status_code == 200)
+    form = env["meinheld.form"]
+    assert(form["key1"] == [b"value1"])
+    filename, content_type, f = form["wallpaper"][0]
+    assert(filename == "wallpaper.jpg")
+    assert(content_type == "image/jpeg")
+    with open(os.path.join(os.path.dirname(__file__), "wallpaper.jpg"), 'rb') as jpg:
+        assert(f.read() == jpg.read())
+    assert(env["wsgi.input"].read() == b"")
+
+def test_form_parser_file_parts():
+
+    def client():
+        files = [("f%d" % i, ("a%d.txt" % i, b"hello", "text/plain")) for i in range(3)]
+        return requests.post("http://localhost:8000/", files=files)
+
+    server.set_form_parser(True)
+    server.set_form_file_parts_max(2)
+    try:
+        env, res = run_client(client, App)
+        limit = server.get_form_file_parts_max()
+    finally:
+        server.set_form_parser(False)
+        server.set_form_file_parts_max(32)
+    assert(limit == 2)
+    # each file part would hold a spool fd
+    assert(res.status_code == 413)
+    assert(env == None)
+
+def test_large_post():
+    # over client_body_buffer_size, spooled to a file
+    payload = os.urandom(1024 * 1024 + 3)
+
+    def client():
+        return requests.post("http://localhost:8000/", data=payload)
+
+    env, res = run_client(client, App)
+    assert(res.status_code == 200)
+    inp = env.get("wsgi.input")
+    assert(inp.read() == payload)
+    inp.seek(0)
+    assert(inp.read(16) == payload[:16])
+
+def test_read_timeout():
+
+    def client():
+        sock = socket.create_connection(("localhost", 8000))
+        sock.send(b"GET / HTTP/1.1\r\n")
+        server.sleep(0.05)
+        start = time.time()
+        sock.send(b"Host: localhost\r\n")
+        data = b""
+        while True:
+            d = sock.recv(1024)
+            if not d:
+                return time.time() - start, data
+            data += d
+
+    server.set_read_timeout(0.25)
+    try:
+        env, (elapsed, res) = run_client(client, App)
+        timeout = server.get_read_timeout()
+    finally:
+        server.set_read_timeout(30)
+    assert(timeout == 0.25)
+    assert(res.startswith(b"HTTP/1.0 408"))
+    assert(0.2 < elapsed < 1)
+
 def test_error():
     def client():
         return requests.get("http://localhost:8000/foo/bar")
@@ -207,3 +703,113 @@ def test_upgrade():
     assert(res.status_code == 101)
     assert(headers["upgrade"] == "websocket")
     assert(headers["connection"] == "upgrade")
+
+def test_lazy_greenlet():
+
+    class SleepApp(App):
+
+        calls = 0
+
+        def __call__(self, environ, start_response):
+            if environ["PATH_INFO"] == "/sleep":
+                self.calls += 1
+                server.sleep(0.05)
+            return App.__call__(self, environ, start_response)
+
+    def client():
+        first = requests.get("http://localhost:8000/")
+        stats = server.get_loop_stats()
+        sleep = requests.get("http://localhost:8000/sleep")
+        again = requests.get("http://localhost:8000/sleep")
+        return stats, (first, sleep, again)
+
+    application = SleepApp()
+    r = ClientRunner(application, client)
+    r.run()
+    server.listen(("0.0.0.0", 8000))
+    start = server.get_loop_stats()
+    server.run(application, greenlet="lazy")
+    stats = server.get_loop_stats()
+    first_stats, (first, sleep, again) = r.receive_data
+    assert(first.status_code == 200)
+    assert(first.content == ASSERT_RESPONSE)
+    # /sleep can not wait on the hub, it fails and is not run again
+    assert(sleep.status_code == 500)
+    assert(again.status_code == 200)
+    assert(again.content == ASSERT_RESPONSE)
+    assert(application.calls == 2)
+    # no greenlet until /sleep has to wait, every later request gets one
+    assert(first_stats["app_direct_calls"] - start["app_direct_calls"] == 1)
+    assert(first_stats["app_greenlets"] == start["app_greenlets"])
+    assert(stats["app_direct_calls"] - start["app_direct_calls"] == 2)
+    assert(stats["app_hub_waits"] - start["app_hub_waits"] == 1)
+    assert(stats["app_greenlets"] - start["app_greenlets"] == 1)
+
+def test_lazy_greenlet_caught():
+
+    class CatchApp(App):
+
+        def __call__(self, environ, start_response):
+            try:
+                server.sleep(0.05)
+            except BaseException:
+                pass
+            return App.__call__(self, environ, start_response)
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    application = CatchApp()
+    r = ClientRunner(application, client)
+    r.run()
+    server.listen(("0.0.0.0", 8000))
+    server.run(application, greenlet="lazy")
+    res = r.receive_data
+    # the app swallowed greenlet_required, the request still fails
+    assert(res.status_code == 500)
+
+def test_lazy_greenlet_trampoline():
+
+    r, w = socket.socketpair()
+
+    class BlockApp(App):
+
+        def __call__(self, environ, start_response):
+            if environ["PATH_INFO"] == "/block":
+                # no timeout, waits for the other client
+                server.trampoline(r.fileno(), read=True)
+                r.recv(1)
+            return App.__call__(self, environ, start_response)
+
+    def client():
+        # the direct call can not wait, from now on greenlets
+        first = requests.get("http://localhost:8000/block")
+        sock = socket.create_connection(("localhost", 8000))
+        sock.send(b"GET /block HTTP/1.0\r\n\r\n")
+        # served while /block waits in its greenlet
+        other = requests.get("http://localhost:8000/")
+        w.send(b"x")
+        data = b""
+        while True:
+            d = sock.recv(1024)
+            if not d:
+                break
+            data += d
+        return first, other, data
+
+    application = BlockApp()
+    c = ClientRunner(application, client)
+    c.run()
+    server.listen(("0.0.0.0", 8000))
+    start = server.get_loop_stats()
+    server.run(application, greenlet="lazy")
+    stats = server.get_loop_stats()
+    first, other, data = c.receive_data
+    r.close()
+    w.close()
+    assert(first.status_code == 500)
+    assert(other.status_code == 200)
+    assert(other.content == ASSERT_RESPONSE)
+    assert(data.startswith(b"HTTP/1.0 200 OK"))
+    assert(data.endswith(ASSERT_RESPONSE))
+    assert(stats["app_hub_waits"] - start["app_hub_waits"] == 1)